@@ -39,14 +39,21 @@ n2n.c
 n2n.h
 n2n_keyfile.c
 n2n_keyfile.h
+n2n_offload.c
+n2n_pktbuf.c
+n2n_offload.h
 n2n.spec
 n2n_transforms.h
 n2n_wire.h
 sn.c
 transform_aes.c
+transform_aesgcm.c
+transform_cc20.c
+transform_lzo.c
 transform_null.c
 transform_tf.c
 tuntap_linux.c
+tuntap_loop.c
 tuntap_freebsd.c
 tuntap_netbsd.c
 tuntap_osx.c
@@ -0,0 +1,171 @@
+#!/bin/bash
+
+# This script checks NAT traversal between two edges, each behind its own
+# NAT router, in network namespaces with nftables doing the NAT.
+#
+#   n2n-wan  supernode on 10.9.0.1 (probe port 7655), a bridge to both routers
+#   n2n-ra   router of edge A, 10.9.0.2 outside, NAT type <nat A>
+#   n2n-rb   router of edge B, 10.9.0.3 outside, NAT type <nat B>
+#   n2n-a    edge A, 10.1.0.2, tunnel address 10.10.0.1
+#   n2n-b    edge B, 10.2.0.2, tunnel address 10.10.0.2
+#
+# NAT types:
+#   none    routed, no NAT
+#   cone    masquerade: one outside port for all destinations
+#   pool    a new outside port per destination, picked at random from 32
+#   random  a new random outside port per destination
+#
+# Like home routers, the NAT routers drop new connections to themselves from
+# outside.
+#
+# Edge B sends UDP echoes to edge A through the tunnel, then both edges are
+# asked whether their peer is reached directly (p2p) or through the supernode
+# (sn). none and cone get through to each other. pool gets through when its
+# port falls into the 32 predicted by the supernode, which is most of the
+# time. random does not and is relayed.
+#
+# Needs root, iproute2, python3 and nft unless both NAT types are none. Run it
+# from the n2n directory with the binaries to test as follows:
+#
+# EDGE=_build/src/edge SUPERNODE=./supernode scripts/nat_test.sh <nat A> <nat B>
+#
+
+set -e
+
+NAT_A=${1:-cone}
+NAT_B=${2:-pool}
+EDGE=`readlink -f ${EDGE:-./edge}`
+SUPERNODE=`readlink -f ${SUPERNODE:-./supernode}`
+NSS="n2n-wan n2n-ra n2n-rb n2n-a n2n-b"
+
+for f in ${EDGE} ${SUPERNODE}; do
+    test -x ${f} || { echo "${f} not found, set EDGE and SUPERNODE"; exit 1; }
+done
+
+cleanup() {
+    for ns in ${NSS}; do
+        ip netns pids ${ns} 2>/dev/null | xargs -r kill 2>/dev/null || true
+    done
+    sleep 0.5
+    for ns in ${NSS}; do
+        ip netns del ${ns} 2>/dev/null || true
+    done
+}
+trap cleanup EXIT
+cleanup
+
+for ns in ${NSS}; do
+    ip netns add ${ns}
+    ip -n ${ns} link set lo up
+done
+
+ip -n n2n-wan link add br0 type bridge
+ip -n n2n-wan addr add 10.9.0.1/24 dev br0
+ip -n n2n-wan link set br0 up
+ip netns exec n2n-wan sysctl -qw net.ipv4.ip_forward=1
+
+# router <ns> <outside ip> <lan prefix> <edge ns> <nat type>
+router() {
+    ip link add wan0 netns $1 type veth peer name $1 netns n2n-wan
+    ip -n n2n-wan link set $1 master br0 up
+    ip -n $1 addr add $2/24 dev wan0
+    ip -n $1 link set wan0 up
+    ip -n $1 route add default via 10.9.0.1
+
+    ip link add lan0 netns $1 type veth peer name eth0 netns $4
+    ip -n $1 addr add $3.1/24 dev lan0
+    ip -n $1 link set lan0 up
+    ip -n $4 addr add $3.2/24 dev eth0
+    ip -n $4 link set eth0 up
+    ip -n $4 route add default via $3.1
+
+    ip netns exec $1 sysctl -qw net.ipv4.ip_forward=1
+
+    case $5 in
+    none)
+        ip -n n2n-wan route add $3.0/24 via $2
+        return ;;
+    cone)
+        rule="masquerade" ;;
+    pool)
+        rule="meta l4proto udp snat to $2:20000-20031 random" ;;
+    random)
+        rule="masquerade fully-random" ;;
+    *)
+        echo "unknown NAT type $5"; exit 1 ;;
+    esac
+
+    which nft >/dev/null || { echo "nft not found"; exit 1; }
+
+    # like a home router, drop new connections to the router itself from
+    # outside; they would otherwise leave unreplied conntrack entries that
+    # clash with the mappings a punch is about to open
+    ip netns exec $1 nft -f - <<EOF
+table ip nat {
+    chain postrouting {
+        type nat hook postrouting priority srcnat;
+        oifname "wan0" ${rule}
+    }
+}
+table ip filter {
+    chain input {
+        type filter hook input priority filter;
+        iifname "wan0" ct state new drop
+    }
+}
+EOF
+}
+
+router n2n-ra 10.9.0.2 10.1.0 n2n-a ${NAT_A}
+router n2n-rb 10.9.0.3 10.2.0 n2n-b ${NAT_B}
+
+ip netns exec n2n-wan ${SUPERNODE} -l 7654 -p 7655 -f > /tmp/n2n_nat_sn.log 2>&1 &
+sleep 0.5
+ip netns exec n2n-a ${EDGE} -f -d n2n0 -a 10.10.0.1 -c natTest -k secret \
+    -l 10.9.0.1:7654 -m 02:00:00:00:00:0a > /tmp/n2n_nat_a.log 2>&1 &
+ip netns exec n2n-b ${EDGE} -f -d n2n0 -a 10.10.0.2 -c natTest -k secret \
+    -l 10.9.0.1:7654 -m 02:00:00:00:00:0b > /tmp/n2n_nat_b.log 2>&1 &
+sleep 3
+
+# UDP echo from B to A through the tunnel
+ip netns exec n2n-a timeout 15 python3 -c "
+import socket
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(('10.10.0.1', 9000))
+while True:
+    d, a = s.recvfrom(2048)
+    s.sendto(d, a)" &
+sleep 0.5
+ip netns exec n2n-b python3 -c "
+import socket, time
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(0.5)
+ok = 0
+for i in range(20):
+    s.sendto(b'n2n', ('10.10.0.1', 9000))
+    try:
+        s.recv(2048)
+        ok += 1
+        time.sleep(0.5)
+    except socket.timeout:
+        pass
+print('echo replies: %d/20' % ok)"
+
+# peer path as seen by the edge in namespace $1
+path() {
+    ip netns exec $1 python3 -c "
+import socket
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(1)
+s.sendto(b'peerstats', ('127.0.0.1', 5644))
+try:
+    while True:
+        for w in s.recv(4096).decode().split():
+            if w.startswith('path='): print(w[5:])
+except socket.timeout:
+    pass"
+}
+
+echo "A (${NAT_A}) reaches B via: `path n2n-a`"
+echo "B (${NAT_B}) reaches A via: `path n2n-b`"
+echo "Logs: /tmp/n2n_nat_sn.log /tmp/n2n_nat_a.log /tmp/n2n_nat_b.log"
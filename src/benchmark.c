@@ -1,108 +1,457 @@
+/** Transform benchmark.
+ *
+ *  Times encode and decode of every transop on Ethernet frames from 64 bytes
+ *  up to the default MTU. Keyed transforms are run with a single SA and with
+ *  several SAs where the tx SA changes on every packet, which is what a
+ *  keyfile with short key lifetimes looks like to the decoder. LZO variants
+ *  are run on random and on text-like payloads since the compressor only
+ *  sees the latter.
+ *
+ *  Results are reported as ns per packet, Gbit/s of payload and, on x86,
+ *  TSC cycles per byte; either as a table or as JSON with -j.
+ */
+
 #include "n2n_wire.h"
 #include "n2n_transforms.h"
 #include "n2n.h"
 
 #ifndef WIN32
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 #include <time.h>
 #include <string.h>
 #include <stdio.h>
 
-uint8_t PKT_CONTENT[]={
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
-    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15 };
-
-/* Prototypes */
-static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c );
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC
+#endif
 
-int main( int argc, char * argv[] )
+#define BENCH_DEFAULT_COUNT     10000   /* packets per measurement */
+#define BENCH_ROTATING_SAS      8       /* SAs in the rotating key schedule */
+#define BENCH_SA_BASE           1000000 /* valid_from of the first SA */
+#define BENCH_SA_WINDOW         100     /* seconds each rotating SA is valid */
+#define BENCH_KEY_HEX           "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+
+enum bench_data
 {
-    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-    n2n_trans_op_t transop_null;
+    BENCH_DATA_RANDOM=0,
+    BENCH_DATA_TEXT
+};
 
-    n2n_common_t cmn;
-    n2n_PACKET_t pkt;
-    n2n_community_t c;
+/** One transop as configured by edge. */
+struct bench_transform
+{
+    const char *        name;           /* as shown on the management port */
+    n2n_transform_t     cipher;         /* transform id of the keyed transop */
+    n2n_transform_t     lzo_id;         /* non-zero: compress, then encrypt with cipher */
+};
 
-    struct timeval t1;
-    struct timeval t2;
+typedef struct bench_transform bench_transform_t;
 
-    unsigned long int i;
-    size_t n;
-    size_t idx;
-    size_t rem;
-    ssize_t nw;
-    unsigned long int tdiff;
+static const bench_transform_t bench_transforms[] =
+{
+    { "null",  N2N_TRANSFORM_ID_NULL,     0 },
+    { "tf",    N2N_TRANSFORM_ID_TWOFISH,  0 },
+    { "aes",   N2N_TRANSFORM_ID_AESCBC,   0 },
+    { "lzo",   N2N_TRANSFORM_ID_NULL,     N2N_TRANSFORM_ID_LZO },
+    { "tflz",  N2N_TRANSFORM_ID_TWOFISH,  N2N_TRANSFORM_ID_TWOFISH_LZO },
+    { "aeslz", N2N_TRANSFORM_ID_AESCBC,   N2N_TRANSFORM_ID_AESCBC_LZO },
+    { "gcm",   N2N_TRANSFORM_ID_AESGCM,   0 },
+    { "cc20",  N2N_TRANSFORM_ID_CHACHA20, 0 },
+    { NULL,    0,                         0 }
+};
 
-    transop_null_init( &transop_null );
-    memset(c,0,sizeof(N2N_COMMUNITY_SIZE));
+static const size_t bench_sizes[] = { 64, 128, 256, 512, 1024, DEFAULT_MTU + ETH_FRAMEHDRSIZE, 0 };
 
-    n=10000;
-    memcpy( c, "abc123def456", 12 );
+/** One line of output. */
+struct bench_result
+{
+    const char *        transform;
+    const char *        dir;            /* "encode" or "decode" */
+    size_t              size;           /* payload bytes per packet */
+    size_t              num_sa;         /* 1 or BENCH_ROTATING_SAS */
+    const char *        data;
+    unsigned long       count;
+    uint64_t            ns;             /* wall time for count packets */
+    uint64_t            cycles;         /* TSC ticks for count packets, 0 if unknown */
+};
 
-    gettimeofday( &t1, NULL );
-    for(i=0; i<n; ++i)
-    {
-        nw = do_encode_packet( pktbuf, N2N_PKT_BUF_SIZE, c);
+typedef struct bench_result bench_result_t;
 
-        nw += transop_null.fwd( &transop_null,
-            pktbuf+nw, N2N_PKT_BUF_SIZE-nw,
-            PKT_CONTENT, sizeof(PKT_CONTENT) );
+static int bench_json=0;
+static int bench_rows=0;
 
-        idx=0;
-        rem=nw;
 
-        decode_common( &cmn, pktbuf, &rem, &idx);
-        decode_PACKET( &pkt, &cmn, pktbuf, &rem, &idx );
+static uint64_t bench_now_ns( void )
+{
+    struct timespec ts;
 
-        if ( 0 == (i%1000) )
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles( void )
+{
+#if defined(BENCH_HAVE_TSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/** Fill buf with incompressible bytes or with repeated protocol text. */
+static void bench_fill( uint8_t * buf, size_t len, enum bench_data data )
+{
+    static const char text[] =
+        "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+        "Accept: text/html,application/xhtml+xml\r\nConnection: keep-alive\r\n\r\n";
+    uint32_t x = 0x2545f491;
+    size_t i;
+
+    for ( i=0; i < len; ++i )
+    {
+        if ( BENCH_DATA_TEXT == data )
+        {
+            buf[i] = text[i % (sizeof(text) - 1)];
+        }
+        else
         {
-            fprintf(stderr,".");
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            buf[i] = (uint8_t)x;
         }
     }
-    gettimeofday( &t2, NULL );
+}
+
+static int bench_init_cipher( n2n_trans_op_t * ttt, n2n_transform_t cipher )
+{
+    switch ( cipher )
+    {
+    case N2N_TRANSFORM_ID_NULL:
+        transop_null_init( ttt );
+        return 0;
+    case N2N_TRANSFORM_ID_TWOFISH:
+        return transop_twofish_init( ttt );
+    case N2N_TRANSFORM_ID_AESCBC:
+        /* Version 1 carries part of the IV over from the previous packet,
+         * so the same packet could not be decoded over and over. Both cost
+         * the same. */
+        return transop_aes_init( ttt ) || transop_aes_set_version( ttt, 2 );
+    case N2N_TRANSFORM_ID_AESGCM:
+        return transop_aesgcm_init( ttt );
+    case N2N_TRANSFORM_ID_CHACHA20:
+        return transop_cc20_init( ttt );
+    default:
+        return -1;
+    }
+}
+
+/** Give a keyed transop num_sa SAs. A single SA is valid forever; several
+ *  SAs get consecutive windows of BENCH_SA_WINDOW seconds.
+ *
+ *  @return 0 on success. */
+static int bench_add_sas( n2n_trans_op_t * ttt, n2n_transform_t cipher, size_t num_sa )
+{
+    n2n_cipherspec_t spec;
+    size_t i;
 
-    tdiff = ((t2.tv_sec - t1.tv_sec) * 1000000) + (t2.tv_usec - t1.tv_usec);
+    for ( i=0; i < num_sa; ++i )
+    {
+        memset( &spec, 0, sizeof(spec) );
+        spec.t = cipher;
+        if ( 1 == num_sa )
+        {
+            spec.valid_from = 0;
+            spec.valid_until = 0x7fffffff;
+        }
+        else
+        {
+            spec.valid_from = BENCH_SA_BASE + i * BENCH_SA_WINDOW;
+            spec.valid_until = spec.valid_from + BENCH_SA_WINDOW - 1;
+        }
+        snprintf( (char *)spec.opaque, N2N_MAX_KEYSIZE, "%u_%s", (unsigned int)(i + 1), BENCH_KEY_HEX );
+        spec.opaque_size = strlen( (char *)spec.opaque );
 
-    fprintf( stderr, "\nrun %lu times. (%lu -> %lu nsec each) %u.%06u -> %u.%06u.\n", i, tdiff, (tdiff *1000)/i, (uint32_t)t1.tv_sec, (uint32_t)t1.tv_usec, (uint32_t)t2.tv_sec, (uint32_t)t2.tv_usec );
+        if ( 0 != (ttt->addspec)( ttt, &spec ) )
+        {
+            return -1;
+        }
+    }
 
     return 0;
 }
 
-static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c )
+/** A time at which SA number i of the schedule set up by bench_add_sas() is
+ *  the only valid one. */
+static time_t bench_sa_time( size_t i )
+{
+    return BENCH_SA_BASE + i * BENCH_SA_WINDOW + 1;
+}
+
+static void bench_report( const bench_result_t * r )
+{
+    double ns_pkt = (double)r->ns / r->count;
+    double gbps = (r->size * 8.0) / ns_pkt;
+
+    if ( bench_json )
+    {
+        printf( "%s\n    {\"transform\":\"%s\",\"dir\":\"%s\",\"size\":%u,\"sas\":%u,\"data\":\"%s\","
+                "\"packets\":%lu,\"ns_per_packet\":%.1f,\"gbit_per_s\":%.3f,\"cycles_per_byte\":",
+                (bench_rows ? "," : ""), r->transform, r->dir, (unsigned int)r->size, (unsigned int)r->num_sa,
+                r->data, r->count, ns_pkt, gbps );
+        if ( r->cycles )
+        {
+            printf( "%.2f}", (double)r->cycles / ((double)r->count * r->size) );
+        }
+        else
+        {
+            printf( "null}" );
+        }
+    }
+    else
+    {
+        if ( 0 == bench_rows )
+        {
+            printf( "%-6s %-6s %5s %3s %-6s %10s %8s %8s\n",
+                    "trans", "dir", "size", "sas", "data", "ns/pkt", "Gbit/s", "cyc/B" );
+        }
+        printf( "%-6s %-6s %5u %3u %-6s %10.1f %8.3f ",
+                r->transform, r->dir, (unsigned int)r->size, (unsigned int)r->num_sa, r->data, ns_pkt, gbps );
+        if ( r->cycles )
+        {
+            printf( "%8.2f\n", (double)r->cycles / ((double)r->count * r->size) );
+        }
+        else
+        {
+            printf( "%8s\n", "-" );
+        }
+    }
+
+    ++bench_rows;
+}
+
+/** Measure encode and decode of one transform, size, SA count and payload.
+ *
+ *  With several SAs the encoder is ticked onto the next SA before every
+ *  packet and the decoder gets packets of all SAs in turn, so both the SA
+ *  switch and the SA lookup are part of the time.
+ *
+ *  @return 0 on success, -1 if setup failed, count is 0, a packet did not
+ *  encode or decode, or decode did not give back the payload. */
+static int bench_run( const bench_transform_t * bt, size_t size, size_t num_sa,
+                      enum bench_data data, unsigned long count )
+{
+    static uint8_t ring[BENCH_ROTATING_SAS][N2N_PKT_BUF_SIZE];
+    int ring_len[BENCH_ROTATING_SAS];
+    uint8_t payload[N2N_PKT_BUF_SIZE];
+    uint8_t out[N2N_PKT_BUF_SIZE];
+    n2n_trans_op_t cipher;
+    n2n_trans_op_t lzo;
+    n2n_trans_op_t * ttt = &cipher;
+    bench_result_t r;
+    uint64_t t0;
+    uint64_t c0;
+    unsigned long i;
+    int rc = -1;
+    int nw = -1;
+
+    if ( 0 == count )
+    {
+        return -1;
+    }
+
+    memset( &cipher, 0, sizeof(cipher) );
+    memset( &lzo, 0, sizeof(lzo) );
+
+    if ( 0 != bench_init_cipher( &cipher, bt->cipher ) )
+    {
+        fprintf( stderr, "%s: init failed\n", bt->name );
+        return -1;
+    }
+
+    if ( (N2N_TRANSFORM_ID_NULL != bt->cipher) && (0 != bench_add_sas( &cipher, bt->cipher, num_sa )) )
+    {
+        fprintf( stderr, "%s: no SA accepted (not built in?)\n", bt->name );
+        goto out;
+    }
+
+    if ( bt->lzo_id )
+    {
+        if ( 0 != transop_lzo_init( &lzo, bt->lzo_id, &cipher ) )
+        {
+            goto out;
+        }
+        ttt = &lzo;
+    }
+
+    bench_fill( payload, size, data );
+    (ttt->tick)( ttt, bench_sa_time( 0 ) );
+
+    /* One packet per SA for the decoder. */
+    for ( i=0; i < num_sa; ++i )
+    {
+        (ttt->tick)( ttt, bench_sa_time( i ) );
+        ring_len[i] = (ttt->fwd)( ttt, ring[i], N2N_PKT_BUF_SIZE, payload, size );
+        if ( ring_len[i] < 0 )
+        {
+            fprintf( stderr, "%s: encode failed\n", bt->name );
+            goto out;
+        }
+    }
+
+    memset( &r, 0, sizeof(r) );
+    r.transform = bt->name;
+    r.size = size;
+    r.num_sa = num_sa;
+    r.data = (BENCH_DATA_TEXT == data) ? "text" : "random";
+    r.count = count;
+
+    r.dir = "encode";
+    t0 = bench_now_ns();
+    c0 = bench_cycles();
+    for ( i=0; i < count; ++i )
+    {
+        if ( num_sa > 1 )
+        {
+            (ttt->tick)( ttt, bench_sa_time( i % num_sa ) );
+        }
+        nw = (ttt->fwd)( ttt, out, N2N_PKT_BUF_SIZE, payload, size );
+    }
+    r.cycles = bench_cycles() - c0;
+    r.ns = bench_now_ns() - t0;
+    if ( nw < 0 )
+    {
+        fprintf( stderr, "%s: encode failed\n", bt->name );
+        goto out;
+    }
+    bench_report( &r );
+
+    r.dir = "decode";
+    t0 = bench_now_ns();
+    c0 = bench_cycles();
+    for ( i=0; i < count; ++i )
+    {
+        size_t k = i % num_sa;
+
+        nw = (ttt->rev)( ttt, out, N2N_PKT_BUF_SIZE, ring[k], ring_len[k] );
+    }
+    r.cycles = bench_cycles() - c0;
+    r.ns = bench_now_ns() - t0;
+    bench_report( &r );
+
+    if ( (nw != (int)size) || (0 != memcmp( out, payload, size )) )
+    {
+        fprintf( stderr, "%s: decode of %u bytes does not match the input\n", bt->name, (unsigned int)size );
+        goto out;
+    }
+
+    rc = 0;
+
+out:
+    if ( lzo.deinit )
+    {
+        (lzo.deinit)( &lzo );
+    }
+    if ( cipher.deinit )
+    {
+        (cipher.deinit)( &cipher );
+    }
+    return rc;
+}
+
+static void help( void )
 {
-    /* n2n_mac_t destMac={0,1,2,3,4,5}; */
-    n2n_common_t cmn;
-    n2n_PACKET_t pkt;
-    size_t idx;
+    fprintf( stderr, "benchmark [-j] [-n <packets>] [-t <transform>] [-s <size>]\n"
+             "  -j  JSON output\n"
+             "  -n  packets per measurement (default %u)\n"
+             "  -t  only this transform: null tf aes lzo tflz aeslz gcm cc20\n"
+             "  -s  only this payload size\n", BENCH_DEFAULT_COUNT );
+    exit( 1 );
+}
 
+int main( int argc, char * argv[] )
+{
+    unsigned long count = BENCH_DEFAULT_COUNT;
+    const char * only_transform = NULL;
+    size_t only_size = 0;
+    const bench_transform_t * bt;
+    const size_t * size;
+    int failed = 0;
+    int opt;
 
-    memset( &cmn, 0, sizeof(cmn) );
-    cmn.ttl = N2N_DEFAULT_TTL;
-    cmn.pc = n2n_packet;
-    cmn.flags=0; /* no options, not from supernode, no socket */
-    memcpy( cmn.community, c, N2N_COMMUNITY_SIZE );
+    while ( (opt = getopt( argc, argv, "jn:t:s:h" )) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'j':
+            bench_json = 1;
+            break;
+        case 'n':
+            count = strtoul( optarg, NULL, 10 );
+            break;
+        case 't':
+            only_transform = optarg;
+            break;
+        case 's':
+            only_size = strtoul( optarg, NULL, 10 );
+            break;
+        default:
+            help();
+        }
+    }
+
+    if ( (0 == count) || (only_size > DEFAULT_MTU + ETH_FRAMEHDRSIZE) )
+    {
+        help();
+    }
 
-    memset( &pkt, 0, sizeof(pkt) );
+    /* A fast cipher is of no use if it is wrong. */
+    if ( 0 != transop_cc20_selftest() )
+    {
+        fprintf( stderr, "cc20: RFC 8439 test vector failed\n" );
+        failed = 1;
+    }
+
+    if ( bench_json )
+    {
+        printf( "{\"packets\":%lu,\"tsc\":%s,\"results\":[", count, bench_cycles() ? "true" : "false" );
+    }
+
+    for ( bt = bench_transforms; bt->name; ++bt )
+    {
+        if ( only_transform && strcmp( only_transform, bt->name ) )
+        {
+            continue;
+        }
+
+        for ( size = bench_sizes; *size; ++size )
+        {
+            size_t s = only_size ? only_size : *size;
+
+            failed |= bench_run( bt, s, 1, BENCH_DATA_RANDOM, count );
+            if ( N2N_TRANSFORM_ID_NULL != bt->cipher )
+            {
+                failed |= bench_run( bt, s, BENCH_ROTATING_SAS, BENCH_DATA_RANDOM, count );
+            }
+            if ( bt->lzo_id )
+            {
+                failed |= bench_run( bt, s, 1, BENCH_DATA_TEXT, count );
+            }
+
+            if ( only_size )
+            {
+                break;
+            }
+        }
+    }
+
+    if ( bench_json )
+    {
+        printf( "\n]}\n" );
+    }
 
-    idx=0;
-    encode_PACKET( pktbuf, &idx, &cmn, &pkt );
-    traceEvent( TRACE_DEBUG, "encoded PACKET header of size=%u", (unsigned int)idx );
-    
-    return idx;
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,366 @@
+/** End-to-end edge benchmark.
+ *
+ *  Drives two edges started with -D (loop device, see tuntap_loop.c): frames
+ *  written to edge A's socket are encrypted, sent through the n2n network and
+ *  come out of edge B's socket. The whole datapath is measured (TAP read,
+ *  peer lookup, transform, UDP both ways, TAP write) without root or TAP
+ *  interfaces.
+ *
+ *    benchmark_edge -a /tmp/a.sock -b /tmp/b.sock -A 02:00:00:00:00:0a -B 02:00:00:00:00:0b &
+ *    supernode -l 7654
+ *    edge -D /tmp/a.sock -m 02:00:00:00:00:0a -a 10.0.0.1 -c bench -k secret -l 127.0.0.1:7654
+ *    edge -D /tmp/b.sock -m 02:00:00:00:00:0b -a 10.0.0.2 -c bench -k secret -l 127.0.0.1:7654
+ *
+ *  After a warm-up that lets the edges register and find each other, frames
+ *  are sent from A to B with at most a window of them in flight. Each frame
+ *  carries a sequence number and its send time, giving frames per second,
+ *  throughput, loss and one-way latency.
+ */
+
+#include "n2n.h"
+
+#ifndef WIN32
+#include <sys/un.h>
+#include <poll.h>
+#endif
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+
+#define BENCH_ETHERTYPE         0x88b5  /* IEEE local experimental */
+#define BENCH_MAGIC             0x4e324e42
+#define BENCH_HDR_SIZE          (ETH_FRAMEHDRSIZE + 4 + 4 + 8)
+#define BENCH_DEFAULT_FRAMES    100000
+#define BENCH_DEFAULT_WINDOW    64
+#define BENCH_WARMUP_SEC        3       /* keep sending after the first frame got through */
+#define BENCH_CONNECT_SEC       60      /* wait this long for the first frame */
+#define BENCH_STALL_MSEC        500     /* in-flight frames are lost after this long without progress */
+
+struct bench_frame
+{
+    uint32_t            magic;
+    uint32_t            seq;
+    uint64_t            sent_ns;
+};
+
+typedef struct bench_frame bench_frame_t;
+
+static n2n_mac_t mac_a;
+static n2n_mac_t mac_b;
+
+
+static uint64_t bench_now_ns( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Listen on path for an edge.
+ *
+ *  @return the listening socket or -1. */
+static int bench_listen( const char * path )
+{
+    struct sockaddr_un addr;
+    int lfd;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path, sizeof(addr.sun_path) - 1 );
+    unlink( path );
+
+    lfd = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+    if ( (lfd < 0)
+         || (bind( lfd, (struct sockaddr *)&addr, sizeof(addr) ) < 0)
+         || (listen( lfd, 1 ) < 0) )
+    {
+        fprintf( stderr, "listen on %s: %s\n", path, strerror(errno) );
+        return -1;
+    }
+
+    return lfd;
+}
+
+/** Wait for the edge to connect to lfd and stop listening.
+ *
+ *  @return the connected socket or -1. */
+static int bench_accept( int lfd, const char * path )
+{
+    int fd;
+
+    fprintf( stderr, "waiting for an edge on %s\n", path );
+    fd = accept( lfd, NULL, NULL );
+    close( lfd );
+    unlink( path );
+
+    return fd;
+}
+
+/** Send frame number seq of size bytes into edge A. */
+static int bench_send( int fd, uint8_t * frame, size_t size, uint32_t seq )
+{
+    bench_frame_t bf;
+
+    bf.magic = BENCH_MAGIC;
+    bf.seq = seq;
+    bf.sent_ns = bench_now_ns();
+    memcpy( frame + ETH_FRAMEHDRSIZE, &bf, sizeof(bf) );
+
+    return (write( fd, frame, size ) == (ssize_t)size) ? 0 : -1;
+}
+
+/** Wait up to msec for a frame out of edge B.
+ *
+ *  @return 1 and the frame in bf, 0 on timeout or a foreign frame, -1 on
+ *  error. */
+static int bench_recv( int fd, int msec, bench_frame_t * bf )
+{
+    uint8_t frame[N2N_PKT_BUF_SIZE];
+    struct pollfd pfd;
+    ssize_t len;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if ( poll( &pfd, 1, msec ) <= 0 )
+    {
+        return 0;
+    }
+
+    len = read( fd, frame, sizeof(frame) );
+    if ( len <= 0 )
+    {
+        return -1;
+    }
+
+    if ( (len < BENCH_HDR_SIZE)
+         || (((frame[12] << 8) | frame[13]) != BENCH_ETHERTYPE) )
+    {
+        return 0;
+    }
+
+    memcpy( bf, frame + ETH_FRAMEHDRSIZE, sizeof(*bf) );
+    return (BENCH_MAGIC == bf->magic) ? 1 : 0;
+}
+
+static int bench_cmp_u64( const void * a, const void * b )
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void help( void )
+{
+    fprintf( stderr, "benchmark_edge -a <socket A> -b <socket B> -A <MAC A> -B <MAC B>\n"
+             "               [-n <frames>] [-s <frame size>] [-w <window>] [-j]\n"
+             "  -a/-b  sockets given to the edges with -D\n"
+             "  -A/-B  MAC addresses given to the edges with -m\n"
+             "  -n     frames to send (default %u)\n"
+             "  -s     Ethernet frame size (default %u)\n"
+             "  -w     frames in flight (default %u)\n"
+             "  -j     JSON output\n",
+             BENCH_DEFAULT_FRAMES, DEFAULT_MTU + ETH_FRAMEHDRSIZE, BENCH_DEFAULT_WINDOW );
+    exit( 1 );
+}
+
+int main( int argc, char * argv[] )
+{
+    const char * path_a = NULL;
+    const char * path_b = NULL;
+    unsigned long frames = BENCH_DEFAULT_FRAMES;
+    unsigned long window = BENCH_DEFAULT_WINDOW;
+    size_t size = DEFAULT_MTU + ETH_FRAMEHDRSIZE;
+    int json = 0;
+    uint8_t frame[N2N_PKT_BUF_SIZE];
+    uint64_t * latency;
+    unsigned long sent = 0;
+    unsigned long received = 0;
+    unsigned long lost = 0;
+    uint32_t lost_below = 0;            /* frames before this were given up on */
+    uint64_t t_start;
+    uint64_t t_end;
+    uint64_t t_progress;
+    uint64_t deadline;
+    bench_frame_t bf;
+    double secs;
+    double sum = 0;
+    unsigned long i;
+    int fd_a;
+    int fd_b;
+    int rc;
+    int opt;
+
+    while ( (opt = getopt( argc, argv, "a:b:A:B:n:s:w:jh" )) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'a':
+            path_a = optarg;
+            break;
+        case 'b':
+            path_b = optarg;
+            break;
+        case 'A':
+            str2mac( mac_a, optarg );
+            break;
+        case 'B':
+            str2mac( mac_b, optarg );
+            break;
+        case 'n':
+            frames = strtoul( optarg, NULL, 10 );
+            break;
+        case 's':
+            size = strtoul( optarg, NULL, 10 );
+            break;
+        case 'w':
+            window = strtoul( optarg, NULL, 10 );
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            help();
+        }
+    }
+
+    if ( !path_a || !path_b || (0 == frames) || (0 == window)
+         || (size < BENCH_HDR_SIZE) || (size > DEFAULT_MTU + ETH_FRAMEHDRSIZE) )
+    {
+        help();
+    }
+
+    latency = (uint64_t *)calloc( frames, sizeof(uint64_t) );
+    if ( NULL == latency )
+    {
+        return 1;
+    }
+
+    memset( frame, 0xa5, sizeof(frame) );
+    memcpy( frame, mac_b, sizeof(n2n_mac_t) );
+    memcpy( frame + 6, mac_a, sizeof(n2n_mac_t) );
+    frame[12] = BENCH_ETHERTYPE >> 8;
+    frame[13] = BENCH_ETHERTYPE & 0xff;
+
+    /* Both sockets exist before either edge has to connect. */
+    fd_a = bench_listen( path_a );
+    fd_b = bench_listen( path_b );
+    if ( (fd_a < 0) || (fd_b < 0) )
+    {
+        return 1;
+    }
+
+    fd_a = bench_accept( fd_a, path_a );
+    fd_b = bench_accept( fd_b, path_b );
+    if ( (fd_a < 0) || (fd_b < 0) )
+    {
+        return 1;
+    }
+
+    /* Warm-up: the first frames go through the supernode while the edges
+     * register with it and then with each other. */
+    fprintf( stderr, "waiting for frames to get from A to B\n" );
+    deadline = bench_now_ns() + BENCH_CONNECT_SEC * 1000000000ULL;
+    while ( 1 )
+    {
+        bench_send( fd_a, frame, size, 0 );
+        rc = bench_recv( fd_b, 100, &bf );
+        if ( rc < 0 )
+        {
+            fprintf( stderr, "edge B went away\n" );
+            return 1;
+        }
+        if ( rc > 0 )
+        {
+            break;
+        }
+        if ( bench_now_ns() > deadline )
+        {
+            fprintf( stderr, "no frame got through in %u seconds\n", BENCH_CONNECT_SEC );
+            return 1;
+        }
+    }
+
+    deadline = bench_now_ns() + BENCH_WARMUP_SEC * 1000000000ULL;
+    while ( bench_now_ns() < deadline )
+    {
+        bench_send( fd_a, frame, size, 0 );
+        while ( bench_recv( fd_b, 10, &bf ) > 0 ) {}
+    }
+    while ( bench_recv( fd_b, 200, &bf ) > 0 ) {}
+
+    /* Measurement; sequence numbers start at 1 to tell warm-up frames apart. */
+    t_start = bench_now_ns();
+    t_progress = t_start;
+    while ( (received + lost) < frames )
+    {
+        while ( (sent < frames) && ((sent - received - lost) < window) )
+        {
+            if ( 0 != bench_send( fd_a, frame, size, (uint32_t)(++sent) ) )
+            {
+                fprintf( stderr, "edge A went away\n" );
+                return 1;
+            }
+        }
+
+        rc = bench_recv( fd_b, BENCH_STALL_MSEC, &bf );
+        if ( rc < 0 )
+        {
+            fprintf( stderr, "edge B went away\n" );
+            return 1;
+        }
+
+        if ( (rc > 0) && (bf.seq > lost_below) && (bf.seq <= sent) )
+        {
+            latency[received++] = bench_now_ns() - bf.sent_ns;
+            t_progress = bench_now_ns();
+        }
+        else if ( bench_now_ns() - t_progress > BENCH_STALL_MSEC * 1000000ULL )
+        {
+            /* Nothing arrived for a while: give up on what is in flight. */
+            lost += sent - received - lost;
+            lost_below = (uint32_t)sent;
+            t_progress = bench_now_ns();
+        }
+    }
+    t_end = bench_now_ns();
+
+    secs = (t_end - t_start) / 1e9;
+    for ( i=0; i < received; ++i )
+    {
+        sum += latency[i];
+    }
+    qsort( latency, received, sizeof(uint64_t), bench_cmp_u64 );
+
+    if ( 0 == received )
+    {
+        fprintf( stderr, "all %lu frames lost\n", frames );
+        return 1;
+    }
+
+    if ( json )
+    {
+        printf( "{\"frames\":%lu,\"size\":%u,\"window\":%lu,\"received\":%lu,\"lost\":%lu,"
+                "\"seconds\":%.3f,\"fps\":%.0f,\"mbit_per_s\":%.1f,"
+                "\"latency_us\":{\"min\":%.1f,\"avg\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+                frames, (unsigned int)size, window, received, lost, secs,
+                received / secs, received * size * 8 / secs / 1e6,
+                latency[0] / 1e3, sum / received / 1e3, latency[received / 2] / 1e3,
+                latency[(received * 99) / 100] / 1e3, latency[received - 1] / 1e3 );
+    }
+    else
+    {
+        printf( "%lu frames of %u bytes, window %lu: %lu received, %lu lost in %.3f s\n",
+                frames, (unsigned int)size, window, received, lost, secs );
+        printf( "%.0f frames/s, %.1f Mbit/s\n", received / secs, received * size * 8 / secs / 1e6 );
+        printf( "latency us: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+                latency[0] / 1e3, sum / received / 1e3, latency[received / 2] / 1e3,
+                latency[(received * 99) / 100] / 1e3, latency[received - 1] / 1e3 );
+    }
+
+    free( latency );
+    close( fd_a );
+    close( fd_b );
+    return 0;
+}
@@ -75,6 +75,11 @@ struct SCM_def sd = {
 #define N2N_TRANSOP_NULL_IDX    0
 #define N2N_TRANSOP_TF_IDX      1
 #define N2N_TRANSOP_AESCBC_IDX  2
+#define N2N_TRANSOP_LZO_IDX     3       /* LZO variants sit at N2N_TRANSOP_LZO_IDX + the cipher's index */
+#define N2N_TRANSOP_TF_LZO_IDX  4
+#define N2N_TRANSOP_AESCBC_LZO_IDX 5
+#define N2N_TRANSOP_AESGCM_IDX  6
+#define N2N_TRANSOP_CC20_IDX    7
 /* etc. */
 
 
@@ -96,8 +101,221 @@ struct SCM_def sd = {
 typedef char n2n_sn_name_t[N2N_EDGE_SN_HOST_SIZE];
 typedef char n2n_local_ip_t[N2N_EDGE_LOCAL_IP_SIZE];
 
-#define N2N_EDGE_NUM_SUPERNODES 2
+#define N2N_EDGE_NUM_SUPERNODES 16
 #define N2N_EDGE_SUP_ATTEMPTS   3       /* Number of failed attmpts before moving on to next supernode. */
+#define EDGE_SN_SWITCH_MIN_US   2000    /* Move to a faster supernode only if it saves this much RTT... */
+#define EDGE_SN_SWITCH_DIV      5       /* ...and at least 1/5 of the current RTT. */
+
+/** A supernode from the -l list.
+ *
+ *  Every registration round sends REGISTER_SUPER to all of them so that each
+ *  can relay to this edge and its RTT is measured by the cookie exchange. */
+typedef struct n2n_edge_sn
+{
+    n2n_sn_name_t       name;
+    n2n_sock_t          sock;
+    n2n_cookie_t        cookie;                 /**< Of the outstanding REGISTER_SUPER. */
+    uint64_t            sent_us;                /**< When it was sent, 0 once answered. */
+    uint32_t            srtt_us;                /**< Smoothed RTT, 0 until measured. */
+    uint32_t            rtt_us;                 /**< Last RTT sample. */
+    size_t              lost;                   /**< REGISTER_SUPERs in a row left unanswered. */
+    time_t              last_ack;
+    n2n_pmtu_t          pmtu;                   /**< Of the path to sock. */
+    uint16_t            probe_port;             /**< Shows it our NAT port allocation, 0 if none. */
+} n2n_edge_sn_t;
+
+/* Path MTU discovery. Probe sizes are whole IPv4 datagrams. */
+#define EDGE_PMTU_MIN           1280    /* Assumed when no probe got through. */
+#define EDGE_PMTU_PROBE_TIMEOUT 1       /* sec to wait for a probe's ACK */
+#define EDGE_PMTU_PROBE_TRIES   2       /* Probes of one size before trying the next smaller. */
+#define EDGE_PMTU_INTERVAL      600     /* sec between searches of a path */
+
+/* RTT probes of the sockets a peer can be reached on. */
+#define EDGE_PEER_PROBE_INTERVAL 10     /* sec between rounds of probes to an operational peer */
+#define EDGE_PEER_PATH_LOST     3       /* Probes in a row unanswered before a socket is not used. */
+#define EDGE_PEER_SWITCH_MIN_US 200     /* Move to a faster socket only if it saves this much RTT... */
+#define EDGE_PEER_SWITCH_DIV    5       /* ...and at least 1/5 of the current RTT. */
+#define EDGE_UDP_HDR_SIZE       28      /* IPv4 and UDP headers of a datagram */
+
+/* Outer IPv4, UDP, common and PACKET headers and the frame's ethernet
+ * header: what a path MTU loses before the transform's overhead. */
+#define EDGE_PACKET_OVERHEAD    (EDGE_UDP_HDR_SIZE + 4 + N2N_COMMUNITY_SIZE + 2 + ETH_FRAMEHDRSIZE)
+
+#define EDGE_TX_BATCH           32      /* Most frames drained from the TAP per wakeup. */
+#define EDGE_BATCH_HIST_SIZE    6       /* Batch size histogram buckets: 1, 2-3, 4-7, 8-15, 16-31, 32+ */
+
+/* A frame sits this far into its Tx slot so that the transform, ethernet and
+ * PACKET headers can be put in front of it without moving the payload. */
+#define EDGE_PACKET_HDR_MAX     32      /* encoded n2n_common_t and PACKET fields */
+#define EDGE_TX_HEADROOM        (EDGE_PACKET_HDR_MAX + ETH_FRAMEHDRSIZE + N2N_TRANSOP_HEADROOM)
+#define EDGE_TX_FRAME_SIZE      (N2N_PKT_BUF_SIZE - EDGE_TX_HEADROOM - N2N_TRANSOP_TAILROOM)
+
+#define EDGE_FLOW_CACHE_SIZE    64      /* Destination MACs remembered per TAP reader, a power of 2. */
+
+/** Where frames for one destination MAC were last sent.
+ *
+ *  An entry is used while its gen matches eee->peer_gen and until expires,
+ *  the next time find_peer_destination() would act on a peer timeout or
+ *  registration retry. What was sent through it is added to the peer's
+ *  counters when it is resolved again. */
+typedef struct n2n_edge_flow
+{
+    n2n_mac_t           mac;
+    int                 p2p;                    /**< 1 if sent to the peer, 0 via the supernode. */
+    uint32_t            gen;                    /**< peer_gen it was resolved in, 0 if unused. */
+    time_t              expires;
+    n2n_sock_t          sock;
+    struct sockaddr_in  addr;                   /**< sock, ready for sendto(). */
+    size_t              mtu;                    /**< Path MTU to sock, 0 if not known. */
+    size_t              tx_pkts;                /**< Sent since last added to the peer's counters. */
+    size_t              tx_bytes;
+    size_t              fec_group;              /**< PACKETs per FEC parity, 0 for none. */
+} n2n_edge_flow_t;
+
+#define EDGE_NEIGH_TTL          120     /* sec a learned binding is used without being confirmed again */
+#define EDGE_NEIGH_HASH_SIZE    53      /* prime number */
+
+/** IP to MAC binding of a host behind another edge, learned from ARP and
+ *  neighbour discovery frames received from the community. */
+struct edge_neigh
+{
+    struct edge_neigh * next;
+    int                 ipv6;
+    uint8_t             ip[16];                 /**< Network order, IPv4 in the first 4 bytes. */
+    n2n_mac_t           mac;
+    time_t              last_seen;
+    time_t              conflict;               /**< Last time another MAC claimed ip, 0 if never. */
+};
+
+typedef struct edge_neigh edge_neigh_t;
+
+#define EDGE_NEIGH_COMPARATOR(e1, e2) \
+    ( ((e1)->ipv6 != (e2)->ipv6) ? ((e1)->ipv6 - (e2)->ipv6) : memcmp((e1)->ip, (e2)->ip, 16) )
+
+static unsigned int edge_neigh_t_hash_function( edge_neigh_t * e );
+
+SGLIB_DEFINE_LIST_PROTOTYPES(edge_neigh_t, EDGE_NEIGH_COMPARATOR, next)
+SGLIB_DEFINE_HASHED_CONTAINER_PROTOTYPES(edge_neigh_t, EDGE_NEIGH_HASH_SIZE, edge_neigh_t_hash_function)
+SGLIB_DEFINE_LIST_FUNCTIONS(edge_neigh_t, EDGE_NEIGH_COMPARATOR, next)
+SGLIB_DEFINE_HASHED_CONTAINER_FUNCTIONS(edge_neigh_t, EDGE_NEIGH_HASH_SIZE, edge_neigh_t_hash_function)
+
+/* Egress scheduler (-S). */
+#define EDGE_SCHED_CLASSES      3       /* 0 goes first, 1 and 2 share the rest by DRR */
+#define EDGE_SCHED_QUEUE_LEN    128     /* PACKETs held per class */
+#define EDGE_SCHED_MAX_PORTS    16      /* -P ports */
+#define EDGE_SCHED_BURST_US     2000    /* Sending may catch up this far after an idle time. */
+
+/** A PACKET waiting in the egress scheduler. */
+typedef struct n2n_edge_sched_pkt
+{
+    size_t              len;
+    n2n_sock_t          dest;
+    struct sockaddr_in  addr;
+    uint8_t             data[N2N_PKT_BUF_SIZE];
+} n2n_edge_sched_pkt_t;
+
+/** PACKETs from the TAP waiting to be sent at the uplink rate.
+ *
+ *  Class 0 is always sent first. Classes 1 and 2 are served by deficit round
+ *  robin, class 1 with three times the quantum. Sending is paced by a
+ *  virtual clock: next_ns advances by each datagram's time on the wire and
+ *  a datagram may go once it is not ahead of the real clock. */
+typedef struct n2n_edge_sched
+{
+    uint64_t            rate;                   /**< Uplink bytes per second. */
+    uint64_t            next_ns;
+    size_t              head[EDGE_SCHED_CLASSES];
+    size_t              count[EDGE_SCHED_CLASSES];
+    size_t              deficit[EDGE_SCHED_CLASSES];
+    size_t              drr;                    /**< DRR class whose turn it is, 1 or 2. */
+    int                 turn;                   /**< drr already got its quantum this turn. */
+    size_t              sent[EDGE_SCHED_CLASSES];
+    size_t              dropped[EDGE_SCHED_CLASSES];
+    n2n_edge_sched_pkt_t q[EDGE_SCHED_CLASSES][EDGE_SCHED_QUEUE_LEN];
+} n2n_edge_sched_t;
+
+/* Forward error correction (-F). */
+#define EDGE_FEC_MIN_GROUP      2
+#define EDGE_FEC_LOSS_DIV       125     /* Group size at most this over the loss per mille: ~1/8 lost per group */
+#define EDGE_FEC_RX_SOURCES     8       /* Peers whose PACKETs are kept for recovery */
+#define EDGE_FEC_RX_RING        48      /* PACKETs kept per peer */
+#define EDGE_FEC_RX_TTL         30      /* sec PACKETs are kept after the peer's last parity */
+#define EDGE_FEC_REPORT_INTERVAL 2      /* sec between loss reports to a peer */
+
+/* Encoded n2n_FEC_t of a parity after the common header. */
+#define EDGE_FEC_HDR_MAX        (2 * N2N_MAC_SIZE + 1 + 2 + 4 * N2N_FEC_MAX_GROUP)
+
+/** The parity being built for one flow cache entry. */
+typedef struct n2n_edge_fec_tx
+{
+    size_t              count;                  /**< PACKETs XORed into parity so far. */
+    size_t              len;                    /**< The longest of them. */
+    uint16_t            len_xor;
+    uint32_t            hash[N2N_FEC_MAX_GROUP];
+    uint8_t             parity[N2N_PKT_BUF_SIZE];
+} n2n_edge_fec_tx_t;
+
+/** A received PACKET after its common header, kept to recover another one
+ *  of its group. */
+typedef struct n2n_edge_fec_pkt
+{
+    uint32_t            hash;
+    uint16_t            len;
+    uint8_t             recovered;              /**< Rebuilt from a parity, not received yet. */
+    uint8_t             data[N2N_PKT_BUF_SIZE - N2N_COMMON_SIZE];
+} n2n_edge_fec_pkt_t;
+
+/** Recovery state for a peer which sends parities. Used by the UDP reader
+ *  only. */
+typedef struct n2n_edge_fec_rx
+{
+    n2n_mac_t           mac;
+    time_t              last_parity;
+    time_t              last_report;
+    size_t              next;                   /**< ring slot of the next PACKET */
+    size_t              recovered;              /**< ring entries with recovered set */
+    size_t              covered;                /**< PACKETs listed by parities since last_report */
+    size_t              lost;                   /**< of covered, not received */
+    uint16_t            loss;                   /**< Smoothed per mille, as reported. */
+    n2n_edge_fec_pkt_t  ring[EDGE_FEC_RX_RING];
+} n2n_edge_fec_rx_t;
+
+/** Encoded PACKETs of one TAP reader waiting to be sent together. */
+struct n2n_edge_txb
+{
+    size_t              n;
+    size_t              len[EDGE_TX_BATCH];
+    uint8_t *           data[EDGE_TX_BATCH];    /**< Start of each PACKET within its buf. */
+    n2n_sock_t          dest[EDGE_TX_BATCH];
+    struct sockaddr_in  addr[EDGE_TX_BATCH];    /**< dest, ready for sendto(). */
+    uint8_t             cls[EDGE_TX_BATCH];     /**< Scheduler class, if eee->sched. */
+    uint8_t             buf[EDGE_TX_BATCH][N2N_PKT_BUF_SIZE];
+    time_t              now;                    /**< Read once per TAP wakeup. */
+    n2n_edge_flow_t     flows[EDGE_FLOW_CACHE_SIZE];
+    n2n_edge_fec_tx_t * fec;                    /**< Parity of each flows entry, NULL unless -F. */
+    size_t              flow_hits;
+    size_t              flow_misses;
+    size_t              tap_hist[EDGE_BATCH_HIST_SIZE];  /**< Frames read per TAP wakeup. */
+    size_t              udp_hist[EDGE_BATCH_HIST_SIZE];  /**< Datagrams per flush. */
+};
+
+typedef struct n2n_edge_txb n2n_edge_txb_t;
+
+#define EDGE_RX_BATCH           32      /* Most datagrams received per wakeup. */
+
+/** Receive ring of the UDP reader, filled by one recvmmsg(). */
+struct n2n_edge_rxb
+{
+    uint8_t             buf[EDGE_RX_BATCH][N2N_PKT_BUF_SIZE];
+    struct sockaddr_in  addr[EDGE_RX_BATCH];
+#if defined(N2N_HAVE_RECVMMSG)
+    struct iovec        iov[EDGE_RX_BATCH];
+    struct mmsghdr      msgs[EDGE_RX_BATCH];
+#endif
+    size_t              hist[EDGE_BATCH_HIST_SIZE];      /**< Datagrams per wakeup. */
+};
+
+typedef struct n2n_edge_rxb n2n_edge_rxb_t;
 
 
 /** Main structure type for edge. */
@@ -111,10 +329,10 @@ struct n2n_edge
 
     size_t              sn_idx;                 /**< Currently active supernode. */
     size_t              sn_num;                 /**< Number of supernode addresses defined. */
-    n2n_sn_name_t       sn_ip_array[N2N_EDGE_NUM_SUPERNODES];
+    n2n_edge_sn_t       sn[N2N_EDGE_NUM_SUPERNODES];
     n2n_local_ip_t      local_ip_str;          /** storing a local ip socket */
     int                 local_sock_ena;        /** > 0 if local_sock is enabled */
-    int                 sn_wait;                /**< Whether we are waiting for a supernode response. */
+    int                 sn_wait;                /**< Whether we are waiting for the active supernode's response. */
 
     n2n_community_t     community_name;         /**< The community. 16 full octets. */
     char                keyschedule[N2N_PATHNAME_MAXLEN];
@@ -127,19 +345,39 @@ struct n2n_edge
     int                 dyn_ip_mode;            /**< Interface IP address is dynamically allocated, eg. DHCP. */
     int                 allow_routing;          /**< Accept packet no to interface address. */
     int                 drop_multicast;         /**< Multicast ethernet addresses. */
+    int                 threaded;               /**< Run the TAP and UDP datapaths in their own threads. */
+    int                 compress;               /**< Compress with LZO before encoding (-z). */
+    int                 pmtu_discovery;         /**< udp_sock can set DF so path MTUs can be probed. */
+#ifndef WIN32
+    pthread_t           tap_thread;
+    pthread_t           net_thread;
+    pthread_mutex_t     peer_lock;              /**< Peer tables and supernode state (threaded mode). */
+    pthread_rwlock_t    transop_lock;           /**< Shared for fwd/rev, exclusive for SA changes (threaded mode). */
+#endif
 
     n2n_trans_op_t      transop[N2N_MAX_TRANSFORMS]; /* one for each transform at fixed positions */
     size_t              tx_transop_idx;         /**< The transop to use when encoding. */
-
-	struct peer_info *  known_peers[PEER_HASH_TAB_SIZE];            /**< Edges we are connected to. */
-    struct peer_info *  pending_peers[PEER_HASH_TAB_SIZE];          /**< Edges we have tried to register with. */
+    int                 aes_accelerated;        /**< CPU has AES instructions; prefer AES-GCM to ChaCha20. */
+    n2n_edge_txb_t *    txb;                    /**< Tx batch of the single TAP reader. */
+    n2n_edge_rxb_t *    rxb;                    /**< Receive ring of the UDP reader. */
+    struct n2n_edge_txq * txq;                  /**< TAP queue workers, NULL unless multi-queue. */
+    size_t              num_txq;
+    n2n_gro_t *         gro;                    /**< Receive coalescing, NULL unless TAP offloads (-O). */
+    n2n_edge_sched_t *  sched;                  /**< Egress scheduler of the TAP reader, NULL unless -S. */
+    uint16_t            prio_ports[EDGE_SCHED_MAX_PORTS]; /**< TCP/UDP ports of class 0 (-P). */
+    size_t              num_prio_ports;
+    size_t              fec_group;              /**< Most PACKETs per FEC parity (-F), 0 for none. */
+    n2n_edge_fec_rx_t * fec_rx[EDGE_FEC_RX_SOURCES]; /**< Allocated in order as peers send parities. */
+
+    struct peer_info *  peers[PEER_HASH_TAB_SIZE];  /**< Other edges, in every n2n_peer_state_t. */
+    uint32_t            peer_gen;               /**< Bumped when the peer table or supernode change. */
+    edge_neigh_t *      neigh[EDGE_NEIGH_HASH_SIZE]; /**< Bindings of remote hosts, under peer_lock. */
+    size_t              num_neigh;
     time_t              last_register_req;      /**< Check if time to re-register with super*/
     size_t              holepunch_interval;      /**< Time distance after last_register_req at which to re-register. */
     time_t              last_purge;             /** last time clients were purged **/
     time_t              last_p2p;               /**< Last time p2p traffic was received. */
     time_t              last_sup;               /**< Last time a packet arrived from supernode. */
-    size_t              sup_attempts;           /**< Number of remaining attempts to this supernode. */
-    n2n_cookie_t        last_cookie;            /**< Cookie sent in last REGISTER_SUPER. */
 
     time_t              start_time;             /**< For calculating uptime */
 
@@ -156,13 +394,136 @@ struct n2n_edge
     size_t              rx_sup;
 	size_t				rx_bit_sup;
     size_t				rx_bps_sup;
+    size_t              gso_frames;             /**< GSO frames read from the TAP and segmented. */
+    size_t              gso_segs;
+    size_t              gro_frames;             /**< Coalesced frames written to the TAP. */
+    size_t              gro_segs;
+    size_t              mss_clamped;            /**< TCP SYNs whose MSS option was lowered. */
+    size_t              too_big;                /**< ICMP too big errors written to the TAP. */
+    size_t              fragmented;             /**< IPv4 packets fragmented to fit the path. */
+    size_t              neigh_answered;         /**< ARP requests and NS answered from neigh. */
+    size_t              neigh_conflicts;        /**< Bindings claimed by a second MAC. */
+    size_t              fec_parities;           /**< FEC parities sent. */
+    size_t              fec_recovered;          /**< PACKETs rebuilt from a parity. */
+    size_t              fec_lost;               /**< PACKETs lost in groups that lost more than one. */
     char       account[N2N_ACCOUNT_SIZE];
 };
 
+/** A TAP to net worker of a multi-queue TAP device.
+ *
+ *  Each worker reads the flows the kernel steers to its queue, encodes with
+ *  its own transops and keeps its own counters. Encoding state (CBC chaining,
+ *  IVs) cannot be shared between threads so the transops are private copies
+ *  holding the same keys as eee->transop, which is used for decoding. */
+struct n2n_edge_txq
+{
+    n2n_edge_t *        eee;
+    int                 queue;                  /**< TAP queue index. */
+#ifndef WIN32
+    pthread_t           thread;
+#endif
+    n2n_trans_op_t      transop[N2N_MAX_TRANSFORMS];
+    n2n_edge_txb_t *    txb;
+    size_t              tx_p2p;
+    size_t              tx_bit_p2p;
+    size_t              tx_sup;
+    size_t              tx_bit_sup;
+};
+
+typedef struct n2n_edge_txq n2n_edge_txq_t;
+
 /** Return the IP address of the current supernode in the ring. */
 static const char * supernode_ip( const n2n_edge_t * eee )
 {
-    return (eee->sn_ip_array)[eee->sn_idx];
+    return eee->sn[eee->sn_idx].name;
+}
+
+/** Monotonic time in microseconds, for supernode RTTs. */
+static uint64_t edge_now_us( void )
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+
+/* Threaded mode (-T).
+ *
+ * readFromTAPSocket() and readFromIPSocket() run in their own threads and
+ * run_loop() is left with registration, purging and management. peer_lock
+ * guards the peer tables and supernode state. transop_lock is held shared
+ * while encoding or decoding, which only touch per-direction transop state,
+ * and exclusively while SAs are ticked or reloaded. Lock order is peer_lock
+ * then transop_lock. Nothing is locked in single-threaded mode. */
+
+static void edge_lock_peers( n2n_edge_t * eee )
+{
+#ifndef WIN32
+    if ( eee->threaded ) pthread_mutex_lock( &(eee->peer_lock) );
+#endif
+}
+
+static void edge_unlock_peers( n2n_edge_t * eee )
+{
+#ifndef WIN32
+    if ( eee->threaded ) pthread_mutex_unlock( &(eee->peer_lock) );
+#endif
+}
+
+static void edge_lock_transops( n2n_edge_t * eee, int exclusive )
+{
+#ifndef WIN32
+    if ( eee->threaded )
+    {
+        if ( exclusive )
+            pthread_rwlock_wrlock( &(eee->transop_lock) );
+        else
+            pthread_rwlock_rdlock( &(eee->transop_lock) );
+    }
+#endif
+}
+
+static void edge_unlock_transops( n2n_edge_t * eee )
+{
+#ifndef WIN32
+    if ( eee->threaded ) pthread_rwlock_unlock( &(eee->transop_lock) );
+#endif
+}
+
+/* Byte counters are added to by the datapath and reset by run_loop(). */
+#if defined(__GNUC__)
+#define edge_stat_add(v, n)     __atomic_fetch_add( &(v), (n), __ATOMIC_RELAXED )
+#define edge_stat_take(v)       __atomic_exchange_n( &(v), 0, __ATOMIC_RELAXED )
+#else
+#define edge_stat_add(v, n)     ((v) += (n))
+static size_t edge_stat_take_( size_t * v ) { size_t r = *v; *v = 0; return r; }
+#define edge_stat_take(v)       edge_stat_take_( &(v) )
+#endif
+
+/* peer_gen is bumped under peer_lock and read by the TAP readers without it. */
+#if defined(__GNUC__)
+#define edge_peer_gen(eee)      __atomic_load_n( &((eee)->peer_gen), __ATOMIC_ACQUIRE )
+#else
+#define edge_peer_gen(eee)      ((eee)->peer_gen)
+#endif
+
+/** Invalidate every cached TX destination. Called with peer_lock held after
+ *  changing the peer table or the supernode. */
+static void edge_peers_changed( n2n_edge_t * eee )
+{
+#if defined(__GNUC__)
+    __atomic_add_fetch( &(eee->peer_gen), 1, __ATOMIC_RELEASE );
+#else
+    ++(eee->peer_gen);
+#endif
 }
 
 
@@ -171,8 +532,9 @@ static int localip2addr(n2n_sock_t * l_ip,
         const n2n_local_ip_t local_ip_strIn, int local_port);
 static int set_localip(n2n_edge_t * eee);
 
-static void send_packet2net(n2n_edge_t * eee,
+static void send_packet2net(n2n_edge_t * eee, n2n_edge_txq_t * txq,
 			    uint8_t *decrypted_msg, size_t len);
+static size_t purge_neigh( n2n_edge_t * eee, time_t purge_before );
 
 
 /* ************************************** */
@@ -309,6 +671,32 @@ static char ** buildargv(int * effectiveargc, char * const linebuffer) {
  *
  *  This also initialises the NULL transform operation opstruct.
  */
+static void edge_init_transops( n2n_trans_op_t * transop )
+{
+    transop_null_init(    &(transop[N2N_TRANSOP_NULL_IDX]) );
+    transop_twofish_init( &(transop[N2N_TRANSOP_TF_IDX]  ) );
+    transop_aes_init( &(transop[N2N_TRANSOP_AESCBC_IDX]  ) );
+    transop_lzo_init( &(transop[N2N_TRANSOP_LZO_IDX]), N2N_TRANSFORM_ID_LZO,
+                      &(transop[N2N_TRANSOP_NULL_IDX]) );
+    transop_lzo_init( &(transop[N2N_TRANSOP_TF_LZO_IDX]), N2N_TRANSFORM_ID_TWOFISH_LZO,
+                      &(transop[N2N_TRANSOP_TF_IDX]) );
+    transop_lzo_init( &(transop[N2N_TRANSOP_AESCBC_LZO_IDX]), N2N_TRANSFORM_ID_AESCBC_LZO,
+                      &(transop[N2N_TRANSOP_AESCBC_IDX]) );
+    transop_aesgcm_init( &(transop[N2N_TRANSOP_AESGCM_IDX]) );
+    transop_cc20_init( &(transop[N2N_TRANSOP_CC20_IDX]) );
+}
+
+static void edge_deinit_transops( n2n_trans_op_t * transop )
+{
+    (transop[N2N_TRANSOP_CC20_IDX].deinit)(&transop[N2N_TRANSOP_CC20_IDX]);
+    (transop[N2N_TRANSOP_AESGCM_IDX].deinit)(&transop[N2N_TRANSOP_AESGCM_IDX]);
+    (transop[N2N_TRANSOP_AESCBC_LZO_IDX].deinit)(&transop[N2N_TRANSOP_AESCBC_LZO_IDX]);
+    (transop[N2N_TRANSOP_TF_LZO_IDX].deinit)(&transop[N2N_TRANSOP_TF_LZO_IDX]);
+    (transop[N2N_TRANSOP_LZO_IDX].deinit)(&transop[N2N_TRANSOP_LZO_IDX]);
+    (transop[N2N_TRANSOP_TF_IDX].deinit)(&transop[N2N_TRANSOP_TF_IDX]);
+    (transop[N2N_TRANSOP_NULL_IDX].deinit)(&transop[N2N_TRANSOP_NULL_IDX]);
+}
+
 static int edge_init(n2n_edge_t * eee)
 {
 #ifdef WIN32
@@ -317,11 +705,13 @@ static int edge_init(n2n_edge_t * eee)
     memset(eee, 0, sizeof(n2n_edge_t));
     eee->start_time = time(NULL);
 
-    transop_null_init(    &(eee->transop[N2N_TRANSOP_NULL_IDX]) );
-    transop_twofish_init( &(eee->transop[N2N_TRANSOP_TF_IDX]  ) );
-    transop_aes_init( &(eee->transop[N2N_TRANSOP_AESCBC_IDX]  ) );
+    edge_init_transops( eee->transop );
 
     eee->tx_transop_idx = N2N_TRANSOP_NULL_IDX; /* No guarantee the others have been setup */
+    eee->aes_accelerated = transop_aesgcm_accelerated();
+    traceEvent( TRACE_INFO, "AES instructions %s, ChaCha20-Poly1305 uses %s code",
+                eee->aes_accelerated ? "present" : "absent",
+                transop_cc20_impl( &(eee->transop[N2N_TRANSOP_CC20_IDX]) ) );
 
     eee->daemon = 1;    /* By default run in daemon mode. */
     eee->re_resolve_supernode_ip = 0;
@@ -334,18 +724,23 @@ static int edge_init(n2n_edge_t * eee)
     eee->allow_routing  = 0;
     eee->drop_multicast = 1;
     eee->local_sock_ena = 0;
-	sglib_hashed_peer_info_t_init(eee->known_peers);
-	sglib_hashed_peer_info_t_init(eee->pending_peers);
+    sglib_hashed_peer_info_t_init(eee->peers);
+    sglib_hashed_edge_neigh_t_init(eee->neigh);
+    eee->peer_gen = 1;
     eee->last_register_req = 0;
     eee->holepunch_interval = DEFAULT_HOLEPUNCH_INTERVAL;
     eee->last_p2p = 0;
     eee->last_sup = 0;
     eee->last_purge = 0;
-    eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS;
 	eee->tx_bit_p2p = 0;
 	eee->tx_bit_sup = 0;
 	eee->rx_bit_p2p = 0;
 	eee->rx_bit_sup = 0;
+    eee->threaded = 0;
+#ifndef WIN32
+    pthread_mutex_init( &(eee->peer_lock), NULL );
+    pthread_rwlock_init( &(eee->transop_lock), NULL );
+#endif
 
     if(lzo_init() != LZO_E_OK)
     {
@@ -353,6 +748,13 @@ static int edge_init(n2n_edge_t * eee)
         return(-1);
     }
 
+    eee->txb = (n2n_edge_txb_t *)calloc( 1, sizeof(n2n_edge_txb_t) );
+    eee->rxb = (n2n_edge_rxb_t *)calloc( 1, sizeof(n2n_edge_rxb_t) );
+    if ( (NULL == eee->txb) || (NULL == eee->rxb) )
+    {
+        return(-1);
+    }
+
     return(0);
 }
 
@@ -361,6 +763,16 @@ static int edge_init(n2n_edge_t * eee)
 /* Called in main() after options are parsed. */
 static int edge_init_twofish( n2n_edge_t * eee, uint8_t *encrypt_pwd, uint32_t encrypt_pwd_len )
 {
+    size_t q;
+
+    for ( q=0; q < eee->num_txq; ++q )
+    {
+        if ( transop_twofish_setup( &(eee->txq[q].transop[N2N_TRANSOP_TF_IDX]), 0, encrypt_pwd, encrypt_pwd_len ) < 0 )
+        {
+            return -1;
+        }
+    }
+
     return transop_twofish_setup( &(eee->transop[N2N_TRANSOP_TF_IDX]), 0, encrypt_pwd, encrypt_pwd_len );
 }
 
@@ -382,6 +794,21 @@ static int transop_enum_to_index( n2n_transform_t id )
     case N2N_TRANSFORM_ID_AESCBC:
         return N2N_TRANSOP_AESCBC_IDX;
         break;
+    case N2N_TRANSFORM_ID_LZO:
+        return N2N_TRANSOP_LZO_IDX;
+        break;
+    case N2N_TRANSFORM_ID_TWOFISH_LZO:
+        return N2N_TRANSOP_TF_LZO_IDX;
+        break;
+    case N2N_TRANSFORM_ID_AESCBC_LZO:
+        return N2N_TRANSOP_AESCBC_LZO_IDX;
+        break;
+    case N2N_TRANSFORM_ID_AESGCM:
+        return N2N_TRANSOP_AESGCM_IDX;
+        break;
+    case N2N_TRANSFORM_ID_CHACHA20:
+        return N2N_TRANSOP_CC20_IDX;
+        break;
     default:
         return -1;
     }
@@ -394,6 +821,7 @@ static int n2n_tick_transop( n2n_edge_t * eee, time_t now )
 {
     n2n_tostat_t tst;
     size_t trop = eee->tx_transop_idx;
+    size_t i;
 
     /* Tests are done in order that most preferred transform is last and causes
      * tx_transop_idx to be left at most preferred valid transform. */
@@ -412,6 +840,35 @@ static int n2n_tick_transop( n2n_edge_t * eee, time_t now )
         trop = N2N_TRANSOP_TF_IDX;
     }
 
+    tst = (eee->transop[N2N_TRANSOP_AESGCM_IDX].tick)( &(eee->transop[N2N_TRANSOP_AESGCM_IDX]), now );
+    if ( tst.can_tx )
+    {
+        traceEvent( TRACE_DEBUG, "can_tx AESGCM (idx=%u)", (unsigned int)N2N_TRANSOP_AESGCM_IDX );
+        trop = N2N_TRANSOP_AESGCM_IDX;
+    }
+
+    /* Between the two AEADs the CPU decides: GCM only wins with AES
+     * instructions. */
+    tst = (eee->transop[N2N_TRANSOP_CC20_IDX].tick)( &(eee->transop[N2N_TRANSOP_CC20_IDX]), now );
+    if ( tst.can_tx && ((N2N_TRANSOP_AESGCM_IDX != trop) || !eee->aes_accelerated) )
+    {
+        traceEvent( TRACE_DEBUG, "can_tx CC20 (idx=%u)", (unsigned int)N2N_TRANSOP_CC20_IDX );
+        trop = N2N_TRANSOP_CC20_IDX;
+    }
+
+    /* Queue workers hold the same keys so they reach the same choice. Their
+     * tick only has to move each private transop to the current tx SA. */
+    for ( i=0; i < eee->num_txq; ++i )
+    {
+        n2n_trans_op_t * transop = eee->txq[i].transop;
+
+        (transop[N2N_TRANSOP_NULL_IDX].tick)( &(transop[N2N_TRANSOP_NULL_IDX]), now );
+        (transop[N2N_TRANSOP_AESCBC_IDX].tick)( &(transop[N2N_TRANSOP_AESCBC_IDX]), now );
+        (transop[N2N_TRANSOP_TF_IDX].tick)( &(transop[N2N_TRANSOP_TF_IDX]), now );
+        (transop[N2N_TRANSOP_AESGCM_IDX].tick)( &(transop[N2N_TRANSOP_AESGCM_IDX]), now );
+        (transop[N2N_TRANSOP_CC20_IDX].tick)( &(transop[N2N_TRANSOP_CC20_IDX]), now );
+    }
+
     if ( trop != eee->tx_transop_idx )
     {
         eee->tx_transop_idx = trop;
@@ -456,9 +913,18 @@ static int edge_init_keyschedule( n2n_edge_t * eee )
             {
             case N2N_TRANSOP_TF_IDX:
             case N2N_TRANSOP_AESCBC_IDX:
+            case N2N_TRANSOP_AESGCM_IDX:
+            case N2N_TRANSOP_CC20_IDX:
             {
+                size_t q;
+
                 retval = (eee->transop[idx].addspec)( &(eee->transop[idx]),
                                                       &(specs[i]) );
+                for ( q=0; (0 == retval) && (q < eee->num_txq); ++q )
+                {
+                    retval = (eee->txq[q].transop[idx].addspec)( &(eee->txq[q].transop[idx]),
+                                                                 &(specs[i]) );
+                }
                 break;
             }
             default:
@@ -488,6 +954,8 @@ static int edge_init_keyschedule( n2n_edge_t * eee )
 /** Deinitialise the edge and deallocate any owned memory. */
 static void edge_deinit(n2n_edge_t * eee)
 {
+    size_t i;
+
     if ( eee->udp_sock >=0 )
     {
         closesocket( eee->udp_sock );
@@ -498,16 +966,87 @@ static void edge_deinit(n2n_edge_t * eee)
         closesocket(eee->udp_mgmt_sock);
     }
 
-    clear_hashed_peer_info_t_list( eee->pending_peers );
-    clear_hashed_peer_info_t_list( eee->known_peers );
+    clear_hashed_peer_info_t_list( eee->peers );
+    purge_neigh( eee, 0xffffffff );
+
+    edge_deinit_transops( eee->transop );
+
+    if ( eee->txq )
+    {
+        size_t q;
+
+        for ( q=0; q < eee->num_txq; ++q )
+        {
+            edge_deinit_transops( eee->txq[q].transop );
+            if ( eee->txq[q].txb )
+            {
+                free( eee->txq[q].txb->fec );
+            }
+            free( eee->txq[q].txb );
+        }
+
+        free( eee->txq );
+        eee->txq = NULL;
+        eee->num_txq = 0;
+    }
+
+    free( eee->gro );
+    eee->gro = NULL;
+    free( eee->sched );
+    eee->sched = NULL;
+    for ( i=0; i < EDGE_FEC_RX_SOURCES; ++i )
+    {
+        free( eee->fec_rx[i] );
+        eee->fec_rx[i] = NULL;
+    }
+    if ( eee->txb )
+    {
+        free( eee->txb->fec );
+    }
+    free( eee->txb );
+    eee->txb = NULL;
+    free( eee->rxb );
+    eee->rxb = NULL;
+}
+
+/** Allocate one worker per TAP queue. Call after tuntap_open() and before
+ *  any keys are set up so that every worker receives them. */
+static int edge_init_txq( n2n_edge_t * eee )
+{
+    size_t q;
+
+    if ( eee->device.num_queues <= 1 )
+    {
+        return 0;
+    }
+
+    eee->txq = (n2n_edge_txq_t *)calloc( eee->device.num_queues, sizeof(n2n_edge_txq_t) );
+    if ( NULL == eee->txq )
+    {
+        return -1;
+    }
+
+    eee->num_txq = eee->device.num_queues;
+    for ( q=0; q < eee->num_txq; ++q )
+    {
+        eee->txq[q].eee = eee;
+        eee->txq[q].queue = q;
+        edge_init_transops( eee->txq[q].transop );
+        eee->txq[q].txb = (n2n_edge_txb_t *)calloc( 1, sizeof(n2n_edge_txb_t) );
+        if ( NULL == eee->txq[q].txb )
+        {
+            return -1;
+        }
+    }
 
-    (eee->transop[N2N_TRANSOP_TF_IDX].deinit)(&eee->transop[N2N_TRANSOP_TF_IDX]);
-    (eee->transop[N2N_TRANSOP_NULL_IDX].deinit)(&eee->transop[N2N_TRANSOP_NULL_IDX]);
+    return 0;
 }
 
 static void readFromIPSocket( n2n_edge_t * eee );
 
-static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running );
+static void readFromMgmtSocket( n2n_edge_t * eee, int * running );
+
+extern int keep_running;
 
 static void help() {
   print_n2n_version();
@@ -531,19 +1070,34 @@ static void help() {
 	 "\n"
 	 "-l <supernode host:port> "
 	 "[-p <local port>] [-M <mtu>] "
-     "[-r] [-E] [-v] [-t <mgmt port>] [-b] [-h]\n\n"
+     "[-r] [-E] [-z] [-T] "
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+     "[-Q <queues>] "
+#endif
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+     "[-O] "
+#endif
+#ifndef WIN32
+     "[-D <socket>] "
+#endif
+     "[-S <kbit/s>] [-P <port>] [-F <group>] "
+     "[-v] [-t <mgmt port>] [-b] [-h]\n\n"
      "-A <account>");
 
 #ifdef __linux__
   printf("-d <tun device>          | tun device name\n");
 #endif
 
+#ifndef WIN32
+  printf("-D <socket>              | Exchange frames with a process listening on this unix socket\n"
+         "                         : instead of a TAP device (e.g. benchmark_edge). Needs no root.\n");
+#endif
   printf("-a <mode:address>        | Set interface address. For DHCP use '-r -a dhcp:0.0.0.0'\n");
   printf("-c <community>           | n2n community name the edge belongs to.\n");
   printf("-k <encrypt key>         | Encryption key (ASCII) - also N2N_KEY=<encrypt key>. Not with -K.\n");
   printf("-K <key file>            | Specify a key schedule file to load. Not with -k.\n");
   printf("-s <netmask>             | Edge interface netmask in dotted decimal notation (255.255.255.0).\n");
-  printf("-l <supernode host:port> | Supernode IP:port\n");
+  printf("-l <supernode host:port> | Supernode IP:port, repeat for up to %u\n", N2N_EDGE_NUM_SUPERNODES);
   printf("-L <local_ip>            | Add local ip to bypass between same nat problem\n");
   printf("-i <interval>            | Set the NAT hole-punch interval (default 20seconds)\n");
   printf("-b                       | Periodically resolve supernode IP\n");
@@ -561,6 +1115,19 @@ static void help() {
   printf("-M <mtu>                 | Specify n2n MTU of edge interface (default %d).\n", DEFAULT_MTU);
   printf("-r                       | Enable packet forwarding through n2n community.\n");
   printf("-E                       | Accept multicast MAC addresses (default=drop).\n");
+  printf("-z                       | Compress outgoing packets with LZO (skips incompressible data).\n");
+#ifndef WIN32
+  printf("-T                       | Run TAP->net and net->TAP in separate threads.\n");
+#endif
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+  printf("-Q <queues>              | Open a multi-queue TAP with a TAP->net thread per queue (implies -T).\n");
+#endif
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+  printf("-O                       | Enable TAP checksum/TSO offloads: segment in edge, coalesce received TCP.\n");
+#endif
+  printf("-S <kbit/s>              | Pace sent packets to this uplink rate, latency sensitive ones first.\n");
+  printf("-P <port>                | TCP/UDP port of latency sensitive traffic for -S. Repeat as required.\n");
+  printf("-F <group>               | Send an FEC parity after every <group> (2 to 16) packets to a peer, fewer on loss.\n");
   printf("-v                       | Make more verbose. Repeat as required.\n");
   printf("-t                       | Management UDP Port (for multiple edges on a machine).\n");
 
@@ -600,10 +1167,14 @@ static ssize_t sendto_sock( int fd, const void * buf, size_t len, const n2n_sock
 }
 
 
-/** Send a REGISTER packet to another edge. */
+/** Send a REGISTER packet to another edge.
+ *
+ *  The REGISTER_ACK echoes cookie, if given, so it can time the round trip.
+ */
 static void send_register( n2n_edge_t * eee,
                            const n2n_sock_t * remote_peer,
-                           const n2n_mac_t dstMac)
+                           const n2n_mac_t dstMac,
+                           const n2n_cookie_t cookie )
 {
     uint8_t pktbuf[N2N_PKT_BUF_SIZE];
     size_t idx;
@@ -618,8 +1189,15 @@ static void send_register( n2n_edge_t * eee,
 
     /* NOTE: Encoding should probably not be done here but in 
      * encode_REGISTER (lukas) */
-    idx=0;
-    encode_uint32( reg.cookie, &idx, 123456789 );
+    if ( cookie )
+    {
+        memcpy( reg.cookie, cookie, N2N_COOKIE_SIZE );
+    }
+    else
+    {
+        idx=0;
+        encode_uint32( reg.cookie, &idx, 123456789 );
+    }
     idx=0;
     encode_mac( reg.srcMac, &idx, eee->device.mac_addr );
     if(dstMac) {
@@ -664,28 +1242,24 @@ static void send_query_peer( n2n_edge_t * eee,
     sendto_sock( eee->udp_sock, pktbuf, idx, &(eee->supernode) );
 }
 
-/** Send a REGISTER_SUPER packet to the current supernode. */
-static void send_register_super( n2n_edge_t * eee,
-                                 const n2n_sock_t * supernode)
+/** Encode a REGISTER_SUPER carrying cookie into pktbuf.
+ *
+ *  @return its length. */
+static size_t encode_register_super( n2n_edge_t * eee,
+                                     const n2n_cookie_t cookie,
+                                     uint8_t * pktbuf )
 {
-    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
     size_t idx;
     n2n_common_t cmn = {0};
     n2n_REGISTER_SUPER_t reg = {0};
-    n2n_sock_str_t sockbuf;
 
     cmn.ttl=N2N_DEFAULT_TTL;
     cmn.pc = n2n_register_super;
     cmn.flags = 0;
     memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
 
-    for( idx=0; idx < N2N_COOKIE_SIZE; ++idx )
-    {
-        eee->last_cookie[idx] = rand() % 0xff;
-    }
-
     reg.aflags = 0;
-    memcpy( reg.cookie, eee->last_cookie, N2N_COOKIE_SIZE );
+    memcpy( reg.cookie, cookie, N2N_COOKIE_SIZE );
     reg.auth.scheme=0; /* No auth yet */
     reg.timeout = eee->holepunch_interval;
 
@@ -702,11 +1276,56 @@ static void send_register_super( n2n_edge_t * eee,
     idx=0;
     encode_REGISTER_SUPER( pktbuf, &idx, &cmn, &reg );
 
+    return idx;
+}
+
+/** Send a REGISTER_SUPER to the probe port of a supernode. It is not answered:
+ *  the supernode only notes the NAT port this edge gets for a second
+ *  destination, to predict those peers will see. */
+static void send_nat_probe( n2n_edge_t * eee,
+                            const n2n_edge_sn_t * sn )
+{
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    n2n_cookie_t cookie;
+    n2n_sock_t probe = sn->sock;
+    size_t idx;
+
+    for( idx=0; idx < N2N_COOKIE_SIZE; ++idx )
+    {
+        cookie[idx] = rand() % 0xff;
+    }
+
+    idx = encode_register_super( eee, cookie, pktbuf );
+    probe.port = sn->probe_port;
+    sendto_sock( eee->udp_sock, pktbuf, idx, &probe );
+}
+
+/** Send a REGISTER_SUPER packet to a supernode, remembering its cookie and
+ *  when it was sent. */
+static void send_register_super( n2n_edge_t * eee,
+                                 n2n_edge_sn_t * sn )
+{
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t idx;
+    n2n_sock_str_t sockbuf;
+
+    for( idx=0; idx < N2N_COOKIE_SIZE; ++idx )
+    {
+        sn->cookie[idx] = rand() % 0xff;
+    }
+
+    idx = encode_register_super( eee, sn->cookie, pktbuf );
+
     traceEvent( TRACE_INFO, "send REGISTER_SUPER to %s",
-                sock_to_cstr( sockbuf, supernode ) );
+                sock_to_cstr( sockbuf, &(sn->sock) ) );
 
+    sn->sent_us = edge_now_us();
+    sendto_sock( eee->udp_sock, pktbuf, idx, &(sn->sock) );
 
-    sendto_sock( eee->udp_sock, pktbuf, idx, supernode );
+    if ( sn->probe_port )
+    {
+        send_nat_probe( eee, sn );
+    }
 }
 
 
@@ -744,773 +1363,2876 @@ static void send_register_ack( n2n_edge_t * eee,
 }
 
 
-/** NOT IMPLEMENTED
+/** Candidate path MTUs, largest first: ethernet, PPPoE, then steps down to
+ *  the IPv6 minimum. */
+static const uint16_t edge_pmtu_sizes[] = { 1500, 1492, 1480, 1460, 1440, 1420, 1400, 1360, 1320, EDGE_PMTU_MIN };
+
+#define EDGE_PMTU_NUM_SIZES     (sizeof(edge_pmtu_sizes) / sizeof(edge_pmtu_sizes[0]))
+
+/** Set or clear DF on the datagrams sock sends from now on. Without DF they
+ *  may be fragmented on the way, and the kernel's path MTU is ignored
+ *  either way.
  *
- *  This would send a DEREGISTER packet to a peer edge or supernode to indicate
- *  the edge is going away.
+ *  @return as setsockopt().
  */
-static void send_deregister(n2n_edge_t * eee,
-                            n2n_sock_t * remote_peer)
+static int edge_set_df( int sock, int df )
 {
-    /* Marshall and send message */
-}
-
-
-static int is_empty_ip_address( const n2n_sock_t * sock );
-static void update_peer_address(n2n_edge_t * eee,
-                                uint8_t from_supernode,
-                                const n2n_mac_t mac,
-                                const n2n_sock_t * peer,
-                                time_t when);
-void check_peer( n2n_edge_t * eee,
-                 uint8_t from_supernode,
-                 const n2n_mac_t mac,
-                 const n2n_sock_t * peer );
-void establish_connection( n2n_edge_t * eee,
-                        const n2n_mac_t mac );
-void set_peer_operational( n2n_edge_t * eee,
-                           const n2n_mac_t mac,
-                           const n2n_sock_t * peer );
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    int sockopt = df ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
 
+    return setsockopt( sock, IPPROTO_IP, IP_MTU_DISCOVER, (void *)&sockopt, sizeof(sockopt) );
+#elif defined(IP_DONTFRAG)
+    int sockopt = df;
 
+    return setsockopt( sock, IPPROTO_IP, IP_DONTFRAG, (void *)&sockopt, sizeof(sockopt) );
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
 
-/** Start the registration process.
+/** Send a path MTU probe of pmtu->probe bytes to sock under a new cookie.
  *
- *  If the peer is already in pending_peers, ignore the request.
- *  If not in pending_peers, add it and query info about it from supernode
+ *  The probe is a REGISTER to a peer or a REGISTER_SUPER to a supernode,
+ *  padded with zeros which the receiver ignores. Either acknowledges it
+ *  with the cookie. The REGISTER has no destination MAC so the peer does
+ *  not register back.
  *
- *  If hdr is for a direct peer-to-peer packet, try to register back to sender
- *  even if the MAC is in pending_peers. This is because an incident direct
- *  packet indicates that peer-to-peer exchange should work so more aggressive
- *  registration can be permitted (once per incoming packet) as this should only
- *  last for a small number of packets..
+ *  Only the probe is sent with DF; PACKETs stay fragmentable so that those
+ *  to a path whose MTU is not known yet get through. Probes are sent with
+ *  the peers locked, so one cannot clear DF under another. A PACKET which a
+ *  TAP reader sends meanwhile may carry DF as well.
  *
- *  Called from the main loop when Rx a packet for our device mac.
+ *  @return as sendto(); fails with EMSGSIZE if the probe does not fit the
+ *  local interface.
  */
-void establish_connection( n2n_edge_t * eee,
-                        const n2n_mac_t mac )
+static ssize_t send_pmtu_probe( n2n_edge_t * eee, n2n_pmtu_t * pmtu,
+                                const n2n_sock_t * sock, int to_supernode )
 {
-    struct peer_info * scan = find_peer_by_mac( eee->pending_peers, mac );
-    macstr_t mac_buf;
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    size_t len = pmtu->probe - EDGE_UDP_HDR_SIZE;
+    size_t idx;
+    struct sockaddr_in peer_addr;
     n2n_sock_str_t sockbuf;
+    ssize_t sent;
+    int saved_errno;
 
-    if ( NULL == scan )
+    for( idx=0; idx < N2N_COOKIE_SIZE; ++idx )
     {
-        time_t now = time(NULL);
-        scan = calloc( 1, sizeof( struct peer_info ) );
-
-        memcpy(scan->mac_addr, mac, N2N_MAC_SIZE);
-        scan->num_sockets = 0;
-        scan->sock = eee->supernode;
-        scan->last_seen = now; /* Don't change this it marks the pending peer for removal. */
+        pmtu->cookie[idx] = rand() % 0xff;
+    }
 
-		sglib_hashed_peer_info_t_add(eee->pending_peers, scan);
+    if ( to_supernode )
+    {
+        idx = encode_register_super( eee, pmtu->cookie, pktbuf );
+    }
+    else
+    {
+        n2n_common_t cmn = {0};
+        n2n_REGISTER_t reg = {{0}};
 
-        traceEvent( TRACE_DEBUG, "=== new pending %s -> %s",
-                    macaddr_str( mac_buf, scan->mac_addr ),
-                    sock_to_cstr( sockbuf, &scan->sock ) );
+        cmn.ttl = N2N_DEFAULT_TTL;
+        cmn.pc = n2n_register;
+        memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
+        memcpy( reg.cookie, pmtu->cookie, N2N_COOKIE_SIZE );
+        memcpy( reg.srcMac, eee->device.mac_addr, N2N_MAC_SIZE );
 
-        traceEvent( TRACE_INFO, "Pending peers list size=%u",
-			(unsigned int)hashed_peer_list_t_size( eee->pending_peers ) );
+        idx = 0;
+        encode_REGISTER( pktbuf, &idx, &cmn, &reg );
+    }
 
-        /* trace Sending REGISTER */
+    memset( pktbuf + idx, 0, len - idx );
 
-        send_query_peer(eee, scan->mac_addr);
-        scan->last_sent_query = now;
+    traceEvent( TRACE_DEBUG, "send path MTU probe of %u bytes to %s",
+                (unsigned int)pmtu->probe, sock_to_cstr( sockbuf, sock ) );
 
-        /* pending_peers now owns scan. */
-    }
-    else
+    fill_sockaddr( (struct sockaddr *)&peer_addr, sizeof(peer_addr), sock );
+    if ( 0 != edge_set_df( eee->udp_sock, 1 ) )
     {
+        return -1;
     }
-}
 
+    sent = sendto( eee->udp_sock, pktbuf, len, 0/*flags*/,
+                   (struct sockaddr *)&peer_addr, sizeof(peer_addr) );
 
-/** Update the last_seen time for this peer, or get registered. */
-void check_peer( n2n_edge_t * eee,
-                 uint8_t from_supernode,
-                 const n2n_mac_t mac,
-                 const n2n_sock_t * peer)
-{
-	peer_info_t scan;
-	memcpy(scan.mac_addr, mac, sizeof(n2n_mac_t));
-    
-	if (sglib_hashed_peer_info_t_find_member(eee->known_peers, &scan) == NULL)
-    {
-        /* Not in known_peers - start the REGISTER process. */
-        establish_connection( eee, mac );
-    }
-    else
-    {
-        /* Already in known_peers. */
-        update_peer_address( eee, from_supernode, mac, peer, time(NULL) );
-    }
-}
+    saved_errno = errno;
+    edge_set_df( eee->udp_sock, 0 );
+    errno = saved_errno;
 
+    return sent;
+}
 
-/* Move the peer from the pending_peers list to the known_peers lists.
- *
- * peer must be a pointer to an element of the pending_peers list.
- *
- * Called by main loop when Rx a REGISTER_ACK.
- */
-void set_peer_operational( n2n_edge_t * eee,
-                        const n2n_mac_t mac,
-                        const n2n_sock_t * peer )
+/** End the search on a path with mtu as its path MTU. */
+static void edge_pmtu_done( n2n_edge_t * eee, n2n_pmtu_t * pmtu, uint16_t mtu,
+                            const n2n_sock_t * sock, time_t now )
 {
-    peer_info_t tmp;
-    peer_info_t *scan;
-    macstr_t mac_buf;
     n2n_sock_str_t sockbuf;
 
-    traceEvent( TRACE_INFO, "set_peer_operational: %s -> %s",
-                macaddr_str( mac_buf, mac),
-                sock_to_cstr( sockbuf, peer ) );
-
-	memcpy(tmp.mac_addr, mac, sizeof(n2n_mac_t));
-
-	scan = sglib_hashed_peer_info_t_find_member(eee->pending_peers, &tmp);
-
-    if(scan) {
-        /* Remove scan from pending_peers. */
-		sglib_hashed_peer_info_t_delete(eee->pending_peers, scan);
-        
-        /* Add scan to known_peers. */
-		sglib_hashed_peer_info_t_add(eee->known_peers, scan);
-
-        
-        scan->sock = *peer;
-
-        traceEvent( TRACE_DEBUG, "=== new peer %s -> %s",
-                    macaddr_str( mac_buf, scan->mac_addr),
-                    sock_to_cstr( sockbuf, &scan->sock ) );
-
-        traceEvent( TRACE_INFO, "Pending peers list size=%u",
-                    (unsigned int)hashed_peer_list_t_size( eee->pending_peers ) );
-
-        traceEvent( TRACE_INFO, "Operational peers list size=%u",
-                    (unsigned int)hashed_peer_list_t_size( eee->known_peers ) );
-
-
-        scan->last_seen = time(NULL);
-    }
-    else
+    if ( mtu != pmtu->mtu )
     {
-        traceEvent( TRACE_DEBUG, "Failed to find sender in pending_peers." );
+        traceEvent( TRACE_NORMAL, "Path MTU to %s is %u",
+                    sock_to_cstr( sockbuf, sock ), (unsigned int)mtu );
+        pmtu->mtu = mtu;
+        edge_peers_changed( eee ); /* flows cache the path MTU */
     }
-}
 
+    pmtu->probe = 0;
+    pmtu->next = now + EDGE_PMTU_INTERVAL;
+}
 
-n2n_mac_t broadcast_mac = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
-
-static int is_empty_ip_address( const n2n_sock_t * sock )
+/** Advance the search on one path: start it when due, probe again or with
+ *  the next smaller size once the last probe went unanswered for
+ *  EDGE_PMTU_PROBE_TIMEOUT, and fall back to EDGE_PMTU_MIN when no size got
+ *  through.
+ *
+ *  @return 1 while the search goes on, 0 otherwise.
+ */
+static int edge_pmtu_step( n2n_edge_t * eee, n2n_pmtu_t * pmtu,
+                           const n2n_sock_t * sock, int to_supernode, time_t now )
 {
-    const uint8_t * ptr=NULL;
-    size_t len=0;
     size_t i;
 
-    if ( AF_INET6 == sock->family )
+    if ( 0 == pmtu->probe )
     {
-        ptr = sock->addr.v6;
-        len = 16;
+        if ( now < pmtu->next )
+        {
+            return 0;
+        }
+
+        pmtu->probe = edge_pmtu_sizes[0];
+        pmtu->tries = 0;
     }
-    else
+    else if ( now - pmtu->sent < EDGE_PMTU_PROBE_TIMEOUT )
     {
-        ptr = sock->addr.v4;
-        len = 4;
+        return 1; /* waiting for the ACK */
     }
 
-    for (i=0; i<len; ++i)
+    for (;;)
     {
-        if ( 0 != ptr[i] )
+        if ( pmtu->tries >= EDGE_PMTU_PROBE_TRIES )
         {
-            /* found a non-zero byte in address */
-            return 0;
+            for ( i=0; (i < EDGE_PMTU_NUM_SIZES) && (edge_pmtu_sizes[i] >= pmtu->probe); ++i )
+            {
+            }
+
+            if ( i == EDGE_PMTU_NUM_SIZES )
+            {
+                edge_pmtu_done( eee, pmtu, EDGE_PMTU_MIN, sock, now );
+                return 0;
+            }
+
+            pmtu->probe = edge_pmtu_sizes[i];
+            pmtu->tries = 0;
+        }
+
+        if ( (send_pmtu_probe( eee, pmtu, sock, to_supernode ) >= 0) || (EMSGSIZE != errno) )
+        {
+            break;
         }
+
+        pmtu->tries = EDGE_PMTU_PROBE_TRIES; /* larger than the local interface allows */
     }
 
+    ++(pmtu->tries);
+    pmtu->sent = now;
     return 1;
 }
 
-
-/** Keep the known_peers list straight.
+/** Take an ACK that may answer a path MTU probe. The probed size got
+ *  through, which ends the search.
  *
- *  Ignore broadcast L2 packets, and packets with invalid public_ip.
- *  If the dst_mac is in known_peers make sure the entry is correct:
- *  - if the public_ip socket has changed, erase the entry
- *  - if the same, update its last_seen = when
+ *  @return 1 if cookie is that of the outstanding probe on pmtu.
  */
-static void update_peer_address(n2n_edge_t * eee,
-                                uint8_t from_supernode,
-                                const n2n_mac_t mac,
-                                const n2n_sock_t * peer,
-                                time_t when)
+static int edge_pmtu_ack( n2n_edge_t * eee, n2n_pmtu_t * pmtu, const n2n_cookie_t cookie,
+                          const n2n_sock_t * sock, time_t now )
 {
-    peer_info_t *scan = NULL;
-    peer_info_t tmp;
-    n2n_sock_str_t sockbuf1;
-    n2n_sock_str_t sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
-    macstr_t mac_buf;
-
-    if ( is_empty_ip_address( peer ) )
+    if ( (0 == pmtu->probe) || (0 != memcmp( cookie, pmtu->cookie, N2N_COOKIE_SIZE )) )
     {
-        /* Not to be registered. */
-        return;
+        return 0;
     }
 
-    if ( 0 == memcmp( mac, broadcast_mac, N2N_MAC_SIZE ) )
-    {
-        /* Not to be registered. */
-        return;
-    }
+    edge_pmtu_done( eee, pmtu, pmtu->probe, sock, now );
+    return 1;
+}
 
-    memcpy(tmp.mac_addr, mac, sizeof(n2n_mac_t));
-    scan = sglib_hashed_peer_info_t_find_member(eee->known_peers, &tmp);
+/** Drive the path MTU searches to the operational peers and the supernodes.
+ *
+ *  @return the number of searches going on.
+ */
+static size_t edge_pmtu_tick( n2n_edge_t * eee, time_t now )
+{
+    struct sglib_hashed_peer_info_t_iterator it;
+    peer_info_t * scan;
+    size_t num = 0;
+    size_t i;
 
-    if ( scan == NULL )
+    if ( !eee->pmtu_discovery )
     {
-        /* Not in known_peers. */
-        return;
+        return 0;
     }
 
-    if ( 0 != sock_equal( &(scan->sock), peer))
+    for ( scan=sglib_hashed_peer_info_t_it_init(&it, eee->peers); scan != NULL;
+          scan=sglib_hashed_peer_info_t_it_next(&it) )
     {
-        if ( 0 == from_supernode )
-        {
-            traceEvent( TRACE_NORMAL, "Peer changed %s: %s -> %s",
-                        macaddr_str( mac_buf, scan->mac_addr ),
-                        sock_to_cstr(sockbuf1, &(scan->sock)),
-                        sock_to_cstr(sockbuf2, peer) );
-
-            /* The peer has changed public socket. It can no longer be assumed to be reachable. */
-            /* Remove the peer. */
-			sglib_hashed_peer_info_t_delete(eee->known_peers, scan);
-            dealloc_peer(scan);
-
-            establish_connection( eee, mac );
-        }
-        else
+        if ( N2N_PEER_OPERATIONAL == scan->state )
         {
-            /* Don't worry about what the supernode reports, it could be seeing
-             * a different socket. */
-            /* anyways, the packet came from supernode. That is potential
-             * trouble... just in case we will send a register back to the 
-             * origin */
-            send_register( eee, &(scan->sock), scan->mac_addr );
+            num += edge_pmtu_step( eee, &(scan->pmtu), &(scan->sock), 0, now );
         }
     }
-    else
+
+    for ( i=0; i < eee->sn_num; ++i )
     {
-        /* Found and unchanged. */
-        if(!from_supernode)
-            scan->last_seen = when;
+        if ( eee->sn[i].sock.family )
+        {
+            num += edge_pmtu_step( eee, &(eee->sn[i].pmtu), &(eee->sn[i].sock), 1, now );
+        }
     }
-}
 
-#if defined(DUMMY_ID_00001) /* Disabled waiting for config option to enable it */
-
-
-
-static char gratuitous_arp[] = {
-  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* Dest mac */
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Src mac */
-  0x08, 0x06, /* ARP */
-  0x00, 0x01, /* Ethernet */
-  0x08, 0x00, /* IP */
-  0x06, /* Hw Size */
-  0x04, /* Protocol Size */
-  0x00, 0x01, /* ARP Request */
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Src mac */
-  0x00, 0x00, 0x00, 0x00, /* Src IP */
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Target mac */
-  0x00, 0x00, 0x00, 0x00 /* Target IP */
-};
-
-
-/** Build a gratuitous ARP packet for a /24 layer 3 (IP) network. */
-static int build_gratuitous_arp(char *buffer, uint16_t buffer_len) {
-  if(buffer_len < sizeof(gratuitous_arp)) return(-1);
+    return num;
+}
 
-  memcpy(buffer, gratuitous_arp, sizeof(gratuitous_arp));
-  memcpy(&buffer[6], device.mac_addr, 6);
-  memcpy(&buffer[22], device.mac_addr, 6);
-  memcpy(&buffer[28], &device.ip_addr, 4);
 
-  /* REVISIT: BbMaj7 - use a real netmask here. This is valid only by accident
-   * for /24 IPv4 networks. */
-  buffer[31] = 0xFF; /* Use a faked broadcast address */
-  memcpy(&buffer[38], &device.ip_addr, 4);
-  return(sizeof(gratuitous_arp));
-}
+/** @return the index of sock among the sockets of peer, or -1. */
+static int find_peer_socket( const peer_info_t * peer, const n2n_sock_t * sock )
+{
+    int i;
 
-/** Called from update_supernode_reg to periodically send gratuitous ARP
- *  broadcasts. */
-static void send_grat_arps(n2n_edge_t * eee,) {
-  char buffer[48];
-  size_t len;
+    for ( i=0; i < peer->num_sockets; ++i )
+    {
+        if ( 0 == sock_equal( &(peer->sockets[i]), sock ) )
+        {
+            return i;
+        }
+    }
 
-  traceEvent(TRACE_NORMAL, "Sending gratuitous ARP...");
-  len = build_gratuitous_arp(buffer, sizeof(buffer));
-  send_packet2net(eee, buffer, len);
-  send_packet2net(eee, buffer, len); /* Two is better than one :-) */
+    return -1;
 }
-#endif /* #if defined(DUMMY_ID_00001) */
 
+/** Send a REGISTER with a fresh cookie to socket i of peer. */
+static void probe_peer_socket( n2n_edge_t * eee, peer_info_t * peer, int i )
+{
+    n2n_peer_path_t * path = &(peer->paths[i]);
+    size_t idx;
 
+    for ( idx=0; idx < N2N_COOKIE_SIZE; ++idx )
+    {
+        path->cookie[idx] = rand() % 0xff;
+    }
 
+    path->sent_us = edge_now_us();
+    send_register( eee, &(peer->sockets[i]), peer->mac_addr, path->cookie );
+}
 
-/** @brief Check to see if we should re-register with the supernode.
+/** Send the data of an operational peer to its socket with the lowest
+ *  smoothed RTT among those answering probes.
  *
- *  This is frequently called by the main loop.
+ *  As with supernodes a faster socket only takes over if the gain is worth
+ *  it, so two sockets of about the same RTT do not flap. The new path gets
+ *  its own MTU search.
  */
-static void update_supernode_reg( n2n_edge_t * eee, time_t nowTime )
+static void select_peer_socket( n2n_edge_t * eee, peer_info_t * peer, time_t now )
 {
-    if ( eee->sn_wait && ( nowTime > (eee->last_register_req + (eee->holepunch_interval/10) ) ) )
+    const n2n_peer_path_t * cur = &(peer->paths[peer->sock_idx]);
+    int best = -1;
+    int i;
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf1;
+    n2n_sock_str_t sockbuf2;
+
+    for ( i=0; i < peer->num_sockets; ++i )
     {
-        /* fall through */
-        traceEvent( TRACE_DEBUG, "update_supernode_reg: doing fast retry." );
+        const n2n_peer_path_t * path = &(peer->paths[i]);
+
+        if ( (path->lost < EDGE_PEER_PATH_LOST) && (path->srtt_us > 0)
+             && ((best < 0) || (path->srtt_us < peer->paths[best].srtt_us)) )
+        {
+            best = i;
+        }
     }
-    else if ( nowTime < (eee->last_register_req + eee->holepunch_interval))
+
+    if ( (best < 0) || (best == peer->sock_idx) )
     {
-        return; /* Too early */
+        return;
     }
 
-    if ( 0 == eee->sup_attempts )
+    if ( (cur->lost < EDGE_PEER_PATH_LOST) && (cur->srtt_us > 0) )
     {
-        /* Give up on that supernode and try the next one. */
-        ++(eee->sn_idx);
+        uint32_t margin = MAX( EDGE_PEER_SWITCH_MIN_US, cur->srtt_us / EDGE_PEER_SWITCH_DIV );
 
-        if (eee->sn_idx >= eee->sn_num)
+        if ( peer->paths[best].srtt_us + margin >= cur->srtt_us )
         {
-            /* Got to end of list, go back to the start. Also works for list of one entry. */
-            eee->sn_idx=0;
+            return; /* not worth moving */
         }
+    }
 
-        traceEvent(TRACE_WARNING, "Supernode not responding - moving to %u of %u", 
-                   (unsigned int)eee->sn_idx, (unsigned int)eee->sn_num );
+    traceEvent( TRACE_NORMAL, "Peer %s moved to %s (srtt %u us) from %s (srtt %u us, %u unanswered)",
+                macaddr_str( mac_buf, peer->mac_addr ),
+                sock_to_cstr( sockbuf1, &(peer->sockets[best]) ), (unsigned int)peer->paths[best].srtt_us,
+                sock_to_cstr( sockbuf2, &(peer->sock) ), (unsigned int)cur->srtt_us, (unsigned int)cur->lost );
 
-        eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS;
-    }
-    else
-    {
-        --(eee->sup_attempts);
-    }
+    peer->sock_idx = best;
+    peer->sock = peer->sockets[best];
+    peer->path_since = now;
 
-    if(eee->re_resolve_supernode_ip || (eee->sn_num > 1) )
+    memset( &(peer->pmtu), 0, sizeof(peer->pmtu) );
+    if ( eee->pmtu_discovery )
     {
-        supernode2addr(&(eee->supernode), eee->sn_ip_array[eee->sn_idx] );
+        edge_pmtu_step( eee, &(peer->pmtu), &(peer->sock), 0, now );
     }
 
-    traceEvent(TRACE_DEBUG, "Registering with supernode (%s) (attempts left %u)",
-               supernode_ip(eee), (unsigned int)eee->sup_attempts);
-
-    send_register_super( eee, &(eee->supernode) );
+    edge_peers_changed( eee );
+}
 
-    eee->sn_wait=1;
+/** Take the RTT sample of a REGISTER_ACK answering a probe of peer.
+ *
+ *  @return 1 if cookie matched a probe, 0 otherwise.
+ */
+static int edge_peer_path_ack( n2n_edge_t * eee, peer_info_t * peer, const n2n_cookie_t cookie, time_t now )
+{
+    int i;
 
-    /* REVISIT: turn-on gratuitous ARP with config option. */
-    /* send_grat_arps(sock_fd, is_udp_sock); */
+    for ( i=0; i < peer->num_sockets; ++i )
+    {
+        n2n_peer_path_t * path = &(peer->paths[i]);
 
-    eee->last_register_req = nowTime;
-}
+        if ( path->sent_us && (0 == memcmp( cookie, path->cookie, N2N_COOKIE_SIZE )) )
+        {
+            uint64_t rtt = edge_now_us() - path->sent_us;
 
+            path->rtt_us = (rtt > UINT32_MAX) ? UINT32_MAX : (uint32_t)rtt;
+            /* Probes are sparse so each sample weighs more than for supernodes. */
+            path->srtt_us = path->srtt_us ? (path->srtt_us + path->rtt_us) / 2 : MAX( path->rtt_us, 1 );
+            path->sent_us = 0;
+            path->lost = 0;
 
-#define RETRY_INTERVAL 5
+            if ( N2N_PEER_OPERATIONAL == peer->state )
+            {
+                select_peer_socket( eee, peer, now );
+            }
+            return 1;
+        }
+    }
 
+    return 0;
+}
 
-/* @return 1 if destination is a peer, 0 if destination is supernode */
-static int find_peer_destination(n2n_edge_t * eee,
-                                 n2n_mac_t mac_address,
-                                 n2n_sock_t * destination)
+/** Probe every socket of the operational peers each
+ *  EDGE_PEER_PROBE_INTERVAL, counting the probes of the previous round that
+ *  went unanswered, and move off sockets that stopped answering. */
+static void edge_peer_probe_tick( n2n_edge_t * eee, time_t now )
 {
-	peer_info_t tmp;
-	peer_info_t* scan = NULL;
-	peer_info_t* tryscan = NULL;
-    macstr_t mac_buf;
-    n2n_sock_str_t sockbuf;
-    int retval=0;
+    struct sglib_hashed_peer_info_t_iterator it;
+    peer_info_t * scan;
     int i;
-	time_t now = time(NULL);
 
-    traceEvent(TRACE_DEBUG, "Searching destination peer for MAC %02X:%02X:%02X:%02X:%02X:%02X",
-               mac_address[0] & 0xFF, mac_address[1] & 0xFF, mac_address[2] & 0xFF,
-               mac_address[3] & 0xFF, mac_address[4] & 0xFF, mac_address[5] & 0xFF);
+    for ( scan=sglib_hashed_peer_info_t_it_init(&it, eee->peers); scan != NULL;
+          scan=sglib_hashed_peer_info_t_it_next(&it) )
+    {
+        if ( (N2N_PEER_OPERATIONAL != scan->state) || (now < scan->last_probe + EDGE_PEER_PROBE_INTERVAL) )
+        {
+            continue;
+        }
 
-	memcpy(tmp.mac_addr, mac_address, sizeof(n2n_mac_t));
-	scan = sglib_hashed_peer_info_t_find_member(eee->known_peers, &tmp);
-	if(scan) {
-        if(now-scan->last_seen > scan->timeout) {
-            /* delete the peer and establish new connection */
-			sglib_hashed_peer_info_t_delete(eee->known_peers, scan);
-            establish_connection( eee, scan->mac_addr );
-            dealloc_peer(scan);
-        } else if(scan->last_seen > 0) {
-			memcpy(destination, &scan->sock, sizeof(n2n_sock_t));
-			retval = 1;
-		}
-	}
-    
-    if ( 0 == retval )
-    {
-		tryscan = sglib_hashed_peer_info_t_find_member(eee->pending_peers, &tmp);
-		if(tryscan) {
-            if(tryscan->num_sockets == 0) {
-                /* not yet received peer_info from supernode */
-                if(now - tryscan->last_sent_query > RETRY_INTERVAL) {
-                    send_query_peer(eee, tryscan->mac_addr);
-                    tryscan->last_sent_query = now;
-                }
-            } else if(now - tryscan->last_seen > RETRY_INTERVAL) {
-				traceEvent(TRACE_INFO, "retrying to register peer (%s) -> [%s]",
-					macaddr_str( mac_buf, mac_address),
-					sock_to_cstr( sockbuf, &tryscan->sock));
-                for(i=0; i<tryscan->num_sockets; i++)
-                    send_register(eee, &tryscan->sockets[i], tryscan->mac_addr);
-				tryscan->last_seen = now;
-			}
-		}
-        memcpy(destination, &(eee->supernode), sizeof(struct sockaddr_in));
-    }
+        for ( i=0; i < scan->num_sockets; ++i )
+        {
+            if ( scan->paths[i].sent_us )
+            {
+                ++(scan->paths[i].lost);
+            }
+        }
 
-    traceEvent(TRACE_DEBUG, "find_peer_address (%s) -> [%s]",
-               macaddr_str( mac_buf, mac_address ),
-               sock_to_cstr( sockbuf, destination ) );
+        select_peer_socket( eee, scan, now );
 
-    return retval;
+        for ( i=0; i < scan->num_sockets; ++i )
+        {
+            probe_peer_socket( eee, scan, i );
+        }
+        scan->last_probe = now;
+    }
 }
 
 
+/** NOT IMPLEMENTED
+ *
+ *  This would send a DEREGISTER packet to a peer edge or supernode to indicate
+ *  the edge is going away.
+ */
+static void send_deregister(n2n_edge_t * eee,
+                            n2n_sock_t * remote_peer)
+{
+    /* Marshall and send message */
+}
+
+
+static int is_empty_ip_address( const n2n_sock_t * sock );
+static void update_peer_address(n2n_edge_t * eee,
+                                uint8_t from_supernode,
+                                const n2n_mac_t mac,
+                                const n2n_sock_t * peer,
+                                time_t when);
+peer_info_t * check_peer( n2n_edge_t * eee,
+                          uint8_t from_supernode,
+                          const n2n_mac_t mac,
+                          const n2n_sock_t * peer );
+void establish_connection( n2n_edge_t * eee,
+                        const n2n_mac_t mac );
+void set_peer_operational( n2n_edge_t * eee,
+                           const n2n_mac_t mac,
+                           const n2n_sock_t * peer );
+
+
+
+static const char * peer_state_str( n2n_peer_state_t state )
+{
+    switch ( state )
+    {
+    case N2N_PEER_QUERYING:     return "querying";
+    case N2N_PEER_PUNCHING:     return "punching";
+    case N2N_PEER_OPERATIONAL:  return "operational";
+    case N2N_PEER_STALE:        return "stale";
+    }
+
+    return "?";
+}
+
+/** Count the peers that are operational and those that are not. */
+static void count_peers( n2n_edge_t * eee, size_t * operational, size_t * pending )
+{
+    struct sglib_hashed_peer_info_t_iterator it;
+    peer_info_t * scan;
+
+    *operational = 0;
+    *pending = 0;
+    for ( scan=sglib_hashed_peer_info_t_it_init(&it, eee->peers); scan != NULL;
+          scan=sglib_hashed_peer_info_t_it_next(&it) )
+    {
+        if ( N2N_PEER_OPERATIONAL == scan->state )
+            ++(*operational);
+        else
+            ++(*pending);
+    }
+}
+
+/** Move peer to state and restart its per-state counters. */
+static void set_peer_state( n2n_edge_t * eee, peer_info_t * peer,
+                            n2n_peer_state_t state, time_t now )
+{
+    macstr_t mac_buf;
+
+    traceEvent( TRACE_DEBUG, "peer %s %s -> %s",
+                macaddr_str( mac_buf, peer->mac_addr ),
+                peer_state_str( peer->state ), peer_state_str( state ) );
+
+    if ( (N2N_PEER_OPERATIONAL == state) != (N2N_PEER_OPERATIONAL == peer->state) )
+    {
+        peer->path_since = now; /* to or from the supernode */
+    }
+    peer->state = state;
+    peer->state_since = now;
+    peer->num_queries = 0;
+    peer->num_registers = 0;
+    edge_peers_changed( eee );
+}
+
+/** Ask the supernode where peer can be reached. */
+static void query_peer( n2n_edge_t * eee, peer_info_t * peer, time_t now )
+{
+    send_query_peer( eee, peer->mac_addr );
+    peer->last_sent_query = now;
+    ++(peer->num_queries);
+}
+
+/** Send a REGISTER to every socket the supernode gave for peer. Their ACKs
+ *  give the first RTT samples of the sockets. */
+static void punch_peer( n2n_edge_t * eee, peer_info_t * peer, time_t now )
+{
+    int i;
+
+    for ( i=0; i < peer->num_sockets; ++i )
+    {
+        probe_peer_socket( eee, peer, i );
+    }
+
+    if ( peer->pred_count && (peer->num_sockets > 0) )
+    {
+        /* Its NAT gives each destination another port: try those it is
+         * likely to have picked for us. The ACK tells the right one. */
+        n2n_sock_t sock = peer->sockets[0];
+
+        for ( i=0; i < peer->pred_count; ++i )
+        {
+            sock.port = (uint16_t)(peer->pred_port + i);
+            if ( sock.port && (sock.port != peer->sockets[0].port) )
+            {
+                send_register( eee, &sock, peer->mac_addr, NULL );
+            }
+        }
+    }
+    peer->last_sent_register = now;
+    ++(peer->num_registers);
+}
+
+/** Make scan, the entry of mac or NULL if there is none, a querying peer
+ *  whose sockets are not known yet. Its entry is reused so only a peer never
+ *  seen before is allocated.
+ *
+ *  @return the entry or NULL if out of memory.
+ */
+static peer_info_t * restart_peer( n2n_edge_t * eee, peer_info_t * scan,
+                                   const n2n_mac_t mac, time_t now )
+{
+    if ( NULL == scan )
+    {
+        scan = calloc( 1, sizeof( struct peer_info ) );
+        if ( NULL == scan )
+        {
+            return NULL;
+        }
+
+        memcpy(scan->mac_addr, mac, N2N_MAC_SIZE);
+        scan->path_since = now;
+		sglib_hashed_peer_info_t_add(eee->peers, scan);
+        /* peers now owns scan. */
+    }
+
+    scan->num_sockets = 0;
+    memset( scan->paths, 0, sizeof(scan->paths) );
+    scan->sock_idx = 0;
+    scan->pred_count = 0;
+    scan->sock = eee->supernode;
+    scan->last_seen = now; /* Don't change this it marks the pending peer for removal. */
+    set_peer_state( eee, scan, N2N_PEER_QUERYING, now );
+
+    return scan;
+}
+
+/** Start the registration process.
+ *
+ *  If the peer is already querying or punching, ignore the request.
+ *  Otherwise, whether it is new, operational with a broken path or stale,
+ *  forget its sockets and query info about it from supernode.
+ *
+ *  Called from the main loop when Rx a packet for our device mac.
+ */
+void establish_connection( n2n_edge_t * eee,
+                        const n2n_mac_t mac )
+{
+    struct peer_info * scan = find_peer_by_mac( eee->peers, mac );
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf;
+    size_t operational;
+    size_t pending;
+    time_t now = time(NULL);
+
+    if ( scan && ((N2N_PEER_QUERYING == scan->state) || (N2N_PEER_PUNCHING == scan->state)) )
+    {
+        return;
+    }
+
+    scan = restart_peer( eee, scan, mac, now );
+    if ( NULL == scan )
+    {
+        return;
+    }
+
+    traceEvent( TRACE_DEBUG, "=== new pending %s -> %s",
+                macaddr_str( mac_buf, scan->mac_addr ),
+                sock_to_cstr( sockbuf, &scan->sock ) );
+
+    count_peers( eee, &operational, &pending );
+    traceEvent( TRACE_INFO, "Pending peers list size=%u", (unsigned int)pending );
+
+    query_peer( eee, scan, now );
+}
+
+
+/** Update the last_seen time for this peer, or get registered.
+ *
+ *  @return the peer's entry, NULL if it could not be allocated. */
+peer_info_t * check_peer( n2n_edge_t * eee,
+                          uint8_t from_supernode,
+                          const n2n_mac_t mac,
+                          const n2n_sock_t * peer)
+{
+    peer_info_t * scan = find_peer_by_mac( eee->peers, mac );
+
+    if ( (NULL == scan) || (N2N_PEER_OPERATIONAL != scan->state) )
+    {
+        /* Not operational - start the REGISTER process. */
+        establish_connection( eee, mac );
+        scan = find_peer_by_mac( eee->peers, mac );
+    }
+    else
+    {
+        /* Already operational. */
+        update_peer_address( eee, from_supernode, mac, peer, time(NULL) );
+    }
+
+    return scan;
+}
+
+
+/* Make a querying or punching peer operational.
+ *
+ * Called by main loop when Rx a REGISTER_ACK.
+ */
+void set_peer_operational( n2n_edge_t * eee,
+                        const n2n_mac_t mac,
+                        const n2n_sock_t * peer )
+{
+    peer_info_t *scan;
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf;
+    size_t operational;
+    size_t pending;
+    time_t now = time(NULL);
+
+    traceEvent( TRACE_INFO, "set_peer_operational: %s -> %s",
+                macaddr_str( mac_buf, mac),
+                sock_to_cstr( sockbuf, peer ) );
+
+    scan = find_peer_by_mac( eee->peers, mac );
+
+    if ( scan && ((N2N_PEER_QUERYING == scan->state) || (N2N_PEER_PUNCHING == scan->state)) )
+    {
+        /* The socket that answered first is used until probes find a faster
+         * one. A socket the supernode did not know replaces the public one. */
+        scan->sock_idx = find_peer_socket( scan, peer );
+        if ( scan->sock_idx < 0 )
+        {
+            scan->sock_idx = 0;
+            scan->sockets[0] = *peer;
+            memset( &(scan->paths[0]), 0, sizeof(scan->paths[0]) );
+            if ( 0 == scan->num_sockets )
+            {
+                scan->num_sockets = 1;
+            }
+        }
+        scan->sock = *peer;
+        scan->last_seen = now;
+        scan->last_probe = now;
+        set_peer_state( eee, scan, N2N_PEER_OPERATIONAL, now );
+
+        /* A new path: search its MTU right away. */
+        memset( &(scan->pmtu), 0, sizeof(scan->pmtu) );
+        if ( eee->pmtu_discovery )
+        {
+            edge_pmtu_step( eee, &(scan->pmtu), &(scan->sock), 0, now );
+        }
+
+        traceEvent( TRACE_DEBUG, "=== new peer %s -> %s",
+                    macaddr_str( mac_buf, scan->mac_addr),
+                    sock_to_cstr( sockbuf, &scan->sock ) );
+
+        count_peers( eee, &operational, &pending );
+        traceEvent( TRACE_INFO, "Pending peers list size=%u", (unsigned int)pending );
+        traceEvent( TRACE_INFO, "Operational peers list size=%u", (unsigned int)operational );
+    }
+    else
+    {
+        traceEvent( TRACE_DEBUG, "Failed to find sender in pending peers." );
+    }
+}
+
+
+/** Make peers not heard from for REGISTRATION_TIMEOUT stale and free those
+ *  that stayed stale as long.
+ *
+ *  A stale peer gets no more queries or REGISTERs and frames to it go via
+ *  the supernode; a packet from it starts establish_connection() again.
+ *
+ *  @return the number of peers made stale or freed. */
+static size_t purge_peers( n2n_edge_t * eee, time_t now )
+{
+    struct sglib_hashed_peer_info_t_iterator it;
+    peer_info_t * scan;
+    size_t num = 0;
+
+    for ( scan=sglib_hashed_peer_info_t_it_init(&it, eee->peers); scan != NULL;
+          scan=sglib_hashed_peer_info_t_it_next(&it) )
+    {
+        if ( N2N_PEER_STALE == scan->state )
+        {
+            if ( scan->state_since < now - REGISTRATION_TIMEOUT )
+            {
+                sglib_hashed_peer_info_t_delete( eee->peers, scan );
+                dealloc_peer( scan );
+                ++num;
+            }
+        }
+        else if ( scan->last_seen < now - REGISTRATION_TIMEOUT )
+        {
+            set_peer_state( eee, scan, N2N_PEER_STALE, now );
+            ++num;
+        }
+    }
+
+    if ( num > 0 )
+    {
+        edge_peers_changed( eee );
+    }
+
+    return num;
+}
+
+
+n2n_mac_t broadcast_mac = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static int is_empty_ip_address( const n2n_sock_t * sock )
+{
+    const uint8_t * ptr=NULL;
+    size_t len=0;
+    size_t i;
+
+    if ( AF_INET6 == sock->family )
+    {
+        ptr = sock->addr.v6;
+        len = 16;
+    }
+    else
+    {
+        ptr = sock->addr.v4;
+        len = 4;
+    }
+
+    for (i=0; i<len; ++i)
+    {
+        if ( 0 != ptr[i] )
+        {
+            /* found a non-zero byte in address */
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/** Keep the operational peers straight.
+ *
+ *  Ignore broadcast L2 packets, and packets with invalid public_ip.
+ *  If the dst_mac is an operational peer make sure the entry is correct:
+ *  - if the public_ip socket has changed, register with it again
+ *  - if the same, update its last_seen = when
+ */
+static void update_peer_address(n2n_edge_t * eee,
+                                uint8_t from_supernode,
+                                const n2n_mac_t mac,
+                                const n2n_sock_t * peer,
+                                time_t when)
+{
+    peer_info_t *scan = NULL;
+    n2n_sock_str_t sockbuf1;
+    n2n_sock_str_t sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
+    macstr_t mac_buf;
+
+    if ( is_empty_ip_address( peer ) )
+    {
+        /* Not to be registered. */
+        return;
+    }
+
+    if ( 0 == memcmp( mac, broadcast_mac, N2N_MAC_SIZE ) )
+    {
+        /* Not to be registered. */
+        return;
+    }
+
+    scan = find_peer_by_mac( eee->peers, mac );
+
+    if ( (scan == NULL) || (N2N_PEER_OPERATIONAL != scan->state) )
+    {
+        /* Not operational. */
+        return;
+    }
+
+    if ( 0 != sock_equal( &(scan->sock), peer))
+    {
+        if ( (0 == from_supernode) && (find_peer_socket( scan, peer ) >= 0) )
+        {
+            /* Another of its sockets, e.g. it prefers the LAN path to us. */
+            scan->last_seen = when;
+        }
+        else if ( 0 == from_supernode )
+        {
+            traceEvent( TRACE_NORMAL, "Peer changed %s: %s -> %s",
+                        macaddr_str( mac_buf, scan->mac_addr ),
+                        sock_to_cstr(sockbuf1, &(scan->sock)),
+                        sock_to_cstr(sockbuf2, peer) );
+
+            /* The peer has changed public socket. It can no longer be assumed to be reachable. */
+            establish_connection( eee, mac );
+        }
+        else
+        {
+            /* Don't worry about what the supernode reports, it could be seeing
+             * a different socket. */
+            /* anyways, the packet came from supernode. That is potential
+             * trouble... just in case we will send a register back to the 
+             * origin */
+            send_register( eee, &(scan->sock), scan->mac_addr, NULL );
+        }
+    }
+    else
+    {
+        /* Found and unchanged. */
+        if(!from_supernode)
+            scan->last_seen = when;
+    }
+}
+
+#if defined(DUMMY_ID_00001) /* Disabled waiting for config option to enable it */
+
+
+
+static char gratuitous_arp[] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* Dest mac */
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Src mac */
+  0x08, 0x06, /* ARP */
+  0x00, 0x01, /* Ethernet */
+  0x08, 0x00, /* IP */
+  0x06, /* Hw Size */
+  0x04, /* Protocol Size */
+  0x00, 0x01, /* ARP Request */
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Src mac */
+  0x00, 0x00, 0x00, 0x00, /* Src IP */
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Target mac */
+  0x00, 0x00, 0x00, 0x00 /* Target IP */
+};
+
+
+/** Build a gratuitous ARP packet for a /24 layer 3 (IP) network. */
+static int build_gratuitous_arp(char *buffer, uint16_t buffer_len) {
+  if(buffer_len < sizeof(gratuitous_arp)) return(-1);
+
+  memcpy(buffer, gratuitous_arp, sizeof(gratuitous_arp));
+  memcpy(&buffer[6], device.mac_addr, 6);
+  memcpy(&buffer[22], device.mac_addr, 6);
+  memcpy(&buffer[28], &device.ip_addr, 4);
+
+  /* REVISIT: BbMaj7 - use a real netmask here. This is valid only by accident
+   * for /24 IPv4 networks. */
+  buffer[31] = 0xFF; /* Use a faked broadcast address */
+  memcpy(&buffer[38], &device.ip_addr, 4);
+  return(sizeof(gratuitous_arp));
+}
+
+/** Called from update_supernode_reg to periodically send gratuitous ARP
+ *  broadcasts. */
+static void send_grat_arps(n2n_edge_t * eee,) {
+  char buffer[48];
+  size_t len;
+
+  traceEvent(TRACE_NORMAL, "Sending gratuitous ARP...");
+  len = build_gratuitous_arp(buffer, sizeof(buffer));
+  send_packet2net(eee, buffer, len);
+  send_packet2net(eee, buffer, len); /* Two is better than one :-) */
+}
+#endif /* #if defined(DUMMY_ID_00001) */
+
+
+
+
+/** Make supernode idx the active one. */
+static void set_supernode( n2n_edge_t * eee, size_t idx )
+{
+    const n2n_edge_sn_t * from = &(eee->sn[eee->sn_idx]);
+    const n2n_edge_sn_t * to = &(eee->sn[idx]);
+
+    traceEvent( TRACE_NORMAL, "Moving to supernode %s (rtt %u us) from %s (rtt %u us, %u unanswered)",
+                to->name, (unsigned int)to->srtt_us,
+                from->name, (unsigned int)from->srtt_us, (unsigned int)from->lost );
+
+    eee->sn_idx = idx;
+    eee->supernode = to->sock;
+    eee->sn_wait = (0 != to->sent_us);
+    edge_peers_changed( eee );
+}
+
+/** Choose the active supernode.
+ *
+ *  A supernode is healthy until N2N_EDGE_SUP_ATTEMPTS REGISTER_SUPERs in a
+ *  row go unanswered. The healthy supernode with the lowest smoothed RTT
+ *  takes over when the active one is unhealthy or slower by more than the
+ *  hysteresis margin, so that similar RTTs do not make edge flap between
+ *  supernodes. With no measured alternative an unhealthy supernode is left
+ *  for the next one in the list, as before RTTs were measured.
+ */
+static void select_supernode( n2n_edge_t * eee )
+{
+    const n2n_edge_sn_t * cur = &(eee->sn[eee->sn_idx]);
+    int cur_healthy = (cur->lost < N2N_EDGE_SUP_ATTEMPTS);
+    size_t best = eee->sn_num;
+    size_t i;
+
+    for ( i=0; i < eee->sn_num; ++i )
+    {
+        const n2n_edge_sn_t * sn = &(eee->sn[i]);
+
+        if ( (sn->lost < N2N_EDGE_SUP_ATTEMPTS) && (sn->srtt_us > 0)
+             && ((best == eee->sn_num) || (sn->srtt_us < eee->sn[best].srtt_us)) )
+        {
+            best = i;
+        }
+    }
+
+    if ( (best == eee->sn_num) || (best == eee->sn_idx) )
+    {
+        if ( !cur_healthy && (eee->sn_num > 1) )
+        {
+            traceEvent( TRACE_WARNING, "Supernode not responding - moving to %u of %u",
+                        (unsigned int)((eee->sn_idx + 1) % eee->sn_num), (unsigned int)eee->sn_num );
+            set_supernode( eee, (eee->sn_idx + 1) % eee->sn_num );
+            eee->sn[eee->sn_idx].lost = 0; /* give it N2N_EDGE_SUP_ATTEMPTS chances */
+        }
+        return;
+    }
+
+    if ( cur_healthy && (cur->srtt_us > 0) )
+    {
+        uint32_t margin = MAX( EDGE_SN_SWITCH_MIN_US, cur->srtt_us / EDGE_SN_SWITCH_DIV );
+
+        if ( eee->sn[best].srtt_us + margin >= cur->srtt_us )
+        {
+            return; /* not worth moving */
+        }
+    }
+
+    set_supernode( eee, best );
+}
+
+/** @brief Check to see if we should re-register with the supernode.
+ *
+ *  This is frequently called by the main loop. Each round registers with
+ *  every supernode, which also probes their RTTs.
+ */
+static void update_supernode_reg( n2n_edge_t * eee, time_t nowTime )
+{
+    size_t i;
+
+    if ( eee->sn_wait && ( nowTime > (eee->last_register_req + (eee->holepunch_interval/10) ) ) )
+    {
+        /* fall through */
+        traceEvent( TRACE_DEBUG, "update_supernode_reg: doing fast retry." );
+    }
+    else if ( nowTime < (eee->last_register_req + eee->holepunch_interval))
+    {
+        return; /* Too early */
+    }
+
+    for ( i=0; i < eee->sn_num; ++i )
+    {
+        if ( eee->sn[i].sent_us )
+        {
+            ++(eee->sn[i].lost);
+        }
+    }
+
+    select_supernode( eee );
+
+    for ( i=0; i < eee->sn_num; ++i )
+    {
+        if ( eee->re_resolve_supernode_ip || (eee->sn_num > 1) )
+        {
+            supernode2addr( &(eee->sn[i].sock), eee->sn[i].name );
+        }
+
+        send_register_super( eee, &(eee->sn[i]) );
+    }
+
+    if ( 0 != sock_equal( &(eee->supernode), &(eee->sn[eee->sn_idx].sock) ) )
+    {
+        eee->supernode = eee->sn[eee->sn_idx].sock;
+        edge_peers_changed( eee );
+    }
+
+    traceEvent(TRACE_DEBUG, "Registering with supernode (%s) (unanswered %u)",
+               supernode_ip(eee), (unsigned int)eee->sn[eee->sn_idx].lost);
+
+    eee->sn_wait=1;
+
+    /* REVISIT: turn-on gratuitous ARP with config option. */
+    /* send_grat_arps(sock_fd, is_udp_sock); */
+
+    eee->last_register_req = nowTime;
+}
+
+
+#define RETRY_INTERVAL 5
+
+
+/** Resolve where frames to mac_address go, starting registration if needed.
+ *
+ *  *expires is set to the last second the answer holds for unless peer_gen
+ *  changes first: when the peer times out or a pending registration is due
+ *  for a retry. *mtu is set to the path MTU to destination, 0 if unknown.
+ *
+ *  @return 1 if destination is a peer, 0 if destination is supernode */
+static int find_peer_destination(n2n_edge_t * eee,
+                                 n2n_mac_t mac_address,
+                                 n2n_sock_t * destination,
+                                 time_t now,
+                                 time_t * expires,
+                                 size_t * mtu)
+{
+    peer_info_t* scan = NULL;
+    macstr_t mac_buf;
+    n2n_sock_str_t sockbuf;
+    int retval=0;
+
+    traceEvent(TRACE_DEBUG, "Searching destination peer for MAC %02X:%02X:%02X:%02X:%02X:%02X",
+               mac_address[0] & 0xFF, mac_address[1] & 0xFF, mac_address[2] & 0xFF,
+               mac_address[3] & 0xFF, mac_address[4] & 0xFF, mac_address[5] & 0xFF);
+
+    *expires = now + PURGE_REGISTRATION_FREQUENCY;
+    memcpy(destination, &(eee->supernode), sizeof(n2n_sock_t));
+    *mtu = eee->sn[eee->sn_idx].pmtu.mtu;
+
+    scan = find_peer_by_mac( eee->peers, mac_address );
+    if ( NULL == scan )
+    {
+        /* Unknown: via the supernode until the peer is heard from. */
+    }
+    else if ( N2N_PEER_OPERATIONAL == scan->state )
+    {
+        if(now-scan->last_seen > scan->timeout) {
+            /* query the supernode again and punch a new path */
+            establish_connection( eee, scan->mac_addr );
+            *expires = scan->last_sent_query + RETRY_INTERVAL;
+        } else {
+            memcpy(destination, &scan->sock, sizeof(n2n_sock_t));
+            *expires = scan->last_seen + scan->timeout;
+            *mtu = scan->pmtu.mtu;
+            retval = 1;
+        }
+    }
+    else if ( N2N_PEER_QUERYING == scan->state )
+    {
+        /* not yet received peer_info from supernode */
+        if(now - scan->last_sent_query > RETRY_INTERVAL) {
+            query_peer( eee, scan, now );
+        }
+        *expires = scan->last_sent_query + RETRY_INTERVAL;
+    }
+    else if ( N2N_PEER_PUNCHING == scan->state )
+    {
+        if(now - scan->last_sent_register > RETRY_INTERVAL) {
+            traceEvent(TRACE_INFO, "retrying to register peer (%s) -> [%s]",
+                macaddr_str( mac_buf, mac_address),
+                sock_to_cstr( sockbuf, &scan->sockets[0]));
+            punch_peer( eee, scan, now );
+            scan->last_seen = now;
+        }
+        *expires = scan->last_sent_register + RETRY_INTERVAL;
+    }
+
+    traceEvent(TRACE_DEBUG, "find_peer_address (%s) -> [%s]",
+               macaddr_str( mac_buf, mac_address ),
+               sock_to_cstr( sockbuf, destination ) );
+
+    return retval;
+}
+
+
+/** Index of the flow cache entry for mac. */
+static size_t edge_flow_slot( const n2n_mac_t mac )
+{
+    return (mac[2] ^ mac[3] ^ mac[4] ^ (mac[5] * 7)) & (EDGE_FLOW_CACHE_SIZE-1);
+}
+
+/** Add what was sent through flow to its peer's counters. Called with
+ *  peer_lock held. */
+static void edge_flush_flow( n2n_edge_t * eee, n2n_edge_flow_t * flow )
+{
+    peer_info_t * scan;
+
+    if ( 0 == flow->tx_pkts )
+    {
+        return;
+    }
+
+    scan = find_peer_by_mac( eee->peers, flow->mac );
+    if ( scan )
+    {
+        if ( flow->p2p )
+            scan->tx_p2p += flow->tx_pkts;
+        else
+            scan->tx_sup += flow->tx_pkts;
+        scan->tx_bytes += flow->tx_bytes;
+    }
+
+    flow->tx_pkts = 0;
+    flow->tx_bytes = 0;
+}
+
+/** PACKETs per FEC parity to mac: -F, fewer while the peer reports loss so
+ *  that a group seldom loses two. Called with peer_lock held. */
+static size_t edge_fec_group( n2n_edge_t * eee, const n2n_mac_t mac )
+{
+    peer_info_t * scan;
+    size_t group = eee->fec_group;
+
+    if ( (0 == group) || is_multi_broadcast( mac ) )
+    {
+        return 0;
+    }
+
+    scan = find_peer_by_mac( eee->peers, mac );
+    if ( scan && scan->fec_loss )
+    {
+        group = MIN( group, EDGE_FEC_LOSS_DIV / scan->fec_loss );
+    }
+
+    return MAX( group, EDGE_FEC_MIN_GROUP );
+}
+
+/** Return the flow cache entry of txb for mac, resolving it again if the
+ *  peer tables changed or it expired. Steady traffic to a destination costs
+ *  one lookup here and no locking. */
+static n2n_edge_flow_t * edge_lookup_flow( n2n_edge_t * eee,
+                                           n2n_edge_txb_t * txb,
+                                           const n2n_mac_t mac )
+{
+    n2n_edge_flow_t * flow = &(txb->flows[edge_flow_slot( mac )]);
+    uint32_t gen = edge_peer_gen( eee );
+
+    if ( (flow->gen == gen) && (txb->now <= flow->expires)
+         && (0 == memcmp( flow->mac, mac, N2N_MAC_SIZE )) )
+    {
+        ++(txb->flow_hits);
+        return flow;
+    }
+
+    ++(txb->flow_misses);
+
+    if ( txb->fec && memcmp( flow->mac, mac, N2N_MAC_SIZE ) )
+    {
+        /* A partial group of another destination is dropped. */
+        txb->fec[flow - txb->flows].count = 0;
+    }
+
+    edge_lock_peers( eee );
+    edge_flush_flow( eee, flow );
+    memcpy( flow->mac, mac, N2N_MAC_SIZE );
+    flow->p2p = find_peer_destination( eee, flow->mac, &(flow->sock), txb->now,
+                                       &(flow->expires), &(flow->mtu) );
+    flow->fec_group = txb->fec ? edge_fec_group( eee, flow->mac ) : 0;
+    /* Read under the lock so that changes made while resolving count. */
+    flow->gen = eee->peer_gen;
+    edge_unlock_peers( eee );
+
+    fill_sockaddr( (struct sockaddr *)&(flow->addr), sizeof(flow->addr), &(flow->sock) );
+
+    return flow;
+}
+
+
+/* *********************************************** */
+
+static const struct option long_options[] = {
+  { "community",          required_argument, NULL, 'c' },
+  { "supernode-list",     required_argument, NULL, 'l' },
+  { "tun-device",         required_argument, NULL, 'd' },
+#ifndef WIN32
+  { "loop-device",        required_argument, NULL, 'D' },
+#endif
+  { "euid",               required_argument, NULL, 'u' },
+  { "egid",               required_argument, NULL, 'g' },
+  { "local-ip",           required_argument, NULL, 'L' },
+  { "holepunch-interval", required_argument, NULL, 'i' },
+  { "help"   ,            no_argument,       NULL, 'h' },
+  { "verbose",            no_argument,       NULL, 'v' },
+#ifdef WIN32
+  { "remove",             no_argument,       NULL, 'R' },
+#endif
+  { NULL,                 0,                 NULL,  0  }
+};
+
+/* ***************************************************** */
+
+
+/** Map a batch size to its histogram bucket: 1, 2-3, 4-7, ... */
+static size_t edge_batch_bucket( size_t n )
+{
+    size_t b = 0;
+
+    while ( (n >>= 1) && (b < EDGE_BATCH_HIST_SIZE-1) )
+    {
+        ++b;
+    }
+
+    return b;
+}
+
+/** Scheduler class of a frame read from the TAP: 0 for DSCP CS5 and above
+ *  (EF, network control), -P ports and ARP, 2 for DSCP LE and CS1, 1 for
+ *  everything else. */
+static uint8_t edge_sched_class( const n2n_edge_t * eee, const uint8_t * frame, size_t len )
+{
+    const uint8_t * ip = frame + ETH_FRAMEHDRSIZE;
+    uint16_t ethertype = (frame[12] << 8) | frame[13];
+    size_t l4 = 0;
+    uint8_t proto;
+    uint8_t dscp;
+    size_t i;
+
+    if ( (0x0800 == ethertype) && (len >= ETH_FRAMEHDRSIZE + 20) )
+    {
+        dscp = ip[1] >> 2;
+        proto = ip[9];
+        if ( 0 == (((ip[6] & 0x1f) << 8) | ip[7]) )
+        {
+            l4 = (ip[0] & 0x0f) * 4; /* ports only in the first fragment */
+        }
+    }
+    else if ( (0x86DD == ethertype) && (len >= ETH_FRAMEHDRSIZE + 40) )
+    {
+        dscp = (((ip[0] & 0x0f) << 4) | (ip[1] >> 4)) >> 2;
+        proto = ip[6];
+        l4 = 40;
+    }
+    else
+    {
+        return (0x0806 == ethertype) ? 0 : 1;
+    }
+
+    if ( dscp >= 40 )
+    {
+        return 0;
+    }
+
+    if ( l4 && ((6 == proto) || (17 == proto)) && (len >= ETH_FRAMEHDRSIZE + l4 + 4) )
+    {
+        uint16_t sport = (ip[l4] << 8) | ip[l4+1];
+        uint16_t dport = (ip[l4+2] << 8) | ip[l4+3];
+
+        for ( i=0; i < eee->num_prio_ports; ++i )
+        {
+            if ( (sport == eee->prio_ports[i]) || (dport == eee->prio_ports[i]) )
+            {
+                return 0;
+            }
+        }
+    }
+
+    return ((1 == dscp) || (8 == dscp)) ? 2 : 1;
+}
+
+/** Queue the PACKET at i of txb in its class, dropping it if the class is
+ *  full. */
+static void edge_sched_enqueue( n2n_edge_sched_t * sched, const n2n_edge_txb_t * txb, size_t i )
+{
+    size_t c = txb->cls[i];
+    n2n_edge_sched_pkt_t * pkt;
+
+    if ( sched->count[c] == EDGE_SCHED_QUEUE_LEN )
+    {
+        ++(sched->dropped[c]);
+        return;
+    }
+
+    pkt = &(sched->q[c][(sched->head[c] + sched->count[c]) % EDGE_SCHED_QUEUE_LEN]);
+    pkt->len = txb->len[i];
+    pkt->dest = txb->dest[i];
+    pkt->addr = txb->addr[i];
+    memcpy( pkt->data, txb->data[i], txb->len[i] );
+    ++(sched->count[c]);
+}
+
+/** @return the class to send from next, -1 if nothing is queued. */
+static int edge_sched_pick( n2n_edge_sched_t * sched )
+{
+    if ( sched->count[0] )
+    {
+        return 0;
+    }
+
+    if ( (0 == sched->count[1]) && (0 == sched->count[2]) )
+    {
+        return -1;
+    }
+
+    for ( ;; )
+    {
+        size_t c = sched->drr;
+
+        if ( sched->count[c] )
+        {
+            if ( !sched->turn )
+            {
+                sched->deficit[c] += (1 == c) ? 3 * N2N_PKT_BUF_SIZE : N2N_PKT_BUF_SIZE;
+                sched->turn = 1;
+            }
+
+            if ( sched->q[c][sched->head[c]].len <= sched->deficit[c] )
+            {
+                return (int)c;
+            }
+        }
+        else
+        {
+            sched->deficit[c] = 0;
+        }
+
+        sched->drr = 3 - c;
+        sched->turn = 0;
+    }
+}
+
+/** Send queued PACKETs as far as the uplink rate allows. */
+static void edge_sched_run( n2n_edge_t * eee )
+{
+    n2n_edge_sched_t * sched = eee->sched;
+    uint64_t now_ns = edge_now_us() * 1000;
+    int c;
+
+    if ( sched->next_ns + EDGE_SCHED_BURST_US * 1000 < now_ns )
+    {
+        sched->next_ns = now_ns - EDGE_SCHED_BURST_US * 1000; /* no credit beyond the burst */
+    }
+
+    while ( (sched->next_ns <= now_ns) && ((c = edge_sched_pick( sched )) >= 0) )
+    {
+        n2n_edge_sched_pkt_t * pkt = &(sched->q[c][sched->head[c]]);
+
+        if ( sendto( eee->udp_sock, pkt->data, pkt->len, 0/*flags*/,
+                     (struct sockaddr *)&(pkt->addr), sizeof(pkt->addr) ) < 0 )
+        {
+            n2n_sock_str_t sockbuf;
+
+            traceEvent( TRACE_ERROR, "sendto %s failed (%d) %s",
+                        sock_to_cstr( sockbuf, &(pkt->dest) ), errno, strerror(errno) );
+        }
+
+        sched->next_ns += (pkt->len + EDGE_UDP_HDR_SIZE) * 1000000000ULL / sched->rate;
+        if ( c > 0 )
+        {
+            sched->deficit[c] -= pkt->len;
+        }
+        sched->head[c] = (sched->head[c] + 1) % EDGE_SCHED_QUEUE_LEN;
+        --(sched->count[c]);
+        ++(sched->sent[c]);
+    }
+}
+
+/** @return microseconds until edge_sched_run() can send again, max_us if
+ *  nothing is waiting. */
+static uint64_t edge_sched_wait_us( const n2n_edge_t * eee, uint64_t max_us )
+{
+    const n2n_edge_sched_t * sched = eee->sched;
+    uint64_t now_ns;
+
+    if ( (NULL == sched) || (0 == sched->count[0] + sched->count[1] + sched->count[2]) )
+    {
+        return max_us;
+    }
+
+    now_ns = edge_now_us() * 1000;
+    if ( sched->next_ns <= now_ns )
+    {
+        return 0;
+    }
+
+    return MIN( max_us, (sched->next_ns - now_ns) / 1000 + 1 );
+}
+
+/** Send all PACKETs queued in txb, through the scheduler if there is one,
+ *  else directly with one sendmmsg() where available.
+ *
+ *  Every message carries its own destination so PACKETs for different peers
+ *  leave in the order their frames were read. */
+static void edge_flush_tx( n2n_edge_t * eee, n2n_edge_txb_t * txb )
+{
+    size_t i;
+
+    if ( eee->sched )
+    {
+        for ( i=0; i < txb->n; ++i )
+        {
+            edge_sched_enqueue( eee->sched, txb, i );
+        }
+        txb->n = 0;
+        edge_sched_run( eee );
+        return;
+    }
+
+    if ( 0 == txb->n )
+    {
+        return;
+    }
+
+    ++(txb->udp_hist[edge_batch_bucket( txb->n )]);
+
+#if defined(N2N_HAVE_SENDMMSG)
+    {
+        struct mmsghdr msgs[EDGE_TX_BATCH];
+        struct iovec iov[EDGE_TX_BATCH];
+        n2n_sock_str_t sockbuf;
+
+        memset( msgs, 0, txb->n * sizeof(struct mmsghdr) );
+        for ( i=0; i < txb->n; ++i )
+        {
+            iov[i].iov_base = txb->data[i];
+            iov[i].iov_len = txb->len[i];
+            msgs[i].msg_hdr.msg_name = &(txb->addr[i]);
+            msgs[i].msg_hdr.msg_namelen = sizeof(txb->addr[i]);
+            msgs[i].msg_hdr.msg_iov = &(iov[i]);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        i = 0;
+        while ( i < txb->n )
+        {
+            int sent = sendmmsg( eee->udp_sock, msgs+i, txb->n-i, 0/*flags*/ );
+
+            if ( sent <= 0 )
+            {
+                /* The message at i failed; report and skip it. */
+                traceEvent( TRACE_ERROR, "sendmmsg %s failed (%d) %s",
+                            sock_to_cstr( sockbuf, &(txb->dest[i]) ), errno, strerror(errno) );
+                sent = 1;
+            }
+
+            i += sent;
+        }
+    }
+#else
+    for ( i=0; i < txb->n; ++i )
+    {
+        if ( sendto( eee->udp_sock, txb->data[i], txb->len[i], 0/*flags*/,
+                     (struct sockaddr *)&(txb->addr[i]), sizeof(txb->addr[i]) ) < 0 )
+        {
+            n2n_sock_str_t sockbuf;
+
+            traceEvent( TRACE_ERROR, "sendto %s failed (%d) %s",
+                        sock_to_cstr( sockbuf, &(txb->dest[i]) ), errno, strerror(errno) );
+        }
+    }
+#endif
+
+    txb->n = 0;
+}
+
+
+/* Choose the transop for Tx. This should be based on the newest valid
+ * cipherspec in the key schedule. 
+ *
+ * Never fall back to NULL tranform unless no key sources were specified. It is
+ * better to render edge inoperative than to expose user data in the clear. In
+ * the case where all SAs are expired an arbitrary transform will be chosen for
+ * Tx. It will fail having no valid SAs but one must be selected.
+ */
+static size_t edge_choose_tx_transop( const n2n_edge_t * eee )
+{
+    size_t idx = eee->null_transop ? N2N_TRANSOP_NULL_IDX : eee->tx_transop_idx;
+
+    if ( eee->compress && (idx <= N2N_TRANSOP_AESCBC_IDX) )
+    {
+        /* Same cipher and keys, compressed first. There is no compressing
+         * variant of AES-GCM. */
+        idx += N2N_TRANSOP_LZO_IDX;
+    }
+
+    return idx;
+}
+
+
+/** Return where the next frame to send goes in txb, flushing txb first if it
+ *  is full. Up to EDGE_TX_FRAME_SIZE bytes fit there. */
+static uint8_t * edge_tx_frame( n2n_edge_t * eee, n2n_edge_txb_t * txb )
+{
+    if ( txb->n == EDGE_TX_BATCH )
+    {
+        edge_flush_tx( eee, txb );
+    }
+
+    return txb->buf[txb->n] + EDGE_TX_HEADROOM;
+}
+
+/** Identify a PACKET, after its common header, for FEC by its length and
+ *  all its bytes. Frames of a flow can share far more than their headers,
+ *  with the null transform in particular. Words are read little endian so
+ *  that both ends agree. */
+static uint32_t edge_fec_hash( const uint8_t * data, size_t len )
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t)len;
+    uint64_t w;
+    size_t i = 0;
+
+    for ( ; i + 8 <= len; i += 8 )
+    {
+        w = (uint64_t)data[i] | ((uint64_t)data[i+1] << 8)
+            | ((uint64_t)data[i+2] << 16) | ((uint64_t)data[i+3] << 24)
+            | ((uint64_t)data[i+4] << 32) | ((uint64_t)data[i+5] << 40)
+            | ((uint64_t)data[i+6] << 48) | ((uint64_t)data[i+7] << 56);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 32;
+    }
+
+    for ( ; i < len; ++i )
+    {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void edge_fec_xor( uint8_t * dst, const uint8_t * src, size_t len )
+{
+    uint64_t a, b;
+    size_t i = 0;
+
+    for ( ; i + 8 <= len; i += 8 )
+    {
+        memcpy( &a, dst+i, 8 );
+        memcpy( &b, src+i, 8 );
+        a ^= b;
+        memcpy( dst+i, &a, 8 );
+    }
+
+    for ( ; i < len; ++i )
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+/** XOR the PACKET just queued in txb through flow into the flow's parity and
+ *  queue the parity after it once it covers flow->fec_group PACKETs. */
+static void edge_fec_add( n2n_edge_t * eee, n2n_edge_txb_t * txb, const n2n_edge_flow_t * flow )
+{
+    n2n_edge_fec_tx_t * fec = &(txb->fec[flow - txb->flows]);
+    size_t i = txb->n - 1;
+    const uint8_t * body = txb->data[i] + N2N_COMMON_SIZE;
+    size_t len = txb->len[i] - N2N_COMMON_SIZE;
+    uint8_t cls = txb->cls[i];
+    n2n_common_t cmn;
+    n2n_FEC_t msg;
+    uint8_t * out;
+    size_t count;
+    size_t idx=0;
+
+    if ( 0 == fec->count )
+    {
+        fec->len = 0;
+        fec->len_xor = 0;
+    }
+
+    if ( len > fec->len )
+    {
+        memset( fec->parity + fec->len, 0, len - fec->len );
+        fec->len = len;
+    }
+
+    edge_fec_xor( fec->parity, body, len );
+    fec->len_xor ^= (uint16_t)len;
+    fec->hash[fec->count] = edge_fec_hash( body, len );
+    ++(fec->count);
+
+    /* A loss report may have shrunk the group since it was opened: close it
+     * once it holds at least the current group size, and list the PACKETs
+     * it actually holds. */
+    if ( fec->count >= flow->fec_group )
+    {
+        count = fec->count;
+        fec->count = 0;
+    }
+    else
+    {
+        return;
+    }
+
+    if ( N2N_COMMON_SIZE + EDGE_FEC_HDR_MAX + fec->len > N2N_PKT_BUF_SIZE )
+    {
+        return; /* jumbo frames */
+    }
+
+    memset( &cmn, 0, sizeof(cmn) );
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = n2n_fec;
+    memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
+
+    memset( &msg, 0, sizeof(msg) );
+    memcpy( msg.srcMac, eee->device.mac_addr, N2N_MAC_SIZE );
+    memcpy( msg.dstMac, flow->mac, N2N_MAC_SIZE );
+    msg.count = (uint8_t)count;
+    msg.len_xor = fec->len_xor;
+    memcpy( msg.hash, fec->hash, sizeof(msg.hash) );
+
+    if ( txb->n == EDGE_TX_BATCH )
+    {
+        edge_flush_tx( eee, txb );
+    }
+
+    out = txb->buf[txb->n];
+    encode_FEC( out, &idx, &cmn, &msg );
+    memcpy( out + idx, fec->parity, fec->len );
+
+    txb->cls[txb->n] = cls;
+    txb->data[txb->n] = out;
+    txb->len[txb->n] = idx + fec->len;
+    txb->dest[txb->n] = flow->sock;
+    txb->addr[txb->n] = flow->addr;
+    ++(txb->n);
+
+    edge_stat_add( eee->fec_parities, 1 );
+}
+
+/** Where frames cut from a larger one go: send_packet2net() for a reader. */
+struct edge_emit_ctx
+{
+    n2n_edge_t *        eee;
+    n2n_edge_txq_t *    txq;
+};
+
+static void edge_emit_frame( void * ctx, uint8_t * frame, size_t len )
+{
+    struct edge_emit_ctx * emit = (struct edge_emit_ctx *)ctx;
+
+    send_packet2net( emit->eee, emit->txq, frame, len );
+}
+
+/** Deal with a frame from the TAP whose IP packet exceeds mtu, the most that
+ *  fits the path once encoded. IPv4 without DF is fragmented; otherwise the
+ *  sender gets an ICMP error with mtu and adjusts, as it would behind a
+ *  router with a smaller MTU.
+ *
+ *  frame may sit in the reader's next Tx slot, which the fragments reuse, so
+ *  it is copied first.
+ *
+ *  @return 0 if the frame was dealt with, -1 if it should be sent as it is.
+ */
+static int edge_frame_too_big( n2n_edge_t * eee, n2n_edge_txq_t * txq,
+                               const uint8_t * frame, size_t len, size_t mtu )
+{
+    uint8_t pkt[EDGE_TX_FRAME_SIZE];
+    uint8_t buf[EDGE_TX_FRAME_SIZE];
+    struct edge_emit_ctx ctx;
+    size_t n;
+
+    memcpy( pkt, frame, len );
+    ctx.eee = eee;
+    ctx.txq = txq;
+
+    if ( n2n_ipv4_fragment( pkt, len, mtu, buf, sizeof(buf), edge_emit_frame, &ctx ) > 0 )
+    {
+        edge_stat_add( eee->fragmented, 1 );
+        return 0;
+    }
+
+    n = n2n_too_big( pkt, len, mtu, buf, sizeof(buf) );
+    if ( n > 0 )
+    {
+        traceEvent( TRACE_DEBUG, "Frame of %u bytes exceeds path MTU, sending ICMP with MTU %u",
+                    (unsigned int)len, (unsigned int)mtu );
+        tuntap_write( &(eee->device), buf, n );
+        edge_stat_add( eee->too_big, 1 );
+        return 0;
+    }
+
+    return -1;
+}
+
+/** A layer-2 packet was received at the tunnel and needs to be sent via UDP.
+ *
+ *  txq is the TAP queue worker that read the packet or NULL for the single
+ *  TAP reader. Frames not already read into edge_tx_frame() are copied
+ *  there; the payload is then transformed in place and the headers are
+ *  prepended so the PACKET is sent from where the frame was put. */
+static void send_packet2net(n2n_edge_t * eee, n2n_edge_txq_t * txq,
+                            uint8_t *tap_pkt, size_t len)
+{
+    n2n_trans_op_t * transop = txq ? txq->transop : eee->transop;
+    n2n_edge_txb_t * txb = txq ? txq->txb : eee->txb;
+    ipstr_t ip_buf;
+    n2n_mac_t destMac;
+    n2n_sock_str_t sockbuf;
+
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+
+    uint8_t pkthdr[EDGE_PACKET_HDR_MAX];
+    uint8_t ethhdr[ETH_FRAMEHDRSIZE];
+    uint8_t * frame;
+    n2n_pktbuf_t pb;
+    size_t idx=0;
+    size_t tx_transop_idx=0;
+
+    ether_hdr_t eh;
+
+    n2n_edge_flow_t *   flow;
+    uint8_t cls;
+    int rc;
+
+    if ( (len < ETH_FRAMEHDRSIZE) || (len > EDGE_TX_FRAME_SIZE) )
+    {
+        traceEvent( TRACE_WARNING, "Dropping frame of size %u", (unsigned int)len );
+        return;
+    }
+
+    /* tap_pkt is not aligned so we have to copy to aligned memory */
+    memcpy( &eh, tap_pkt, sizeof(ether_hdr_t) );
+
+    /* Discard IP packets that are not originated by this hosts */
+    if(!(eee->allow_routing)) {
+        if(ntohs(eh.type) == 0x0800) {
+            /* This is an IP packet from the local source address - not forwarded. */
+            uint32_t *src = (uint32_t*)&tap_pkt[ETH_FRAMEHDRSIZE + IP4_SRCOFFSET];
+
+            /* Note: all elements of the_ip are in network order */
+            if( *src != eee->device.ip_addr) {
+		/* This is a packet that needs to be routed */
+		traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
+                           intoa(ntohl(*src), ip_buf, sizeof(ip_buf)));
+		return;
+            } else {
+                /* This packet is originated by us */
+                /* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
+            }
+        }
+    }
+
+    /* Optionally compress then apply transforms, eg encryption. */
+
+    /* Once processed, send to destination in PACKET */
+
+    memcpy( destMac, tap_pkt, N2N_MAC_SIZE ); /* dest MAC is first in ethernet header */
+
+    memset( &cmn, 0, sizeof(cmn) );
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = n2n_packet;
+    cmn.flags=0; /* no options, not from supernode, no socket */
+    memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
+
+    flow = edge_lookup_flow( eee, txb, destMac );
+
+    memset( &pkt, 0, sizeof(pkt) );
+
+    frame = edge_tx_frame( eee, txb );
+    if ( frame != tap_pkt )
+    {
+        memcpy( frame, tap_pkt, len );
+    }
+
+    edge_lock_transops( eee, 0 );
+    tx_transop_idx = edge_choose_tx_transop( eee );
+
+    if ( flow->mtu )
+    {
+        /* Keep the encoded frame within the path MTU. */
+        size_t mtu = flow->mtu - EDGE_PACKET_OVERHEAD - transop[tx_transop_idx].overhead;
+
+        if ( flow->fec_group )
+        {
+            mtu -= EDGE_FEC_HDR_MAX; /* so that the parity fits as well */
+        }
+
+        if ( len - ETH_FRAMEHDRSIZE > mtu )
+        {
+            edge_unlock_transops( eee );
+            if ( 0 == edge_frame_too_big( eee, txq, frame, len, mtu ) )
+            {
+                return;
+            }
+            edge_lock_transops( eee, 0 );
+            tx_transop_idx = edge_choose_tx_transop( eee );
+        }
+        else if ( n2n_mss_clamp( frame, len, mtu ) )
+        {
+            edge_stat_add( eee->mss_clamped, 1 );
+        }
+    }
+
+    cls = eee->sched ? edge_sched_class( eee, frame, len ) : 0;
+
+    /* The ethernet header stays in clear; the rest is transformed. The
+     * transform header may overwrite it so it is put back afterwards. */
+    memcpy( ethhdr, frame, ETH_FRAMEHDRSIZE );
+    n2n_pktbuf_init( &pb, txb->buf[txb->n], N2N_PKT_BUF_SIZE,
+                     EDGE_TX_HEADROOM + ETH_FRAMEHDRSIZE, len - ETH_FRAMEHDRSIZE );
+
+    pkt.transform = transop[tx_transop_idx].transform_id;
+
+    rc = n2n_transop_fwd_pb( &(transop[tx_transop_idx]), &pb );
+    ++(transop[tx_transop_idx].tx_cnt); /* stats */
+    edge_unlock_transops( eee );
+
+    if ( rc < 0 )
+    {
+        traceEvent( TRACE_WARNING, "Dropping frame, transform %u failed", (unsigned int)pkt.transform );
+        return;
+    }
+
+    n2n_pktbuf_push( &pb, ETH_FRAMEHDRSIZE );
+    memcpy( pb.data, ethhdr, ETH_FRAMEHDRSIZE );
+
+    encode_PACKET( pkthdr, &idx, &cmn, &pkt );
+    n2n_pktbuf_push( &pb, idx );
+    memcpy( pb.data, pkthdr, idx );
+
+    traceEvent( TRACE_DEBUG, "encoded PACKET header of size=%u transform %u (idx=%u)", 
+                (unsigned int)idx, (unsigned int)pkt.transform, (unsigned int)tx_transop_idx );
+
+    idx = pb.len;
+
+    if ( txq )
+    {
+        if ( flow->p2p )
+        {
+            ++(txq->tx_p2p);
+            edge_stat_add( txq->tx_bit_p2p, idx );
+        }
+        else
+        {
+            ++(txq->tx_sup);
+            edge_stat_add( txq->tx_bit_sup, idx );
+        }
+    }
+    else if ( flow->p2p )
+    {
+        ++(eee->tx_p2p);
+		edge_stat_add( eee->tx_bit_p2p, idx );
+    }
+    else
+    {
+        ++(eee->tx_sup);
+		edge_stat_add( eee->tx_bit_sup, idx );
+    }
+
+    ++(flow->tx_pkts);
+    flow->tx_bytes += idx;
+
+    traceEvent( TRACE_INFO, "send_PACKET to %s", sock_to_cstr( sockbuf, &(flow->sock) ) );
+    txb->cls[txb->n] = cls;
+    txb->data[txb->n] = pb.data;
+    txb->len[txb->n] = idx;
+    txb->dest[txb->n] = flow->sock;
+    txb->addr[txb->n] = flow->addr;
+    ++(txb->n);
+
+    if ( flow->fec_group )
+    {
+        edge_fec_add( eee, txb, flow );
+    }
+}
+
+
+/** Destination MAC 33:33:0:00:00:00 - 33:33:FF:FF:FF:FF is reserved for IPv6
+ *  neighbour discovery.
+ */
+static int is_ip6_discovery( const void * buf, size_t bufsize )
+{
+    int retval = 0;
+
+    if ( bufsize >= sizeof(ether_hdr_t) )
+    {
+        /* copy to aligned memory */
+        ether_hdr_t eh;
+        memcpy( &eh, buf, sizeof(ether_hdr_t) );
+
+        if ( (0x33 == eh.dhost[0]) &&
+             (0x33 == eh.dhost[1]) )
+        {
+            retval = 1; /* This is an IPv6 multicast packet [RFC2464]. */
+        }
+    }
+    return retval;
+}
+
+/** Destination 01:00:5E:00:00:00 - 01:00:5E:7F:FF:FF is multicast ethernet.
+ */
+static int is_ethMulticast( const void * buf, size_t bufsize )
+{
+    int retval = 0;
+
+    /* Match 01:00:5E:00:00:00 - 01:00:5E:7F:FF:FF */
+    if ( bufsize >= sizeof(ether_hdr_t) )
+    {
+        /* copy to aligned memory */
+        ether_hdr_t eh;
+        memcpy( &eh, buf, sizeof(ether_hdr_t) );
+
+        if ( (0x01 == eh.dhost[0]) &&
+             (0x00 == eh.dhost[1]) &&
+             (0x5E == eh.dhost[2]) &&
+             (0 == (0x80 & eh.dhost[3])) )
+        {
+            retval = 1; /* This is an ethernet multicast packet [RFC1112]. */
+        }
+    }
+    return retval;
+}
+
+
+
+/* Neighbour proxy.
+ *
+ * ARP requests and IPv6 neighbour solicitations from the host are broadcast
+ * to the whole community through the supernode. Edge learns the bindings of
+ * remote hosts from the ARP and ND frames it receives and answers the host's
+ * requests for them itself, so only the first request for an address crosses
+ * the overlay. A binding is used for EDGE_NEIGH_TTL seconds after it was last
+ * confirmed by its owner. While two MACs claim an address, or the host claims
+ * it itself, requests for it are sent as usual for the owners to answer. */
+
+static unsigned int edge_neigh_t_hash_function( edge_neigh_t * e )
+{
+    unsigned int h = (unsigned int)e->ipv6;
+    size_t i;
+
+    for ( i=0; i < sizeof(e->ip); ++i )
+    {
+        h = (h * 31) + e->ip[i];
+    }
+
+    return h;
+}
+
+static edge_neigh_t * find_neigh( n2n_edge_t * eee, int ipv6, const uint8_t * ip )
+{
+    edge_neigh_t tmp;
+
+    memset( &tmp, 0, sizeof(tmp) );
+    tmp.ipv6 = ipv6;
+    memcpy( tmp.ip, ip, ipv6 ? 16 : 4 );
+
+    return sglib_hashed_edge_neigh_t_find_member( eee->neigh, &tmp );
+}
+
+/** Format the address of a binding for logging. */
+static const char * neigh_ip_str( char * buf, size_t size, const edge_neigh_t * n )
+{
+    if ( n->ipv6 )
+    {
+        snprintf( buf, size, "%x:%x:%x:%x:%x:%x:%x:%x",
+                  (n->ip[0] << 8) | n->ip[1], (n->ip[2] << 8) | n->ip[3],
+                  (n->ip[4] << 8) | n->ip[5], (n->ip[6] << 8) | n->ip[7],
+                  (n->ip[8] << 8) | n->ip[9], (n->ip[10] << 8) | n->ip[11],
+                  (n->ip[12] << 8) | n->ip[13], (n->ip[14] << 8) | n->ip[15] );
+    }
+    else
+    {
+        snprintf( buf, size, "%u.%u.%u.%u", n->ip[0], n->ip[1], n->ip[2], n->ip[3] );
+    }
+
+    return buf;
+}
+
+/** Learn from an ARP or ND frame received from src. Claims whose link-layer
+ *  address differs from the frame source are proxied and not trusted. Called
+ *  with peer_lock held. */
+static void edge_neigh_learn( n2n_edge_t * eee, const n2n_neigh_t * nb, const n2n_mac_t src, time_t now )
+{
+    edge_neigh_t *  n;
+    macstr_t        mac_buf;
+    macstr_t        mac_buf2;
+    char            ip_buf[48];
+
+    if ( !nb->claim || (0 != memcmp( nb->claim_mac, src, N2N_MAC_SIZE )) || (src[0] & 0x01)
+         || ( !nb->ipv6 && (0 == memcmp( nb->claim_ip, &(eee->device.ip_addr), 4 )) ) )
+    {
+        return;
+    }
+
+    n = find_neigh( eee, nb->ipv6, nb->claim_ip );
+
+    if ( n && (0 != memcmp( n->mac, src, N2N_MAC_SIZE )) )
+    {
+        traceEvent( TRACE_WARNING, "Neighbour %s claimed by %s, was %s",
+                    neigh_ip_str( ip_buf, sizeof(ip_buf), n ),
+                    macaddr_str( mac_buf, src ), macaddr_str( mac_buf2, n->mac ) );
+        memcpy( n->mac, src, N2N_MAC_SIZE );
+        n->conflict = now;
+        ++(eee->neigh_conflicts);
+    }
+
+    if ( NULL == n )
+    {
+        n = (edge_neigh_t *)calloc( 1, sizeof(edge_neigh_t) ); /* deallocated in purge_neigh */
+        if ( NULL == n )
+        {
+            return;
+        }
+
+        n->ipv6 = nb->ipv6;
+        memcpy( n->ip, nb->claim_ip, sizeof(n->ip) );
+        memcpy( n->mac, src, N2N_MAC_SIZE );
+        sglib_hashed_edge_neigh_t_add( eee->neigh, n );
+        ++(eee->num_neigh);
+
+        traceEvent( TRACE_DEBUG, "Neighbour %s is at %s",
+                    neigh_ip_str( ip_buf, sizeof(ip_buf), n ), macaddr_str( mac_buf, src ) );
+    }
+
+    n->last_seen = now;
+}
+
+/** Answer an ARP request or neighbour solicitation read from the TAP for a
+ *  remote host whose binding is known. A claim by the host for a learned
+ *  address drops the binding.
+ *
+ *  @return 1 if the frame was answered and must not be sent, 0 otherwise.
+ */
+static int edge_neigh_answer( n2n_edge_t * eee, const uint8_t * frame, size_t len, time_t now )
+{
+    n2n_neigh_t     nb;
+    edge_neigh_t *  n;
+    n2n_mac_t       mac;
+    uint8_t         out[ETH_FRAMEHDRSIZE + 96];
+    size_t          olen;
+    char            ip_buf[48];
+    int             found = 0;
+
+    if ( 0 != n2n_neigh_parse( frame, len, &nb ) )
+    {
+        return 0;
+    }
+
+    edge_lock_peers( eee );
+
+    if ( nb.claim && (NULL != (n = find_neigh( eee, nb.ipv6, nb.claim_ip ))) )
+    {
+        traceEvent( TRACE_WARNING, "Neighbour %s claimed by this host, forgetting binding",
+                    neigh_ip_str( ip_buf, sizeof(ip_buf), n ) );
+        sglib_hashed_edge_neigh_t_delete( eee->neigh, n );
+        free( n );
+        --(eee->num_neigh);
+        ++(eee->neigh_conflicts);
+    }
+
+    /* Only broadcast and multicast requests; a unicast one checks an entry
+     * of the host's cache with the owner. */
+    if ( (N2N_NEIGH_SOLICIT == nb.op) && (frame[0] & 0x01)
+         && (NULL != (n = find_neigh( eee, nb.ipv6, nb.target_ip )))
+         && ((now - n->last_seen) <= EDGE_NEIGH_TTL) && ((now - n->conflict) > EDGE_NEIGH_TTL) )
+    {
+        memcpy( mac, n->mac, N2N_MAC_SIZE );
+        neigh_ip_str( ip_buf, sizeof(ip_buf), n );
+        found = 1;
+    }
+
+    edge_unlock_peers( eee );
+
+    if ( !found )
+    {
+        return 0;
+    }
+
+    olen = n2n_neigh_reply( frame, &nb, mac, out, sizeof(out) );
+    if ( 0 == olen )
+    {
+        return 0;
+    }
+
+    traceEvent( TRACE_DEBUG, "Answering %s for %s", nb.ipv6 ? "NS" : "ARP", ip_buf );
+    tuntap_write( &(eee->device), out, olen );
+    edge_stat_add( eee->neigh_answered, 1 );
+
+    return 1;
+}
+
+/** Remove bindings not confirmed since purge_before. Called with peer_lock
+ *  held. */
+static size_t purge_neigh( n2n_edge_t * eee, time_t purge_before )
+{
+    edge_neigh_t * ll;
+    struct sglib_hashed_edge_neigh_t_iterator it;
+    size_t retval = 0;
+
+    for ( ll=sglib_hashed_edge_neigh_t_it_init(&it, eee->neigh); ll!=NULL;
+          ll=sglib_hashed_edge_neigh_t_it_next(&it) )
+    {
+        if ( ll->last_seen < purge_before )
+        {
+            ++retval;
+            sglib_hashed_edge_neigh_t_delete( eee->neigh, ll );
+            free( ll );
+        }
+    }
+
+    eee->num_neigh -= retval;
+    return retval;
+}
+
+
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+#define EDGE_TAP_BUF_SIZE       (N2N_VNET_HDR_SIZE + N2N_GSO_MAX_FRAME)
+
+/** Send a frame read with a virtio-net header (-O).
+ *
+ *  The peer writes what it decodes as plain frames, so offloaded work is
+ *  finished here before encoding: GSO frames are cut into MSS sized segments
+ *  with full checksums and partial checksums are completed.
+ */
+static void send_offloaded2net( n2n_edge_t * eee, n2n_edge_txq_t * txq,
+                                const n2n_vnet_hdr_t * hdr, uint8_t * frame, size_t len )
+{
+    if ( N2N_VNET_GSO_NONE != (hdr->gso_type & ~N2N_VNET_GSO_ECN) )
+    {
+        uint8_t segbuf[N2N_PKT_BUF_SIZE];
+        struct edge_emit_ctx ctx;
+        int n;
+
+        ctx.eee = eee;
+        ctx.txq = txq;
+        n = n2n_gso_segment( hdr, frame, len, segbuf, sizeof(segbuf), edge_emit_frame, &ctx );
+        if ( n < 0 )
+        {
+            traceEvent( TRACE_WARNING, "Dropping GSO frame type %u size %u len %u",
+                        (unsigned int)hdr->gso_type, (unsigned int)hdr->gso_size, (unsigned int)len );
+        }
+        else
+        {
+            edge_stat_add( eee->gso_frames, 1 );
+            edge_stat_add( eee->gso_segs, n );
+        }
+    }
+    else if ( (hdr->flags & N2N_VNET_F_NEEDS_CSUM) && (0 != n2n_offload_csum( frame, len, hdr )) )
+    {
+        traceEvent( TRACE_WARNING, "Dropping frame with bad checksum offsets %u/%u len %u",
+                    (unsigned int)hdr->csum_start, (unsigned int)hdr->csum_offset, (unsigned int)len );
+    }
+    else
+    {
+        send_packet2net( eee, txq, frame, len );
+    }
+}
+#endif /* #if defined(N2N_HAVE_TAP_VNET_HDR) */
 
+/** Read a single frame from the TAP interface, encode it and queue the
+ *  resulting PACKET in the reader's Tx batch.
+ *
+ *  Plain frames are read straight into the next Tx slot. With a virtio-net
+ *  header the read may be a GSO super-frame and goes to a large buffer.
+ *
+ *  @return 1 if a frame was read, 0 if none was waiting, -1 on error.
+ */
+static int edge_read_tap_frame( n2n_edge_t * eee, n2n_edge_txq_t * txq )
+{
+    /* tun -> remote */
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+    uint8_t             vnet_pkt[EDGE_TAP_BUF_SIZE];
+#endif
+    uint8_t *           eth_pkt;
+    uint8_t *           frame;
+    size_t              bufsize;
+    macstr_t            mac_buf;
+    ssize_t             len;
 
-/* *********************************************** */
-
-static const struct option long_options[] = {
-  { "community",          required_argument, NULL, 'c' },
-  { "supernode-list",     required_argument, NULL, 'l' },
-  { "tun-device",         required_argument, NULL, 'd' },
-  { "euid",               required_argument, NULL, 'u' },
-  { "egid",               required_argument, NULL, 'g' },
-  { "local-ip",           required_argument, NULL, 'L' },
-  { "holepunch-interval", required_argument, NULL, 'i' },
-  { "help"   ,            no_argument,       NULL, 'h' },
-  { "verbose",            no_argument,       NULL, 'v' },
-#ifdef WIN32
-  { "remove",             no_argument,       NULL, 'R' },
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+    if ( eee->device.vnet_hdr )
+    {
+        eth_pkt = vnet_pkt;
+        bufsize = EDGE_TAP_BUF_SIZE;
+    }
+    else
 #endif
-  { NULL,                 0,                 NULL,  0  }
-};
+    {
+        eth_pkt = edge_tx_frame( eee, txq ? txq->txb : eee->txb );
+        bufsize = EDGE_TX_FRAME_SIZE;
+    }
+    frame = eth_pkt;
 
-/* ***************************************************** */
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+    if ( txq )
+        len = tuntap_read_queue( &(eee->device), txq->queue, eth_pkt, bufsize );
+    else
+#endif
+        len = tuntap_read( &(eee->device), eth_pkt, bufsize );
 
+    if( (len < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)) )
+    {
+        return 0; /* drained */
+    }
 
-/** Send an ecapsulated ethernet PACKET to a destination edge or broadcast MAC
- *  address. */
-static int send_PACKET( n2n_edge_t * eee,
-                        n2n_mac_t dstMac,
-                        const uint8_t * pktbuf,
-                        size_t pktlen,
-                        n2n_sock_t * destination)
-{
-    n2n_sock_str_t sockbuf;
+    if( 0 == len )
+    {
+        /* Only a loop device reaches EOF: its peer process went away. */
+        traceEvent(TRACE_NORMAL, "TAP device closed, stopping");
+        keep_running = 0;
+        return -1;
+    }
 
-    /* hexdump( pktbuf, pktlen ); */
+    if( (len < 0) || (len > bufsize) )
+    {
+        traceEvent(TRACE_WARNING, "read()=%d [%d/%s]",
+                   (signed int)len, errno, strerror(errno));
+        return -1;
+    }
 
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+    if ( eee->device.vnet_hdr )
+    {
+        if ( len < N2N_VNET_HDR_SIZE + sizeof(ether_hdr_t) )
+        {
+            traceEvent(TRACE_WARNING, "Short read with virtio-net header (%d)", (signed int)len);
+            return 1;
+        }
 
-    traceEvent( TRACE_INFO, "send_PACKET to %s", sock_to_cstr( sockbuf, destination ) );
+        frame += N2N_VNET_HDR_SIZE;
+        len -= N2N_VNET_HDR_SIZE;
+    }
+#endif
 
-    sendto_sock( eee->udp_sock, pktbuf, pktlen, destination );
-    return 0;
-}
+    {
+        const uint8_t * mac = frame;
+        traceEvent(TRACE_INFO, "### Rx TAP packet (%4d) for %s",
+                   (signed int)len, macaddr_str(mac_buf, mac) );
 
+        if ( edge_neigh_answer( eee, frame, len, (txq ? txq->txb : eee->txb)->now ) )
+        {
+            /* answered locally */
+        }
+        else if ( eee->drop_multicast &&
+             ( is_ip6_discovery( frame, len ) ||
+               is_ethMulticast( frame, len)
+                 )
+            )
+        {
+            traceEvent(TRACE_DEBUG, "Dropping multicast");
+        }
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+        else if ( eee->device.vnet_hdr )
+        {
+            n2n_vnet_hdr_t hdr;
 
-/* Choose the transop for Tx. This should be based on the newest valid
- * cipherspec in the key schedule. 
+            memcpy( &hdr, eth_pkt, N2N_VNET_HDR_SIZE );
+            send_offloaded2net(eee, txq, &hdr, frame, len);
+        }
+#endif
+        else
+        {
+            send_packet2net(eee, txq, frame, len);
+        }
+    }
+
+    return 1;
+}
+
+/** Drain up to EDGE_TX_BATCH frames from the TAP interface and send the
+ *  corresponding packets to the cooked socket together.
  *
- * Never fall back to NULL tranform unless no key sources were specified. It is
- * better to render edge inoperative than to expose user data in the clear. In
- * the case where all SAs are expired an arbitrary transform will be chosen for
- * Tx. It will fail having no valid SAs but one must be selected.
+ *  txq selects the TAP queue to read; NULL reads the device's only queue.
+ *  The TAP fds are non-blocking on UNIX; on Windows reads block so only one
+ *  frame is taken per call.
  */
-static size_t edge_choose_tx_transop( const n2n_edge_t * eee )
+static void readFromTAPSocket( n2n_edge_t * eee, n2n_edge_txq_t * txq )
 {
-    if ( eee->null_transop)
+    n2n_edge_txb_t * txb = txq ? txq->txb : eee->txb;
+#ifdef WIN32
+    size_t max_frames = 1;
+#else
+    size_t max_frames = EDGE_TX_BATCH;
+#endif
+    size_t n = 0;
+
+    txb->now = time(NULL);
+
+    while ( (n < max_frames) && (edge_read_tap_frame( eee, txq ) > 0) )
     {
-        return N2N_TRANSOP_NULL_IDX;
+        ++n;
     }
 
-    return eee->tx_transop_idx;
+    if ( n > 0 )
+    {
+        ++(txb->tap_hist[edge_batch_bucket( n )]);
+    }
+
+    edge_flush_tx( eee, txb );
 }
 
 
-/** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
-static void send_packet2net(n2n_edge_t * eee,
-                            uint8_t *tap_pkt, size_t len)
+/** Write the coalesced frame held in eee->gro, if any, to the TAP. */
+static void edge_gro_flush( n2n_edge_t * eee )
 {
-    ipstr_t ip_buf;
-    n2n_mac_t destMac;
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+    n2n_vnet_hdr_t hdr;
+    size_t len;
+    int segs;
 
-    n2n_common_t cmn;
-    n2n_PACKET_t pkt;
+    if ( NULL == eee->gro )
+    {
+        return;
+    }
 
-    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-    size_t idx=0;
-    size_t tx_transop_idx=0;
+    segs = eee->gro->segs;
+    len = n2n_gro_finish( eee->gro, &hdr );
+    if ( 0 == len )
+    {
+        return;
+    }
 
-    ether_hdr_t eh;
+    if ( segs > 1 )
+    {
+        ++(eee->gro_frames);
+        eee->gro_segs += segs;
+    }
 
-    int dest;
-    int offset;
-    n2n_sock_t destination;
+    traceEvent( TRACE_INFO, "sending to TAP %u (%d segments)", (unsigned int)len, segs );
+    if ( tuntap_write_vnet( &(eee->device), &hdr, eee->gro->frame, len ) != (int)len )
+    {
+        traceEvent( TRACE_WARNING, "TAP write of %u coalesced bytes failed [%d/%s]",
+                    (unsigned int)len, errno, strerror(errno) );
+    }
+#endif
+}
 
-    /* tap_pkt is not aligned so we have to copy to aligned memory */
-    memcpy( &eh, tap_pkt, sizeof(ether_hdr_t) );
+/** Flush eee->gro unless more datagrams are already waiting on the UDP
+ *  socket which might continue the held frame. Used after a full receive
+ *  batch. */
+static void edge_gro_flush_idle( n2n_edge_t * eee )
+{
+    fd_set socket_mask;
+    struct timeval wait_time;
 
-    /* Discard IP packets that are not originated by this hosts */
-    if(!(eee->allow_routing)) {
-        if(ntohs(eh.type) == 0x0800) {
-            /* This is an IP packet from the local source address - not forwarded. */
-            uint32_t *src = (uint32_t*)&tap_pkt[ETH_FRAMEHDRSIZE + IP4_SRCOFFSET];
+    if ( (NULL == eee->gro) || (0 == eee->gro->len) )
+    {
+        return;
+    }
 
-            /* Note: all elements of the_ip are in network order */
-            if( *src != eee->device.ip_addr) {
-		/* This is a packet that needs to be routed */
-		traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
-                           intoa(ntohl(*src), ip_buf, sizeof(ip_buf)));
-		return;
-            } else {
-                /* This packet is originated by us */
-                /* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
+    FD_ZERO(&socket_mask);
+    FD_SET(eee->udp_sock, &socket_mask);
+    wait_time.tv_sec = 0; wait_time.tv_usec = 0;
+
+    if ( select(eee->udp_sock+1, &socket_mask, NULL, NULL, &wait_time) <= 0 )
+    {
+        edge_gro_flush( eee );
+    }
+}
+
+/** Write a decoded ethernet frame to the TAP, coalescing TCP segments when
+ *  offloads are enabled.
+ *
+ *  @return len if the frame was written or queued, otherwise as write().
+ */
+static ssize_t edge_write_to_tap( n2n_edge_t * eee, uint8_t * buf, size_t len )
+{
+    if ( eee->gro )
+    {
+        int rc = n2n_gro_receive( eee->gro, buf, len );
+
+        if ( rc < 0 )
+        {
+            edge_gro_flush( eee );
+            rc = n2n_gro_receive( eee->gro, buf, len );
+        }
+
+        if ( rc > 0 )
+        {
+            if ( eee->gro->closed )
+            {
+                edge_gro_flush( eee ); /* PSH or short segment: end of burst */
             }
+            return len;
         }
+
+        edge_gro_flush( eee ); /* keep frames in order */
     }
 
-    /* Optionally compress then apply transforms, eg encryption. */
+    traceEvent( TRACE_INFO, "sending to TAP %u", (unsigned int)len );
+    return tuntap_write( &(eee->device), buf, len );
+}
 
-    /* Once processed, send to destination in PACKET */
 
-    memcpy( destMac, tap_pkt, N2N_MAC_SIZE ); /* dest MAC is first in ethernet header */
 
-    memset( &cmn, 0, sizeof(cmn) );
-    cmn.ttl = N2N_DEFAULT_TTL;
-    cmn.pc = n2n_packet;
-    cmn.flags=0; /* no options, not from supernode, no socket */
-    memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
+/** Count a PACKET from mac that could not be decoded. */
+static void edge_count_rx_fail( n2n_edge_t * eee, const n2n_mac_t mac )
+{
+    peer_info_t * scan;
 
-    dest = find_peer_destination(eee, destMac, &destination);
+    edge_lock_peers( eee );
+    scan = find_peer_by_mac( eee->peers, mac );
+    if ( scan )
+    {
+        ++(scan->rx_fail);
+    }
+    edge_unlock_peers( eee );
+}
 
-    memset( &pkt, 0, sizeof(pkt) );
 
-    tx_transop_idx = edge_choose_tx_transop( eee );
+/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
+ *  encrypted.
+ *
+ *  The psize bytes at payload are decoded in place; bufsize bytes from
+ *  payload on may be used, as decompression can grow the frame. */
+static int handle_PACKET( n2n_edge_t * eee,
+                          const n2n_common_t * cmn,
+                          const n2n_PACKET_t * pkt,
+                          const n2n_sock_t * orig_sender,
+                          uint8_t * payload,
+                          size_t psize,
+                          size_t bufsize )
+{
+    ssize_t             data_sent_len;
+    uint8_t             from_supernode;
+    int                 retval = -1;
+    time_t              now;
+    n2n_ETHFRAMEHDR_t   eth;
+    peer_info_t *       scan;
 
-    pkt.transform = eee->transop[tx_transop_idx].transform_id;
+    now = time(NULL);
 
-    idx=0;
-    encode_PACKET( pktbuf, &idx, &cmn, &pkt );
-    /* make the ethernet-header part of the PACKET header */
-    offset = copy_ETHFRAMEHDR( pktbuf+idx , tap_pkt);
-    idx += offset;
-    tap_pkt += offset;
-    len -= offset;
+    traceEvent( TRACE_DEBUG, "handle_PACKET size %u transform %u", 
+                (unsigned int)psize, (unsigned int)pkt->transform );
+    /* hexdump( payload, psize ); */
 
-    traceEvent( TRACE_DEBUG, "encoded PACKET header of size=%u transform %u (idx=%u)", 
-                (unsigned int)idx, (unsigned int)pkt.transform, (unsigned int)tx_transop_idx );
+    if ( psize < ETH_FRAMEHDRSIZE )
+    {
+        traceEvent( TRACE_WARNING, "handle_PACKET dropped, too short (%u)", (unsigned int)psize );
+        return retval;
+    }
 
-    idx += eee->transop[tx_transop_idx].fwd( &(eee->transop[tx_transop_idx]),
-                                             pktbuf+idx, N2N_PKT_BUF_SIZE-idx,
-                                             tap_pkt, len );
-    ++(eee->transop[tx_transop_idx].tx_cnt); /* stats */
+    from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
 
-    if ( dest )
+    if ( from_supernode )
     {
-        ++(eee->tx_p2p);
-		eee->tx_bit_p2p += idx;
+        ++(eee->rx_sup);
+        eee->last_sup=now;
+		edge_stat_add( eee->rx_bit_sup, psize );
     }
     else
     {
-        ++(eee->tx_sup);
-		eee->tx_bit_sup += idx;
+        ++(eee->rx_p2p);
+        eee->last_p2p=now;
+		edge_stat_add( eee->rx_bit_p2p, psize );
+    }
+
+    decode_ETHFRAMEHDR(&eth, payload);
+    /* Update the sender in peer table entry */
+    edge_lock_peers( eee );
+    scan = check_peer( eee, from_supernode, eth.srcMac, orig_sender);
+    if ( scan )
+    {
+        if ( from_supernode )
+            ++(scan->rx_sup);
+        else
+            ++(scan->rx_p2p);
+        scan->rx_bytes += psize;
+    }
+    edge_unlock_peers( eee );
+
+    /* Handle transform. */
+    {
+        n2n_pktbuf_t pb;
+        n2n_neigh_t nb;
+        int rx_transop_idx=0;
+        int rc;
+
+        /* The ethernet header is in clear in front of the transformed part. */
+        n2n_pktbuf_init( &pb, payload, bufsize, ETH_FRAMEHDRSIZE, psize - ETH_FRAMEHDRSIZE );
+
+        rx_transop_idx = transop_enum_to_index(pkt->transform);
+
+        if ( rx_transop_idx >=0 )
+        {
+            edge_lock_transops( eee, 0 );
+            rc = n2n_transop_rev_pb( &(eee->transop[rx_transop_idx]), &pb );
+            ++(eee->transop[rx_transop_idx].rx_cnt); /* stats */
+            edge_unlock_transops( eee );
+
+            if ( rc < 0 )
+            {
+                /* Undecodable, or failed authentication. */
+                traceEvent( TRACE_DEBUG, "handle_PACKET dropped, transform %u failed",
+                            (unsigned int)pkt->transform );
+                edge_count_rx_fail( eee, eth.srcMac );
+                return retval;
+            }
+
+            /* Join the ethernet header to the decoded payload. */
+            n2n_pktbuf_push( &pb, ETH_FRAMEHDRSIZE );
+            memmove( pb.data, payload, ETH_FRAMEHDRSIZE );
+
+            if ( 0 == n2n_neigh_parse( pb.data, pb.len, &nb ) )
+            {
+                edge_lock_peers( eee );
+                edge_neigh_learn( eee, &nb, eth.srcMac, now );
+                edge_unlock_peers( eee );
+            }
+
+            /* Write ethernet packet to tap device. */
+            data_sent_len = edge_write_to_tap( eee, pb.data, pb.len );
+
+            if (data_sent_len == pb.len)
+            {
+                retval = 0;
+            }
+        }
+        else
+        {
+            traceEvent( TRACE_ERROR, "handle_PACKET dropped unknown transform enum %u", 
+                        (unsigned int)pkt->transform );
+            edge_count_rx_fail( eee, eth.srcMac );
+        }
     }
-    send_PACKET( eee, destMac, pktbuf, idx, &destination);
+
+    return retval;
 }
 
 
-/** Destination MAC 33:33:0:00:00:00 - 33:33:FF:FF:FF:FF is reserved for IPv6
- *  neighbour discovery.
- */
-static int is_ip6_discovery( const void * buf, size_t bufsize )
+/** Return the recovery state of the peer at mac, NULL if it has not sent a
+ *  parity for EDGE_FEC_RX_TTL. */
+static n2n_edge_fec_rx_t * find_fec_rx( n2n_edge_t * eee, const n2n_mac_t mac, time_t now )
 {
-    int retval = 0;
+    size_t i;
 
-    if ( bufsize >= sizeof(ether_hdr_t) )
+    for ( i=0; (i < EDGE_FEC_RX_SOURCES) && eee->fec_rx[i]; ++i )
     {
-        /* copy to aligned memory */
-        ether_hdr_t eh;
-        memcpy( &eh, buf, sizeof(ether_hdr_t) );
-
-        if ( (0x33 == eh.dhost[0]) &&
-             (0x33 == eh.dhost[1]) )
+        if ( (0 == memcmp( eee->fec_rx[i]->mac, mac, N2N_MAC_SIZE ))
+             && (now - eee->fec_rx[i]->last_parity <= EDGE_FEC_RX_TTL) )
         {
-            retval = 1; /* This is an IPv6 multicast packet [RFC2464]. */
+            return eee->fec_rx[i];
         }
     }
-    return retval;
+
+    return NULL;
 }
 
-/** Destination 01:00:5E:00:00:00 - 01:00:5E:7F:FF:FF is multicast ethernet.
- */
-static int is_ethMulticast( const void * buf, size_t bufsize )
+/** Start keeping the PACKETs of the peer at mac, in a new entry or in place
+ *  of the one whose peer sent a parity longest ago. */
+static n2n_edge_fec_rx_t * add_fec_rx( n2n_edge_t * eee, const n2n_mac_t mac, time_t now )
 {
-    int retval = 0;
+    n2n_edge_fec_rx_t * rx;
+    size_t oldest = 0;
+    size_t i;
 
-    /* Match 01:00:5E:00:00:00 - 01:00:5E:7F:FF:FF */
-    if ( bufsize >= sizeof(ether_hdr_t) )
+    for ( i=0; i < EDGE_FEC_RX_SOURCES; ++i )
     {
-        /* copy to aligned memory */
-        ether_hdr_t eh;
-        memcpy( &eh, buf, sizeof(ether_hdr_t) );
+        if ( NULL == eee->fec_rx[i] )
+        {
+            eee->fec_rx[i] = (n2n_edge_fec_rx_t *)malloc( sizeof(n2n_edge_fec_rx_t) );
+            if ( NULL == eee->fec_rx[i] )
+            {
+                return NULL;
+            }
+            oldest = i;
+            break;
+        }
 
-        if ( (0x01 == eh.dhost[0]) &&
-             (0x00 == eh.dhost[1]) &&
-             (0x5E == eh.dhost[2]) &&
-             (0 == (0x80 & eh.dhost[3])) )
+        if ( eee->fec_rx[i]->last_parity < eee->fec_rx[oldest]->last_parity )
         {
-            retval = 1; /* This is an ethernet multicast packet [RFC1112]. */
+            oldest = i;
         }
     }
-    return retval;
+
+    rx = eee->fec_rx[oldest];
+    memset( rx, 0, sizeof(n2n_edge_fec_rx_t) );
+    memcpy( rx->mac, mac, N2N_MAC_SIZE );
+    rx->last_parity = now;
+    rx->last_report = now;
+
+    return rx;
 }
 
+/** Put a PACKET after its common header, body of len bytes, into the ring
+ *  of rx in place of the oldest one. */
+static void edge_fec_store( n2n_edge_fec_rx_t * rx, const uint8_t * body, size_t len,
+                            uint32_t hash, uint8_t recovered )
+{
+    n2n_edge_fec_pkt_t * kept = &(rx->ring[rx->next]);
 
+    if ( kept->recovered )
+    {
+        --(rx->recovered);
+    }
 
-/** Read a single packet from the TAP interface, process it and write out the
- *  corresponding packet to the cooked socket.
- */
-static void readFromTAPSocket( n2n_edge_t * eee )
+    kept->hash = hash;
+    kept->len = (uint16_t)len;
+    kept->recovered = recovered;
+    memcpy( kept->data, body, len );
+    rx->next = (rx->next + 1) % EDGE_FEC_RX_RING;
+    rx->recovered += recovered;
+}
+
+/** Keep a copy of a PACKET, udp_buf of len bytes, from src if src sends
+ *  parities.
+ *
+ *  Returns 1 if the PACKET has already been recovered from a parity and
+ *  handled, having arrived late, 0 otherwise. */
+static int edge_fec_keep( n2n_edge_t * eee, const uint8_t * udp_buf, size_t len,
+                          const n2n_mac_t src, time_t now )
 {
-    /* tun -> remote */
-    uint8_t             eth_pkt[N2N_PKT_BUF_SIZE];
-    macstr_t            mac_buf;
-    ssize_t             len;
+    const uint8_t * body = udp_buf + N2N_COMMON_SIZE;
+    n2n_edge_fec_rx_t * rx;
+    uint32_t hash;
+    size_t j;
 
-    len = tuntap_read( &(eee->device), eth_pkt, N2N_PKT_BUF_SIZE );
+    if ( (NULL == eee->fec_rx[0]) || (len <= N2N_COMMON_SIZE) )
+    {
+        return 0;
+    }
 
-    if( (len <= 0) || (len > N2N_PKT_BUF_SIZE) )
+    rx = find_fec_rx( eee, src, now );
+    if ( NULL == rx )
     {
-        traceEvent(TRACE_WARNING, "read()=%d [%d/%s]",
-                   (signed int)len, errno, strerror(errno));
+        return 0;
     }
-    else
+
+    len -= N2N_COMMON_SIZE;
+    hash = edge_fec_hash( body, len );
+
+    for ( j=0; rx->recovered && (j < EDGE_FEC_RX_RING); ++j )
     {
-        const uint8_t * mac = eth_pkt;
-        traceEvent(TRACE_INFO, "### Rx TAP packet (%4d) for %s",
-                   (signed int)len, macaddr_str(mac_buf, mac) );
+        n2n_edge_fec_pkt_t * kept = &(rx->ring[j]);
 
-        if ( eee->drop_multicast &&
-             ( is_ip6_discovery( eth_pkt, len ) ||
-               is_ethMulticast( eth_pkt, len)
-                 )
-            )
-        {
-            traceEvent(TRACE_DEBUG, "Dropping multicast");
-        }
-        else
+        if ( kept->recovered && (kept->hash == hash) && (kept->len == len)
+             && (0 == memcmp( kept->data, body, len )) )
         {
-            send_packet2net(eee, eth_pkt, len);
+            kept->recovered = 0;
+            --(rx->recovered);
+            return 1;
         }
     }
+
+    edge_fec_store( rx, body, len, hash, 0 );
+    return 0;
 }
 
+/** Send the peer at rx->mac the loss of its PACKETs since the last report,
+ *  smoothed, through dest where its parity came from. */
+static void send_fec_report( n2n_edge_t * eee, n2n_edge_fec_rx_t * rx,
+                             const n2n_sock_t * dest, time_t now )
+{
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    n2n_common_t cmn;
+    n2n_FEC_t msg;
+    size_t idx=0;
 
+    if ( rx->covered )
+    {
+        rx->loss = (rx->loss + rx->lost * 1000 / rx->covered) / 2;
+    }
 
-/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
- *  encrypted. */
-static int handle_PACKET( n2n_edge_t * eee,
-                          const n2n_common_t * cmn,
-                          const n2n_PACKET_t * pkt,
-                          const n2n_sock_t * orig_sender,
-                          uint8_t * payload,
-                          size_t psize )
-{
-    ssize_t             data_sent_len;
-    uint8_t             from_supernode;
-    uint8_t *           eth_payload=NULL;
-    int                 retval = -1;
-    time_t              now;
-    n2n_ETHFRAMEHDR_t   eth;
+    memset( &cmn, 0, sizeof(cmn) );
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = n2n_fec;
+    memcpy( cmn.community, eee->community_name, N2N_COMMUNITY_SIZE );
 
-    now = time(NULL);
+    memset( &msg, 0, sizeof(msg) );
+    memcpy( msg.srcMac, eee->device.mac_addr, N2N_MAC_SIZE );
+    memcpy( msg.dstMac, rx->mac, N2N_MAC_SIZE );
+    msg.loss = rx->loss;
 
-    traceEvent( TRACE_DEBUG, "handle_PACKET size %u transform %u", 
-                (unsigned int)psize, (unsigned int)pkt->transform );
-    /* hexdump( payload, psize ); */
+    encode_FEC( pktbuf, &idx, &cmn, &msg );
+    sendto_sock( eee->udp_sock, pktbuf, idx, dest );
 
-    from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
+    rx->covered = 0;
+    rx->lost = 0;
+    rx->last_report = now;
+}
 
-    if ( from_supernode )
+/** An FEC message has arrived.
+ *
+ *  A loss report sets the size of the groups sent to its peer. For a parity,
+ *  the PACKETs it lists are looked up among those kept from its sender; when
+ *  just one is missing it is rebuilt from the parity and the others, which
+ *  is then handled as if it had been received. */
+static void handle_FEC( n2n_edge_t * eee,
+                        const n2n_common_t * cmn,
+                        const n2n_FEC_t * fec,
+                        const n2n_sock_t * sender,
+                        const uint8_t * parity,
+                        size_t psize,
+                        time_t now )
+{
+    n2n_edge_fec_rx_t * rx;
+    const n2n_edge_fec_pkt_t * have[N2N_FEC_MAX_GROUP];
+    size_t missing = N2N_FEC_MAX_GROUP;
+    size_t lost = 0;
+    size_t i, j;
+
+    if ( 0 != memcmp( fec->dstMac, eee->device.mac_addr, N2N_MAC_SIZE ) )
     {
-        ++(eee->rx_sup);
-        eee->last_sup=now;
-		eee->rx_bit_sup += psize;
+        return;
     }
-    else
+
+    if ( 0 == fec->count )
     {
-        ++(eee->rx_p2p);
-        eee->last_p2p=now;
-		eee->rx_bit_p2p += psize;
-    }
+        peer_info_t * scan;
+        macstr_t mac_buf;
 
-    decode_ETHFRAMEHDR(&eth, payload);
-    /* Update the sender in peer table entry */
-    check_peer( eee, from_supernode, eth.srcMac, orig_sender);
+        edge_lock_peers( eee );
+        scan = find_peer_by_mac( eee->peers, fec->srcMac );
+        if ( scan )
+        {
+            size_t group = edge_fec_group( eee, scan->mac_addr );
 
-    /* Handle transform. */
+            scan->fec_loss = MIN( fec->loss, 1000 );
+            if ( edge_fec_group( eee, scan->mac_addr ) != group )
+            {
+                traceEvent( TRACE_INFO, "%s reports %u per mille lost, FEC group now %u",
+                            macaddr_str( mac_buf, scan->mac_addr ), (unsigned int)scan->fec_loss,
+                            (unsigned int)edge_fec_group( eee, scan->mac_addr ) );
+                edge_peers_changed( eee );
+            }
+        }
+        edge_unlock_peers( eee );
+        return;
+    }
+
+    rx = find_fec_rx( eee, fec->srcMac, now );
+    if ( NULL == rx )
     {
-        uint8_t decodebuffer[N2N_PKT_BUF_SIZE];
-        uint8_t * decodebuf = decodebuffer;
-        size_t eth_size;
-        size_t rx_transop_idx=0;
-        int offset;
+        /* Only PACKETs that arrive from now on can be recovered. */
+        add_fec_rx( eee, fec->srcMac, now );
+        return;
+    }
+    rx->last_parity = now;
 
-        /* copy eth header to decodebuf */
-        offset = copy_ETHFRAMEHDR(decodebuffer, payload);
-        decodebuf += offset;
-        payload += offset;
-        psize -= offset;
-        eth_size = offset;
+    for ( i=0; i < fec->count; ++i )
+    {
+        /* Newest first: the PACKETs of a parity arrive just before it, an
+         * older one with the same hash is another PACKET. */
+        have[i] = NULL;
+        for ( j=1; j <= EDGE_FEC_RX_RING; ++j )
+        {
+            const n2n_edge_fec_pkt_t * kept = &(rx->ring[(rx->next + EDGE_FEC_RX_RING - j) % EDGE_FEC_RX_RING]);
 
-        rx_transop_idx = transop_enum_to_index(pkt->transform);
+            if ( kept->len && (kept->hash == fec->hash[i]) )
+            {
+                have[i] = kept;
+                break;
+            }
+        }
 
-        if ( rx_transop_idx >=0 )
+        if ( NULL == have[i] )
         {
-            eth_payload = decodebuf;
-            eth_size += eee->transop[rx_transop_idx].rev( &(eee->transop[rx_transop_idx]),
-                                                         eth_payload, N2N_PKT_BUF_SIZE,
-                                                         payload, psize );
-            ++(eee->transop[rx_transop_idx].rx_cnt); /* stats */
+            missing = i;
+            ++lost;
+        }
+    }
 
-            /* Write ethernet packet to tap device. */
-            traceEvent( TRACE_INFO, "sending to TAP %u", (unsigned int)eth_size );
-            data_sent_len = tuntap_write(&(eee->device), decodebuffer, eth_size);
+    rx->covered += fec->count;
+    rx->lost += lost;
 
-            if (data_sent_len == eth_size)
+    if ( lost > 1 )
+    {
+        edge_stat_add( eee->fec_lost, lost );
+    }
+    else if ( 1 == lost )
+    {
+        uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+        uint8_t * body = pktbuf + N2N_COMMON_SIZE;
+        n2n_common_t pcmn;
+        n2n_PACKET_t pkt;
+        size_t len = fec->len_xor;
+        size_t rem;
+        size_t idx=0;
+
+        memcpy( body, parity, psize );
+        for ( i=0; i < fec->count; ++i )
+        {
+            if ( i != missing )
             {
-                retval = 0;
+                edge_fec_xor( body, have[i]->data, MIN( have[i]->len, psize ) );
+                len ^= have[i]->len;
             }
         }
+
+        if ( (len <= psize) && (len > sizeof(n2n_transform_t) + ETH_FRAMEHDRSIZE)
+             && (edge_fec_hash( body, len ) == fec->hash[missing]) )
+        {
+            edge_stat_add( eee->fec_recovered, 1 );
+
+            /* So that the PACKET is not handled again should it arrive late. */
+            edge_fec_store( rx, body, len, fec->hash[missing], 1 );
+
+            pcmn = *cmn;
+            pcmn.pc = n2n_packet;
+            encode_common( pktbuf, &idx, &pcmn );
+
+            rem = len;
+            decode_PACKET( &pkt, &pcmn, pktbuf, &rem, &idx );
+            handle_PACKET( eee, &pcmn, &pkt, sender, pktbuf+idx, N2N_COMMON_SIZE + len - idx,
+                           N2N_PKT_BUF_SIZE - idx );
+        }
         else
         {
-            traceEvent( TRACE_ERROR, "handle_PACKET dropped unknown transform enum %u", 
-                        (unsigned int)pkt->transform );
+            edge_stat_add( eee->fec_lost, 1 );
         }
     }
 
-    return retval;
+    if ( now - rx->last_report >= EDGE_FEC_REPORT_INTERVAL )
+    {
+        send_fec_report( eee, rx, sender, now );
+    }
+}
+
+
+/** Add what the TAP readers have sent to peer since their flow cache entries
+ *  were last flushed. Read without their locks, like the other counters. */
+static void peer_pending_tx( n2n_edge_t * eee, const peer_info_t * peer,
+                             uint64_t * tx_p2p, uint64_t * tx_sup, uint64_t * tx_bytes )
+{
+    size_t slot = edge_flow_slot( peer->mac_addr );
+    size_t q;
+
+    for ( q=0; q <= eee->num_txq; ++q )
+    {
+        const n2n_edge_flow_t * flow = &(((q < eee->num_txq) ? eee->txq[q].txb : eee->txb)->flows[slot]);
+
+        if ( flow->tx_pkts && (0 == memcmp( flow->mac, peer->mac_addr, N2N_MAC_SIZE )) )
+        {
+            if ( flow->p2p )
+                *tx_p2p += flow->tx_pkts;
+            else
+                *tx_sup += flow->tx_pkts;
+            *tx_bytes += flow->tx_bytes;
+        }
+    }
+}
+
+/** Answer "peerstats": a PEERS header datagram, then one datagram per peer
+ *  of key=value fields. path is p2p while frames go to sock, otherwise sn;
+ *  path_age is the time since that last changed. tx and rx count PACKETs
+ *  sent straight and via the supernode; bytes are encoded sizes. rx_fail
+ *  counts PACKETs that failed to decode; fec_loss is the loss per mille the
+ *  peer reports for PACKETs covered by FEC. Called with peer_lock held. */
+static void send_peer_stats( n2n_edge_t * eee, const struct sockaddr_in * sender_sock, time_t now )
+{
+    char                buf[N2N_PKT_BUF_SIZE];
+    size_t              msg_len;
+    peer_info_t *       scan;
+    struct sglib_hashed_peer_info_t_iterator it;
+    macstr_t            mac_buf;
+    n2n_sock_str_t      sockbuf;
+    size_t              operational;
+    size_t              pending;
+
+    count_peers( eee, &operational, &pending );
+    msg_len = snprintf( buf, sizeof(buf), "PEERS count=%u\n", (unsigned int)(operational + pending) );
+    sendto( eee->udp_mgmt_sock, buf, msg_len, 0, (const struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
+
+    for ( scan=sglib_hashed_peer_info_t_it_init(&it, eee->peers); scan != NULL;
+          scan=sglib_hashed_peer_info_t_it_next(&it) )
+    {
+        int p2p = (N2N_PEER_OPERATIONAL == scan->state);
+        uint64_t tx_p2p = scan->tx_p2p;
+        uint64_t tx_sup = scan->tx_sup;
+        uint64_t tx_bytes = scan->tx_bytes;
+
+        peer_pending_tx( eee, scan, &tx_p2p, &tx_sup, &tx_bytes );
+
+        msg_len = snprintf( buf, sizeof(buf),
+                            "PEER mac=%s state=%s path=%s sock=%s rtt=%u srtt=%u path_age=%ld last_seen=%ld"
+                            " tx_p2p=%llu tx_sn=%llu tx_bytes=%llu rx_p2p=%llu rx_sn=%llu rx_bytes=%llu rx_fail=%llu"
+                            " fec_loss=%u\n",
+                            macaddr_str( mac_buf, scan->mac_addr ), peer_state_str( scan->state ),
+                            p2p ? "p2p" : "sn", p2p ? sock_to_cstr( sockbuf, &(scan->sock) ) : "-",
+                            p2p ? (unsigned int)scan->paths[scan->sock_idx].rtt_us : 0,
+                            p2p ? (unsigned int)scan->paths[scan->sock_idx].srtt_us : 0,
+                            (long)(now - scan->path_since), (long)(now - scan->last_seen),
+                            (unsigned long long)tx_p2p, (unsigned long long)tx_sup, (unsigned long long)tx_bytes,
+                            (unsigned long long)scan->rx_p2p, (unsigned long long)scan->rx_sup,
+                            (unsigned long long)scan->rx_bytes, (unsigned long long)scan->rx_fail,
+                            (unsigned int)scan->fec_loss );
+        sendto( eee->udp_mgmt_sock, buf, msg_len, 0, (const struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
+    }
 }
 
 
 /** Read a datagram from the management UDP socket and take appropriate
  *  action. */
-static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
+static void readFromMgmtSocket( n2n_edge_t * eee, int * running )
 {
     uint8_t             udp_buf[N2N_PKT_BUF_SIZE+1];   /* Complete UDP packet */
     ssize_t             recvlen;
@@ -1523,6 +4245,10 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
     peer_info_t *	lpi = NULL;
     struct sglib_hashed_peer_info_t_iterator    it;
     int			c;
+    int			k;
+    size_t		q;
+    size_t		tx_sup, tx_p2p;
+    size_t		transop_tx_cnt[N2N_MAX_TRANSFORMS];
 
     now = time(NULL);
     i = sizeof(sender_sock);
@@ -1544,7 +4270,7 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
         if ( 0 == memcmp( udp_buf, "stop", 4 ) )
         {
             traceEvent( TRACE_ERROR, "stop command received." );
-            *keep_running = 0;
+            *running = 0;
             return;
         }
 
@@ -1560,6 +4286,7 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
                                  "  +verb   Increase verbosity of logging\n"
                                  "  -verb   Decrease verbosity of logging\n"
 								 "  peers   List table of known peers\n"
+                                 "  peerstats  Traffic counters of each peer\n"
                                  "  reload  Re-read the keyschedule\n"
                                  "  mangle_peer mac ip [port] mangle peer\n"
                                  "  localip [value]     Show or set the local IP value\n"
@@ -1613,6 +4340,12 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
             return;
         }
 
+        if ( (recvlen >= 9) && (0 == memcmp( udp_buf, "peerstats", 9 )) )
+        {
+            send_peer_stats( eee, &sender_sock, now );
+            return;
+        }
+
 		if ( 0 == memcmp( udp_buf, "peers", 5 ) )
 		{
 			msg_len = 0;
@@ -1625,13 +4358,22 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
 				(struct sockaddr *)&sender_sock, sizeof(struct sockaddr_in) );
 
 			c = 0;
-			for(lpi=sglib_hashed_peer_info_t_it_init(&it,eee->known_peers); lpi!=NULL; lpi=sglib_hashed_peer_info_t_it_next(&it)) {
+			for(lpi=sglib_hashed_peer_info_t_it_init(&it,eee->peers); lpi!=NULL; lpi=sglib_hashed_peer_info_t_it_next(&it)) {
+				if ( N2N_PEER_OPERATIONAL != lpi->state )
+					continue;
 				c++;
 				msg_len = 0;
 				msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
-                                        ">  %i: %s -> %s last: %li(%ld sec ago)\n", c, macaddr_str( mac_buf, lpi->mac_addr ),
-						sock_to_cstr( sockbuf, &(lpi->sock) ),
+                                        ">  %i: %s -> %s pmtu:%u last: %li(%ld sec ago)\n", c, macaddr_str( mac_buf, lpi->mac_addr ),
+						sock_to_cstr( sockbuf, &(lpi->sock) ), (unsigned int)lpi->pmtu.mtu,
                                                 lpi->last_seen, (now - lpi->last_seen));
+				for ( k=0; k < lpi->num_sockets; ++k )
+				{
+					msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+					                     "      %c %s rtt:%u srtt:%u us unanswered:%u\n", (k == lpi->sock_idx) ? '*' : ' ',
+					                     sock_to_cstr( sockbuf, &(lpi->sockets[k]) ), (unsigned int)lpi->paths[k].rtt_us,
+					                     (unsigned int)lpi->paths[k].srtt_us, (unsigned int)lpi->paths[k].lost );
+				}
 				sendto( eee->udp_mgmt_sock, udp_buf, msg_len, 0,
 					(struct sockaddr *)&sender_sock, sizeof(struct sockaddr_in) );
 			}
@@ -1644,18 +4386,25 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
 				(struct sockaddr *)&sender_sock, sizeof(struct sockaddr_in) );
 
 			c = 0;
-			for(lpi=sglib_hashed_peer_info_t_it_init(&it,eee->pending_peers); lpi!=NULL; lpi=sglib_hashed_peer_info_t_it_next(&it)) {
+			for(lpi=sglib_hashed_peer_info_t_it_init(&it,eee->peers); lpi!=NULL; lpi=sglib_hashed_peer_info_t_it_next(&it)) {
+				if ( N2N_PEER_OPERATIONAL == lpi->state )
+					continue;
 				c++;
 				msg_len = 0;
                 if(lpi->num_sockets == 0)
                     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
-                        ">  %i: %s -> (no info) last: %li(%ld sec ago)\n", c,
-                        macaddr_str( mac_buf, lpi->mac_addr ), 
+                        ">  %i: %s -> (no info) %s for %ld sec, queries:%u registers:%u last: %li(%ld sec ago)\n", c,
+                        macaddr_str( mac_buf, lpi->mac_addr ),
+                        peer_state_str( lpi->state ), (now - lpi->state_since),
+                        (unsigned int)lpi->num_queries, (unsigned int)lpi->num_registers,
                         lpi->last_seen, (now - lpi->last_seen));
                 else
                     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
-                        ">  %i: %s -> %s last: %li(%ld sec ago)\n", c, macaddr_str( mac_buf, lpi->mac_addr ),
+                        ">  %i: %s -> %s %s for %ld sec, queries:%u registers:%u last: %li(%ld sec ago)\n", c,
+                            macaddr_str( mac_buf, lpi->mac_addr ),
                             sock_to_cstr( sockbuf, lpi->sockets ),
+                            peer_state_str( lpi->state ), (now - lpi->state_since),
+                            (unsigned int)lpi->num_queries, (unsigned int)lpi->num_registers,
                             lpi->last_seen, (now - lpi->last_seen));
                 if(lpi->num_sockets > 1)
                     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
@@ -1675,7 +4424,13 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
         {
             if ( strlen( eee->keyschedule ) > 0 )
             {
-                if ( edge_init_keyschedule(eee) == 0 )
+                int rc;
+
+                edge_lock_transops( eee, 1 );
+                rc = edge_init_keyschedule(eee);
+                edge_unlock_transops( eee );
+
+                if ( rc == 0 )
                 {
                     msg_len=0;
                     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
@@ -1705,8 +4460,8 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
                     mac+2, mac+3, mac+4, mac+5, ip, ip+1, ip+2, ip+3, &port);
             for( j=0; j<6; j++ )
                 target_mac[j] = (uint8_t) mac[j];
-            scan = find_peer_by_mac( eee->pending_peers, target_mac );
-            if (NULL != scan && n_matched >= 10) {
+            scan = find_peer_by_mac( eee->peers, target_mac );
+            if (NULL != scan && N2N_PEER_OPERATIONAL != scan->state && n_matched >= 10) {
                 scan->sock.family = AF_INET;
                 printf("n_matched: %d, port: %d\n", n_matched, port);
                 if (n_matched >= 11 && port > 0)
@@ -1757,6 +4512,24 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
 
     traceEvent(TRACE_DEBUG, "mgmt status rq" );
 
+    tx_sup = eee->tx_sup;
+    tx_p2p = eee->tx_p2p;
+    for ( q=0; q < N2N_MAX_TRANSFORMS; ++q )
+    {
+        transop_tx_cnt[q] = eee->transop[q].tx_cnt;
+    }
+    for ( q=0; q < eee->num_txq; ++q )
+    {
+        size_t t;
+
+        tx_sup += eee->txq[q].tx_sup;
+        tx_p2p += eee->txq[q].tx_p2p;
+        for ( t=0; t < N2N_MAX_TRANSFORMS; ++t )
+        {
+            transop_tx_cnt[t] += eee->txq[q].transop[t].tx_cnt;
+        }
+    }
+
     msg_len=0;
     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
                          "Statistics for edge\n" );
@@ -1769,9 +4542,9 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
 			"paths  super:(tx),(rx) p2p: (tx),(rx)\n");
     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
                          "packets      %u,%u     %u,%u\n",
-                         (unsigned int)eee->tx_sup,
+                         (unsigned int)tx_sup,
 			 (unsigned int)eee->rx_sup,
-			 (unsigned int)eee->tx_p2p,
+			 (unsigned int)tx_p2p,
 			 (unsigned int)eee->rx_p2p );
 
    msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
@@ -1784,23 +4557,177 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
                          "trans:null |%6u|%6u|\n"
                          "trans:tf   |%6u|%6u|\n"
-                         "trans:aes  |%6u|%6u|\n",
-                         (unsigned int)eee->transop[N2N_TRANSOP_NULL_IDX].tx_cnt,
+                         "trans:aes  |%6u|%6u|\n"
+                         "trans:lzo  |%6u|%6u|\n"
+                         "trans:tflz |%6u|%6u|\n"
+                         "trans:aeslz|%6u|%6u|\n"
+                         "trans:gcm  |%6u|%6u|\n"
+                         "trans:cc20 |%6u|%6u|\n",
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_NULL_IDX],
                          (unsigned int)eee->transop[N2N_TRANSOP_NULL_IDX].rx_cnt,
-                         (unsigned int)eee->transop[N2N_TRANSOP_TF_IDX].tx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_TF_IDX],
                          (unsigned int)eee->transop[N2N_TRANSOP_TF_IDX].rx_cnt,
-                         (unsigned int)eee->transop[N2N_TRANSOP_AESCBC_IDX].tx_cnt,
-                         (unsigned int)eee->transop[N2N_TRANSOP_AESCBC_IDX].rx_cnt );
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_AESCBC_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_AESCBC_IDX].rx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_LZO_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_LZO_IDX].rx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_TF_LZO_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_TF_LZO_IDX].rx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_AESCBC_LZO_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_AESCBC_LZO_IDX].rx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_AESGCM_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_AESGCM_IDX].rx_cnt,
+                         (unsigned int)transop_tx_cnt[N2N_TRANSOP_CC20_IDX],
+                         (unsigned int)eee->transop[N2N_TRANSOP_CC20_IDX].rx_cnt );
+
+    if ( eee->compress )
+    {
+        n2n_lzo_stats_t lzo;
+        size_t t;
+
+        memset( &lzo, 0, sizeof(lzo) );
+        for ( t=N2N_TRANSOP_LZO_IDX; t <= N2N_TRANSOP_AESCBC_LZO_IDX; ++t )
+        {
+            transop_lzo_stats( &(eee->transop[t]), &lzo );
+            for ( q=0; q < eee->num_txq; ++q )
+            {
+                transop_lzo_stats( &(eee->txq[q].transop[t]), &lzo );
+            }
+        }
+
+        /* Time the compressor would have spent on skipped frames, at the
+         * measured rate. */
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "lzo    in:%llu out:%llu ratio:%u%% comp:%u stored:%u skipped:%u saved:%lluus\n",
+                             (unsigned long long)lzo.bytes_in,
+                             (unsigned long long)lzo.bytes_out,
+                             (unsigned int)(lzo.bytes_in ? (lzo.bytes_out * 100 / lzo.bytes_in) : 100),
+                             (unsigned int)lzo.compressed,
+                             (unsigned int)lzo.stored,
+                             (unsigned int)lzo.skipped,
+                             (unsigned long long)(lzo.compress_bytes ?
+                                 (lzo.skipped_bytes * lzo.compress_ns / lzo.compress_bytes / 1000) : 0) );
+    }
+
+    for ( q=0; q < eee->num_txq; ++q )
+    {
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "queue %-2u     tx super:%u p2p:%u\n",
+                             (unsigned int)q,
+                             (unsigned int)eee->txq[q].tx_sup,
+                             (unsigned int)eee->txq[q].tx_p2p );
+    }
+
+    {
+        size_t tap_hist[EDGE_BATCH_HIST_SIZE];
+        size_t udp_hist[EDGE_BATCH_HIST_SIZE];
+        size_t flow_hits = eee->txb->flow_hits;
+        size_t flow_misses = eee->txb->flow_misses;
+        size_t b;
+
+        for ( q=0; q < eee->num_txq; ++q )
+        {
+            flow_hits += eee->txq[q].txb->flow_hits;
+            flow_misses += eee->txq[q].txb->flow_misses;
+        }
+
+        for ( b=0; b < EDGE_BATCH_HIST_SIZE; ++b )
+        {
+            tap_hist[b] = eee->txb->tap_hist[b];
+            udp_hist[b] = eee->txb->udp_hist[b];
+            for ( q=0; q < eee->num_txq; ++q )
+            {
+                tap_hist[b] += eee->txq[q].txb->tap_hist[b];
+                udp_hist[b] += eee->txq[q].txb->udp_hist[b];
+            }
+        }
+
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "batch tap  1:%u 2:%u 4:%u 8:%u 16:%u 32:%u\n"
+                             "batch udp  1:%u 2:%u 4:%u 8:%u 16:%u 32:%u\n"
+                             "batch rx   1:%u 2:%u 4:%u 8:%u 16:%u 32:%u\n",
+                             (unsigned int)tap_hist[0], (unsigned int)tap_hist[1],
+                             (unsigned int)tap_hist[2], (unsigned int)tap_hist[3],
+                             (unsigned int)tap_hist[4], (unsigned int)tap_hist[5],
+                             (unsigned int)udp_hist[0], (unsigned int)udp_hist[1],
+                             (unsigned int)udp_hist[2], (unsigned int)udp_hist[3],
+                             (unsigned int)udp_hist[4], (unsigned int)udp_hist[5],
+                             (unsigned int)eee->rxb->hist[0], (unsigned int)eee->rxb->hist[1],
+                             (unsigned int)eee->rxb->hist[2], (unsigned int)eee->rxb->hist[3],
+                             (unsigned int)eee->rxb->hist[4], (unsigned int)eee->rxb->hist[5] );
+
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "flow cache hit:%u miss:%u\n",
+                             (unsigned int)flow_hits, (unsigned int)flow_misses );
+    }
+
+    if ( eee->device.vnet_hdr )
+    {
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "offload gso:%u/%u gro:%u/%u\n",
+                             (unsigned int)eee->gso_frames,
+                             (unsigned int)eee->gso_segs,
+                             (unsigned int)eee->gro_frames,
+                             (unsigned int)eee->gro_segs );
+    }
+
+    if ( eee->pmtu_discovery )
+    {
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "pmtu   mss clamped:%u too big:%u fragmented:%u\n",
+                             (unsigned int)eee->mss_clamped,
+                             (unsigned int)eee->too_big,
+                             (unsigned int)eee->fragmented );
+    }
+
+    if ( eee->sched )
+    {
+        const n2n_edge_sched_t * sched = eee->sched;
+
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "sched  rate:%u kbit/s queued:%u/%u/%u sent:%u/%u/%u dropped:%u/%u/%u\n",
+                             (unsigned int)(sched->rate * 8 / 1000),
+                             (unsigned int)sched->count[0], (unsigned int)sched->count[1], (unsigned int)sched->count[2],
+                             (unsigned int)sched->sent[0], (unsigned int)sched->sent[1], (unsigned int)sched->sent[2],
+                             (unsigned int)sched->dropped[0], (unsigned int)sched->dropped[1], (unsigned int)sched->dropped[2] );
+    }
+
+    msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                         "neigh  known:%u answered:%u conflicts:%u\n",
+                         (unsigned int)eee->num_neigh,
+                         (unsigned int)eee->neigh_answered,
+                         (unsigned int)eee->neigh_conflicts );
 
     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
-                         "peers  pend:%u full:%u\n",
-                         (unsigned int)hashed_peer_list_t_size( eee->pending_peers ), 
-			 (unsigned int)hashed_peer_list_t_size( eee->known_peers ) );
+                         "fec    group:%u parities:%u recovered:%u lost:%u\n",
+                         (unsigned int)eee->fec_group,
+                         (unsigned int)eee->fec_parities,
+                         (unsigned int)eee->fec_recovered,
+                         (unsigned int)eee->fec_lost );
+
+    {
+        size_t operational;
+        size_t pending;
+
+        count_peers( eee, &operational, &pending );
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "peers  pend:%u full:%u\n",
+                             (unsigned int)pending, (unsigned int)operational );
+    }
 
     msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
                          "last   super:%lu(%ld sec ago) p2p:%lu(%ld sec ago)\n",
                          eee->last_sup, (now - eee->last_sup), eee->last_p2p, (now - eee->last_p2p) );
 
+    for ( q=0; q < eee->sn_num; ++q )
+    {
+        msg_len += snprintf( (char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+                             "sn %-2u %c %s rtt:%u srtt:%u us unanswered:%u pmtu:%u\n",
+                             (unsigned int)q, (q == eee->sn_idx) ? '*' : ' ', eee->sn[q].name,
+                             (unsigned int)eee->sn[q].rtt_us, (unsigned int)eee->sn[q].srtt_us,
+                             (unsigned int)eee->sn[q].lost, (unsigned int)eee->sn[q].pmtu.mtu );
+    }
+
     traceEvent(TRACE_DEBUG, "mgmt status sending: %s", udp_buf );
 
 
@@ -1809,8 +4736,10 @@ static void readFromMgmtSocket( n2n_edge_t * eee, int * keep_running )
 }
 
 
-/** Read a datagram from the main UDP socket to the internet. */
-static void readFromIPSocket( n2n_edge_t * eee )
+/** Process one datagram received on the UDP socket. udp_buf is
+ *  N2N_PKT_BUF_SIZE bytes; PACKETs are decoded in place inside it. */
+static void edge_handle_datagram( n2n_edge_t * eee, uint8_t * udp_buf, size_t recvlen,
+                                  const struct sockaddr_in * sender_sock )
 {
     n2n_common_t        cmn; /* common fields in the packet header */
 
@@ -1819,16 +4748,12 @@ static void readFromIPSocket( n2n_edge_t * eee )
     macstr_t            mac_buf1;
     macstr_t            mac_buf2;
 
-    uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
-    ssize_t             recvlen;
     size_t              rem;
     size_t              idx;
     size_t              msg_type;
-    struct sockaddr_in  sender_sock;
     n2n_sock_t          sender;
     n2n_sock_t *        orig_sender=NULL;
     time_t              now=0;
-    size_t              i;
     int                 j;
 
     /* for PACKET packages */
@@ -1840,31 +4765,22 @@ static void readFromIPSocket( n2n_edge_t * eee )
 
     /* for REGISTER packages */
     n2n_REGISTER_t reg;
-    peer_info_t tmp;
 
     /* for REGISTER_ACK packages */
     n2n_REGISTER_ACK_t ra;
 
+    /* for FEC packages */
+    n2n_FEC_t fec;
+
     /* For REGISTER_SUPER_ACK packages */
     n2n_REGISTER_SUPER_ACK_t rsa;
 
 
-    i = sizeof(sender_sock);
-    recvlen = recvfrom(eee->udp_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
-                     (struct sockaddr *)&sender_sock, (socklen_t*)&i);
-
-    if ( recvlen < 0 )
-    {
-        traceEvent(TRACE_ERROR, "recvfrom failed with %s", strerror(errno) );
-
-        return; /* failed to receive data from UDP */
-    }
-
     /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
      * IP transport version the packet arrived on. May need to UDP sockets. */
     sender.family = AF_INET; /* udp_sock was opened PF_INET v4 */
-    sender.port = ntohs(sender_sock.sin_port);
-    memcpy( &(sender.addr.v4), &(sender_sock.sin_addr.s_addr), IPV4_SIZE );
+    sender.port = ntohs(sender_sock->sin_port);
+    memcpy( &(sender.addr.v4), &(sender_sock->sin_addr.s_addr), IPV4_SIZE );
 
     /* The packet may not have an orig_sender socket spec. So default to last
      * hop as sender. */
@@ -1889,6 +4805,14 @@ static void readFromIPSocket( n2n_edge_t * eee )
 
     if( 0 == memcmp(cmn.community, eee->community_name, N2N_COMMUNITY_SIZE) )
     {
+        /* Everything but PACKET and FEC is control traffic which works on
+         * the peer tables. handle_PACKET() and handle_FEC() take the lock
+         * themselves when they need it. */
+        if ( (MSG_TYPE_PACKET != msg_type) && (MSG_TYPE_FEC != msg_type) )
+        {
+            edge_lock_peers( eee );
+        }
+
         switch(msg_type) {
         case MSG_TYPE_PACKET:
             /* process PACKET */
@@ -1898,28 +4822,63 @@ static void readFromIPSocket( n2n_edge_t * eee )
                        sock_to_cstr(sockbuf1, &sender),
                        sock_to_cstr(sockbuf2, orig_sender) );
 
+            if ( recvlen >= idx + ETH_FRAMEHDRSIZE )
+            {
+                /* Before decoding in place; the source MAC is in clear. */
+                if ( edge_fec_keep( eee, udp_buf, recvlen, udp_buf + idx + N2N_MAC_SIZE, now ) )
+                {
+                    traceEvent( TRACE_DEBUG, "Rx PACKET already recovered from a parity" );
+                    break;
+                }
+            }
+
             handle_PACKET( eee, &cmn, &pkt, orig_sender, udp_buf+idx,
-                    recvlen-idx );
+                    recvlen-idx, N2N_PKT_BUF_SIZE-idx );
+            break;
+        case MSG_TYPE_FEC:
+            if ( decode_FEC( &fec, &cmn, udp_buf, &rem, &idx ) < 0 )
+            {
+                traceEvent(TRACE_WARNING, "Rx FEC undecodable from %s", sock_to_cstr(sockbuf1, &sender) );
+                break;
+            }
+
+            traceEvent(TRACE_DEBUG, "Rx FEC src=%s count=%u from %s",
+                       macaddr_str( mac_buf1, fec.srcMac ), (unsigned int)fec.count,
+                       sock_to_cstr(sockbuf1, &sender) );
+
+            handle_FEC( eee, &cmn, &fec, &sender, udp_buf+idx, recvlen-idx, now );
             break;
         case MSG_TYPE_PEER_INFO:
             decode_PEER_INFO( &pi, &cmn, udp_buf, &rem, &idx );
 
-            scan = find_peer_by_mac( eee->pending_peers, pi.mac );
-            if (scan) {
+            scan = find_peer_by_mac( eee->peers, pi.mac );
+            if ( (pi.aflags & N2N_AFLAGS_PUNCH) && ((NULL == scan) || (N2N_PEER_STALE == scan->state)) ) {
+                /* The peer is punching towards us: punch back, as its NAT
+                 * only lets through who it sent to. */
+                traceEvent(TRACE_INFO, "Rx PEER_INFO on %s to punch back",
+                           macaddr_str(mac_buf1, pi.mac) );
+                scan = restart_peer( eee, scan, pi.mac, now );
+            }
+            if ( scan && ((N2N_PEER_QUERYING == scan->state) || (N2N_PEER_PUNCHING == scan->state)) ) {
                 scan->timeout = pi.timeout;
-                if (scan->num_sockets > 0)
-                    free(scan->sockets);
                 if (pi.aflags & N2N_AFLAGS_LOCAL_SOCKET)
                     scan->num_sockets = 2;
                 else
                     scan->num_sockets = 1;
-                scan->sockets = malloc(scan->num_sockets*sizeof(n2n_sock_t));
                 for(j=0; j<scan->num_sockets; j++)
                     scan->sockets[j] = pi.sockets[j];
-                traceEvent(TRACE_INFO, "Rx PEER_INFO on %s",
-                           macaddr_str(mac_buf1, pi.mac) );
-                for(j=0; j<scan->num_sockets; j++)
-                    send_register(eee, scan->sockets+j, scan->mac_addr);
+                memset( scan->paths, 0, sizeof(scan->paths) );
+                if (pi.aflags & N2N_AFLAGS_PORT_PREDICT) {
+                    scan->pred_port = pi.pred_port;
+                    scan->pred_count = pi.pred_count;
+                } else {
+                    scan->pred_count = 0;
+                }
+                traceEvent(TRACE_INFO, "Rx PEER_INFO on %s, %u predicted ports from %u",
+                           macaddr_str(mac_buf1, pi.mac),
+                           (unsigned int)scan->pred_count, (unsigned int)scan->pred_port );
+                set_peer_state( eee, scan, N2N_PEER_PUNCHING, now );
+                punch_peer( eee, scan, now );
             } else {
                 traceEvent(TRACE_INFO, "Rx PEER_INFO unknown peer %s",
                            macaddr_str(mac_buf1, pi.mac) );
@@ -1939,10 +4898,9 @@ static void readFromIPSocket( n2n_edge_t * eee )
 
             if ( 0 == memcmp(reg.dstMac, (eee->device.mac_addr), 6) )
             {
-                memcpy(tmp.mac_addr, reg.srcMac, sizeof(n2n_mac_t));
-                if (sglib_hashed_peer_info_t_find_member( 
-                            eee->pending_peers, &tmp) != NULL)
-                    send_register(eee, orig_sender, NULL);
+                scan = find_peer_by_mac( eee->peers, reg.srcMac );
+                if ( scan && ((N2N_PEER_QUERYING == scan->state) || (N2N_PEER_PUNCHING == scan->state)) )
+                    send_register(eee, orig_sender, NULL, NULL);
             }
 
             send_register_ack(eee, orig_sender, &reg);
@@ -1963,61 +4921,120 @@ static void readFromIPSocket( n2n_edge_t * eee )
                        sock_to_cstr(sockbuf1, &sender),
                        sock_to_cstr(sockbuf2, orig_sender) );
 
-            /* Move from pending_peers to known_peers; ignore if not in pending. */
+            scan = find_peer_by_mac( eee->peers, ra.srcMac );
+            if ( scan && edge_pmtu_ack( eee, &(scan->pmtu), ra.cookie, &sender, now ) )
+            {
+                break; /* path MTU probe */
+            }
+
+            /* Make operational; ignore unless querying or punching. */
             set_peer_operational( eee, ra.srcMac, &sender );
+
+            if ( scan )
+            {
+                edge_peer_path_ack( eee, scan, ra.cookie, now );
+            }
             break;
         case MSG_TYPE_REGISTER_SUPER_ACK:
-            if ( eee->sn_wait )
+        {
+            n2n_edge_sn_t * sn = NULL;
+            int probe = 0; /* answers a path MTU probe */
+
+            decode_REGISTER_SUPER_ACK( &rsa, &cmn, udp_buf, &rem, &idx );
+
+            if ( rsa.sock.family )
             {
-                decode_REGISTER_SUPER_ACK( &rsa, &cmn, udp_buf, &rem, &idx );
+                orig_sender = &(rsa.sock);
+            }
+
+            for ( j=0; j < (int)eee->sn_num; ++j )
+            {
+                if ( eee->sn[j].sent_us
+                     && (0 == memcmp( rsa.cookie, eee->sn[j].cookie, N2N_COOKIE_SIZE )) )
+                {
+                    sn = &(eee->sn[j]);
+                    break;
+                }
 
-                if ( rsa.sock.family )
+                if ( edge_pmtu_ack( eee, &(eee->sn[j].pmtu), rsa.cookie, &(eee->sn[j].sock), now ) )
                 {
-                    orig_sender = &(rsa.sock);
+                    probe = 1;
+                    break;
                 }
+            }
+
+            if ( sn )
+            {
+                uint64_t rtt = edge_now_us() - sn->sent_us;
 
-                traceEvent(TRACE_NORMAL, "Rx REGISTER_SUPER_ACK myMAC=%s [%s] (external %s). Attempts %u",
-                           macaddr_str( mac_buf1, rsa.edgeMac ),
-                           sock_to_cstr(sockbuf1, &sender),
-                           sock_to_cstr(sockbuf2, orig_sender), 
-                           (unsigned int)eee->sup_attempts );
+                sn->rtt_us = (uint32_t)MIN( rtt, UINT32_MAX );
+                sn->srtt_us = sn->srtt_us ? (7 * sn->srtt_us + sn->rtt_us) / 8 : MAX( sn->rtt_us, 1 );
+                sn->sent_us = 0;
+                sn->lost = 0;
+                sn->last_ack = now;
 
-                if ( 0 == memcmp( rsa.cookie, eee->last_cookie, N2N_COOKIE_SIZE ) )
+                if ( rsa.probe_port != sn->probe_port )
                 {
-                    if ( rsa.num_sn > 0 )
+                    sn->probe_port = rsa.probe_port;
+                    if ( sn->probe_port )
                     {
-                        traceEvent(TRACE_NORMAL, "Rx REGISTER_SUPER_ACK backup supernode at %s",
-                                   sock_to_cstr(sockbuf1, &(rsa.sn_bak) ) );
+                        send_nat_probe( eee, sn );
                     }
+                }
 
-                    eee->last_p2p = now;
-                    eee->last_sup = now;
-                    eee->sn_wait=0;
-                    eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS; /* refresh because we got a response */
-
-                    /* REVISIT: store sn_back */
-                    /* don't adjust lifetime according to supernode - this value should be specified
-                     * by the client (because dependent on NAT/firewall) (lukas) 
-                    eee->holepunch_interval = rsa.lifetime;
-                    eee->holepunch_interval = MAX( eee->holepunch_interval, REGISTER_SUPER_INTERVAL_MIN );
-                    eee->holepunch_interval = MIN( eee->holepunch_interval, REGISTER_SUPER_INTERVAL_MAX );
-                     */
+                if ( sn == &(eee->sn[eee->sn_idx]) )
+                {
+                    traceEvent(TRACE_NORMAL, "Rx REGISTER_SUPER_ACK myMAC=%s [%s] (external %s). rtt %u us",
+                               macaddr_str( mac_buf1, rsa.edgeMac ),
+                               sock_to_cstr(sockbuf1, &sender),
+                               sock_to_cstr(sockbuf2, orig_sender),
+                               (unsigned int)sn->rtt_us );
                 }
                 else
                 {
-                    traceEvent( TRACE_WARNING, "Rx REGISTER_SUPER_ACK with wrong or old cookie." );
+                    traceEvent(TRACE_INFO, "Rx REGISTER_SUPER_ACK from standby supernode %s. rtt %u us",
+                               sock_to_cstr(sockbuf1, &sender), (unsigned int)sn->rtt_us );
+                }
+
+                if ( rsa.num_sn > 0 )
+                {
+                    traceEvent(TRACE_NORMAL, "Rx REGISTER_SUPER_ACK backup supernode at %s",
+                               sock_to_cstr(sockbuf1, &(rsa.sn_bak) ) );
+                }
+
+                if ( sn == &(eee->sn[eee->sn_idx]) )
+                {
+                    eee->last_p2p = now;
+                    eee->last_sup = now;
+                    eee->sn_wait=0;
                 }
+
+                select_supernode( eee );
+
+                /* REVISIT: store sn_back */
+                /* don't adjust lifetime according to supernode - this value should be specified
+                 * by the client (because dependent on NAT/firewall) (lukas) 
+                eee->holepunch_interval = rsa.lifetime;
+                eee->holepunch_interval = MAX( eee->holepunch_interval, REGISTER_SUPER_INTERVAL_MIN );
+                eee->holepunch_interval = MIN( eee->holepunch_interval, REGISTER_SUPER_INTERVAL_MAX );
+                 */
             }
-            else
+            else if ( !probe )
             {
-                traceEvent( TRACE_WARNING, "Rx REGISTER_SUPER_ACK with no outstanding REGISTER_SUPER." );
+                traceEvent( TRACE_WARNING, "Rx REGISTER_SUPER_ACK with wrong or old cookie." );
             }
             break;
+        }
         default:
             /* Not a known message type */
             traceEvent(TRACE_WARNING, "Unable to handle packet type %d: ignored", (signed int)msg_type);
             break;
         } /* end switch(msg_type) */
+
+        if ( (MSG_TYPE_PACKET != msg_type) && (MSG_TYPE_FEC != msg_type) )
+        {
+            edge_unlock_peers( eee );
+        }
     } /* if (community match) */
     else
     {
@@ -2026,6 +5043,76 @@ static void readFromIPSocket( n2n_edge_t * eee )
 
 }
 
+/** Read the datagrams waiting on the UDP socket, up to EDGE_RX_BATCH with one
+ *  recvmmsg(), and process them in order.
+ *
+ *  With TAP offloads the end of a batch that did not fill the ring means the
+ *  socket is drained, so coalesced frames are written out there. */
+static void readFromIPSocket( n2n_edge_t * eee )
+{
+    n2n_edge_rxb_t *    rxb = eee->rxb;
+    size_t              n, i;
+
+#if defined(N2N_HAVE_RECVMMSG)
+    int                 rc;
+
+    for ( i=0; i < EDGE_RX_BATCH; ++i )
+    {
+        rxb->iov[i].iov_base = rxb->buf[i];
+        rxb->iov[i].iov_len = N2N_PKT_BUF_SIZE;
+        memset( &(rxb->msgs[i].msg_hdr), 0, sizeof(struct msghdr) );
+        rxb->msgs[i].msg_hdr.msg_name = &(rxb->addr[i]);
+        rxb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        rxb->msgs[i].msg_hdr.msg_iov = &(rxb->iov[i]);
+        rxb->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    rc = recvmmsg( eee->udp_sock, rxb->msgs, EDGE_RX_BATCH, MSG_DONTWAIT, NULL );
+    if ( rc <= 0 )
+    {
+        if ( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+        {
+            traceEvent(TRACE_ERROR, "recvmmsg failed with %s", strerror(errno) );
+        }
+
+        return; /* failed to receive data from UDP */
+    }
+
+    n = rc;
+    for ( i=0; i < n; ++i )
+    {
+        edge_handle_datagram( eee, rxb->buf[i], rxb->msgs[i].msg_len, &(rxb->addr[i]) );
+    }
+#else
+    ssize_t             recvlen;
+    socklen_t           slen = sizeof(struct sockaddr_in);
+
+    recvlen = recvfrom(eee->udp_sock, rxb->buf[0], N2N_PKT_BUF_SIZE, 0/*flags*/,
+                     (struct sockaddr *)&(rxb->addr[0]), &slen);
+
+    if ( recvlen < 0 )
+    {
+        traceEvent(TRACE_ERROR, "recvfrom failed with %s", strerror(errno) );
+
+        return; /* failed to receive data from UDP */
+    }
+
+    n = 1;
+    edge_handle_datagram( eee, rxb->buf[0], recvlen, &(rxb->addr[0]) );
+#endif
+
+    ++(rxb->hist[edge_batch_bucket( n )]);
+
+    if ( n < EDGE_RX_BATCH )
+    {
+        edge_gro_flush( eee );
+    }
+    else
+    {
+        edge_gro_flush_idle( eee );
+    }
+}
+
 /* ***************************************************** */
 
 
@@ -2036,7 +5123,7 @@ static DWORD tunReadThread(LPVOID lpArg )
 
     while(1)
     {
-        readFromTAPSocket(eee);
+        readFromTAPSocket(eee, NULL);
     }
 
     return((DWORD)NULL);
@@ -2309,10 +5396,12 @@ int real_main(int argc, char* argv[])
     char    netmask[N2N_NETMASK_STR_SIZE]="255.255.255.0";
     int     mtu = DEFAULT_MTU;
     int     got_s = 0;
+    unsigned long sched_kbps = 0; /* -S, 0 to send at once */
 
 #ifndef WIN32
     uid_t   userid=0; /* root is the only guaranteed ID */
     gid_t   groupid=0; /* root is the only guaranteed ID */
+    char    loop_path[N2N_PATHNAME_MAXLEN]=""; /* frames over a unix socket instead of a TAP */
 #endif
 
     char    device_mac[N2N_MACNAMSIZ]="";
@@ -2410,7 +5499,7 @@ int real_main(int argc, char* argv[])
     optarg = NULL;
     while((opt = getopt_long(effectiveargc,
                              effectiveargv,
-                             "K:k:a:bc:Eu:g:m:M:s:d:l:L:i:p:fvhrt:RA:", long_options, NULL)) != EOF)
+                             "K:k:a:bc:Eu:g:m:M:s:d:D:l:L:i:p:fvhrt:RA:TQ:OzS:P:F:", long_options, NULL)) != EOF)
     {
         switch (opt)
         {
@@ -2500,12 +5589,95 @@ int real_main(int argc, char* argv[])
             break;
         }
 
+        case 'z': /* LZO compression before encryption */
+        {
+            eee.compress = 1;
+            break;
+        }
+
+#ifndef WIN32
+        case 'T': /* separate TAP and UDP datapath threads */
+        {
+            eee.threaded = 1;
+            break;
+        }
+#endif
+
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+        case 'Q': /* TAP queues, each with a worker thread */
+        {
+            eee.device.num_queues = atoi(optarg);
+            if ( (eee.device.num_queues < 1) || (eee.device.num_queues > N2N_TUNTAP_MAX_QUEUES) )
+            {
+                fprintf(stderr, "Error: -Q must be between 1 and %d.\n", N2N_TUNTAP_MAX_QUEUES);
+                exit(1);
+            }
+            if ( eee.device.num_queues > 1 )
+            {
+                eee.threaded = 1;
+            }
+            break;
+        }
+#endif
+
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+        case 'O': /* virtio-net header and TAP offloads */
+        {
+            eee.device.vnet_hdr = 1;
+            break;
+        }
+#endif
+
+#ifndef WIN32
+        case 'D': /* loop device socket */
+        {
+            strncpy( loop_path, optarg, N2N_PATHNAME_MAXLEN-1 );
+            break;
+        }
+#endif
+
+        case 'S': /* egress scheduler rate */
+        {
+            sched_kbps = strtoul( optarg, NULL, 10 );
+            if ( 0 == sched_kbps )
+            {
+                fprintf(stderr, "Error: -S needs the uplink rate in kbit/s.\n");
+                exit(1);
+            }
+            break;
+        }
+
+        case 'P': /* priority port */
+        {
+            if ( eee.num_prio_ports < EDGE_SCHED_MAX_PORTS )
+            {
+                eee.prio_ports[eee.num_prio_ports++] = (uint16_t)atoi(optarg);
+            }
+            else
+            {
+                fprintf(stderr, "Error: at most %u -P ports.\n", (unsigned int)EDGE_SCHED_MAX_PORTS);
+                exit(1);
+            }
+            break;
+        }
+
+        case 'F': /* FEC group size */
+        {
+            eee.fec_group = atoi(optarg);
+            if ( (eee.fec_group < EDGE_FEC_MIN_GROUP) || (eee.fec_group > N2N_FEC_MAX_GROUP) )
+            {
+                fprintf(stderr, "Error: -F must be between %d and %d.\n", EDGE_FEC_MIN_GROUP, N2N_FEC_MAX_GROUP);
+                exit(1);
+            }
+            break;
+        }
+
         case 'l': /* supernode-list */
         {
             if ( eee.sn_num < N2N_EDGE_NUM_SUPERNODES )
             {
-                strncpy( (eee.sn_ip_array[eee.sn_num]), optarg, N2N_EDGE_SN_HOST_SIZE);
-                traceEvent(TRACE_DEBUG, "Adding supernode[%u] = %s\n", (unsigned int)eee.sn_num, (eee.sn_ip_array[eee.sn_num]) );
+                strncpy( (eee.sn[eee.sn_num].name), optarg, N2N_EDGE_SN_HOST_SIZE-1);
+                traceEvent(TRACE_DEBUG, "Adding supernode[%u] = %s\n", (unsigned int)eee.sn_num, (eee.sn[eee.sn_num].name) );
                 ++eee.sn_num;
             }
             else
@@ -2617,16 +5789,16 @@ int real_main(int argc, char* argv[])
     }
 #endif /* #ifdef N2N_HAVE_DAEMON */
 
-
     traceEvent( TRACE_NORMAL, "Starting n2n edge %s %s", n2n_sw_version, n2n_sw_buildDate );
 
 
-    for (i=0; i< N2N_EDGE_NUM_SUPERNODES; ++i )
+    for (i=0; i< eee.sn_num; ++i )
     {
-        traceEvent( TRACE_NORMAL, "supernode %u => %s\n", i, (eee.sn_ip_array[i]) );
+        traceEvent( TRACE_NORMAL, "supernode %u => %s\n", i, (eee.sn[i].name) );
+        supernode2addr( &(eee.sn[i].sock), eee.sn[i].name );
     }
 
-    supernode2addr( &(eee.supernode), eee.sn_ip_array[eee.sn_idx] );
+    eee.supernode = eee.sn[eee.sn_idx].sock;
 
 
     for ( i=0; i<effectiveargc; ++i )
@@ -2673,9 +5845,81 @@ int real_main(int argc, char* argv[])
         traceEvent(TRACE_NORMAL, "ip_mode='%s'", ip_mode);        
     }
 
+#ifndef WIN32
+    if ( loop_path[0] )
+    {
+        if ( tuntap_loop_open( &(eee.device), loop_path, ip_mode, ip_addr, netmask, device_mac, mtu ) < 0 )
+            return(-1);
+    }
+    else
+#endif
     if(tuntap_open(&(eee.device), tuntap_dev_name, ip_mode, ip_addr, netmask, device_mac, mtu) < 0)
         return(-1);
 
+    if ( edge_init_txq( &eee ) != 0 )
+    {
+        traceEvent( TRACE_ERROR, "Failed to allocate TAP queue workers" );
+        return(-1);
+    }
+
+    if ( sched_kbps )
+    {
+        if ( eee.num_txq > 0 )
+        {
+            traceEvent( TRACE_ERROR, "-S needs a single TAP queue" );
+            return(-1);
+        }
+
+        eee.sched = (n2n_edge_sched_t *)calloc( 1, sizeof(n2n_edge_sched_t) );
+        if ( NULL == eee.sched )
+        {
+            traceEvent( TRACE_ERROR, "Failed to allocate egress scheduler" );
+            return(-1);
+        }
+        eee.sched->rate = (uint64_t)sched_kbps * 1000 / 8;
+        eee.sched->drr = 1;
+        traceEvent( TRACE_NORMAL, "Pacing sent packets to %lu kbit/s", sched_kbps );
+    }
+
+    if ( eee.fec_group )
+    {
+        eee.txb->fec = (n2n_edge_fec_tx_t *)calloc( EDGE_FLOW_CACHE_SIZE, sizeof(n2n_edge_fec_tx_t) );
+        for ( i=0; (i < eee.num_txq) && eee.txb->fec; ++i )
+        {
+            eee.txq[i].txb->fec = (n2n_edge_fec_tx_t *)calloc( EDGE_FLOW_CACHE_SIZE, sizeof(n2n_edge_fec_tx_t) );
+            if ( NULL == eee.txq[i].txb->fec )
+            {
+                break;
+            }
+        }
+        if ( (NULL == eee.txb->fec) || (i < eee.num_txq) )
+        {
+            traceEvent( TRACE_ERROR, "Failed to allocate FEC parities" );
+            return(-1);
+        }
+        traceEvent( TRACE_NORMAL, "Sending an FEC parity after at most %u packets", (unsigned int)eee.fec_group );
+    }
+
+#ifndef WIN32
+    /* readFromTAPSocket() drains each TAP fd until it would block. */
+    fcntl( eee.device.fd, F_SETFL, fcntl( eee.device.fd, F_GETFL ) | O_NONBLOCK );
+    for ( i=1; i < eee.device.num_queues; ++i )
+    {
+        fcntl( eee.device.queue_fd[i], F_SETFL, fcntl( eee.device.queue_fd[i], F_GETFL ) | O_NONBLOCK );
+    }
+#endif
+
+    if ( eee.device.vnet_hdr )
+    {
+        eee.gro = (n2n_gro_t *)malloc( sizeof(n2n_gro_t) );
+        if ( NULL == eee.gro )
+        {
+            traceEvent( TRACE_ERROR, "Failed to allocate receive coalescing buffer" );
+            return(-1);
+        }
+        n2n_gro_init( eee.gro );
+    }
+
 #ifndef WIN32
     if ( (userid != 0) || (groupid != 0 ) ) {
         traceEvent(TRACE_NORMAL, "Interface up. Dropping privileges to uid=%d, gid=%d", 
@@ -2712,6 +5956,15 @@ int real_main(int argc, char* argv[])
         return(-1);
     }
 
+    /* Probes set DF while they are sent, see send_pmtu_probe(). PACKETs go
+     * without it and are kept within the probed path MTUs once known. */
+    eee.pmtu_discovery = (0 == edge_set_df( eee.udp_sock, 1 ))
+                         && (0 == edge_set_df( eee.udp_sock, 0 ));
+    if ( !eee.pmtu_discovery )
+    {
+        traceEvent( TRACE_WARNING, "Cannot set DF on the UDP socket, path MTU discovery disabled" );
+    }
+
 
     if(eee.local_sock_ena) {
         if ( set_localip(&eee) != 0) {
@@ -2729,6 +5982,10 @@ int real_main(int argc, char* argv[])
     }
 
 
+    /* After daemon() as threads do not survive fork, and after the startup
+     * checks so that their errors are written synchronously. */
+    traceEventStartAsync();
+
     traceEvent(TRACE_NORMAL, "edge started");
 
     update_supernode_reg(&eee, time(NULL) );
@@ -2737,17 +5994,172 @@ int real_main(int argc, char* argv[])
 }
 
 int   keep_running=1;
+
+#ifndef WIN32
+#define EDGE_THREAD_POLL_SECS   1       /* how often datapath threads check keep_running */
+
+/** Wait up to wait_us microseconds for fd to become readable.
+ *
+ *  @return 1 if readable, 0 on timeout or signal.
+ */
+static int edge_wait_readable( int fd, uint64_t wait_us )
+{
+    fd_set socket_mask;
+    struct timeval wait_time;
+
+    FD_ZERO(&socket_mask);
+    FD_SET(fd, &socket_mask);
+    wait_time.tv_sec = wait_us / 1000000; wait_time.tv_usec = wait_us % 1000000;
+
+    return ( select(fd+1, &socket_mask, NULL, NULL, &wait_time) > 0 ) ? 1 : 0;
+}
+
+/** TAP to net: read frames, encode and send them. */
+static void * edge_tap_thread( void * arg )
+{
+    n2n_edge_t * eee = (n2n_edge_t *)arg;
+
+    while(keep_running)
+    {
+        if ( edge_wait_readable( eee->device.fd, edge_sched_wait_us( eee, EDGE_THREAD_POLL_SECS * 1000000 ) ) )
+        {
+            readFromTAPSocket(eee, NULL);
+        }
+        else if ( eee->sched )
+        {
+            edge_sched_run( eee );
+        }
+    }
+
+    return NULL;
+}
+
+/** TAP to net for one queue of a multi-queue TAP device. */
+static void * edge_txq_thread( void * arg )
+{
+    n2n_edge_txq_t * txq = (n2n_edge_txq_t *)arg;
+    n2n_edge_t * eee = txq->eee;
+
+    while(keep_running)
+    {
+        if ( edge_wait_readable( eee->device.queue_fd[txq->queue], EDGE_THREAD_POLL_SECS * 1000000 ) )
+        {
+            readFromTAPSocket(eee, txq);
+        }
+    }
+
+    return NULL;
+}
+
+/** Net to TAP: receive datagrams, decode PACKETs and write them to the TAP. */
+static void * edge_net_thread( void * arg )
+{
+    n2n_edge_t * eee = (n2n_edge_t *)arg;
+
+    while(keep_running)
+    {
+        if ( edge_wait_readable( eee->udp_sock, EDGE_THREAD_POLL_SECS * 1000000 ) )
+        {
+            readFromIPSocket(eee);
+        }
+    }
+
+    return NULL;
+}
+
+/** Stop and join the first num_txq queue workers and, if started, the other
+ *  datapath threads. */
+static void edge_join_threads( n2n_edge_t * eee, size_t num_txq, int tap, int net )
+{
+    size_t q;
+
+    keep_running = 0;
+
+    for ( q=0; q < num_txq; ++q )
+    {
+        pthread_join( eee->txq[q].thread, NULL );
+    }
+
+    if ( tap ) pthread_join( eee->tap_thread, NULL );
+    if ( net ) pthread_join( eee->net_thread, NULL );
+}
+
+/** Start the datapath threads of threaded mode: the UDP reader and either one
+ *  TAP reader or one worker per TAP queue.
+ *
+ *  @return 0 on success, -1 if a thread could not be started (none are left
+ *  running).
+ */
+static int edge_start_threads( n2n_edge_t * eee )
+{
+    size_t q;
+
+    if ( 0 != pthread_create( &(eee->net_thread), NULL, edge_net_thread, eee ) )
+    {
+        return -1;
+    }
+
+    if ( 0 == eee->num_txq )
+    {
+        if ( 0 != pthread_create( &(eee->tap_thread), NULL, edge_tap_thread, eee ) )
+        {
+            edge_join_threads( eee, 0, 0, 1 );
+            return -1;
+        }
+
+        traceEvent( TRACE_NORMAL, "Running TAP and UDP datapaths in separate threads" );
+        return 0;
+    }
+
+    for ( q=0; q < eee->num_txq; ++q )
+    {
+        if ( 0 != pthread_create( &(eee->txq[q].thread), NULL, edge_txq_thread, &(eee->txq[q]) ) )
+        {
+            edge_join_threads( eee, q, 0, 1 );
+            return -1;
+        }
+    }
+
+    traceEvent( TRACE_NORMAL, "Running %u TAP queue workers and a UDP datapath thread",
+                (unsigned int)eee->num_txq );
+    return 0;
+}
+#endif /* #ifndef WIN32 */
+
 static int run_loop(n2n_edge_t * eee )
 {
     size_t numPurged;
+    size_t pmtu_searches=0;
+    time_t lastPmtuCheck=0;
     time_t lastIfaceCheck=0;
     time_t lastTransop=0;
 	time_t lastStatCalc=0;
 	time_t lastStatCalcDiff;
 
 
+    /* Pick the Tx transform before any datapath thread can send. */
+    lastTransop = time(NULL);
+    n2n_tick_transop( eee, lastTransop );
+
 #ifdef WIN32
     startTunReadThread(eee);
+#else
+    if ( eee->threaded && (0 != edge_start_threads( eee )) )
+    {
+        eee->threaded = 0;
+        keep_running = 1;
+
+        if ( eee->num_txq > 0 )
+        {
+            /* Flows steered to the other queues would never be read. */
+            traceEvent( TRACE_ERROR, "Failed to start TAP queue workers." );
+            keep_running = 0;
+        }
+        else
+        {
+            traceEvent( TRACE_WARNING, "Failed to start datapath threads. Running single-threaded." );
+        }
+    }
 #endif
 
     /* Main loop
@@ -2765,15 +6177,29 @@ static int run_loop(n2n_edge_t * eee )
         time_t nowTime;
 
         FD_ZERO(&socket_mask);
-        FD_SET(eee->udp_sock, &socket_mask);
         FD_SET(eee->udp_mgmt_sock, &socket_mask);
-        max_sock = max( eee->udp_sock, eee->udp_mgmt_sock );
+        max_sock = eee->udp_mgmt_sock;
+        if ( !eee->threaded )
+        {
+            FD_SET(eee->udp_sock, &socket_mask);
+            max_sock = max( max_sock, eee->udp_sock );
 #ifndef WIN32
-        FD_SET(eee->device.fd, &socket_mask);
-        max_sock = max( max_sock, eee->device.fd );
+            FD_SET(eee->device.fd, &socket_mask);
+            max_sock = max( max_sock, eee->device.fd );
 #endif
+        }
+
+        /* Wake up for probe timeouts while path MTUs are searched. */
+        wait_time.tv_sec = pmtu_searches ? EDGE_PMTU_PROBE_TIMEOUT : SOCKET_TIMEOUT_INTERVAL_SECS;
+        wait_time.tv_usec = 0;
+        if ( !eee->threaded )
+        {
+            /* and when the egress scheduler may send again */
+            uint64_t wait_us = edge_sched_wait_us( eee, wait_time.tv_sec * 1000000 );
 
-        wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+            wait_time.tv_sec = wait_us / 1000000;
+            wait_time.tv_usec = wait_us % 1000000;
+        }
 
         rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
         nowTime=time(NULL);
@@ -2783,14 +6209,16 @@ static int run_loop(n2n_edge_t * eee )
         {
             lastTransop = nowTime;
 
+            edge_lock_transops( eee, 1 );
             n2n_tick_transop( eee, nowTime );
+            edge_unlock_transops( eee );
         }
 
         if(rc > 0)
         {
             /* Any or all of the FDs could have input; check them all. */
 
-            if(FD_ISSET(eee->udp_sock, &socket_mask))
+            if( !eee->threaded && FD_ISSET(eee->udp_sock, &socket_mask))
             {
                 /* Read a cooked socket from the internet socket. Writes on the TAP
                  * socket. */
@@ -2801,37 +6229,58 @@ static int run_loop(n2n_edge_t * eee )
             {
                 /* Read a cooked socket from the internet socket. Writes on the TAP
                  * socket. */
+                edge_lock_peers( eee );
                 readFromMgmtSocket(eee, &keep_running);
+                edge_unlock_peers( eee );
             }
 
 #ifndef WIN32
-            if(FD_ISSET(eee->device.fd, &socket_mask))
+            if( !eee->threaded && FD_ISSET(eee->device.fd, &socket_mask))
             {
                 /* Read an ethernet frame from the TAP socket. Write on the IP
                  * socket. */
-                readFromTAPSocket(eee);
+                readFromTAPSocket(eee, NULL);
             }
 #endif
         }
 
+        if ( !eee->threaded && eee->sched )
+        {
+            edge_sched_run( eee );
+        }
+
         /* Finished processing select data. */
 
 
+        edge_lock_peers( eee );
+
         update_supernode_reg(eee, nowTime);
 
+        if ( nowTime != lastPmtuCheck )
+        {
+            pmtu_searches = edge_pmtu_tick( eee, nowTime );
+            edge_peer_probe_tick( eee, nowTime );
+            lastPmtuCheck = nowTime;
+        }
+
         numPurged = 0;
         if ((nowTime - eee->last_purge) >= PURGE_REGISTRATION_FREQUENCY) {
-            numPurged += hashed_purge_expired_registrations(eee->known_peers);
-            numPurged += hashed_purge_expired_registrations(eee->pending_peers);
+            numPurged = purge_peers( eee, nowTime );
+            purge_neigh( eee, nowTime - EDGE_NEIGH_TTL );
             eee->last_purge = nowTime;
         }
         if ( numPurged > 0 )
         {
+            size_t operational;
+            size_t pending;
+
+            count_peers( eee, &operational, &pending );
             traceEvent( TRACE_NORMAL, "Peer removed: pending=%u, operational=%u",
-                        (unsigned int)hashed_peer_list_t_size( eee->pending_peers ), 
-                        (unsigned int)hashed_peer_list_t_size( eee->known_peers ) );
+                        (unsigned int)pending, (unsigned int)operational );
         }
 
+        edge_unlock_peers( eee );
+
         if ( eee->dyn_ip_mode && 
              (( nowTime - lastIfaceCheck ) > IFACE_UPDATE_INTERVAL ) )
         {
@@ -2843,26 +6292,42 @@ static int run_loop(n2n_edge_t * eee )
 		lastStatCalcDiff = nowTime - lastStatCalc;
 		if(lastStatCalcDiff > STAT_CALC_INTERVAL) {
 			// traceEvent(TRACE_NORMAL, "recalc bps.");
-			eee->tx_bps_p2p = eee->tx_bit_p2p / (size_t)lastStatCalcDiff;
-			eee->tx_bit_p2p = 0;
-			eee->tx_bps_sup = eee->tx_bit_sup / (size_t)lastStatCalcDiff;
-			eee->tx_bit_sup = 0;
-			eee->rx_bps_p2p = eee->rx_bit_p2p / (size_t)lastStatCalcDiff;
-			eee->rx_bit_p2p = 0;
-			eee->rx_bps_sup = eee->rx_bit_sup / (size_t)lastStatCalcDiff;
-			eee->rx_bit_sup = 0;
+			size_t q, tx_bit_p2p, tx_bit_sup;
+
+			tx_bit_p2p = edge_stat_take( eee->tx_bit_p2p );
+			tx_bit_sup = edge_stat_take( eee->tx_bit_sup );
+			for ( q=0; q < eee->num_txq; ++q ) {
+				tx_bit_p2p += edge_stat_take( eee->txq[q].tx_bit_p2p );
+				tx_bit_sup += edge_stat_take( eee->txq[q].tx_bit_sup );
+			}
+
+			eee->tx_bps_p2p = tx_bit_p2p / (size_t)lastStatCalcDiff;
+			eee->tx_bps_sup = tx_bit_sup / (size_t)lastStatCalcDiff;
+			eee->rx_bps_p2p = edge_stat_take( eee->rx_bit_p2p ) / (size_t)lastStatCalcDiff;
+			eee->rx_bps_sup = edge_stat_take( eee->rx_bit_sup ) / (size_t)lastStatCalcDiff;
 			lastStatCalc = nowTime;
 		}
 
     } /* while */
 
+#ifndef WIN32
+    if ( eee->threaded )
+    {
+        edge_join_threads( eee, eee->num_txq, (0 == eee->num_txq), 1 );
+        eee->threaded = 0;
+    }
+#endif
+
     send_deregister( eee, &(eee->supernode));
 
+    edge_gro_flush( eee );
     closesocket(eee->udp_sock);
     tuntap_close(&(eee->device));
 
     edge_deinit( eee );
 
+    traceEventStopAsync();
+
     return(0);
 }
 
@@ -99,63 +99,270 @@ int traceLevel = 2 /* NORMAL */;
 int useSyslog = 0, syslog_opened = 0;
 
 #define N2N_TRACE_DATESIZE 32
-void traceEvent(int eventTraceLevel, char* file, int line, char * format, ...) {
+#define N2N_TRACE_MSGSIZE  640
+
+/** Write one formatted trace line to syslog or stdout. Does not flush stdout. */
+static void trace_write(int eventTraceLevel, const char* file, int line,
+                        time_t theTime, char * buf) {
+  char out_buf[N2N_TRACE_MSGSIZE+64];
+  char theDate[N2N_TRACE_DATESIZE];
+  char *extra_msg = "";
+  size_t len;
+#ifdef WIN32
+  int i;
+#endif
+
+  strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&theTime));
+
+  if(eventTraceLevel == 0 /* TRACE_ERROR */)
+    extra_msg = "ERROR: ";
+  else if(eventTraceLevel == 1 /* TRACE_WARNING */)
+    extra_msg = "WARNING: ";
+
+  len = strlen(buf);
+  while((len > 0) && (buf[len-1] == '\n')) buf[--len] = '\0';
+
+#ifndef WIN32
+  if(useSyslog) {
+    if(!syslog_opened) {
+      openlog("n2n", LOG_PID, LOG_DAEMON);
+      syslog_opened = 1;
+    }
+
+    snprintf(out_buf, sizeof(out_buf), "%s%s", extra_msg, buf);
+    syslog(LOG_INFO, "%s", out_buf);
+  } else {
+    snprintf(out_buf, sizeof(out_buf), "%s [%11s:%4d] %s%s", theDate, file, line, extra_msg, buf);
+    printf("%s\n", out_buf);
+  }
+#else
+  /* this is the WIN32 code */
+  OutputDebugStringA(buf);
+  for(i=strlen(file)-1; i>0; i--) if(file[i] == '\\') { i++; break; };
+  snprintf(out_buf, sizeof(out_buf), "%s [%11s:%4d] %s%s", theDate, &file[i], line, extra_msg, buf);
+  printf("%s\n", out_buf);
+#endif
+}
+
+#if !defined(WIN32) && defined(__GNUC__)
+#define N2N_HAVE_ASYNC_TRACE 1
+#endif
+
+#if defined(N2N_HAVE_ASYNC_TRACE)
+
+/* Asynchronous trace sink.
+ *
+ * Each thread that traces gets a single-producer/single-consumer ring of
+ * pre-formatted messages. The producer only formats the message text and
+ * publishes the slot; time formatting, syslog/printf and fflush happen in a
+ * background writer thread which drains all rings. When a ring is full the
+ * message is dropped and counted rather than blocking the packet path. */
+
+#define N2N_TRACE_RING_SLOTS   256      /* power of two */
+#define N2N_TRACE_IDLE_USEC    10000    /* writer sleep when all rings are empty */
+
+struct n2n_trace_msg {
+  time_t        when;
+  int           level;
+  const char *  file;
+  int           line;
+  char          text[N2N_TRACE_MSGSIZE];
+};
+
+struct n2n_trace_ring {
+  struct n2n_trace_ring * next;         /* all rings, never unlinked */
+  int                     in_use;       /* owned by a live thread */
+  uint32_t                head;         /* written by producer */
+  uint32_t                tail;         /* written by writer */
+  uint32_t                dropped;
+  struct n2n_trace_msg    slot[N2N_TRACE_RING_SLOTS];
+};
+
+static struct n2n_trace_ring * trace_rings = NULL;
+static pthread_key_t           trace_ring_key;
+static pthread_t               trace_writer;
+static int                     trace_async = 0;
+static volatile int            trace_writer_stop = 0;
+
+/* Thread exit: the ring becomes available to the next thread that traces. The
+ * writer still drains whatever is left in it. */
+static void trace_ring_release(void * arg) {
+  struct n2n_trace_ring * ring = (struct n2n_trace_ring *)arg;
+
+  __atomic_store_n(&(ring->in_use), 0, __ATOMIC_RELEASE);
+}
+
+static struct n2n_trace_ring * trace_ring_get(void) {
+  struct n2n_trace_ring * ring = (struct n2n_trace_ring *)pthread_getspecific(trace_ring_key);
+
+  if(ring) return(ring);
+
+  /* Reuse a ring released by a dead thread. */
+  for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    int expected = 0;
+
+    if(__atomic_compare_exchange_n(&(ring->in_use), &expected, 1, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if(NULL == ring) {
+    ring = (struct n2n_trace_ring *)calloc(1, sizeof(struct n2n_trace_ring));
+    if(NULL == ring) return(NULL);
+
+    ring->in_use = 1;
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&trace_rings, &(ring->next), ring, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ; /* ring->next was refreshed by the failed exchange */
+  }
+
+  pthread_setspecific(trace_ring_key, ring);
+  return(ring);
+}
+
+/** Drain every ring once. @return number of messages written. */
+static size_t trace_drain(void) {
+  struct n2n_trace_ring * ring;
+  size_t written = 0;
+
+  for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    uint32_t dropped;
+
+    while(tail != head) {
+      struct n2n_trace_msg * msg = &(ring->slot[tail & (N2N_TRACE_RING_SLOTS-1)]);
+
+      trace_write(msg->level, msg->file, msg->line, msg->when, msg->text);
+      ++tail;
+      ++written;
+    }
+
+    __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_exchange_n(&(ring->dropped), 0, __ATOMIC_RELAXED);
+    if(dropped > 0) {
+      char buf[64];
+
+      snprintf(buf, sizeof(buf), "%u trace messages dropped", (unsigned int)dropped);
+      trace_write(1 /* TRACE_WARNING */, __FILE__, __LINE__, time(NULL), buf);
+      ++written;
+    }
+  }
+
+  if(written > 0) fflush(stdout);
+
+  return(written);
+}
+
+static void * trace_writer_thread(void * arg) {
+  while(!trace_writer_stop) {
+    if(0 == trace_drain())
+      usleep(N2N_TRACE_IDLE_USEC);
+  }
+
+  trace_drain();
+  return(NULL);
+}
+
+/** Start the background trace writer. Call after daemon() as threads do not
+ *  survive fork, and once startup has succeeded so that configuration errors
+ *  are written at once. Until then (or on failure) traceEvent writes
+ *  synchronously. The writer is stopped and drained at exit() or when main()
+ *  returns, whichever path the process takes.
+ *
+ *  @return 0 on success, -1 on error.
+ */
+int traceEventStartAsync(void) {
+  static int stop_at_exit = 0;
+
+  if(trace_async) return(0);
+
+  if(!stop_at_exit) {
+    if(0 != atexit(traceEventStopAsync))
+      return(-1);
+    stop_at_exit = 1;
+  }
+
+  if(0 != pthread_key_create(&trace_ring_key, trace_ring_release))
+    return(-1);
+
+  trace_writer_stop = 0;
+  if(0 != pthread_create(&trace_writer, NULL, trace_writer_thread, NULL)) {
+    pthread_key_delete(trace_ring_key);
+    return(-1);
+  }
+
+  __atomic_store_n(&trace_async, 1, __ATOMIC_RELEASE);
+  return(0);
+}
+
+/** Stop the background writer after writing out all queued messages. Later
+ *  messages are written synchronously. */
+void traceEventStopAsync(void) {
+  if(!trace_async) return;
+
+  __atomic_store_n(&trace_async, 0, __ATOMIC_RELEASE);
+  trace_writer_stop = 1;
+  pthread_join(trace_writer, NULL);
+}
+
+#else /* #if defined(N2N_HAVE_ASYNC_TRACE) */
+
+int traceEventStartAsync(void) {
+  return(-1); /* not supported; traceEvent stays synchronous */
+}
+
+void traceEventStopAsync(void) {
+}
+
+#endif /* #if defined(N2N_HAVE_ASYNC_TRACE) */
+
+/* Called through the traceEvent() macro which has already checked the level. */
+void _traceEvent(int eventTraceLevel, char* file, int line, char * format, ...) {
   va_list va_ap;
 
   if(eventTraceLevel <= traceLevel) {
-    char buf[2048];
-    char out_buf[640];
-    char theDate[N2N_TRACE_DATESIZE];
-    char *extra_msg = "";
-    time_t theTime = time(NULL);
-#ifdef WIN32
-	int i;
-#endif
+    char buf[N2N_TRACE_MSGSIZE];
 
-    /* We have two paths - one if we're logging, one if we aren't
-     *   Note that the no-log case is those systems which don't support it (WIN32),
-     *                                those without the headers !defined(USE_SYSLOG)
-     *                                those where it's parametrically off...
-     */
+#if defined(N2N_HAVE_ASYNC_TRACE)
+    if(__atomic_load_n(&trace_async, __ATOMIC_ACQUIRE)) {
+      struct n2n_trace_ring * ring = trace_ring_get();
 
-    memset(buf, 0, sizeof(buf));
-    strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&theTime));
+      if(ring) {
+        uint32_t head = ring->head;
+        uint32_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        struct n2n_trace_msg * msg;
 
-    va_start (va_ap, format);
-    vsnprintf(buf, sizeof(buf)-1, format, va_ap);
-    va_end(va_ap);
+        if((head - tail) >= N2N_TRACE_RING_SLOTS) {
+          __atomic_add_fetch(&(ring->dropped), 1, __ATOMIC_RELAXED);
+          return;
+        }
 
-    if(eventTraceLevel == 0 /* TRACE_ERROR */)
-      extra_msg = "ERROR: ";
-    else if(eventTraceLevel == 1 /* TRACE_WARNING */)
-      extra_msg = "WARNING: ";
+        msg = &(ring->slot[head & (N2N_TRACE_RING_SLOTS-1)]);
+        msg->when = time(NULL);
+        msg->level = eventTraceLevel;
+        msg->file = file;
+        msg->line = line;
 
-    while(buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1] = '\0';
+        va_start (va_ap, format);
+        vsnprintf(msg->text, sizeof(msg->text), format, va_ap);
+        va_end(va_ap);
 
-#ifndef WIN32
-    if(useSyslog) {
-      if(!syslog_opened) {
-        openlog("n2n", LOG_PID, LOG_DAEMON);
-        syslog_opened = 1;
+        __atomic_store_n(&(ring->head), head+1, __ATOMIC_RELEASE);
+        return;
       }
-
-      snprintf(out_buf, sizeof(out_buf), "%s%s", extra_msg, buf);
-      syslog(LOG_INFO, "%s", out_buf);
-    } else {
-      snprintf(out_buf, sizeof(out_buf), "%s [%11s:%4d] %s%s", theDate, file, line, extra_msg, buf);
-      printf("%s\n", out_buf);
-      fflush(stdout);
     }
-#else
-    /* this is the WIN32 code */
-    OutputDebugStringA(buf);
-	for(i=strlen(file)-1; i>0; i--) if(file[i] == '\\') { i++; break; };
-    snprintf(out_buf, sizeof(out_buf), "%s [%11s:%4d] %s%s", theDate, &file[i], line, extra_msg, buf);
-    printf("%s\n", out_buf);
+#endif /* #if defined(N2N_HAVE_ASYNC_TRACE) */
+
+    va_start (va_ap, format);
+    vsnprintf(buf, sizeof(buf), format, va_ap);
+    va_end(va_ap);
+
+    trace_write(eventTraceLevel, file, line, time(NULL), buf);
     fflush(stdout);
-#endif
   }
-
 }
 
 /* *********************************************** */
@@ -334,7 +541,6 @@ size_t purge_with_function(struct peer_info ** peer_list, size_t(*purger)(struct
 
 void dealloc_peer( peer_info_t* peer )
 {
-    free(peer->sockets);
     free(peer);
 }
 
@@ -40,6 +40,10 @@
 #define _DARWIN_
 #endif
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* sendmmsg(), recvmmsg() */
+#endif
+
 
 /* Some capability defaults which can be reset for particular platforms. */
 #define N2N_HAVE_DAEMON 1
@@ -80,6 +84,14 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #define N2N_CAN_NAME_IFACE 1
+#if defined(IFF_MULTI_QUEUE)
+#define N2N_HAVE_TAP_MULTI_QUEUE 1
+#endif
+#if defined(IFF_VNET_HDR) && defined(TUNSETOFFLOAD)
+#define N2N_HAVE_TAP_VNET_HDR 1
+#endif
+#define N2N_HAVE_SENDMMSG 1
+#define N2N_HAVE_RECVMMSG 1
 #endif /* #ifdef __linux__ */
 
 #ifdef __FreeBSD__
@@ -127,9 +139,11 @@ typedef struct ether_hdr ether_hdr_t;
 #include "sglib.h"
 
 #include "n2n_wire.h"
+#include "n2n_offload.h"
 
 /* N2N_IFNAMSIZ is needed on win32 even if dev_name is not used after declaration */
 #define N2N_IFNAMSIZ            16 /* 15 chars * NULL */
+#define N2N_TUNTAP_MAX_QUEUES   16
 #ifndef WIN32
 typedef struct tuntap_dev {
   int           fd;
@@ -137,6 +151,9 @@ typedef struct tuntap_dev {
   uint32_t      ip_addr, device_mask;
   uint16_t      mtu;
   char          dev_name[N2N_IFNAMSIZ];
+  int           num_queues;                         /* set >1 before tuntap_open() for a multi-queue device */
+  int           queue_fd[N2N_TUNTAP_MAX_QUEUES];    /* queue_fd[0] == fd */
+  int           vnet_hdr;                           /* set before tuntap_open() for virtio-net headers and offloads */
 } tuntap_dev;
 
 #define SOCKET int
@@ -155,6 +172,7 @@ typedef struct tuntap_dev {
 #define MSG_TYPE_FEDERATION             8
 #define MSG_TYPE_PEER_INFO              9
 #define MSG_TYPE_QUERY_PEER            10
+#define MSG_TYPE_FEC                   11
 
 /* Set N2N_COMPRESSION_ENABLED to 0 to disable lzo1x compression of ethernet
  * frames. Doing this will break compatibility with the standard n2n packet
@@ -181,16 +199,78 @@ typedef char ipstr_t[32];
 #define N2N_MACSTR_SIZE 32
 typedef char macstr_t[N2N_MACSTR_SIZE];
 
+#define N2N_PEER_MAX_SOCKETS    2       /* public and local, as in PEER_INFO */
+#define N2N_NAT_PORTS           4       /* external ports of an edge kept by the supernode */
+
+/** Where an edge is with another edge. */
+typedef enum n2n_peer_state
+{
+    N2N_PEER_QUERYING = 0,      /**< Asked the supernode for its sockets. */
+    N2N_PEER_PUNCHING,          /**< Sending REGISTERs to its sockets. */
+    N2N_PEER_OPERATIONAL,       /**< Acknowledged a REGISTER; frames go direct. */
+    N2N_PEER_STALE              /**< Idle; kept until purged or heard from again. */
+} n2n_peer_state_t;
+
+/** Path MTU discovery of one path from an edge (edge only).
+ *
+ *  A search sends padded probes from the largest candidate size down until
+ *  one is acknowledged. mtu keeps its value while searching. */
+typedef struct n2n_pmtu
+{
+    uint16_t            mtu;            /**< Largest IP datagram known to get through, 0 if unknown. */
+    uint16_t            probe;          /**< Size being probed, 0 when not searching. */
+    n2n_cookie_t        cookie;         /**< Of the outstanding probe. */
+    uint8_t             tries;          /**< Probes sent of this size. */
+    time_t              sent;           /**< When the last probe was sent. */
+    time_t              next;           /**< When the next search is due. */
+} n2n_pmtu_t;
+
+/** RTT and loss of one of a peer's sockets, measured with REGISTERs whose
+ *  cookies come back in REGISTER_ACKs (edge only). */
+typedef struct n2n_peer_path
+{
+    n2n_cookie_t        cookie;         /**< Of the outstanding probe. */
+    uint64_t            sent_us;        /**< When it was sent, 0 once answered. */
+    uint32_t            srtt_us;        /**< Smoothed RTT, 0 until measured. */
+    uint32_t            rtt_us;         /**< Last RTT sample. */
+    size_t              lost;           /**< Probes in a row left unanswered. */
+} n2n_peer_path_t;
+
 struct peer_info {
     struct peer_info *  next;
     n2n_community_t     community_name;
     n2n_mac_t           mac_addr;
     n2n_sock_t          sock;
     int                 num_sockets;
-    n2n_sock_t *        sockets;
+    n2n_sock_t          sockets[N2N_PEER_MAX_SOCKETS];
     time_t              last_seen;
     time_t              last_sent_query;
     size_t              timeout;
+    /* edge only */
+    n2n_peer_state_t    state;
+    time_t              last_sent_register;
+    time_t              state_since;    /* when state was entered */
+    size_t              num_queries;    /* QUERY_PEERs sent since the last state change */
+    size_t              num_registers;  /* REGISTERs sent since the last state change */
+    n2n_pmtu_t          pmtu;           /* of the path to sock */
+    n2n_peer_path_t     paths[N2N_PEER_MAX_SOCKETS]; /* probes of sockets */
+    int                 sock_idx;       /* the entry of sockets used as sock */
+    time_t              last_probe;     /* last round of probes to sockets */
+    uint16_t            pred_port;      /* first predicted port of sockets[0], if pred_count */
+    uint8_t             pred_count;     /* predicted ports to punch after sockets */
+    time_t              path_since;     /* when frames to the peer last changed socket or went to/from relay */
+    uint64_t            tx_p2p;         /* PACKETs sent to sock */
+    uint64_t            tx_sup;         /* PACKETs sent via the supernode */
+    uint64_t            tx_bytes;
+    uint64_t            rx_p2p;         /* PACKETs received from the peer */
+    uint64_t            rx_sup;         /* PACKETs from the peer relayed by the supernode */
+    uint64_t            rx_bytes;
+    uint64_t            rx_fail;        /* PACKETs that did not decode */
+    uint16_t            fec_loss;       /* per mille of our FEC covered PACKETs the peer reported lost */
+    uint64_t            relay_tx_bytes; /* supernode: bytes relayed to this edge */
+    uint64_t            relay_rx_bytes; /* supernode: bytes relayed from this edge */
+    uint16_t            nat_ports[N2N_NAT_PORTS]; /* supernode: distinct external ports seen, newest first */
+    uint8_t             num_nat_ports;
 };
 typedef struct peer_info peer_info_t;
 
@@ -226,6 +306,25 @@ typedef struct n2n_edge         n2n_edge_t;
 #define TRACE_INFO      3, __FILE__, __LINE__
 #define TRACE_DEBUG     4, __FILE__, __LINE__
 
+/* Most verbose trace level compiled into the binaries. Messages above it
+ * vanish at compile time; eg. -DN2N_TRACE_COMPILE_LEVEL=2 leaves no INFO or
+ * DEBUG tracing in the packet paths. */
+#ifndef N2N_TRACE_COMPILE_LEVEL
+#define N2N_TRACE_COMPILE_LEVEL 4
+#endif
+
+/* traceEvent() checks the level at the call site so that the arguments (often
+ * macaddr_str() and sock_to_cstr() calls) are only evaluated for messages that
+ * will be written. The extra expansion step splits TRACE_xxx into its three
+ * arguments. */
+#define N2N_TRACE_EXPAND(x) x
+#define N2N_TRACE_CHECKED(lvl, file, line, ...)                         \
+    do {                                                                \
+        if( ((lvl) <= N2N_TRACE_COMPILE_LEVEL) && ((lvl) <= traceLevel) ) \
+            _traceEvent((lvl), (file), (line), __VA_ARGS__);            \
+    } while(0)
+#define traceEvent(...) N2N_TRACE_EXPAND(N2N_TRACE_CHECKED(__VA_ARGS__))
+
 /* ************************************** */
 
 #define SUPERNODE_IP    "127.0.0.1"
@@ -251,13 +350,25 @@ extern const uint8_t broadcast_addr[6];
 extern const uint8_t multicast_addr[6];
 
 /* Functions */
-extern void traceEvent(int eventTraceLevel, char* file, int line, char * format, ...);
+extern void _traceEvent(int eventTraceLevel, char* file, int line, char * format, ...);
+extern int  traceEventStartAsync(void);
+extern void traceEventStopAsync(void);
 extern int  tuntap_open(tuntap_dev *device, char *dev, const char *address_mode, char *device_ip, 
 			char *device_mask, const char * device_mac, int mtu);
 extern int  tuntap_read(struct tuntap_dev *tuntap, unsigned char *buf, int len);
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+extern int  tuntap_read_queue(struct tuntap_dev *tuntap, int queue, unsigned char *buf, int len);
+#endif
 extern int  tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len);
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+extern int  tuntap_write_vnet(struct tuntap_dev *tuntap, const n2n_vnet_hdr_t *hdr, unsigned char *buf, int len);
+#endif
 extern void tuntap_close(struct tuntap_dev *tuntap);
 extern void tuntap_get_address(struct tuntap_dev *tuntap);
+#ifndef WIN32
+extern int  tuntap_loop_open(tuntap_dev *device, const char *path, const char *address_mode, char *device_ip,
+                             char *device_mask, const char * device_mac, int mtu);
+#endif
 
 extern SOCKET open_socket(int local_port, int bind_any);
 
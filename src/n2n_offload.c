@@ -0,0 +1,929 @@
+/* (c) 2026 n2n contributors - see n2n_offload.h */
+
+/** TAP offload helpers. See n2n_offload.h.
+ *
+ *  Only untagged ethernet frames carrying TCP over IPv4 (without fragments) or
+ *  IPv6 (without extension headers) are segmented or coalesced. Anything else
+ *  is passed through unchanged.
+ */
+
+#include "n2n_offload.h"
+#include <string.h>
+
+#define ETH_HDR_LEN             14
+#define ETHTYPE_IPV4            0x0800
+#define ETHTYPE_IPV6            0x86DD
+#define ETHTYPE_ARP             0x0806
+#define IPPROTO_ICMP_           1
+#define IPPROTO_TCP_            6
+#define IPPROTO_ICMPV6_         58
+#define IPV6_HDR_LEN            40
+#define IPV6_MIN_MTU            1280
+
+#define ARP_LEN                 28      /* ethernet/IPv4 ARP body */
+#define ARP_OP_REQUEST          1
+#define ARP_OP_REPLY            2
+#define ND_NS                   135
+#define ND_NA                   136
+#define ND_LEN                  24      /* NS/NA without options */
+#define ND_OPT_SLLA             1
+#define ND_OPT_TLLA             2
+#define ND_NA_SOLICITED         0x40
+#define ND_NA_OVERRIDE          0x20
+
+#define IP4_DF                  0x4000
+#define IP4_MF                  0x2000
+#define IP4_OFFMASK             0x1fff
+#define ICMP_QUOTE_MAX          548     /* RFC 1812: error at most 576 bytes */
+
+#define TCP_FIN                 0x01
+#define TCP_SYN                 0x02
+#define TCP_RST                 0x04
+#define TCP_PSH                 0x08
+#define TCP_ACK                 0x10
+#define TCP_URG                 0x20
+#define TCP_ECE                 0x40
+#define TCP_CWR                 0x80
+
+#define TCP_SEQ_OFF             4
+#define TCP_FLAGS_OFF           13
+#define TCP_CSUM_OFF            16
+
+#define TCP_OPT_EOL             0
+#define TCP_OPT_NOP             1
+#define TCP_OPT_MSS             2
+
+
+static uint16_t get16( const uint8_t * p )
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put16( uint8_t * p, uint16_t v )
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static uint32_t get32( const uint8_t * p )
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32( uint8_t * p, uint32_t v )
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/** Add len bytes to a ones-complement sum. Odd lengths are only allowed on
+ *  the last call for a given sum. */
+static uint64_t csum_add( uint64_t sum, const uint8_t * p, size_t len )
+{
+    while ( len > 1 )
+    {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+
+    if ( len )
+    {
+        sum += p[0] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t csum_fold( uint64_t sum )
+{
+    while ( sum >> 16 )
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return (uint16_t)sum;
+}
+
+/** Sum of the TCP pseudo header for a TCP segment of tcp_len bytes. */
+static uint64_t csum_pseudo( const uint8_t * frame, size_t l3_off, int ipv6, size_t tcp_len )
+{
+    uint64_t sum;
+
+    if ( ipv6 )
+    {
+        sum = csum_add( 0, frame + l3_off + 8, 32 );   /* src and dst */
+    }
+    else
+    {
+        sum = csum_add( 0, frame + l3_off + 12, 8 );   /* src and dst */
+    }
+
+    return sum + IPPROTO_TCP_ + (tcp_len & 0xffff) + (tcp_len >> 16);
+}
+
+/** Locate the IP and TCP headers of a frame.
+ *
+ *  @return 0 if the frame is TCP over IPv4 or IPv6, -1 otherwise.
+ */
+static int parse_tcp( const uint8_t * frame, size_t len,
+                      size_t * l3_off, size_t * l4_off, size_t * hdr_len, int * ipv6 )
+{
+    size_t l4;
+    size_t thl;
+
+    if ( len < ETH_HDR_LEN + 20 )
+    {
+        return -1;
+    }
+
+    switch ( get16( frame + 12 ) )
+    {
+    case ETHTYPE_IPV4:
+        if ( ((frame[ETH_HDR_LEN] >> 4) != 4) || (frame[ETH_HDR_LEN + 9] != IPPROTO_TCP_) )
+        {
+            return -1;
+        }
+        l4 = ETH_HDR_LEN + (frame[ETH_HDR_LEN] & 0x0f) * 4;
+        *ipv6 = 0;
+        break;
+    case ETHTYPE_IPV6:
+        if ( (len < ETH_HDR_LEN + IPV6_HDR_LEN) || ((frame[ETH_HDR_LEN] >> 4) != 6)
+             || (frame[ETH_HDR_LEN + 6] != IPPROTO_TCP_) )
+        {
+            return -1;
+        }
+        l4 = ETH_HDR_LEN + IPV6_HDR_LEN;
+        *ipv6 = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    if ( (l4 < ETH_HDR_LEN + 20) || (l4 + 20 > len) )
+    {
+        return -1;
+    }
+
+    thl = (frame[l4 + 12] >> 4) * 4;
+    if ( (thl < 20) || (l4 + thl > len) )
+    {
+        return -1;
+    }
+
+    *l3_off = ETH_HDR_LEN;
+    *l4_off = l4;
+    *hdr_len = l4 + thl;
+    return 0;
+}
+
+/** Fill in the IPv4 header checksum. */
+static void ipv4_set_csum( uint8_t * ip )
+{
+    size_t ihl = (ip[0] & 0x0f) * 4;
+
+    put16( ip + 10, 0 );
+    put16( ip + 10, (uint16_t)~csum_fold( csum_add( 0, ip, ihl ) ) );
+}
+
+/** Fill in the full TCP checksum of a frame whose headers have been parsed. */
+static void tcp_set_csum( uint8_t * frame, size_t len, size_t l3_off, size_t l4_off, int ipv6 )
+{
+    uint64_t sum;
+
+    put16( frame + l4_off + TCP_CSUM_OFF, 0 );
+    sum = csum_pseudo( frame, l3_off, ipv6, len - l4_off );
+    sum = csum_add( sum, frame + l4_off, len - l4_off );
+    put16( frame + l4_off + TCP_CSUM_OFF, (uint16_t)~csum_fold( sum ) );
+}
+
+
+/** Complete the partial checksum of a frame flagged N2N_VNET_F_NEEDS_CSUM.
+ *  The checksum field already holds the pseudo header sum.
+ *
+ *  @return 0 on success, -1 if the offsets are outside the frame.
+ */
+int n2n_offload_csum( uint8_t * frame, size_t len, const n2n_vnet_hdr_t * hdr )
+{
+    size_t start = hdr->csum_start;
+    size_t field = start + hdr->csum_offset;
+    uint16_t csum;
+
+    if ( (start >= len) || (field + 2 > len) )
+    {
+        return -1;
+    }
+
+    csum = ~csum_fold( csum_add( 0, frame + start, len - start ) );
+    if ( (0 == csum) && (6 == hdr->csum_offset) )
+    {
+        csum = 0xffff; /* UDP: zero means no checksum */
+    }
+
+    put16( frame + field, csum );
+    return 0;
+}
+
+
+/** Cut a TCP GSO frame into segments of hdr->gso_size payload bytes.
+ *
+ *  Each segment is built in segbuf with its own IP length, IPv4 ID, TCP
+ *  sequence number and full checksums, then handed to emit. FIN and PSH are
+ *  only kept on the last segment, CWR only on the first.
+ *
+ *  @return number of segments emitted or -1 if the frame cannot be segmented.
+ */
+int n2n_gso_segment( const n2n_vnet_hdr_t * hdr,
+                     const uint8_t * frame, size_t len,
+                     uint8_t * segbuf, size_t segbuf_size,
+                     n2n_gso_emit_t emit, void * ctx )
+{
+    size_t l3_off, l4_off, hdr_len;
+    size_t payload, off;
+    size_t seg = hdr->gso_size;
+    uint32_t seq;
+    uint16_t ip_id = 0;
+    int ipv6;
+    int n = 0;
+
+    if ( (0 == seg) || (0 != parse_tcp( frame, len, &l3_off, &l4_off, &hdr_len, &ipv6 )) )
+    {
+        return -1;
+    }
+
+    payload = len - hdr_len;
+    seq = get32( frame + l4_off + TCP_SEQ_OFF );
+    if ( !ipv6 )
+    {
+        ip_id = get16( frame + l3_off + 4 );
+    }
+
+    for ( off=0; (off < payload) || (0 == n); off += seg, ++n )
+    {
+        size_t chunk = ((payload - off) < seg) ? (payload - off) : seg;
+        size_t seglen = hdr_len + chunk;
+        uint8_t * flags = segbuf + l4_off + TCP_FLAGS_OFF;
+
+        if ( seglen > segbuf_size )
+        {
+            return -1;
+        }
+
+        memcpy( segbuf, frame, hdr_len );
+        memcpy( segbuf + hdr_len, frame + hdr_len + off, chunk );
+
+        if ( ipv6 )
+        {
+            put16( segbuf + l3_off + 4, (uint16_t)(seglen - l3_off - IPV6_HDR_LEN) );
+        }
+        else
+        {
+            put16( segbuf + l3_off + 2, (uint16_t)(seglen - l3_off) );
+            put16( segbuf + l3_off + 4, (uint16_t)(ip_id + n) );
+            ipv4_set_csum( segbuf + l3_off );
+        }
+
+        put32( segbuf + l4_off + TCP_SEQ_OFF, seq + (uint32_t)off );
+        if ( off + chunk < payload )
+        {
+            *flags &= ~(TCP_FIN | TCP_PSH);
+        }
+        if ( n > 0 )
+        {
+            *flags &= ~TCP_CWR;
+        }
+
+        tcp_set_csum( segbuf, seglen, l3_off, l4_off, ipv6 );
+        emit( ctx, segbuf, seglen );
+    }
+
+    return n;
+}
+
+
+void n2n_gro_init( n2n_gro_t * gro )
+{
+    gro->len = 0;
+    gro->segs = 0;
+    gro->closed = 0;
+}
+
+/** Compare the headers of a new segment to the held frame, ignoring the
+ *  fields which legitimately differ between segments of one burst. */
+static int gro_same_flow( const n2n_gro_t * gro, const uint8_t * frame )
+{
+    const uint8_t * held = gro->frame;
+    size_t l3 = gro->l3_off;
+    size_t l4 = gro->l4_off;
+
+    if ( 0 != memcmp( held, frame, l3 ) )
+    {
+        return 0; /* ethernet header */
+    }
+
+    if ( gro->ipv6 )
+    {
+        /* Everything but payload length. */
+        if ( (0 != memcmp( held + l3, frame + l3, 4 ))
+             || (0 != memcmp( held + l3 + 6, frame + l3 + 6, IPV6_HDR_LEN - 6 )) )
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        /* Version, TOS; flags, TTL, protocol; addresses. Not length, ID or
+         * checksum. */
+        if ( (0 != memcmp( held + l3, frame + l3, 2 ))
+             || (0 != memcmp( held + l3 + 6, frame + l3 + 6, 4 ))
+             || (0 != memcmp( held + l3 + 12, frame + l3 + 12, 8 )) )
+        {
+            return 0;
+        }
+    }
+
+    /* Ports; ack, offset; window; urgent pointer and options. Not sequence,
+     * flags (checked by the caller) or checksum. */
+    if ( (0 != memcmp( held + l4, frame + l4, 4 ))
+         || (0 != memcmp( held + l4 + 8, frame + l4 + 8, 5 ))
+         || (0 != memcmp( held + l4 + 14, frame + l4 + 14, 2 ))
+         || (0 != memcmp( held + l4 + 18, frame + l4 + 18, gro->hdr_len - l4 - 18 )) )
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/** Offer a received frame for coalescing.
+ *
+ *  @return  1 if the frame was taken into gro,
+ *           0 if it cannot be coalesced; flush gro and write it as it is,
+ *          -1 if it does not continue the held frame; flush gro and offer the
+ *             frame again.
+ */
+int n2n_gro_receive( n2n_gro_t * gro, const uint8_t * frame, size_t len )
+{
+    size_t l3_off, l4_off, hdr_len;
+    size_t payload;
+    uint32_t seq;
+    uint8_t flags;
+    int ipv6;
+
+    if ( 0 != parse_tcp( frame, len, &l3_off, &l4_off, &hdr_len, &ipv6 ) )
+    {
+        return 0;
+    }
+
+    if ( !ipv6 )
+    {
+        if ( ((frame[l3_off] & 0x0f) != 5)                      /* options */
+             || ((get16( frame + l3_off + 6 ) & 0x3fff) != 0)   /* MF or offset */
+             || (get16( frame + l3_off + 2 ) != len - l3_off)
+             || (0xffff != csum_fold( csum_add( 0, frame + l3_off, 20 ) )) )
+        {
+            return 0;
+        }
+    }
+    else if ( get16( frame + l3_off + 4 ) != len - l3_off - IPV6_HDR_LEN )
+    {
+        return 0;
+    }
+
+    flags = frame[l4_off + TCP_FLAGS_OFF];
+    payload = len - hdr_len;
+    if ( (0 == payload) || ((flags & ~TCP_PSH) != TCP_ACK) )
+    {
+        return 0;
+    }
+
+    /* The merged frame is handed over as checksum-partial, so the kernel will
+     * not look at the data again. Check each segment here instead. */
+    if ( 0xffff != csum_fold( csum_add( csum_pseudo( frame, l3_off, ipv6, len - l4_off ),
+                                        frame + l4_off, len - l4_off ) ) )
+    {
+        return 0;
+    }
+
+    seq = get32( frame + l4_off + TCP_SEQ_OFF );
+
+    if ( 0 == gro->len )
+    {
+        memcpy( gro->frame, frame, len );
+        gro->len = len;
+        gro->l3_off = l3_off;
+        gro->l4_off = l4_off;
+        gro->hdr_len = hdr_len;
+        gro->ipv6 = ipv6;
+        gro->seg_size = payload;
+        gro->next_seq = seq + (uint32_t)payload;
+        gro->segs = 1;
+        gro->closed = (flags & TCP_PSH) ? 1 : 0;
+        return 1;
+    }
+
+    if ( gro->closed || (ipv6 != gro->ipv6) || (l4_off != gro->l4_off) || (hdr_len != gro->hdr_len)
+         || (seq != gro->next_seq) || (payload > gro->seg_size)
+         || (gro->len + payload > N2N_GSO_MAX_FRAME)
+         || (gro->len + payload - l3_off > 0xffff)
+         || !gro_same_flow( gro, frame ) )
+    {
+        return -1;
+    }
+
+    memcpy( gro->frame + gro->len, frame + hdr_len, payload );
+    gro->len += payload;
+    gro->next_seq += (uint32_t)payload;
+    ++(gro->segs);
+
+    if ( (payload < gro->seg_size) || (flags & TCP_PSH) )
+    {
+        gro->frame[l4_off + TCP_FLAGS_OFF] |= (flags & TCP_PSH);
+        gro->closed = 1;
+    }
+
+    return 1;
+}
+
+/** Finish the held frame for writing to the TAP device.
+ *
+ *  A single segment is returned unchanged with an empty hdr. Several segments
+ *  get their IP length fixed up and are described in hdr as a TCP GSO frame
+ *  with a partial checksum. gro->frame stays valid until the next call to
+ *  n2n_gro_receive().
+ *
+ *  @return length of gro->frame, 0 if nothing was held.
+ */
+size_t n2n_gro_finish( n2n_gro_t * gro, n2n_vnet_hdr_t * hdr )
+{
+    size_t len = gro->len;
+    uint8_t * frame = gro->frame;
+
+    memset( hdr, 0, sizeof(n2n_vnet_hdr_t) );
+
+    if ( 0 == len )
+    {
+        return 0;
+    }
+
+    if ( gro->segs > 1 )
+    {
+        if ( gro->ipv6 )
+        {
+            put16( frame + gro->l3_off + 4, (uint16_t)(len - gro->l3_off - IPV6_HDR_LEN) );
+        }
+        else
+        {
+            put16( frame + gro->l3_off + 2, (uint16_t)(len - gro->l3_off) );
+            ipv4_set_csum( frame + gro->l3_off );
+        }
+
+        put16( frame + gro->l4_off + TCP_CSUM_OFF,
+               csum_fold( csum_pseudo( frame, gro->l3_off, gro->ipv6, len - gro->l4_off ) ) );
+
+        hdr->flags = N2N_VNET_F_NEEDS_CSUM;
+        hdr->gso_type = gro->ipv6 ? N2N_VNET_GSO_TCPV6 : N2N_VNET_GSO_TCPV4;
+        hdr->hdr_len = (uint16_t)gro->hdr_len;
+        hdr->gso_size = (uint16_t)gro->seg_size;
+        hdr->csum_start = (uint16_t)gro->l4_off;
+        hdr->csum_offset = TCP_CSUM_OFF;
+    }
+
+    n2n_gro_init( gro );
+    return len;
+}
+
+
+/** Lower the MSS option of a TCP SYN so that the segments the other end
+ *  sends fit into IP packets of mtu bytes.
+ *
+ *  @return 1 if the option was lowered, 0 otherwise.
+ */
+int n2n_mss_clamp( uint8_t * frame, size_t len, size_t mtu )
+{
+    size_t l3_off, l4_off, hdr_len;
+    size_t ip_len;
+    size_t mss;
+    size_t opt;
+    int ipv6;
+
+    if ( (0 != parse_tcp( frame, len, &l3_off, &l4_off, &hdr_len, &ipv6 ))
+         || !(frame[l4_off + TCP_FLAGS_OFF] & TCP_SYN) )
+    {
+        return 0;
+    }
+
+    /* Frames may be padded; the checksum covers the IP payload only. */
+    if ( ipv6 )
+    {
+        ip_len = IPV6_HDR_LEN + get16( frame + l3_off + 4 );
+        mss = mtu - IPV6_HDR_LEN - 20;
+    }
+    else
+    {
+        ip_len = get16( frame + l3_off + 2 );
+        mss = mtu - 20 - 20;
+    }
+
+    if ( (mtu < IPV6_HDR_LEN + 20) || (l3_off + ip_len > len) || (l3_off + ip_len < hdr_len) )
+    {
+        return 0;
+    }
+
+    opt = l4_off + 20;
+    while ( opt < hdr_len )
+    {
+        size_t olen;
+
+        if ( TCP_OPT_EOL == frame[opt] )
+        {
+            break;
+        }
+        if ( TCP_OPT_NOP == frame[opt] )
+        {
+            ++opt;
+            continue;
+        }
+
+        olen = (opt + 1 < hdr_len) ? frame[opt + 1] : 0;
+        if ( (olen < 2) || (opt + olen > hdr_len) )
+        {
+            break;
+        }
+
+        if ( (TCP_OPT_MSS == frame[opt]) && (4 == olen) )
+        {
+            if ( get16( frame + opt + 2 ) <= mss )
+            {
+                return 0;
+            }
+
+            put16( frame + opt + 2, (uint16_t)mss );
+            tcp_set_csum( frame, l3_off + ip_len, l3_off, l4_off, ipv6 );
+            return 1;
+        }
+
+        opt += olen;
+    }
+
+    return 0;
+}
+
+
+/** Build the ICMP error telling the sender of an IP packet that did not fit
+ *  that packets to its destination must not exceed mtu bytes: fragmentation
+ *  needed for IPv4, packet too big for IPv6.
+ *
+ *  The error comes from the packet's destination address and quotes as much
+ *  of the packet as RFC 1812 and RFC 4443 allow. None is built for ICMP
+ *  errors, IPv4 fragments after the first or unusable source addresses.
+ *
+ *  @return length of the ethernet frame written to out, 0 if none is due.
+ */
+size_t n2n_too_big( const uint8_t * frame, size_t len, size_t mtu,
+                    uint8_t * out, size_t out_size )
+{
+    const uint8_t * ip = frame + ETH_HDR_LEN;
+    uint8_t * oip = out + ETH_HDR_LEN;
+    uint8_t * icmp;
+    size_t quote;
+    size_t n;
+    uint64_t sum;
+
+    if ( len < ETH_HDR_LEN + IPV6_HDR_LEN )
+    {
+        return 0;
+    }
+
+    switch ( get16( frame + 12 ) )
+    {
+    case ETHTYPE_IPV4:
+    {
+        size_t ihl = (ip[0] & 0x0f) * 4;
+
+        if ( ((ip[0] >> 4) != 4) || (ihl < 20) || (len < ETH_HDR_LEN + ihl + 8)
+             || (get16( ip + 6 ) & IP4_OFFMASK)
+             || (0 == ip[12]) || (ip[12] >= 224) || (ip[16] >= 224) )
+        {
+            return 0;
+        }
+        if ( (IPPROTO_ICMP_ == ip[9]) && (0 != ip[ihl]) && (8 != ip[ihl]) )
+        {
+            return 0; /* only echo gets an error */
+        }
+
+        quote = len - ETH_HDR_LEN;
+        if ( quote > ICMP_QUOTE_MAX )
+        {
+            quote = ICMP_QUOTE_MAX;
+        }
+        n = ETH_HDR_LEN + 20 + 8 + quote;
+        if ( (n > out_size) || (mtu > 0xffff) )
+        {
+            return 0;
+        }
+
+        memset( oip, 0, 20 + 8 );
+        oip[0] = 0x45;
+        oip[1] = 0xc0;                          /* internetwork control */
+        put16( oip + 2, (uint16_t)(20 + 8 + quote) );
+        oip[8] = 64;                            /* TTL */
+        oip[9] = IPPROTO_ICMP_;
+        memcpy( oip + 12, ip + 16, 4 );
+        memcpy( oip + 16, ip + 12, 4 );
+        ipv4_set_csum( oip );
+
+        icmp = oip + 20;
+        icmp[0] = 3;                            /* destination unreachable */
+        icmp[1] = 4;                            /* fragmentation needed */
+        put16( icmp + 6, (uint16_t)mtu );
+        memcpy( icmp + 8, ip, quote );
+        put16( icmp + 2, (uint16_t)~csum_fold( csum_add( 0, icmp, 8 + quote ) ) );
+        break;
+    }
+    case ETHTYPE_IPV6:
+    {
+        static const uint8_t unspecified[16] = {0};
+
+        if ( ((ip[0] >> 4) != 6) || (0xff == ip[8]) || (0 == memcmp( ip + 8, unspecified, 16 ))
+             || (mtu < IPV6_MIN_MTU) )
+        {
+            return 0;
+        }
+        if ( (IPPROTO_ICMPV6_ == ip[6]) && ((len < ETH_HDR_LEN + IPV6_HDR_LEN + 1) || (ip[IPV6_HDR_LEN] < 128)) )
+        {
+            return 0; /* no error about an error */
+        }
+
+        quote = len - ETH_HDR_LEN;
+        if ( quote > IPV6_MIN_MTU - IPV6_HDR_LEN - 8 )
+        {
+            quote = IPV6_MIN_MTU - IPV6_HDR_LEN - 8;
+        }
+        n = ETH_HDR_LEN + IPV6_HDR_LEN + 8 + quote;
+        if ( n > out_size )
+        {
+            return 0;
+        }
+
+        memset( oip, 0, IPV6_HDR_LEN + 8 );
+        oip[0] = 0x60;
+        put16( oip + 4, (uint16_t)(8 + quote) );
+        oip[6] = IPPROTO_ICMPV6_;
+        oip[7] = 255;                           /* hop limit */
+        memcpy( oip + 8, ip + 24, 16 );
+        memcpy( oip + 24, ip + 8, 16 );
+
+        icmp = oip + IPV6_HDR_LEN;
+        icmp[0] = 2;                            /* packet too big */
+        put32( icmp + 4, (uint32_t)mtu );
+        memcpy( icmp + 8, ip, quote );
+        sum = csum_add( 0, oip + 8, 32 ) + IPPROTO_ICMPV6_ + 8 + quote;
+        sum = csum_add( sum, icmp, 8 + quote );
+        put16( icmp + 2, (uint16_t)~csum_fold( sum ) );
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    memcpy( out, frame + 6, 6 );
+    memcpy( out + 6, frame, 6 );
+    memcpy( out + 12, frame + 12, 2 );
+
+    return n;
+}
+
+
+/** Cut an IPv4 packet without DF into fragments of at most mtu bytes, built
+ *  one at a time in fragbuf and handed to emit. The packet may itself be a
+ *  fragment. Options are only kept in the first fragment.
+ *
+ *  @return number of fragments emitted or -1 if the packet cannot be
+ *  fragmented.
+ */
+int n2n_ipv4_fragment( const uint8_t * frame, size_t len, size_t mtu,
+                       uint8_t * fragbuf, size_t fragbuf_size,
+                       n2n_gso_emit_t emit, void * ctx )
+{
+    const uint8_t * ip = frame + ETH_HDR_LEN;
+    size_t ihl, total, payload;
+    size_t base, off, chunk;
+    uint16_t frag;
+    int n = 0;
+
+    if ( (len < ETH_HDR_LEN + 20) || (ETHTYPE_IPV4 != get16( frame + 12 )) || ((ip[0] >> 4) != 4) )
+    {
+        return -1;
+    }
+
+    ihl = (ip[0] & 0x0f) * 4;
+    total = get16( ip + 2 );
+    frag = get16( ip + 6 );
+    if ( (ihl < 20) || (total < ihl) || (ETH_HDR_LEN + total > len) || (frag & IP4_DF) || (mtu < ihl + 8) )
+    {
+        return -1;
+    }
+
+    base = (frag & IP4_OFFMASK) * 8;
+    payload = total - ihl;
+
+    for ( off=0; off < payload; off += chunk, ++n )
+    {
+        size_t hl = (0 == off) ? ihl : 20;
+        uint16_t more = IP4_MF;
+        uint8_t * fip = fragbuf + ETH_HDR_LEN;
+
+        chunk = (mtu - hl) & ~(size_t)7;
+        if ( off + chunk >= payload )
+        {
+            chunk = payload - off;
+            more = frag & IP4_MF;
+        }
+
+        if ( ETH_HDR_LEN + hl + chunk > fragbuf_size )
+        {
+            return -1;
+        }
+
+        memcpy( fragbuf, frame, ETH_HDR_LEN + hl );
+        fip[0] = 0x40 | (uint8_t)(hl / 4);
+        put16( fip + 2, (uint16_t)(hl + chunk) );
+        put16( fip + 6, (uint16_t)(((base + off) / 8) | more) );
+        memcpy( fip + hl, ip + ihl + off, chunk );
+        ipv4_set_csum( fip );
+
+        emit( ctx, fragbuf, ETH_HDR_LEN + hl + chunk );
+    }
+
+    return n;
+}
+
+
+/** Decode an ARP frame for IPv4 over ethernet or a neighbour solicitation or
+ *  advertisement. NS and NA must come with hop limit 255 directly after the
+ *  IPv6 header; a solicitation from the unspecified address (duplicate
+ *  address detection) claims nothing.
+ *
+ *  @return 0 and fills nb if the frame is one of these, -1 otherwise.
+ */
+int n2n_neigh_parse( const uint8_t * frame, size_t len, n2n_neigh_t * nb )
+{
+    static const uint8_t unspecified[16] = {0};
+    const uint8_t * l3 = frame + ETH_HDR_LEN;
+    const uint8_t * nd;
+    const uint8_t * opt;
+    size_t nd_len;
+
+    if ( len < ETH_HDR_LEN + ARP_LEN )
+    {
+        return -1;
+    }
+
+    memset( nb, 0, sizeof(*nb) );
+
+    switch ( get16( frame + 12 ) )
+    {
+    case ETHTYPE_ARP:
+        if ( (1 != get16( l3 )) || (ETHTYPE_IPV4 != get16( l3 + 2 )) || (6 != l3[4]) || (4 != l3[5]) )
+        {
+            return -1;
+        }
+
+        switch ( get16( l3 + 6 ) )
+        {
+        case ARP_OP_REQUEST: nb->op = N2N_NEIGH_SOLICIT; break;
+        case ARP_OP_REPLY:   nb->op = N2N_NEIGH_ADVERT; break;
+        default:             return -1;
+        }
+
+        nb->claim = (0 != memcmp( l3 + 14, unspecified, 4 )); /* ARP probes claim nothing */
+        memcpy( nb->claim_mac, l3 + 8, 6 );
+        memcpy( nb->claim_ip, l3 + 14, 4 );
+        memcpy( nb->target_ip, l3 + 24, 4 );
+        return 0;
+
+    case ETHTYPE_IPV6:
+        if ( (len < ETH_HDR_LEN + IPV6_HDR_LEN + ND_LEN) || ((l3[0] >> 4) != 6)
+             || (IPPROTO_ICMPV6_ != l3[6]) || (255 != l3[7]) )
+        {
+            return -1;
+        }
+
+        nd = l3 + IPV6_HDR_LEN;
+        nd_len = get16( l3 + 4 );
+        if ( (nd_len < ND_LEN) || (ETH_HDR_LEN + IPV6_HDR_LEN + nd_len > len) || (0 != nd[1]) )
+        {
+            return -1;
+        }
+
+        nb->ipv6 = 1;
+        memcpy( nb->target_ip, nd + 8, 16 );
+
+        if ( ND_NS == nd[0] )
+        {
+            nb->op = N2N_NEIGH_SOLICIT;
+            memcpy( nb->claim_ip, l3 + 8, 16 );
+        }
+        else if ( ND_NA == nd[0] )
+        {
+            nb->op = N2N_NEIGH_ADVERT;
+            memcpy( nb->claim_ip, nd + 8, 16 );
+        }
+        else
+        {
+            return -1;
+        }
+
+        /* The link-layer address of the claim comes from an option. */
+        for ( opt = nd + ND_LEN; opt + 8 <= nd + nd_len; opt += opt[1] * 8 )
+        {
+            if ( 0 == opt[1] )
+            {
+                return -1;
+            }
+            if ( (opt[0] == ((N2N_NEIGH_SOLICIT == nb->op) ? ND_OPT_SLLA : ND_OPT_TLLA)) && (1 == opt[1]) )
+            {
+                memcpy( nb->claim_mac, opt + 2, 6 );
+                nb->claim = (0 != memcmp( nb->claim_ip, unspecified, 16 ));
+            }
+        }
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+
+/** Build the answer to the solicitation frame decoded into nb: target_ip is
+ *  at mac. An NA is solicited and overrides, like one from the owner.
+ *
+ *  @return length of the ethernet frame written to out, 0 if none is due.
+ */
+size_t n2n_neigh_reply( const uint8_t * frame, const n2n_neigh_t * nb, const uint8_t * mac,
+                        uint8_t * out, size_t out_size )
+{
+    static const uint8_t unspecified[16] = {0};
+    const uint8_t * l3 = frame + ETH_HDR_LEN;
+    uint8_t * ol3 = out + ETH_HDR_LEN;
+    uint8_t * nd;
+    uint64_t sum;
+    size_t n;
+
+    if ( N2N_NEIGH_SOLICIT != nb->op )
+    {
+        return 0;
+    }
+
+    if ( !nb->ipv6 )
+    {
+        n = ETH_HDR_LEN + ARP_LEN;
+        if ( n > out_size )
+        {
+            return 0;
+        }
+
+        memcpy( ol3, l3, 6 );                   /* ethernet/IPv4 */
+        put16( ol3 + 6, ARP_OP_REPLY );
+        memcpy( ol3 + 8, mac, 6 );
+        memcpy( ol3 + 14, nb->target_ip, 4 );
+        memcpy( ol3 + 18, l3 + 8, 10 );         /* requester's MAC and IP */
+        put16( out + 12, ETHTYPE_ARP );
+    }
+    else
+    {
+        n = ETH_HDR_LEN + IPV6_HDR_LEN + ND_LEN + 8;
+        if ( (n > out_size) || (0 == memcmp( l3 + 8, unspecified, 16 )) )
+        {
+            return 0; /* DAD is left to the owner */
+        }
+
+        memset( ol3, 0, IPV6_HDR_LEN + ND_LEN + 8 );
+        ol3[0] = 0x60;
+        put16( ol3 + 4, ND_LEN + 8 );
+        ol3[6] = IPPROTO_ICMPV6_;
+        ol3[7] = 255;                           /* hop limit */
+        memcpy( ol3 + 8, nb->target_ip, 16 );
+        memcpy( ol3 + 24, l3 + 8, 16 );
+
+        nd = ol3 + IPV6_HDR_LEN;
+        nd[0] = ND_NA;
+        nd[4] = ND_NA_SOLICITED | ND_NA_OVERRIDE;
+        memcpy( nd + 8, nb->target_ip, 16 );
+        nd[ND_LEN] = ND_OPT_TLLA;
+        nd[ND_LEN + 1] = 1;
+        memcpy( nd + ND_LEN + 2, mac, 6 );
+        sum = csum_add( 0, ol3 + 8, 32 ) + IPPROTO_ICMPV6_ + ND_LEN + 8;
+        sum = csum_add( sum, nd, ND_LEN + 8 );
+        put16( nd + 2, (uint16_t)~csum_fold( sum ) );
+        put16( out + 12, ETHTYPE_IPV6 );
+    }
+
+    memcpy( out, frame + 6, 6 );
+    memcpy( out + 6, mac, 6 );
+
+    return n;
+}
@@ -0,0 +1,108 @@
+/* TAP offload support: segmentation of GSO frames read from the TAP device
+ * and coalescing of received TCP segments into GRO frames for writing back.
+ *
+ * With IFF_VNET_HDR every frame on the TAP device is preceded by a
+ * virtio_net_hdr. The kernel may then hand edge TCP "super-frames" of up to
+ * 64KB with an unfinished checksum. Edge cuts them into MTU sized segments
+ * with full checksums before encoding since the peer may not use offloads.
+ * In the other direction consecutive segments of one TCP flow are merged so
+ * that the kernel receives one large frame per burst.
+ *
+ * The path MTU helpers keep frames read from the TAP within what fits into
+ * one n2n PACKET: TCP MSS clamping, ICMP "too big" errors and IPv4
+ * fragmentation.
+ *
+ * The neighbour helpers let edge answer ARP requests and IPv6 neighbour
+ * solicitations from its own host for addresses it has learned elsewhere.
+ */
+
+#if !defined( N2N_OFFLOAD_H_ )
+#define N2N_OFFLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same layout as struct virtio_net_hdr (native byte order). */
+struct n2n_vnet_hdr
+{
+    uint8_t     flags;
+    uint8_t     gso_type;
+    uint16_t    hdr_len;        /* ethernet + IP + TCP header length */
+    uint16_t    gso_size;       /* payload bytes per segment */
+    uint16_t    csum_start;     /* offset where checksumming starts */
+    uint16_t    csum_offset;    /* checksum field offset from csum_start */
+};
+
+typedef struct n2n_vnet_hdr n2n_vnet_hdr_t;
+
+#define N2N_VNET_HDR_SIZE               10
+
+#define N2N_VNET_F_NEEDS_CSUM           1
+#define N2N_VNET_GSO_NONE               0
+#define N2N_VNET_GSO_TCPV4              1
+#define N2N_VNET_GSO_TCPV6              4
+#define N2N_VNET_GSO_ECN                0x80
+
+#define N2N_GSO_MAX_FRAME               65536   /* largest super-frame, excluding vnet header */
+
+/** Called for each segment produced by n2n_gso_segment(). */
+typedef void (*n2n_gso_emit_t)( void * ctx, uint8_t * frame, size_t len );
+
+/** Coalescing state for one receive path. */
+struct n2n_gro
+{
+    size_t      len;            /* bytes in frame, 0 if empty */
+    size_t      l3_off;         /* IP header offset */
+    size_t      l4_off;         /* TCP header offset */
+    size_t      hdr_len;        /* all headers */
+    size_t      seg_size;       /* payload size of the first segment */
+    uint32_t    next_seq;
+    int         ipv6;
+    int         segs;
+    int         closed;         /* last segment was short or had PSH */
+    uint8_t     frame[N2N_GSO_MAX_FRAME];
+};
+
+typedef struct n2n_gro n2n_gro_t;
+
+int n2n_offload_csum( uint8_t * frame, size_t len, const n2n_vnet_hdr_t * hdr );
+
+int n2n_gso_segment( const n2n_vnet_hdr_t * hdr,
+                     const uint8_t * frame, size_t len,
+                     uint8_t * segbuf, size_t segbuf_size,
+                     n2n_gso_emit_t emit, void * ctx );
+
+void n2n_gro_init( n2n_gro_t * gro );
+int  n2n_gro_receive( n2n_gro_t * gro, const uint8_t * frame, size_t len );
+size_t n2n_gro_finish( n2n_gro_t * gro, n2n_vnet_hdr_t * hdr );
+
+/* mtu is the largest IP packet, without ethernet header, that may be sent. */
+int    n2n_mss_clamp( uint8_t * frame, size_t len, size_t mtu );
+size_t n2n_too_big( const uint8_t * frame, size_t len, size_t mtu,
+                    uint8_t * out, size_t out_size );
+int    n2n_ipv4_fragment( const uint8_t * frame, size_t len, size_t mtu,
+                          uint8_t * fragbuf, size_t fragbuf_size,
+                          n2n_gso_emit_t emit, void * ctx );
+
+#define N2N_NEIGH_SOLICIT               1       /* ARP request or neighbour solicitation */
+#define N2N_NEIGH_ADVERT                2       /* ARP reply or neighbour advertisement */
+
+/** What an ARP or neighbour discovery frame says. Addresses are in network
+ *  order; an IPv4 address takes the first 4 bytes. */
+struct n2n_neigh
+{
+    int         op;             /* N2N_NEIGH_* */
+    int         ipv6;
+    int         claim;          /* 1 if the sender says claim_ip is at claim_mac */
+    uint8_t     claim_ip[16];
+    uint8_t     claim_mac[6];
+    uint8_t     target_ip[16];  /* address a solicitation asks for */
+};
+
+typedef struct n2n_neigh n2n_neigh_t;
+
+int    n2n_neigh_parse( const uint8_t * frame, size_t len, n2n_neigh_t * nb );
+size_t n2n_neigh_reply( const uint8_t * frame, const n2n_neigh_t * nb, const uint8_t * mac,
+                        uint8_t * out, size_t out_size );
+
+#endif /* #if !defined( N2N_OFFLOAD_H_ ) */
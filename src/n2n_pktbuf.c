@@ -0,0 +1,135 @@
+/* (c) 2026 n2n contributors - see n2n_transforms.h */
+
+/** Packet buffers with headroom and in-place transforms.
+ *
+ *  Edge reads a frame from the TAP straight into the buffer it will send,
+ *  leaving room in front for the transform and PACKET headers and behind it
+ *  for padding or an authentication tag. Transops that set fwd_pb/rev_pb
+ *  then encrypt and decrypt without copying the payload. For the others the
+ *  helpers here bounce through a stack buffer using fwd/rev.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+/** Describe a packet of len bytes starting headroom bytes into buf. */
+void n2n_pktbuf_init( n2n_pktbuf_t * pb, uint8_t * buf, size_t size,
+                      size_t headroom, size_t len )
+{
+    pb->head = buf;
+    pb->size = size;
+    pb->data = buf + headroom;
+    pb->len  = len;
+}
+
+/** Grow the packet by n bytes at the front.
+ *
+ *  @return the new start of the packet or NULL if there is not enough
+ *  headroom. */
+uint8_t * n2n_pktbuf_push( n2n_pktbuf_t * pb, size_t n )
+{
+    if ( (size_t)(pb->data - pb->head) < n )
+    {
+        return NULL;
+    }
+
+    pb->data -= n;
+    pb->len += n;
+    return pb->data;
+}
+
+/** Remove n bytes from the front of the packet.
+ *
+ *  @return the new start of the packet or NULL if it is shorter than n. */
+uint8_t * n2n_pktbuf_pull( n2n_pktbuf_t * pb, size_t n )
+{
+    if ( pb->len < n )
+    {
+        return NULL;
+    }
+
+    pb->data += n;
+    pb->len -= n;
+    return pb->data;
+}
+
+/** Grow the packet by n bytes at the end.
+ *
+ *  @return where the added bytes start or NULL if there is not enough
+ *  tailroom. */
+uint8_t * n2n_pktbuf_put( n2n_pktbuf_t * pb, size_t n )
+{
+    uint8_t * tail = pb->data + pb->len;
+
+    if ( (size_t)(pb->head + pb->size - tail) < n )
+    {
+        return NULL;
+    }
+
+    pb->len += n;
+    return tail;
+}
+
+/** Shorten the packet to len bytes.
+ *
+ *  @return 0 on success, -1 if it is shorter already. */
+int n2n_pktbuf_trim( n2n_pktbuf_t * pb, size_t len )
+{
+    if ( len > pb->len )
+    {
+        return -1;
+    }
+
+    pb->len = len;
+    return 0;
+}
+
+/** Encode the packet in pb with ttt.
+ *
+ *  @return 0 on success, -1 on error. */
+int n2n_transop_fwd_pb( n2n_trans_op_t * ttt, n2n_pktbuf_t * pb )
+{
+    uint8_t bounce[N2N_PKT_BUF_SIZE];
+    size_t room = pb->head + pb->size - pb->data;
+    int len;
+
+    if ( ttt->fwd_pb )
+    {
+        return (ttt->fwd_pb)( ttt, pb );
+    }
+
+    len = (ttt->fwd)( ttt, bounce, sizeof(bounce), pb->data, pb->len );
+    if ( (len < 0) || ((size_t)len > room) )
+    {
+        return -1;
+    }
+
+    memcpy( pb->data, bounce, len );
+    pb->len = len;
+    return 0;
+}
+
+/** Decode the packet in pb with ttt.
+ *
+ *  @return 0 on success, -1 on error. */
+int n2n_transop_rev_pb( n2n_trans_op_t * ttt, n2n_pktbuf_t * pb )
+{
+    uint8_t bounce[N2N_PKT_BUF_SIZE];
+    size_t room = pb->head + pb->size - pb->data;
+    int len;
+
+    if ( ttt->rev_pb )
+    {
+        return (ttt->rev_pb)( ttt, pb );
+    }
+
+    len = (ttt->rev)( ttt, bounce, sizeof(bounce), pb->data, pb->len );
+    if ( (len < 0) || ((size_t)len > room) )
+    {
+        return -1;
+    }
+
+    memcpy( pb->data, bounce, len );
+    pb->len = len;
+    return 0;
+}
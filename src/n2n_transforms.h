@@ -14,6 +14,8 @@
 #define N2N_TRANSFORM_ID_LZO            4
 #define N2N_TRANSFORM_ID_TWOFISH_LZO    5
 #define N2N_TRANSFORM_ID_AESCBC_LZO     6
+#define N2N_TRANSFORM_ID_AESGCM         7
+#define N2N_TRANSFORM_ID_CHACHA20       8
 #define N2N_TRANSFORM_ID_USER_START     64
 #define N2N_TRANSFORM_ID_MAX            65535
 
@@ -42,6 +44,29 @@ typedef int             (*n2n_transform_f)( n2n_trans_op_t * arg,
                                             const uint8_t * inbuf,
                                             size_t in_len );
 
+/* Most a transform adds in front of and behind the payload. */
+#define N2N_TRANSOP_HEADROOM            32
+#define N2N_TRANSOP_TAILROOM            32
+
+/** A packet inside a larger buffer. Space before and after the packet lets
+ *  a transform prepend its header and append padding or a tag where the
+ *  payload already is instead of copying the payload to a new buffer. */
+struct n2n_pktbuf
+{
+    uint8_t *           head;           /* start of the buffer */
+    size_t              size;           /* size of the buffer */
+    uint8_t *           data;           /* first byte of the packet */
+    size_t              len;            /* length of the packet */
+};
+
+typedef struct n2n_pktbuf n2n_pktbuf_t;
+
+/** Encode or decode the packet in pb in place.
+ *
+ *  @return 0 with pb describing the result, -1 on error. */
+typedef int             (*n2n_transform_pb_f)( n2n_trans_op_t * arg,
+                                               n2n_pktbuf_t * pb );
+
 /** Holds the info associated with a data transform plugin.
  *
  *  When a packet arrives the transform ID is extracted. This defines the code
@@ -55,14 +80,44 @@ struct n2n_trans_op
     n2n_transform_t     transform_id;   /* link header enum to a transform */
     size_t              tx_cnt;
     size_t              rx_cnt;
+    size_t              overhead;       /* most bytes fwd adds to a payload */
 
     n2n_transdeinit_f   deinit; /* destructor function */
     n2n_transaddspec_f  addspec; /* parse opaque data from a key schedule file. */
     n2n_transtick_f     tick;   /* periodic maintenance */
     n2n_transform_f     fwd;    /* encode a payload */
     n2n_transform_f     rev;    /* decode a payload */
+    n2n_transform_pb_f  fwd_pb; /* encode in place; NULL if unsupported */
+    n2n_transform_pb_f  rev_pb; /* decode in place; NULL if unsupported */
 };
 
+/** Compression counters of an LZO transop (encode side). */
+struct n2n_lzo_stats
+{
+    size_t              frames;         /* frames encoded */
+    size_t              compressed;     /* sent compressed */
+    size_t              stored;         /* compressor ran but did not shrink the frame */
+    size_t              skipped;        /* judged incompressible, compressor not run */
+    uint64_t            bytes_in;
+    uint64_t            bytes_out;      /* before encryption */
+    uint64_t            compress_ns;    /* time spent in the compressor */
+    uint64_t            compress_bytes; /* bytes given to the compressor */
+    uint64_t            skipped_bytes;  /* bytes not given to the compressor */
+};
+
+typedef struct n2n_lzo_stats n2n_lzo_stats_t;
+
+void      n2n_pktbuf_init( n2n_pktbuf_t * pb, uint8_t * buf, size_t size,
+                           size_t headroom, size_t len );
+uint8_t * n2n_pktbuf_push( n2n_pktbuf_t * pb, size_t n );
+uint8_t * n2n_pktbuf_pull( n2n_pktbuf_t * pb, size_t n );
+uint8_t * n2n_pktbuf_put( n2n_pktbuf_t * pb, size_t n );
+int       n2n_pktbuf_trim( n2n_pktbuf_t * pb, size_t len );
+
+/* Run a transop on a pktbuf, in place if the transop supports it. */
+int  n2n_transop_fwd_pb( n2n_trans_op_t * ttt, n2n_pktbuf_t * pb );
+int  n2n_transop_rev_pb( n2n_trans_op_t * ttt, n2n_pktbuf_t * pb );
+
 /* Setup a single twofish SA for single-key operation. */
 int transop_twofish_setup( n2n_trans_op_t * ttt, 
                            n2n_sa_t sa_num,
@@ -72,7 +127,15 @@ int transop_twofish_setup( n2n_trans_op_t * ttt,
 /* Initialise an empty transop ready to receive cipherspec elements. */
 int  transop_twofish_init( n2n_trans_op_t * ttt );
 int  transop_aes_init( n2n_trans_op_t * ttt );
+int  transop_aes_set_version( n2n_trans_op_t * ttt, uint8_t version );
+int  transop_aesgcm_init( n2n_trans_op_t * ttt );
+int  transop_aesgcm_accelerated( void );
+int  transop_cc20_init( n2n_trans_op_t * ttt );
+const char * transop_cc20_impl( const n2n_trans_op_t * ttt );
+int  transop_cc20_selftest( void );
 void transop_null_init( n2n_trans_op_t * ttt );
+int  transop_lzo_init( n2n_trans_op_t * ttt, n2n_transform_t id, n2n_trans_op_t * inner );
+void transop_lzo_stats( const n2n_trans_op_t * ttt, n2n_lzo_stats_t * stats );
 
 #endif /* #if !defined(N2N_TRANSFORMS_H_) */
 
@@ -54,13 +54,16 @@ enum n2n_pc
     n2n_register_super_nak=7,   /* NAK from supernode to edge - registration refused */
     n2n_federation=8,           /* Not used by edge */
     n2n_peer_info=9,            /* Send info on a peer from sn to edge */
-    n2n_query_peer=10           /* ask supernode for info on a peer */
+    n2n_query_peer=10,          /* ask supernode for info on a peer */
+    n2n_fec=11                  /* FEC parity or loss report from edge to edge */
 };
 
 typedef enum n2n_pc n2n_pc_t;
 
 /* for the additional_flags present in some non-PACKET types */
 #define N2N_AFLAGS_LOCAL_SOCKET         0x0001
+#define N2N_AFLAGS_PORT_PREDICT         0x0002  /* PEER_INFO: NAT ports the peer is likely to get next */
+#define N2N_AFLAGS_PUNCH                0x0004  /* PEER_INFO: the peer is punching, punch back */
 
 /* for the common header section */
 #define N2N_FLAGS_FROM_SUPERNODE        0x0020
@@ -72,6 +75,8 @@ typedef enum n2n_pc n2n_pc_t;
 #define IPV4_SIZE                       4
 #define IPV6_SIZE                       16
 
+#define N2N_COMMON_SIZE                 (4 + N2N_COMMUNITY_SIZE)        /* encoded n2n_common_t */
+
 #define ETH_FRAMEHDRSIZE                   14
 #define IP4_SRCOFFSET                   12
 
@@ -192,6 +197,9 @@ struct n2n_REGISTER_SUPER_ACK
                                          * non-zero then sn_bak is valid. */
     n2n_sock_t          sn_bak;         /* Socket of the first backup supernode */
 
+    uint16_t            probe_port;     /* Where REGISTER_SUPER shows the NAT port
+                                         * allocation of the edge, 0 if none.
+                                         * Optional at the end of the packet. */
 };
 
 typedef struct n2n_REGISTER_SUPER_ACK n2n_REGISTER_SUPER_ACK_t;
@@ -211,6 +219,8 @@ struct n2n_PEER_INFO
     uint16_t    timeout;
     n2n_mac_t   mac;
     n2n_sock_t  sockets[2];
+    uint16_t    pred_port;      /* N2N_AFLAGS_PORT_PREDICT: first port of sockets[0] to try */
+    uint8_t     pred_count;     /* and the number of consecutive ports from it */
 };
 
 typedef struct n2n_PEER_INFO n2n_PEER_INFO_t;
@@ -223,6 +233,24 @@ struct n2n_QUERY_PEER
 
 typedef struct n2n_QUERY_PEER n2n_QUERY_PEER_t;
 
+#define N2N_FEC_MAX_GROUP               16      /* PACKETs covered by one parity */
+
+/* Linked with n2n_fec in n2n_pc_t. From edge to edge, directly or relayed by
+ * the supernode. A parity covers the PACKETs it lists after their common
+ * header and is followed by their XOR, each padded with zeros to the longest.
+ * A loss report goes back from the receiver of the PACKETs to their sender. */
+struct n2n_FEC
+{
+    n2n_mac_t   srcMac;
+    n2n_mac_t   dstMac;
+    uint8_t     count;          /* PACKETs covered, 0 for a loss report */
+    uint16_t    loss;           /* report: per mille of covered PACKETs that were lost */
+    uint16_t    len_xor;        /* XOR of the covered lengths */
+    uint32_t    hash[N2N_FEC_MAX_GROUP]; /* of each covered PACKET */
+};
+
+typedef struct n2n_FEC n2n_FEC_t;
+
 struct n2n_buf
 {
     uint8_t *   data;
@@ -377,6 +405,17 @@ int decode_QUERY_PEER( n2n_QUERY_PEER_t * qp,
                    size_t * rem,
                    size_t * idx );
 
+int encode_FEC( uint8_t * base, 
+                size_t * idx,
+                const n2n_common_t * common, 
+                const n2n_FEC_t * fec );
+
+int decode_FEC( n2n_FEC_t * fec,
+                const n2n_common_t * cmn, /* info on how to interpret it */
+                const uint8_t * base,
+                size_t * rem,
+                size_t * idx );
+
 void decode_ETHFRAMEHDR( n2n_ETHFRAMEHDR_t * eth,
                         const uint8_t * base );
 
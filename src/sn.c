@@ -13,11 +13,21 @@
 
 #include "sql.h"
 #include "n2n.h"
+#include "n2n_transforms.h"
 #define N2N_SN_LPORT_DEFAULT 7654
 #define N2N_SN_PKTBUF_SIZE   2048
 
 #define N2N_SN_MGMT_PORT                5645
 
+#define N2N_SN_ARP_TTL                  120     /* sec. Lifetime of a learned binding without refresh. */
+#define N2N_SN_ARP_HASH_SIZE            53      /* prime number */
+
+#define N2N_SN_DUMP_PAGE_EDGES          10      /* edges per management dump datagram */
+#define N2N_SN_DUMP_MAX_PAGES           16      /* datagrams sent per dump request */
+
+#define N2N_SN_PREDICT_PORTS            32      /* NAT ports offered to punch for an edge with a symmetric NAT */
+#define N2N_SN_PREDICT_MAX_SPAN         1024    /* Ports seen further apart than this are not predictable. */
+
 char table_ip[] = "n2n_register_ip";
 char table_user[] = "n2n_register_user";
 //id = userid
@@ -42,12 +52,42 @@ struct sn_stats
     size_t reg_super_nak;       /* Number of REGISTER_SUPER requests declined. */
     size_t fwd;                 /* Number of messages forwarded. */
     size_t broadcast;           /* Number of messages broadcast to a community. */
+    size_t arp_proxied;         /* Number of ARP requests forwarded unicast instead of broadcast. */
+    size_t arp_flushed;         /* Number of ARP bindings flushed due to a mismatch. */
+    size_t predicted;           /* Number of PEER_INFOs with predicted NAT ports. */
+    size_t punch_req;           /* Number of PEER_INFOs sent to make the target punch back. */
     time_t last_fwd;            /* Time when last message was forwarded. */
     time_t last_reg_super;      /* Time when last REGISTER_SUPER was received. */
 };
 
 typedef struct sn_stats sn_stats_t;
 
+/** IP to MAC binding learned from ARP traffic relayed through the supernode.
+ *
+ *  Bindings are kept per community so that overlapping address plans in
+ *  different communities do not interfere. */
+struct sn_arp_binding
+{
+    struct sn_arp_binding * next;
+    n2n_community_t     community;
+    uint32_t            ip_addr;        /* network order */
+    n2n_mac_t           mac_addr;
+    time_t              last_seen;
+};
+
+typedef struct sn_arp_binding sn_arp_binding_t;
+
+#define SN_ARP_BINDING_COMPARATOR(e1, e2) \
+    ( ((e1)->ip_addr != (e2)->ip_addr) ? (((e1)->ip_addr < (e2)->ip_addr) ? -1 : 1) \
+      : memcmp((e1)->community, (e2)->community, sizeof(n2n_community_t)) )
+
+static unsigned int sn_arp_binding_t_hash_function( sn_arp_binding_t * e );
+
+SGLIB_DEFINE_LIST_PROTOTYPES(sn_arp_binding_t, SN_ARP_BINDING_COMPARATOR, next)
+SGLIB_DEFINE_HASHED_CONTAINER_PROTOTYPES(sn_arp_binding_t, N2N_SN_ARP_HASH_SIZE, sn_arp_binding_t_hash_function)
+SGLIB_DEFINE_LIST_FUNCTIONS(sn_arp_binding_t, SN_ARP_BINDING_COMPARATOR, next)
+SGLIB_DEFINE_HASHED_CONTAINER_FUNCTIONS(sn_arp_binding_t, N2N_SN_ARP_HASH_SIZE, sn_arp_binding_t_hash_function)
+
 struct n2n_sn
 {
     time_t              start_time;     /* Used to measure uptime. */
@@ -55,9 +95,12 @@ struct n2n_sn
     int                 daemon;         /* If non-zero then daemonise. */
     uint16_t            lport;          /* Local UDP port to bind to. */
     int                 sock;           /* Main socket for UDP traffic with edges. */
+    int                 probe_port;     /* Second UDP port showing NAT port allocation; 0 for none. */
+    int                 probe_sock;     /* Socket on probe_port. */
     int                 mgmt_sock;      /* management socket. */
     time_t              last_purge;     /* last purge time */
     peer_info_t *		edges[PEER_HASH_TAB_SIZE];          /* Link list of registered edges. */
+    sn_arp_binding_t *  arp_bindings[N2N_SN_ARP_HASH_SIZE]; /* IP to MAC bindings per community. */
 };
 
 typedef struct n2n_sn n2n_sn_t;
@@ -88,13 +131,18 @@ static int init_sn( n2n_sn_t * sss )
     sss->daemon = 1; /* By defult run as a daemon. */
     sss->lport = N2N_SN_LPORT_DEFAULT;
     sss->sock = -1;
+    sss->probe_port = 0;
+    sss->probe_sock = -1;
     sss->mgmt_sock = -1;
     sss->last_purge = 0;
 	sglib_hashed_peer_info_t_init(sss->edges);
+    sglib_hashed_sn_arp_binding_t_init(sss->arp_bindings);
 
     return 0; /* OK */
 }
 
+static size_t purge_arp_bindings( n2n_sn_t * sss, time_t purge_before );
+
 /** Deinitialise the supernode structure and deallocate any memory owned by
  *  it. */
 static void deinit_sn( n2n_sn_t * sss )
@@ -105,6 +153,12 @@ static void deinit_sn( n2n_sn_t * sss )
     }
     sss->sock=-1;
 
+    if ( sss->probe_sock >= 0 )
+    {
+        closesocket(sss->probe_sock);
+    }
+    sss->probe_sock=-1;
+
     if ( sss->mgmt_sock >= 0 )
     {
         closesocket(sss->mgmt_sock);
@@ -112,6 +166,7 @@ static void deinit_sn( n2n_sn_t * sss )
     sss->mgmt_sock=-1;
 
     purge_hashed_peer_list_t(sss->edges, 0xffffffff);
+    purge_arp_bindings(sss, 0xffffffff);
 }
 
 
@@ -126,6 +181,28 @@ static uint16_t reg_lifetime( n2n_sn_t * sss )
 }
 
 
+/** Remember port as an external port of edge unless it is one of the recent
+ *  ones. */
+static void note_nat_port( peer_info_t * edge, uint16_t port )
+{
+    size_t i;
+
+    for ( i=0; i < edge->num_nat_ports; ++i )
+    {
+        if ( port == edge->nat_ports[i] )
+        {
+            return;
+        }
+    }
+
+    memmove( edge->nat_ports + 1, edge->nat_ports, (N2N_NAT_PORTS - 1) * sizeof(edge->nat_ports[0]) );
+    edge->nat_ports[0] = port;
+    if ( edge->num_nat_ports < N2N_NAT_PORTS )
+    {
+        ++(edge->num_nat_ports);
+    }
+}
+
 /** Update the edge table with the details of the edge which contacted the
  *  supernode. */
 static int update_edge( n2n_sn_t * sss, 
@@ -157,11 +234,9 @@ static int update_edge( n2n_sn_t * sss,
         scan->timeout = reg->timeout;
         if(reg->aflags & N2N_AFLAGS_LOCAL_SOCKET) {
             scan->num_sockets = 2;
-            scan->sockets = malloc(scan->num_sockets*sizeof(n2n_sock_t));
             scan->sockets[1] = reg->local_sock;
         } else {
             scan->num_sockets = 1;
-            scan->sockets = malloc(scan->num_sockets*sizeof(n2n_sock_t));
         }
         scan->sockets[0] = scan->sock;
 
@@ -185,27 +260,14 @@ static int update_edge( n2n_sn_t * sss,
         if (0 != sock_equal(sender_sock, &(scan->sock) )) {
             memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
             memcpy(scan->sockets, sender_sock, sizeof(n2n_sock_t));
+            scan->num_nat_ports = 0; /* maybe another NAT */
             num_changes++;
         }
-        if (scan->num_sockets == 1) {
-            if (reg->aflags & N2N_AFLAGS_LOCAL_SOCKET) {
-                scan->num_sockets = 2;
-                free(scan->sockets);
-                scan->sockets = malloc(scan->num_sockets*sizeof(n2n_sock_t));
-                scan->sockets[0] = scan->sock;
-                scan->sockets[1] = reg->local_sock;
-            }
+        if (reg->aflags & N2N_AFLAGS_LOCAL_SOCKET) {
+            scan->num_sockets = 2;
+            scan->sockets[1] = reg->local_sock;
         } else {
-            if (reg->aflags & N2N_AFLAGS_LOCAL_SOCKET) {
-                if (0 != sock_equal(&(reg->local_sock), scan->sockets+1 )) {
-                    memcpy(scan->sockets+1, &(reg->local_sock), sizeof(n2n_sock_t));
-                }
-            } else {
-                scan->num_sockets = 1;
-                free(scan->sockets);
-                scan->sockets = malloc(scan->num_sockets*sizeof(n2n_sock_t));
-                scan->sockets[0] = scan->sock;
-            }
+            scan->num_sockets = 1;
         }
         if (num_changes) {
             traceEvent( TRACE_INFO, "update_edge updated   %s ==> %s",
@@ -219,6 +281,7 @@ static int update_edge( n2n_sn_t * sss,
 
     }
 
+    note_nat_port( scan, sender_sock->port );
     scan->last_seen = now;
     return 0;
 }
@@ -283,6 +346,7 @@ static int try_forward( n2n_sn_t * sss,
         if ( data_sent_len == pktsize )
         {
             ++(sss->stats.fwd);
+            scan->relay_tx_bytes += pktsize;
             traceEvent(TRACE_DEBUG, "unicast %lu to [%s] %s",
                        pktsize,
                        sock_to_cstr( sockbuf, &(scan->sock) ),
@@ -348,6 +412,7 @@ static int try_broadcast( n2n_sn_t * sss,
             else 
             {
                 ++(sss->stats.broadcast);
+                ll->relay_tx_bytes += pktsize;
                 traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
                            pktsize,
                            sock_to_cstr( sockbuf, &(ll->sock) ),
@@ -360,6 +425,492 @@ static int try_broadcast( n2n_sn_t * sss,
 }
 
 
+/* ***************************************************** */
+
+/* ARP proxy.
+ *
+ * Most broadcast traffic in a community is ARP requests. The supernode learns
+ * IP to MAC bindings from the ARP replies and gratuitous ARPs it relays and
+ * uses them to forward later requests for a known IP to the owning edge only.
+ * Only frames carried with the NULL transform can be inspected: the
+ * supernode does not hold the community key. */
+
+#define SN_ETHTYPE_ARP          0x0806
+#define SN_ARP_HTYPE_ETHER      1
+#define SN_ARP_PTYPE_IPV4       0x0800
+#define SN_ARP_OP_REQUEST       1
+#define SN_ARP_OP_REPLY         2
+#define SN_ARP_PKT_SIZE         28      /* ethernet/IPv4 ARP body */
+
+struct sn_arp_pkt
+{
+    uint16_t    op;
+    n2n_mac_t   sha;                    /* sender hardware address */
+    uint32_t    spa;                    /* sender protocol address, network order */
+    n2n_mac_t   tha;                    /* target hardware address */
+    uint32_t    tpa;                    /* target protocol address, network order */
+};
+
+typedef struct sn_arp_pkt sn_arp_pkt_t;
+
+static unsigned int sn_arp_binding_t_hash_function( sn_arp_binding_t * e )
+{
+    unsigned int h = e->ip_addr;
+    size_t i;
+
+    for ( i=0; (i < N2N_COMMUNITY_SIZE) && e->community[i]; ++i )
+    {
+        h = (h * 31) + e->community[i];
+    }
+
+    return h;
+}
+
+/** Decode an ethernet/IPv4 ARP body. @return 0 on success, -1 if not ARP for
+ *  IPv4 over ethernet. */
+static int decode_arp( sn_arp_pkt_t * arp, const uint8_t * base, size_t size )
+{
+    uint16_t htype, ptype;
+    size_t rem = size;
+    size_t idx = 0;
+    uint8_t hlen = 0, plen = 0;
+
+    if ( size < SN_ARP_PKT_SIZE )
+    {
+        return -1;
+    }
+
+    decode_uint16( &htype, base, &rem, &idx );
+    decode_uint16( &ptype, base, &rem, &idx );
+    decode_uint8( &hlen, base, &rem, &idx );
+    decode_uint8( &plen, base, &rem, &idx );
+
+    if ( (SN_ARP_HTYPE_ETHER != htype) || (SN_ARP_PTYPE_IPV4 != ptype)
+         || (N2N_MAC_SIZE != hlen) || (IPV4_SIZE != plen) )
+    {
+        return -1;
+    }
+
+    decode_uint16( &(arp->op), base, &rem, &idx );
+    decode_mac( arp->sha, base, &rem, &idx );
+    decode_buf( (uint8_t *)&(arp->spa), IPV4_SIZE, base, &rem, &idx );
+    decode_mac( arp->tha, base, &rem, &idx );
+    decode_buf( (uint8_t *)&(arp->tpa), IPV4_SIZE, base, &rem, &idx );
+
+    return 0;
+}
+
+static sn_arp_binding_t * find_arp_binding( n2n_sn_t * sss,
+                                            const n2n_community_t community,
+                                            uint32_t ip_addr )
+{
+    sn_arp_binding_t tmp;
+
+    memcpy( tmp.community, community, sizeof(n2n_community_t) );
+    tmp.ip_addr = ip_addr;
+
+    return sglib_hashed_sn_arp_binding_t_find_member( sss->arp_bindings, &tmp );
+}
+
+/** Learn from an ARP body seen in a community. A sender claiming an IP which
+ *  is bound to a different MAC flushes the binding; replies and gratuitous
+ *  ARPs then (re-)establish it. */
+static void arp_learn( n2n_sn_t * sss,
+                       const n2n_common_t * cmn,
+                       const n2n_ETHFRAMEHDR_t * eth,
+                       const sn_arp_pkt_t * arp,
+                       time_t now )
+{
+    sn_arp_binding_t *  bind;
+    macstr_t            mac_buf;
+    macstr_t            mac_buf2;
+    ipstr_t             ip_buf;
+    int                 authoritative;
+
+    if ( 0 == arp->spa )
+    {
+        return; /* ARP probe, no address claimed yet. */
+    }
+
+    authoritative = ( (SN_ARP_OP_REPLY == arp->op)
+                      || ( (SN_ARP_OP_REQUEST == arp->op) && (arp->spa == arp->tpa) ) )
+                    /* Do not trust ARP bodies which disagree with the frame source. */
+                    && ( 0 == memcmp( arp->sha, eth->srcMac, N2N_MAC_SIZE ) );
+
+    bind = find_arp_binding( sss, cmn->community, arp->spa );
+
+    if ( bind && (0 != memcmp( bind->mac_addr, arp->sha, N2N_MAC_SIZE )) )
+    {
+        traceEvent( TRACE_INFO, "arp flush %s: %s -> %s",
+                    intoa( ntohl(arp->spa), ip_buf, sizeof(ip_buf) ),
+                    macaddr_str( mac_buf, bind->mac_addr ),
+                    macaddr_str( mac_buf2, arp->sha ) );
+
+        sglib_hashed_sn_arp_binding_t_delete( sss->arp_bindings, bind );
+        free( bind );
+        bind = NULL;
+        ++(sss->stats.arp_flushed);
+    }
+
+    if ( !authoritative )
+    {
+        return;
+    }
+
+    if ( NULL == bind )
+    {
+        bind = (sn_arp_binding_t *)calloc( 1, sizeof(sn_arp_binding_t) ); /* deallocated in purge_arp_bindings */
+        if ( NULL == bind )
+        {
+            return;
+        }
+
+        memcpy( bind->community, cmn->community, sizeof(n2n_community_t) );
+        bind->ip_addr = arp->spa;
+        memcpy( bind->mac_addr, arp->sha, N2N_MAC_SIZE );
+        sglib_hashed_sn_arp_binding_t_add( sss->arp_bindings, bind );
+
+        traceEvent( TRACE_DEBUG, "arp learn %s -> %s",
+                    intoa( ntohl(arp->spa), ip_buf, sizeof(ip_buf) ),
+                    macaddr_str( mac_buf, arp->sha ) );
+    }
+
+    bind->last_seen = now;
+}
+
+/** Inspect a PACKET payload for ARP. Learns bindings and, for a resolvable
+ *  broadcast request, fills owner with the MAC of the edge to forward to.
+ *
+ *  @return 1 if the request can be forwarded unicast to owner, 0 otherwise.
+ */
+static int arp_proxy( n2n_sn_t * sss,
+                      const n2n_common_t * cmn,
+                      const n2n_PACKET_t * pkt,
+                      const uint8_t * frame,
+                      size_t frame_size,
+                      time_t now,
+                      n2n_mac_t owner )
+{
+    n2n_ETHFRAMEHDR_t   eth;
+    sn_arp_pkt_t        arp;
+    sn_arp_binding_t *  bind;
+    struct peer_info *  edge;
+    uint16_t            ethertype;
+
+    if ( (N2N_TRANSFORM_ID_NULL != pkt->transform) || (frame_size < ETH_FRAMEHDRSIZE) )
+    {
+        return 0; /* Payload is opaque to us. */
+    }
+
+    ethertype = ( (frame[12] & 0xff) << 8 ) | ( frame[13] & 0xff );
+    if ( SN_ETHTYPE_ARP != ethertype )
+    {
+        return 0;
+    }
+
+    if ( 0 != decode_arp( &arp, frame + ETH_FRAMEHDRSIZE, frame_size - ETH_FRAMEHDRSIZE ) )
+    {
+        return 0;
+    }
+
+    decode_ETHFRAMEHDR( &eth, frame );
+    arp_learn( sss, cmn, &eth, &arp, now );
+
+    if ( (SN_ARP_OP_REQUEST != arp.op) || (arp.spa == arp.tpa)
+         || (0 != memcmp( eth.dstMac, broadcast_addr, N2N_MAC_SIZE )) )
+    {
+        return 0;
+    }
+
+    bind = find_arp_binding( sss, cmn->community, arp.tpa );
+    if ( (NULL == bind) || ( (now - bind->last_seen) > N2N_SN_ARP_TTL ) )
+    {
+        return 0;
+    }
+
+    /* Only hand the request to an edge that is still registered in this
+     * community; otherwise fall back to broadcast. */
+    edge = find_peer_by_mac( sss->edges, bind->mac_addr );
+    if ( (NULL == edge)
+         || (0 != memcmp( edge->community_name, cmn->community, sizeof(n2n_community_t) ))
+         || (0 == memcmp( edge->mac_addr, eth.srcMac, N2N_MAC_SIZE )) )
+    {
+        return 0;
+    }
+
+    memcpy( owner, bind->mac_addr, N2N_MAC_SIZE );
+    return 1;
+}
+
+/** Remove ARP bindings not refreshed since purge_before. */
+static size_t purge_arp_bindings( n2n_sn_t * sss, time_t purge_before )
+{
+    sn_arp_binding_t *  ll;
+    struct sglib_hashed_sn_arp_binding_t_iterator it;
+    size_t retval = 0;
+
+    for ( ll=sglib_hashed_sn_arp_binding_t_it_init(&it, sss->arp_bindings); ll!=NULL;
+          ll=sglib_hashed_sn_arp_binding_t_it_next(&it) )
+    {
+        if ( ll->last_seen < purge_before )
+        {
+            ++retval;
+            sglib_hashed_sn_arp_binding_t_delete( sss->arp_bindings, ll );
+            free( ll );
+        }
+    }
+
+    return retval;
+}
+
+/* ***************************************************** */
+
+/* Edge table dump.
+ *
+ * "edges [<cursor> [<pages>]]" on the management port returns the edge table
+ * in pages of at most N2N_SN_DUMP_PAGE_EDGES entries, one datagram per page.
+ * Each page starts with a header line carrying the cursor to ask for next:
+ *
+ *   EDGES total=<n> count=<n> next=<cursor>|end
+ *   EDGE mac=<mac> community=<name> sock=<ip:port> local=<ip:port>|- age=<sec> tx=<bytes> rx=<bytes>
+ *
+ * The cursor is "<bucket>" or "<bucket>.<mac>" and walks the hash table in
+ * (bucket, MAC) order, so the dump needs no state in the supernode. Edges
+ * present for the whole dump are listed exactly once even if others register
+ * or expire in between. A request sends at most N2N_SN_DUMP_MAX_PAGES pages
+ * so a large table never holds up forwarding for long. */
+
+struct sn_dump_cursor
+{
+    unsigned int        bucket;
+    int                 have_mac;       /* resume after mac within bucket */
+    n2n_mac_t           mac;
+};
+
+typedef struct sn_dump_cursor sn_dump_cursor_t;
+
+/** Parse a cursor. An empty string is the start of the table.
+ *
+ *  @return 0 on success, -1 if malformed.
+ */
+static int parse_dump_cursor( sn_dump_cursor_t * cur, const char * str )
+{
+    char macstr[N2N_MACSTR_SIZE];
+    unsigned int i;
+
+    memset( cur, 0, sizeof(sn_dump_cursor_t) );
+
+    if ( '\0' == str[0] )
+    {
+        return 0;
+    }
+
+    switch ( sscanf( str, "%u.%17s", &(cur->bucket), macstr ) )
+    {
+    case 1:
+        break;
+    case 2:
+        if ( 12 != strlen(macstr) )
+        {
+            return -1;
+        }
+        for ( i=0; i<N2N_MAC_SIZE; ++i )
+        {
+            unsigned int b;
+
+            if ( 1 != sscanf( macstr + 2*i, "%2x", &b ) )
+            {
+                return -1;
+            }
+            cur->mac[i] = (uint8_t)b;
+        }
+        cur->have_mac = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    return ( cur->bucket <= PEER_HASH_TAB_SIZE ) ? 0 : -1;
+}
+
+/** Collect the next page of edges after cur in (bucket, MAC) order and
+ *  advance cur past them.
+ *
+ *  @return number of edges stored in page.
+ */
+static size_t collect_dump_page( n2n_sn_t * sss, 
+                                 sn_dump_cursor_t * cur,
+                                 peer_info_t ** page,
+                                 size_t max )
+{
+    size_t num = 0;
+
+    while ( (cur->bucket < PEER_HASH_TAB_SIZE) && (num < max) )
+    {
+        peer_info_t * scan;
+        size_t found = 0;
+        size_t room = max - num;
+        size_t i;
+
+        /* Keep the smallest MACs above the cursor, sorted by insertion. */
+        for ( scan = sss->edges[cur->bucket]; scan; scan = scan->next )
+        {
+            if ( cur->have_mac && (memcmp( scan->mac_addr, cur->mac, N2N_MAC_SIZE ) <= 0) )
+            {
+                continue;
+            }
+
+            if ( (found == room) && (memcmp( scan->mac_addr, page[num+found-1]->mac_addr, N2N_MAC_SIZE ) >= 0) )
+            {
+                continue;
+            }
+
+            /* When the page is full the largest entry falls off the end. */
+            i = (found < room) ? found : found-1;
+            while ( (i > 0) && (memcmp( page[num+i-1]->mac_addr, scan->mac_addr, N2N_MAC_SIZE ) > 0) )
+            {
+                page[num+i] = page[num+i-1];
+                --i;
+            }
+
+            page[num+i] = scan;
+            if ( found < room )
+            {
+                ++found;
+            }
+        }
+
+        num += found;
+
+        if ( found < room )
+        {
+            /* Bucket exhausted. */
+            ++(cur->bucket);
+            cur->have_mac = 0;
+        }
+        else
+        {
+            memcpy( cur->mac, page[num-1]->mac_addr, N2N_MAC_SIZE );
+            cur->have_mac = 1;
+        }
+    }
+
+    return num;
+}
+
+/** Copy a community name for output, replacing anything that would break the
+ *  line format. */
+static char * dump_community_str( char * buf, const n2n_community_t community )
+{
+    size_t i;
+
+    for ( i=0; (i < N2N_COMMUNITY_SIZE) && community[i]; ++i )
+    {
+        buf[i] = ( isgraph( community[i] ) && ('=' != community[i]) ) ? community[i] : '?';
+    }
+    buf[i] = '\0';
+
+    return buf;
+}
+
+/** Send pages of the edge table dump starting at the cursor in args. */
+static int process_mgmt_edges( n2n_sn_t * sss, 
+                               const struct sockaddr_in * sender_sock,
+                               const char * args,
+                               time_t now )
+{
+    char resbuf[N2N_SN_PKTBUF_SIZE];
+    char cursorstr[32];
+    sn_dump_cursor_t cur;
+    peer_info_t * page[N2N_SN_DUMP_PAGE_EDGES];
+    unsigned int pages = 1;
+    unsigned int sent;
+    unsigned int total = (unsigned int)hashed_peer_list_t_size( sss->edges );
+
+    cursorstr[0] = '\0';
+    sscanf( args, "%31s %u", cursorstr, &pages );
+    if ( 0 == strcmp( cursorstr, "-" ) )
+    {
+        cursorstr[0] = '\0';
+    }
+
+    if ( 0 != parse_dump_cursor( &cur, cursorstr ) )
+    {
+        size_t ressize = snprintf( resbuf, N2N_SN_PKTBUF_SIZE, "ERROR bad cursor\n" );
+
+        sendto( sss->mgmt_sock, resbuf, ressize, 0/*flags*/, 
+                (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
+        return -1;
+    }
+
+    pages = MAX( 1, MIN( pages, N2N_SN_DUMP_MAX_PAGES ) );
+
+    for ( sent=0; sent < pages; ++sent )
+    {
+        size_t num;
+        size_t i;
+        size_t ressize = 0;
+        ssize_t r;
+
+        num = collect_dump_page( sss, &cur, page, N2N_SN_DUMP_PAGE_EDGES );
+
+        if ( cur.bucket >= PEER_HASH_TAB_SIZE )
+        {
+            snprintf( cursorstr, sizeof(cursorstr), "end" );
+        }
+        else if ( cur.have_mac )
+        {
+            snprintf( cursorstr, sizeof(cursorstr), "%u.%02x%02x%02x%02x%02x%02x", cur.bucket,
+                      cur.mac[0], cur.mac[1], cur.mac[2], cur.mac[3], cur.mac[4], cur.mac[5] );
+        }
+        else
+        {
+            snprintf( cursorstr, sizeof(cursorstr), "%u", cur.bucket );
+        }
+
+        ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+                             "EDGES total=%u count=%u next=%s\n",
+                             total, (unsigned int)num, cursorstr );
+
+        for ( i=0; i<num; ++i )
+        {
+            const peer_info_t * edge = page[i];
+            macstr_t            mac_buf;
+            n2n_sock_str_t      sockbuf;
+            n2n_sock_str_t      localbuf;
+            char                community[N2N_COMMUNITY_SIZE+1];
+
+            ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+                                 "EDGE mac=%s community=%s sock=%s local=%s age=%lu tx=%llu rx=%llu\n",
+                                 macaddr_str( mac_buf, edge->mac_addr ),
+                                 dump_community_str( community, edge->community_name ),
+                                 sock_to_cstr( sockbuf, &(edge->sock) ),
+                                 (edge->num_sockets > 1) ? sock_to_cstr( localbuf, &(edge->sockets[1]) ) : "-",
+                                 (long unsigned int)(now - edge->last_seen),
+                                 (unsigned long long)edge->relay_tx_bytes,
+                                 (unsigned long long)edge->relay_rx_bytes );
+        }
+
+        r = sendto( sss->mgmt_sock, resbuf, MIN( ressize, N2N_SN_PKTBUF_SIZE-1 ), 0/*flags*/, 
+                    (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
+
+        if ( r <= 0 )
+        {
+            ++(sss->stats.errors);
+            traceEvent( TRACE_ERROR, "process_mgmt_edges : sendto failed. %s", strerror(errno) );
+            return -1;
+        }
+
+        if ( cur.bucket >= PEER_HASH_TAB_SIZE )
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
 static int process_mgmt( n2n_sn_t * sss, 
                          const struct sockaddr_in * sender_sock,
                          const uint8_t * mgmt_buf, 
@@ -372,6 +923,17 @@ static int process_mgmt( n2n_sn_t * sss,
 
     traceEvent( TRACE_DEBUG, "process_mgmt" );
 
+    if ( (mgmt_size >= 5) && (0 == memcmp( mgmt_buf, "edges", 5 )) )
+    {
+        char cmdbuf[64];
+        size_t cmdlen = MIN( mgmt_size - 5, sizeof(cmdbuf) - 1 );
+
+        memcpy( cmdbuf, mgmt_buf + 5, cmdlen );
+        cmdbuf[cmdlen] = '\0';
+
+        return process_mgmt_edges( sss, sender_sock, cmdbuf, now );
+    }
+
     ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
                          "----------------\n" );
 
@@ -402,6 +964,22 @@ static int process_mgmt( n2n_sn_t * sss,
                          "broadcast %u\n",
 			 (unsigned int) sss->stats.broadcast );
 
+    ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
+                         "arp_proxy %u\n",
+			 (unsigned int) sss->stats.arp_proxied );
+
+    ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
+                         "arp_flush %u\n",
+			 (unsigned int) sss->stats.arp_flushed );
+
+    ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
+                         "predict   %u\n",
+			 (unsigned int) sss->stats.predicted );
+
+    ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
+                         "punch_req %u\n",
+			 (unsigned int) sss->stats.punch_req );
+
     ressize += snprintf( resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize, 
                          "last fwd  %lu sec ago\n", 
 			 (long unsigned int)(now - sss->stats.last_fwd) );
@@ -424,6 +1002,113 @@ static int process_mgmt( n2n_sn_t * sss,
 }
 
 
+/** Fill pi with what a peer needs to reach edge.
+ *
+ *  An edge behind a NAT that maps every destination to another external port
+ *  has a public socket of no use to peers: they can only hit the port its
+ *  NAT picks for them. Such NATs mostly hand out ports in sequence or from a
+ *  small pool, so the ports seen on the main and probe ports bound the next
+ *  one. A window of them is offered, reaching further up than down.
+ *
+ *  @return 1 if pi has a port prediction, 0 otherwise.
+ */
+static int fill_peer_info( n2n_PEER_INFO_t * pi, const peer_info_t * edge )
+{
+    uint16_t lo;
+    uint16_t hi;
+    uint32_t span;
+    int32_t start;
+    int i;
+
+    memset( pi, 0, sizeof(n2n_PEER_INFO_t) );
+    pi->timeout = edge->timeout;
+    memcpy( pi->mac, edge->mac_addr, sizeof(n2n_mac_t) );
+    for(i=0; i<edge->num_sockets; i++)
+        pi->sockets[i] = edge->sockets[i];
+    if(edge->num_sockets > 1)
+        pi->aflags |= N2N_AFLAGS_LOCAL_SOCKET;
+
+    if ( edge->num_nat_ports < 2 )
+    {
+        return 0; /* one port for all destinations so far */
+    }
+
+    lo = hi = edge->nat_ports[0];
+    for ( i=1; i < edge->num_nat_ports; ++i )
+    {
+        lo = MIN( lo, edge->nat_ports[i] );
+        hi = MAX( hi, edge->nat_ports[i] );
+    }
+
+    span = hi - lo + 1;
+    if ( span > N2N_SN_PREDICT_MAX_SPAN )
+    {
+        return 0; /* random ports */
+    }
+
+    if ( span >= N2N_SN_PREDICT_PORTS )
+    {
+        start = hi - N2N_SN_PREDICT_PORTS / 4;
+    }
+    else
+    {
+        start = lo - (N2N_SN_PREDICT_PORTS - span) / 4;
+    }
+    start = MAX( start, 1024 );
+    start = MIN( start, 65536 - N2N_SN_PREDICT_PORTS );
+
+    pi->aflags |= N2N_AFLAGS_PORT_PREDICT;
+    pi->pred_port = (uint16_t)start;
+    pi->pred_count = N2N_SN_PREDICT_PORTS;
+
+    return 1;
+}
+
+/** Note the external port the NAT of an edge gave for the probe port.
+ *
+ *  Edges send a REGISTER_SUPER there with each registration. It is not
+ *  answered and only counts for registered edges at their registered address.
+ */
+static void process_probe( n2n_sn_t * sss, 
+                           const struct sockaddr_in * sender_sock,
+                           const uint8_t * udp_buf, 
+                           size_t udp_size )
+{
+    n2n_common_t            cmn;
+    n2n_REGISTER_SUPER_t    regs;
+    peer_info_t *           scan;
+    size_t                  rem = udp_size;
+    size_t                  idx = 0;
+    uint8_t                 num_nat_ports;
+    macstr_t                mac_buf;
+
+    if ( (decode_common( &cmn, udp_buf, &rem, &idx ) < 0) || (n2n_register_super != cmn.pc) )
+    {
+        return;
+    }
+
+    decode_REGISTER_SUPER( &regs, &cmn, udp_buf, &rem, &idx );
+
+    scan = find_peer_by_mac( sss->edges, regs.edgeMac );
+    if ( (NULL == scan) || (AF_INET != scan->sock.family)
+         || (0 != memcmp( cmn.community, scan->community_name, sizeof(n2n_community_t) ))
+         || (0 != memcmp( scan->sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE )) )
+    {
+        return;
+    }
+
+    num_nat_ports = scan->num_nat_ports;
+    note_nat_port( scan, ntohs(sender_sock->sin_port) );
+
+    if ( scan->num_nat_ports != num_nat_ports )
+    {
+        traceEvent( TRACE_DEBUG, "Rx probe from %s: NAT port %u, %u ports seen",
+                    macaddr_str( mac_buf, regs.edgeMac ),
+                    (unsigned int)ntohs(sender_sock->sin_port), (unsigned int)scan->num_nat_ports );
+    }
+}
+
+
 /** Examine a datagram and determine what to do with it.
  *
  */
@@ -447,7 +1132,7 @@ static int process_udp( n2n_sn_t * sss,
     size_t              encx=0;
     uint8_t             encbuf[N2N_SN_PKTBUF_SIZE];
     n2n_ETHFRAMEHDR_t   eth;
-    int                 i;
+    n2n_mac_t           arp_owner;
 
     /* for PACKET packages */
     n2n_PACKET_t                    pkt; 
@@ -455,11 +1140,17 @@ static int process_udp( n2n_sn_t * sss,
     /* for QUERY_PEER packages */
     n2n_QUERY_PEER_t                query;
     struct peer_info *              scan;
+    struct peer_info *              querier;
     n2n_PEER_INFO_t                 pi;
+    n2n_PEER_INFO_t                 pi2;
+    int                             predicted;
 
     /* for REGISTER packages */
     n2n_REGISTER_t                  reg;
 
+    /* for FEC packages */
+    n2n_FEC_t                       fec;
+
     /* for REGISTER_SUPER packages */
     n2n_REGISTER_SUPER_t            regs;
     n2n_REGISTER_SUPER_ACK_t        ack;
@@ -516,6 +1207,12 @@ static int process_udp( n2n_sn_t * sss,
 
         if ( !from_supernode )
         {
+            scan = find_peer_by_mac( sss->edges, eth.srcMac );
+            if ( scan )
+            {
+                scan->relay_rx_bytes += udp_size;
+            }
+
             memcpy( &cmn2, &cmn, sizeof( n2n_common_t ) );
 
             /* We are going to add socket even if it was not there before */
@@ -545,6 +1242,14 @@ static int process_udp( n2n_sn_t * sss,
         {
             try_forward( sss, &cmn, eth.dstMac, rec_buf, encx );
         }
+        else if ( arp_proxy( sss, &cmn, &pkt, udp_buf+idx, udp_size-idx, now, arp_owner ) )
+        {
+            /* ARP request for a known binding: only the owner needs it. */
+            traceEvent( TRACE_DEBUG, "Rx ARP request proxied to %s",
+                        macaddr_str( mac_buf, arp_owner ) );
+            ++(sss->stats.arp_proxied);
+            try_forward( sss, &cmn, arp_owner, rec_buf, encx );
+        }
         else
         {
             try_broadcast( sss, &cmn, eth.srcMac, rec_buf, encx );
@@ -565,21 +1270,40 @@ static int process_udp( n2n_sn_t * sss,
             cmn2.flags = N2N_FLAGS_FROM_SUPERNODE;
             memcpy( cmn2.community, cmn.community, sizeof(n2n_community_t) );
 
-            pi.aflags = 0;
-            pi.timeout = scan->timeout;
-            memcpy( pi.mac, query.targetMac, sizeof(n2n_mac_t) );
-            for(i=0; i<scan->num_sockets; i++)
-                pi.sockets[i] = scan->sockets[i];
-            if(scan->num_sockets > 1)
-                pi.aflags |= N2N_AFLAGS_LOCAL_SOCKET;
+            predicted = fill_peer_info( &pi, scan );
+            sss->stats.predicted += predicted;
 
             encode_PEER_INFO( encbuf, &encx, &cmn2, &pi );
 
             sendto( sss->sock, encbuf, encx, 0, 
                     (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
 
-            traceEvent( TRACE_DEBUG, "Tx PEER_INFO to %s",
-                        macaddr_str( mac_buf, query.srcMac ) );
+            traceEvent( TRACE_DEBUG, "Tx PEER_INFO to %s%s",
+                        macaddr_str( mac_buf, query.srcMac ), predicted ? " with predicted ports" : "" );
+
+            /* Behind a symmetric NAT a port only opens when its edge sends to
+             * that peer: have the target punch at the same time. */
+            querier = find_peer_by_mac( sss->edges, query.srcMac );
+            if ( querier && (0 == memcmp(cmn.community, querier->community_name, sizeof(n2n_community_t))) )
+            {
+                if ( fill_peer_info( &pi2, querier ) )
+                {
+                    ++predicted;
+                    ++(sss->stats.predicted);
+                }
+                if ( predicted )
+                {
+                    pi2.aflags |= N2N_AFLAGS_PUNCH;
+                    encx = 0;
+                    encode_PEER_INFO( encbuf, &encx, &cmn2, &pi2 );
+                    sendto_sock( sss, &(scan->sock), encbuf, encx );
+
+                    ++(sss->stats.punch_req);
+                    traceEvent( TRACE_DEBUG, "Tx PEER_INFO on %s to %s to punch back",
+                                macaddr_str( mac_buf, query.srcMac ),
+                                macaddr_str( mac_buf2, query.targetMac ) );
+                }
+            }
         } else {
             traceEvent( TRACE_DEBUG, "Ignoring QUERY_PEER for unknown edge %s",
                         macaddr_str( mac_buf, query.targetMac ) );
@@ -640,6 +1364,44 @@ static int process_udp( n2n_sn_t * sss,
     case MSG_TYPE_REGISTER_ACK:
         traceEvent( TRACE_DEBUG, "Rx REGISTER_ACK (NOT IMPLEMENTED) SHould not be via supernode" );
         break;
+    case MSG_TYPE_FEC:
+        /* FEC parity or loss report from one edge to another. Only the
+         * common header changes. */
+        sss->stats.last_fwd=now;
+        if ( decode_FEC( &fec, &cmn, udp_buf, &rem, &idx ) < 0 )
+        {
+            traceEvent( TRACE_WARNING, "Rx FEC undecodable" );
+            break;
+        }
+
+        if ( is_multi_broadcast( fec.dstMac ) )
+        {
+            traceEvent( TRACE_WARNING, "Rx FEC with multicast destination" );
+            break;
+        }
+
+        traceEvent( TRACE_DEBUG, "Rx FEC %s -> %s %s",
+                    macaddr_str( mac_buf, fec.srcMac ),
+                    macaddr_str( mac_buf2, fec.dstMac ),
+                    (from_supernode?"from sn":"local") );
+
+        if ( !from_supernode )
+        {
+            memcpy( &cmn2, &cmn, sizeof( n2n_common_t ) );
+            cmn2.flags |= N2N_FLAGS_FROM_SUPERNODE;
+
+            rec_buf = encbuf;
+            encode_common( encbuf, &encx, &cmn2 );
+            encode_buf( encbuf, &encx, (udp_buf + encx), (udp_size - encx) );
+        }
+        else
+        {
+            rec_buf = udp_buf;
+            encx = udp_size;
+        }
+
+        try_forward( sss, &cmn, fec.dstMac, rec_buf, encx );
+        break;
     case MSG_TYPE_REGISTER_SUPER:
         /* Edge requesting registration with us.  */
         
@@ -694,6 +1456,7 @@ static int process_udp( n2n_sn_t * sss,
 
         ack.num_sn=0; /* No backup */
         memset( &(ack.sn_bak), 0, sizeof(n2n_sock_t) );
+        ack.probe_port = (sss->probe_sock >= 0) ? sss->probe_port : 0;
 
         traceEvent( TRACE_DEBUG, "Rx REGISTER_SUPER for %s [%s]",
                     macaddr_str( mac_buf, regs.edgeMac ),
@@ -725,6 +1488,7 @@ static void exit_help(int argc, char * const argv[])
 {
     fprintf( stderr, "%s usage\n", argv[0] );
     fprintf( stderr, "-l <lport>\tSet UDP main listen port to <lport>\n" );
+    fprintf( stderr, "-p <port> \tSet UDP port showing NAT port allocation of edges (default none)\n" );
 
 #if defined(N2N_HAVE_DAEMON)
     fprintf( stderr, "-f        \tRun in foreground.\n" );
@@ -746,6 +1510,7 @@ static int run_loop( n2n_sn_t * sss );
 static const struct option long_options[] = {
   { "foreground",      no_argument,       NULL, 'f' },
   { "local-port",      required_argument, NULL, 'l' },
+  { "probe-port",      required_argument, NULL, 'p' },
   { "help"   ,         no_argument,       NULL, 'h' },
   { "verbose",         no_argument,       NULL, 'v' },
   { NULL,              0,                 NULL,  0  }
@@ -780,13 +1545,16 @@ int main( int argc, char * const argv[] )
     {
         int opt;
 
-        while((opt = getopt_long(argc, argv, "fl:u:g:vh", long_options, NULL)) != -1) 
+        while((opt = getopt_long(argc, argv, "fl:p:u:g:vh", long_options, NULL)) != -1) 
         {
             switch (opt) 
             {
             case 'l': /* local-port */
                 sss.lport = atoi(optarg);
                 break;
+            case 'p': /* probe-port */
+                sss.probe_port = atoi(optarg);
+                break;
             case 'f': /* foreground */
                 sss.daemon = 0;
                 break;
@@ -838,6 +1606,19 @@ int main( int argc, char * const argv[] )
         traceEvent( TRACE_NORMAL, "supernode is listening on UDP %u (main)", sss.lport );
     }
 
+    if ( sss.probe_port > 0 )
+    {
+        sss.probe_sock = open_socket(sss.probe_port, 1 /*bind ANY*/ );
+        if ( -1 == sss.probe_sock )
+        {
+            traceEvent( TRACE_WARNING, "Failed to open probe socket, NAT ports are not predicted. %s", strerror(errno) );
+        }
+        else
+        {
+            traceEvent( TRACE_NORMAL, "supernode is listening on UDP %u (probe)", sss.probe_port );
+        }
+    }
+
     sss.mgmt_sock = open_socket(N2N_SN_MGMT_PORT, 0 /* bind LOOPBACK */ );
     if ( -1 == sss.mgmt_sock )
     {
@@ -859,6 +1640,10 @@ int main( int argc, char * const argv[] )
 	    setregid( groupid, groupid );
     }
 #endif
+    /* After daemon() as threads do not survive fork, and after the startup
+     * checks so that their errors are written synchronously. */
+    traceEventStartAsync();
+
     traceEvent(TRACE_NORMAL, "supernode started");
 
     return run_loop(&sss);
@@ -885,9 +1670,14 @@ static int run_loop( n2n_sn_t * sss )
 
         FD_ZERO(&socket_mask);
         max_sock = MAX(sss->sock, sss->mgmt_sock);
+        max_sock = MAX(max_sock, sss->probe_sock);
 
         FD_SET(sss->sock, &socket_mask);
         FD_SET(sss->mgmt_sock, &socket_mask);
+        if ( sss->probe_sock >= 0 )
+        {
+            FD_SET(sss->probe_sock, &socket_mask);
+        }
 
         wait_time.tv_sec = 10; wait_time.tv_usec = 0;
         rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
@@ -921,6 +1711,21 @@ static int run_loop( n2n_sn_t * sss )
                 }
             }
 
+            if ( (sss->probe_sock >= 0) && FD_ISSET(sss->probe_sock, &socket_mask) )
+            {
+                struct sockaddr_in  sender_sock;
+                socklen_t           i;
+
+                i = sizeof(sender_sock);
+                bread = recvfrom( sss->probe_sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
+				  (struct sockaddr *)&sender_sock, (socklen_t*)&i);
+
+                if ( bread > 0 )
+                {
+                    process_probe( sss, &sender_sock, pktbuf, bread );
+                }
+            }
+
             if (FD_ISSET(sss->mgmt_sock, &socket_mask)) 
             {
                 struct sockaddr_in  sender_sock;
@@ -947,6 +1752,7 @@ static int run_loop( n2n_sn_t * sss )
         }
         if ((now - sss->last_purge) >= PURGE_REGISTRATION_FREQUENCY) {
             hashed_purge_expired_registrations( sss->edges );
+            purge_arp_bindings( sss, now - N2N_SN_ARP_TTL );
             sss->last_purge = now;
         }
 
@@ -955,6 +1761,8 @@ static int run_loop( n2n_sn_t * sss )
     CloseSql();
     deinit_sn( sss );
 
+    traceEventStopAsync();
+
     return 0;
 }
 
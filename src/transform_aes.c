@@ -18,6 +18,7 @@
 #define N2N_AES_NUM_SA                  32 /* space for SAa */
 
 #define N2N_AES_TRANSFORM_VERSION       1  /* version of the transform encoding */
+#define N2N_AES_TRANSFORM_VERSION_2     2  /* whole IV reset, sent on request only */
 #define N2N_AES_IVEC_SIZE               32 /* Enough space for biggest AES ivec */
 
 typedef unsigned char n2n_aes_ivec_t[N2N_AES_IVEC_SIZE];
@@ -46,6 +47,7 @@ struct transop_aes
 {
     ssize_t             tx_sa;
     size_t              num_sa;
+    uint8_t             tx_version;     /* encoding version sent */
     sa_aes_t            sa[N2N_AES_NUM_SA];
 };
 
@@ -120,74 +122,82 @@ static size_t aes_best_keysize(size_t numBytes)
  *
  *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
  *         |<------ encrypted ------>|
+ *
+ *  The payload in pb is encrypted where it is; nonce and header go into the
+ *  headroom and the CBC padding into the tailroom.
  */
+static int transop_encode_aes_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    transop_aes_t * priv = (transop_aes_t *)arg->priv;
+    sa_aes_t * sa;
+    uint32_t nonce;
+    size_t in_len = pb->len;
+    size_t idx=0;
+    size_t len;
+    size_t len2;
+
+    /* Need at least one encrypted byte at the end for the padding. */
+    len = in_len + TRANSOP_AES_NONCE_SIZE;
+    len2 = ( (len / AES_BLOCK_SIZE) + 1) * AES_BLOCK_SIZE; /* Round up to next whole AES adding at least one byte. */
+
+    if ( (NULL == n2n_pktbuf_put( pb, len2 - len ))
+         || (NULL == n2n_pktbuf_push( pb, TRANSOP_AES_NONCE_SIZE )) )
+    {
+        traceEvent( TRACE_ERROR, "encode_aes no room for nonce and padding." );
+        return -1;
+    }
+
+    /* The transmit sa is periodically updated */
+    sa = &(priv->sa[aes_choose_tx_sa( priv )]); /* Proper Tx SA index */
+
+    traceEvent( TRACE_DEBUG, "encode_aes %lu with SA %lu.", in_len, sa->sa_id );
+
+    nonce = rand();
+    memcpy( pb->data, &nonce, TRANSOP_AES_NONCE_SIZE );
+    pb->data[ len2-1 ] = (len2-len);
+    traceEvent( TRACE_DEBUG, "padding = %u", pb->data[ len2-1 ] );
+
+    memset( &(sa->enc_ivec), 0,
+            (N2N_AES_TRANSFORM_VERSION_2 == priv->tx_version) ? N2N_AES_IVEC_SIZE : sizeof(int) );
+    AES_cbc_encrypt( pb->data, pb->data, len2, /* in place */
+                     &(sa->enc_key), sa->enc_ivec, 1 /* encrypt */ );
+
+    if ( NULL == n2n_pktbuf_push( pb, TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE ) )
+    {
+        traceEvent( TRACE_ERROR, "encode_aes no headroom." );
+        return -1;
+    }
+
+    encode_uint8( pb->data, &idx, priv->tx_version );
+    encode_uint32( pb->data, &idx, sa->sa_id );
+
+    return 0;
+}
+
+/** Encode into a separate buffer. See transop_encode_aes_pb(). */
 static int transop_encode_aes( n2n_trans_op_t * arg,
                                    uint8_t * outbuf,
                                    size_t out_len,
                                    const uint8_t * inbuf,
                                    size_t in_len )
 {
-    int len2=-1;
-    transop_aes_t * priv = (transop_aes_t *)arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
-    uint32_t * pnonce;
+    const size_t hdr = TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_NONCE_SIZE;
+    n2n_pktbuf_t pb;
 
-    if ( (in_len + TRANSOP_AES_NONCE_SIZE) <= N2N_PKT_BUF_SIZE )
+    if ( (in_len + hdr) > out_len )
     {
-        if ( (in_len + TRANSOP_AES_NONCE_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_VER_SIZE) <= out_len )
-        {
-            int len=-1;
-            size_t idx=0;
-            sa_aes_t * sa;
-            size_t tx_sa_num = 0;
-
-            /* The transmit sa is periodically updated */
-            tx_sa_num = aes_choose_tx_sa( priv );
-
-            sa = &(priv->sa[tx_sa_num]); /* Proper Tx SA index */
-        
-            traceEvent( TRACE_DEBUG, "encode_aes %lu with SA %lu.", in_len, sa->sa_id );
-            
-            /* Encode the aes format version. */
-            encode_uint8( outbuf, &idx, N2N_AES_TRANSFORM_VERSION );
-
-            /* Encode the security association (SA) number */
-            encode_uint32( outbuf, &idx, sa->sa_id );
-
-            /* Encrypt the assembly contents and write the ciphertext after the SA. */
-            len = in_len + TRANSOP_AES_NONCE_SIZE;
-
-            /* The assembly buffer is a source for encrypting data. The nonce is
-             * written in first followed by the packet payload. The whole
-             * contents of assembly are encrypted. */
-            pnonce = (uint32_t *)assembly;
-            *pnonce = rand();
-            memcpy( assembly + TRANSOP_AES_NONCE_SIZE, inbuf, in_len );
-
-            /* Need at least one encrypted byte at the end for the padding. */
-            len2 = ( (len / AES_BLOCK_SIZE) + 1) * AES_BLOCK_SIZE; /* Round up to next whole AES adding at least one byte. */
-            assembly[ len2-1 ]=(len2-len);
-            traceEvent( TRACE_DEBUG, "padding = %u", assembly[ len2-1 ] );
-
-            memset( &(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
-            AES_cbc_encrypt( assembly, /* source */
-                             outbuf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE, /* dest */
-                             len2, /* enc size */
-                             &(sa->enc_key), sa->enc_ivec, 1 /* encrypt */ );
-
-            len2 += TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE; /* size of data carried in UDP. */
-        }
-        else
-        {
-            traceEvent( TRACE_ERROR, "encode_aes outbuf too small." );
-        }
+        traceEvent( TRACE_ERROR, "encode_aes outbuf too small." );
+        return -1;
     }
-    else
+
+    memcpy( outbuf + hdr, inbuf, in_len );
+    n2n_pktbuf_init( &pb, outbuf, out_len, hdr, in_len );
+    if ( 0 != transop_encode_aes_pb( arg, &pb ) )
     {
-        traceEvent( TRACE_ERROR, "encode_aes inbuf too big to encrypt." );
+        return -1;
     }
 
-    return len2;
+    return pb.len;
 }
 
 
@@ -214,6 +224,20 @@ static ssize_t aes_find_sa( const transop_aes_t * priv, const n2n_sa_t req_id )
 }
 
 
+/** Reset the receive IV of sa for a packet of encoding version ver.
+ *
+ *  Version 1 encoders reset only the first sizeof(int) bytes of the IV and
+ *  carry the rest over from the previous packet. Those packets decode intact
+ *  only in the order they were sent. Version 2 zeroes the whole IV, so every
+ *  packet decodes on its own. Edges send version 1 unless told otherwise by
+ *  transop_aes_set_version(), as edges of earlier releases drop version 2.
+ */
+static void aes_reset_dec_ivec( sa_aes_t * sa, uint8_t ver )
+{
+    memset( &(sa->dec_ivec), 0,
+            (N2N_AES_TRANSFORM_VERSION_2 == ver) ? N2N_AES_IVEC_SIZE : sizeof(int) );
+}
+
 /** The aes packet format consists of:
  *
  *  - a 8-bit aes encoding version in clear text
@@ -246,7 +270,8 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
         /* Get the encoding version to make sure it is supported */
         decode_uint8( &aes_enc_ver, inbuf, &rem, &idx );
 
-        if ( N2N_AES_TRANSFORM_VERSION == aes_enc_ver )
+        if ( (N2N_AES_TRANSFORM_VERSION == aes_enc_ver)
+             || (N2N_AES_TRANSFORM_VERSION_2 == aes_enc_ver) )
         {
             /* Get the SA number and make sure we are decrypting with the right one. */
             decode_uint32( &sa_rx, inbuf, &rem, &idx );
@@ -264,7 +289,7 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
                 {
                     uint8_t padding;
 
-                    memset( &(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
+                    aes_reset_dec_ivec( sa, aes_enc_ver );
                     AES_cbc_encrypt( (inbuf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE),
                                      assembly, /* destination */
                                      len, 
@@ -326,6 +351,72 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
     return len;
 }
 
+/** Decode the packet in pb where it is; pb is left on the payload. See
+ *  transop_decode_aes(). */
+static int transop_decode_aes_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    transop_aes_t * priv = (transop_aes_t *)arg->priv;
+    const size_t hdr = TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE;
+    n2n_sa_t sa_rx;
+    ssize_t sa_idx;
+    sa_aes_t * sa;
+    size_t rem=pb->len;
+    size_t idx=0;
+    uint8_t aes_enc_ver=0;
+    uint8_t padding;
+    size_t len;
+
+    if ( pb->len < (hdr + AES_BLOCK_SIZE) )
+    {
+        traceEvent( TRACE_ERROR, "decode_aes inbuf wrong size (%lu) to decrypt.", pb->len );
+        return -1;
+    }
+
+    decode_uint8( &aes_enc_ver, pb->data, &rem, &idx );
+    if ( (N2N_AES_TRANSFORM_VERSION != aes_enc_ver)
+         && (N2N_AES_TRANSFORM_VERSION_2 != aes_enc_ver) )
+    {
+        traceEvent( TRACE_ERROR, "decode_aes unsupported aes version %u.", aes_enc_ver );
+        return -1;
+    }
+
+    decode_uint32( &sa_rx, pb->data, &rem, &idx );
+    sa_idx = aes_find_sa( priv, sa_rx );
+    if ( sa_idx < 0 )
+    {
+        traceEvent( TRACE_ERROR, "decode_aes SA number %lu not found.", sa_rx );
+        return -1;
+    }
+
+    sa = &(priv->sa[sa_idx]);
+    traceEvent( TRACE_DEBUG, "decode_aes %lu with SA %lu.", pb->len, sa_rx );
+
+    len = pb->len - hdr;
+    if ( 0 != (len % AES_BLOCK_SIZE) )
+    {
+        traceEvent( TRACE_WARNING, "Encrypted length %d is not a multiple of AES_BLOCK_SIZE (%d)", (int)len, AES_BLOCK_SIZE );
+        return -1;
+    }
+
+    n2n_pktbuf_pull( pb, hdr );
+
+    aes_reset_dec_ivec( sa, aes_enc_ver );
+    AES_cbc_encrypt( pb->data, pb->data, len, /* in place */
+                     &(sa->dec_key), sa->dec_ivec, 0 /* decrypt */ );
+
+    /* last byte is how much was padding */
+    padding = pb->data[ len-1 ];
+    if ( len < (padding + TRANSOP_AES_NONCE_SIZE) )
+    {
+        traceEvent( TRACE_WARNING, "UDP payload decryption failed." );
+        return -1;
+    }
+
+    /* Step over 4-byte random nonce value */
+    n2n_pktbuf_pull( pb, TRANSOP_AES_NONCE_SIZE );
+    return n2n_pktbuf_trim( pb, len - padding - TRANSOP_AES_NONCE_SIZE );
+}
+
 static int transop_addspec_aes( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
 {
     int retval = 1;
@@ -365,8 +456,8 @@ static int transop_addspec_aes( n2n_trans_op_t * arg, const n2n_cipherspec_t * c
                 memset( &(sa->enc_key), 0, sizeof(AES_KEY) );
                 memset( &(sa->dec_key), 0, sizeof(AES_KEY) );
 
-                memset( &(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
-                memset( &(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
+                memset( &(sa->enc_ivec), 0, N2N_AES_IVEC_SIZE );
+                memset( &(sa->dec_ivec), 0, N2N_AES_IVEC_SIZE );
 
                 aes_keysize_bytes = aes_best_keysize(pstat);
                 aes_keysize_bits = 8 * aes_keysize_bytes;
@@ -467,13 +558,17 @@ int transop_aes_init( n2n_trans_op_t * ttt )
         ttt->priv = priv;
         priv->num_sa=0;
         priv->tx_sa=0; /* We will use this sa index for encoding. */
+        priv->tx_version=N2N_AES_TRANSFORM_VERSION;
 
         ttt->transform_id = N2N_TRANSFORM_ID_AESCBC;
         ttt->addspec = transop_addspec_aes;
         ttt->tick = transop_tick_aes; /* chooses a new tx_sa */
         ttt->deinit = transop_deinit_aes;
         ttt->fwd = transop_encode_aes;
+        ttt->overhead = TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_NONCE_SIZE + AES_BLOCK_SIZE;
         ttt->rev = transop_decode_aes;
+        ttt->fwd_pb = transop_encode_aes_pb;
+        ttt->rev_pb = transop_decode_aes_pb;
 
         for(i=0; i<N2N_AES_NUM_SA; ++i)
         {
@@ -481,9 +576,9 @@ int transop_aes_init( n2n_trans_op_t * ttt )
             sa->sa_id=0;
             memset( &(sa->spec), 0, sizeof(n2n_cipherspec_t) );
             memset( &(sa->enc_key), 0, sizeof(AES_KEY) );
-            memset( &(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
+            memset( &(sa->enc_ivec), 0, N2N_AES_IVEC_SIZE );
             memset( &(sa->dec_key), 0, sizeof(AES_KEY) );
-            memset( &(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE) );
+            memset( &(sa->dec_ivec), 0, N2N_AES_IVEC_SIZE );
         }
 
         retval = 0;
@@ -497,6 +592,22 @@ int transop_aes_init( n2n_trans_op_t * ttt )
     return retval;
 }
 
+/** Make ttt send AES encoding version 1 or 2. Both are always decoded.
+ *
+ *  @return 0 on success, -1 for another version. */
+int transop_aes_set_version( n2n_trans_op_t * ttt, uint8_t version )
+{
+    transop_aes_t * priv = (transop_aes_t *)ttt->priv;
+
+    if ( (N2N_AES_TRANSFORM_VERSION != version) && (N2N_AES_TRANSFORM_VERSION_2 != version) )
+    {
+        return -1;
+    }
+
+    priv->tx_version = version;
+    return 0;
+}
+
 #else /* #if defined(N2N_HAVE_AES) */
 
 struct transop_aes
@@ -593,5 +704,10 @@ int transop_aes_init( n2n_trans_op_t * ttt )
     return retval;
 }
 
+int transop_aes_set_version( n2n_trans_op_t * ttt, uint8_t version )
+{
+    return -1;
+}
+
 #endif /* #if defined(N2N_HAVE_AES) */
 
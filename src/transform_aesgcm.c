@@ -0,0 +1,501 @@
+/* (c) 2026 n2n contributors */
+
+/** AES-GCM transform using the OpenSSL EVP interface.
+ *
+ *  EVP picks the AES-NI/PCLMUL code paths where the CPU has them. Keys come
+ *  from the keyfile in the same "<sa>_<hexkey>" form as AES-CBC and choose
+ *  AES-128, -192 or -256 by length. Unlike the CBC transform every packet
+ *  carries an authentication tag covering the payload and the transform
+ *  header.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#if defined(N2N_HAVE_AES)
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#ifndef _MSC_VER
+/* Not included in Visual Studio 2008 */
+#include <strings.h> /* index() */
+#endif
+
+#define N2N_AESGCM_NUM_SA               32 /* space for SAs */
+
+#define N2N_AESGCM_TRANSFORM_VERSION    1  /* version of the transform encoding */
+
+#define TRANSOP_AESGCM_VER_SIZE         1
+#define TRANSOP_AESGCM_SA_SIZE          4
+#define TRANSOP_AESGCM_SALT_SIZE        4
+#define TRANSOP_AESGCM_NONCE_SIZE       12 /* random salt then 64-bit counter */
+#define TRANSOP_AESGCM_TAG_SIZE         16
+#define TRANSOP_AESGCM_HDR_SIZE         (TRANSOP_AESGCM_VER_SIZE + TRANSOP_AESGCM_SA_SIZE + TRANSOP_AESGCM_NONCE_SIZE)
+
+struct sa_aesgcm
+{
+    n2n_cipherspec_t    spec;           /* cipher spec parameters */
+    n2n_sa_t            sa_id;          /* security association index */
+    EVP_CIPHER_CTX *    enc_ctx;        /* tx, key set, IV set per packet */
+    EVP_CIPHER_CTX *    dec_ctx;        /* rx */
+};
+
+typedef struct sa_aesgcm sa_aesgcm_t;
+
+
+/** AES-GCM transform state data.
+ *
+ *  The nonce of a packet is the transop's salt followed by a 64-bit counter.
+ *  Salt and counter start are both drawn at random when the transop is
+ *  created, so every sender - each edge, and each multi-queue worker with its
+ *  own transop - starts at an independent random point of the 96-bit nonce
+ *  space; a 32-bit salt alone is likely to repeat among some 10000 senders.
+ */
+struct transop_aesgcm
+{
+    ssize_t             tx_sa;
+    size_t              num_sa;
+    uint8_t             salt[TRANSOP_AESGCM_SALT_SIZE];
+    uint64_t            tx_counter;
+    sa_aesgcm_t         sa[N2N_AESGCM_NUM_SA];
+};
+
+typedef struct transop_aesgcm transop_aesgcm_t;
+
+static int transop_deinit_aesgcm( n2n_trans_op_t * arg )
+{
+    transop_aesgcm_t * priv = (transop_aesgcm_t *)arg->priv;
+    size_t i;
+
+    if ( priv )
+    {
+        for ( i=0; i < priv->num_sa; ++i )
+        {
+            EVP_CIPHER_CTX_free( priv->sa[i].enc_ctx );
+            EVP_CIPHER_CTX_free( priv->sa[i].dec_ctx );
+        }
+
+        free(priv);
+    }
+
+    arg->priv=NULL; /* return to fully uninitialised state */
+
+    return 0;
+}
+
+static const EVP_CIPHER * aesgcm_cipher( size_t key_bytes )
+{
+    if ( key_bytes >= 32 )
+    {
+        return EVP_aes_256_gcm();
+    }
+    else if ( key_bytes >= 24 )
+    {
+        return EVP_aes_192_gcm();
+    }
+    else
+    {
+        return EVP_aes_128_gcm();
+    }
+}
+
+/** The AES-GCM packet format consists of:
+ *
+ *  - a 8-bit encoding version in clear text
+ *  - a 32-bit SA number in clear text
+ *  - a 96-bit nonce in clear text
+ *  - the encrypted payload
+ *  - a 128-bit tag authenticating the header and payload
+ *
+ *  [V|SSSS|NNNNNNNNNNNN|DDDDDDDDDDDDDDDD|TTTTTTTTTTTTTTTT]
+ *                      |<-encrypted-->|
+ */
+static int transop_encode_aesgcm( n2n_trans_op_t * arg,
+                                  uint8_t * outbuf,
+                                  size_t out_len,
+                                  const uint8_t * inbuf,
+                                  size_t in_len )
+{
+    transop_aesgcm_t * priv = (transop_aesgcm_t *)arg->priv;
+    sa_aesgcm_t * sa;
+    uint8_t * nonce;
+    size_t idx=0;
+    int len;
+    int fin;
+
+    if ( (in_len + TRANSOP_AESGCM_HDR_SIZE + TRANSOP_AESGCM_TAG_SIZE) > out_len )
+    {
+        traceEvent( TRACE_ERROR, "encode_aesgcm outbuf too small." );
+        return -1;
+    }
+
+    if ( 0 == priv->num_sa )
+    {
+        traceEvent( TRACE_ERROR, "encode_aesgcm no SA." );
+        return -1;
+    }
+
+    sa = &(priv->sa[priv->tx_sa]); /* set in tick */
+
+    traceEvent( TRACE_DEBUG, "encode_aesgcm %lu with SA %lu.", in_len, sa->sa_id );
+
+    encode_uint8( outbuf, &idx, N2N_AESGCM_TRANSFORM_VERSION );
+    encode_uint32( outbuf, &idx, sa->sa_id );
+
+    nonce = outbuf + idx;
+    memcpy( nonce, priv->salt, TRANSOP_AESGCM_SALT_SIZE );
+    idx += TRANSOP_AESGCM_SALT_SIZE;
+    encode_uint32( outbuf, &idx, (uint32_t)(priv->tx_counter >> 32) );
+    encode_uint32( outbuf, &idx, (uint32_t)(priv->tx_counter) );
+    ++(priv->tx_counter);
+
+    if ( (1 != EVP_EncryptInit_ex( sa->enc_ctx, NULL, NULL, NULL, nonce ))
+         || (1 != EVP_EncryptUpdate( sa->enc_ctx, NULL, &len, outbuf, TRANSOP_AESGCM_HDR_SIZE ))
+         || (1 != EVP_EncryptUpdate( sa->enc_ctx, outbuf + idx, &len, inbuf, in_len ))
+         || (1 != EVP_EncryptFinal_ex( sa->enc_ctx, outbuf + idx + len, &fin ))
+         || (1 != EVP_CIPHER_CTX_ctrl( sa->enc_ctx, EVP_CTRL_GCM_GET_TAG, TRANSOP_AESGCM_TAG_SIZE,
+                                       outbuf + idx + len + fin )) )
+    {
+        traceEvent( TRACE_ERROR, "encode_aesgcm encryption failed." );
+        return -1;
+    }
+
+    return idx + len + fin + TRANSOP_AESGCM_TAG_SIZE;
+}
+
+
+/* Search through the array of SAs to find the one with the required ID.
+ *
+ * @return array index where found or -1 if not found
+ */
+static ssize_t aesgcm_find_sa( const transop_aesgcm_t * priv, const n2n_sa_t req_id )
+{
+    size_t i;
+
+    for (i=0; i < priv->num_sa; ++i)
+    {
+        if (req_id == priv->sa[i].sa_id)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/** Decrypt and authenticate a packet. See transop_encode_aesgcm().
+ *
+ *  @return payload length, or -1 if the packet is malformed, uses an unknown
+ *  SA or fails authentication.
+ */
+static int transop_decode_aesgcm( n2n_trans_op_t * arg,
+                                  uint8_t * outbuf,
+                                  size_t out_len,
+                                  const uint8_t * inbuf,
+                                  size_t in_len )
+{
+    transop_aesgcm_t * priv = (transop_aesgcm_t *)arg->priv;
+    sa_aesgcm_t * sa;
+    n2n_sa_t sa_rx;
+    ssize_t sa_idx;
+    uint8_t ver=0;
+    size_t rem=in_len;
+    size_t idx=0;
+    size_t clen;
+    int len;
+    int fin;
+
+    if ( in_len < (TRANSOP_AESGCM_HDR_SIZE + TRANSOP_AESGCM_TAG_SIZE) )
+    {
+        traceEvent( TRACE_ERROR, "decode_aesgcm inbuf too short (%lu).", in_len );
+        return -1;
+    }
+
+    clen = in_len - TRANSOP_AESGCM_HDR_SIZE - TRANSOP_AESGCM_TAG_SIZE;
+    if ( clen > out_len )
+    {
+        traceEvent( TRACE_ERROR, "decode_aesgcm outbuf too small." );
+        return -1;
+    }
+
+    decode_uint8( &ver, inbuf, &rem, &idx );
+    if ( N2N_AESGCM_TRANSFORM_VERSION != ver )
+    {
+        traceEvent( TRACE_ERROR, "decode_aesgcm unsupported version %u.", ver );
+        return -1;
+    }
+
+    decode_uint32( &sa_rx, inbuf, &rem, &idx );
+    sa_idx = aesgcm_find_sa( priv, sa_rx );
+    if ( sa_idx < 0 )
+    {
+        traceEvent( TRACE_ERROR, "decode_aesgcm SA number %lu not found.", sa_rx );
+        return -1;
+    }
+
+    sa = &(priv->sa[sa_idx]);
+
+    if ( (1 != EVP_DecryptInit_ex( sa->dec_ctx, NULL, NULL, NULL, inbuf + idx ))
+         || (1 != EVP_DecryptUpdate( sa->dec_ctx, NULL, &len, inbuf, TRANSOP_AESGCM_HDR_SIZE ))
+         || (1 != EVP_DecryptUpdate( sa->dec_ctx, outbuf, &len, inbuf + TRANSOP_AESGCM_HDR_SIZE, clen ))
+         || (1 != EVP_CIPHER_CTX_ctrl( sa->dec_ctx, EVP_CTRL_GCM_SET_TAG, TRANSOP_AESGCM_TAG_SIZE,
+                                       (void *)(inbuf + TRANSOP_AESGCM_HDR_SIZE + clen) ))
+         || (1 != EVP_DecryptFinal_ex( sa->dec_ctx, outbuf + len, &fin )) )
+    {
+        traceEvent( TRACE_WARNING, "decode_aesgcm authentication failed (SA %lu).", sa_rx );
+        return -1;
+    }
+
+    traceEvent( TRACE_DEBUG, "decode_aesgcm %lu with SA %lu.", in_len, sa_rx );
+
+    return len + fin;
+}
+
+/** Encode the payload in pb where it is. The header goes into the headroom
+ *  and the tag into the tailroom. */
+static int transop_encode_aesgcm_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    uint8_t * payload = pb->data;
+    size_t in_len = pb->len;
+    int len;
+
+    if ( (NULL == n2n_pktbuf_put( pb, TRANSOP_AESGCM_TAG_SIZE ))
+         || (NULL == n2n_pktbuf_push( pb, TRANSOP_AESGCM_HDR_SIZE )) )
+    {
+        traceEvent( TRACE_ERROR, "encode_aesgcm no room for header and tag." );
+        return -1;
+    }
+
+    /* The cipher writes the ciphertext over the plaintext. */
+    len = transop_encode_aesgcm( arg, pb->data, pb->len, payload, in_len );
+
+    return (len < 0) ? -1 : 0;
+}
+
+/** Decode the packet in pb where it is; pb is left on the payload. */
+static int transop_decode_aesgcm_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    int len;
+
+    if ( pb->len < TRANSOP_AESGCM_HDR_SIZE )
+    {
+        return -1;
+    }
+
+    len = transop_decode_aesgcm( arg, pb->data + TRANSOP_AESGCM_HDR_SIZE,
+                               pb->len - TRANSOP_AESGCM_HDR_SIZE, pb->data, pb->len );
+    if ( len < 0 )
+    {
+        return -1;
+    }
+
+    n2n_pktbuf_pull( pb, TRANSOP_AESGCM_HDR_SIZE );
+    return n2n_pktbuf_trim( pb, len );
+}
+
+static int transop_addspec_aesgcm( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
+{
+    transop_aesgcm_t * priv = (transop_aesgcm_t *)arg->priv;
+    const char * op = (const char *)cspec->opaque;
+    const char * sep = index( op, '_' );
+    uint8_t keybuf[N2N_MAX_KEYSIZE];
+    ssize_t pstat;
+    sa_aesgcm_t * sa;
+    const EVP_CIPHER * cipher;
+    char tmp[256];
+    size_t s;
+
+    if ( priv->num_sa >= N2N_AESGCM_NUM_SA )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_aesgcm : full.\n");
+        return 1;
+    }
+
+    if ( NULL == sep )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_aesgcm : bad key data - missing '_'.\n");
+        return 1;
+    }
+
+    s = sep - op;
+    if ( s >= sizeof(tmp) )
+    {
+        return 1;
+    }
+    memcpy( tmp, cspec->opaque, s );
+    tmp[s]=0;
+
+    memset( keybuf, 0, N2N_MAX_KEYSIZE );
+    pstat = n2n_parse_hex( keybuf, N2N_MAX_KEYSIZE, sep+1, strlen(sep+1) );
+    if ( pstat <= 0 )
+    {
+        return 1;
+    }
+
+    sa = &(priv->sa[priv->num_sa]);
+    sa->spec = *cspec;
+    sa->sa_id = strtoul(tmp, NULL, 10);
+    sa->enc_ctx = EVP_CIPHER_CTX_new();
+    sa->dec_ctx = EVP_CIPHER_CTX_new();
+    cipher = aesgcm_cipher( pstat );
+
+    /* The key schedule is expanded once here; packets only set the IV. */
+    if ( (NULL == sa->enc_ctx) || (NULL == sa->dec_ctx)
+         || (1 != EVP_EncryptInit_ex( sa->enc_ctx, cipher, NULL, keybuf, NULL ))
+         || (1 != EVP_DecryptInit_ex( sa->dec_ctx, cipher, NULL, keybuf, NULL )) )
+    {
+        EVP_CIPHER_CTX_free( sa->enc_ctx );
+        EVP_CIPHER_CTX_free( sa->dec_ctx );
+        sa->enc_ctx = sa->dec_ctx = NULL;
+        traceEvent( TRACE_ERROR, "transop_addspec_aesgcm : cipher setup failed.\n");
+        return 1;
+    }
+
+    memset( keybuf, 0, N2N_MAX_KEYSIZE );
+
+    traceEvent( TRACE_DEBUG, "transop_addspec_aesgcm sa_id=%u, %u bits.\n",
+                sa->sa_id, (unsigned int)(8 * EVP_CIPHER_key_length( cipher )) );
+
+    ++(priv->num_sa);
+    return 0;
+}
+
+
+static n2n_tostat_t transop_tick_aesgcm( n2n_trans_op_t * arg, time_t now )
+{
+    transop_aesgcm_t * priv = (transop_aesgcm_t *)arg->priv;
+    size_t i;
+    n2n_tostat_t r;
+
+    memset( &r, 0, sizeof(r) );
+
+    for ( i=0; i < priv->num_sa; ++i )
+    {
+        if ( 0 == validCipherSpec( &(priv->sa[i].spec), now ) )
+        {
+            traceEvent( TRACE_INFO, "transop_aesgcm choosing tx_sa=%u (valid for %lu sec)",
+                        priv->sa[i].sa_id, priv->sa[i].spec.valid_until - now );
+            priv->tx_sa = i;
+            r.can_tx = 1;
+            r.tx_spec = priv->sa[i].spec;
+            break;
+        }
+    }
+
+    if ( !r.can_tx )
+    {
+        traceEvent( TRACE_INFO, "transop_aesgcm no keys are currently valid. Keeping tx_sa=%u", priv->tx_sa );
+    }
+
+    return r;
+}
+
+
+int transop_aesgcm_init( n2n_trans_op_t * ttt )
+{
+    transop_aesgcm_t * priv = NULL;
+
+    memset( ttt, 0, sizeof( n2n_trans_op_t ) );
+
+    priv = (transop_aesgcm_t *) calloc( 1, sizeof(transop_aesgcm_t) );
+    if ( NULL == priv )
+    {
+        traceEvent( TRACE_ERROR, "Failed to allocate priv for aesgcm" );
+        return 1;
+    }
+
+    if ( (1 != RAND_bytes( priv->salt, TRANSOP_AESGCM_SALT_SIZE )) ||
+         (1 != RAND_bytes( (unsigned char *)&(priv->tx_counter), sizeof(priv->tx_counter) )) )
+    {
+        uint32_t r = (uint32_t)rand() ^ (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+        traceEvent( TRACE_WARNING, "No strong randomness for the aesgcm nonce start" );
+        memcpy( priv->salt, &r, TRANSOP_AESGCM_SALT_SIZE );
+        priv->tx_counter = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+    }
+
+    ttt->priv = priv;
+    ttt->transform_id = N2N_TRANSFORM_ID_AESGCM;
+    ttt->addspec = transop_addspec_aesgcm;
+    ttt->tick = transop_tick_aesgcm; /* chooses a new tx_sa */
+    ttt->deinit = transop_deinit_aesgcm;
+    ttt->fwd = transop_encode_aesgcm;
+    ttt->overhead = TRANSOP_AESGCM_HDR_SIZE + TRANSOP_AESGCM_TAG_SIZE;
+    ttt->rev = transop_decode_aesgcm;
+    ttt->fwd_pb = transop_encode_aesgcm_pb;
+    ttt->rev_pb = transop_decode_aesgcm_pb;
+
+    return 0;
+}
+
+#else /* #if defined(N2N_HAVE_AES) */
+
+static int transop_deinit_aesgcm( n2n_trans_op_t * arg )
+{
+    return 0;
+}
+
+static int transop_encode_aesgcm( n2n_trans_op_t * arg,
+                                  uint8_t * outbuf,
+                                  size_t out_len,
+                                  const uint8_t * inbuf,
+                                  size_t in_len )
+{
+    return -1;
+}
+
+static int transop_addspec_aesgcm( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
+{
+    traceEvent( TRACE_DEBUG, "transop_addspec_aesgcm AES not built into edge.\n");
+
+    return -1;
+}
+
+static n2n_tostat_t transop_tick_aesgcm( n2n_trans_op_t * arg, time_t now )
+{
+    n2n_tostat_t r;
+
+    memset( &r, 0, sizeof(r) );
+
+    return r;
+}
+
+int transop_aesgcm_init( n2n_trans_op_t * ttt )
+{
+    memset( ttt, 0, sizeof( n2n_trans_op_t ) );
+
+    ttt->transform_id = N2N_TRANSFORM_ID_AESGCM;
+    ttt->addspec = transop_addspec_aesgcm;
+    ttt->tick = transop_tick_aesgcm;
+    ttt->deinit = transop_deinit_aesgcm;
+    ttt->fwd = transop_encode_aesgcm;
+    ttt->rev = transop_encode_aesgcm;
+
+    return 0;
+}
+
+#endif /* #if defined(N2N_HAVE_AES) */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#include <sys/auxv.h>
+#endif
+
+/** Whether the CPU has AES instructions, so that AES-GCM beats ChaCha20.
+ *  Unknown CPUs are assumed not to. */
+int transop_aesgcm_accelerated( void )
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    unsigned int a, b, c, d;
+
+    return __get_cpuid( 1, &a, &b, &c, &d ) && (c & (1 << 25)); /* AES-NI */
+#elif defined(__linux__) && defined(__aarch64__)
+    return (getauxval( AT_HWCAP ) & (1 << 3)) != 0;  /* HWCAP_AES */
+#elif defined(__linux__) && defined(__arm__) && defined(AT_HWCAP2)
+    return (getauxval( AT_HWCAP2 ) & (1 << 0)) != 0; /* HWCAP2_AES */
+#else
+    return 0;
+#endif
+}
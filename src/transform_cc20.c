@@ -0,0 +1,954 @@
+/* (c) 2026 n2n contributors */
+
+/** ChaCha20-Poly1305 transform (the RFC 8439 AEAD construction).
+ *
+ *  Meant for edges on CPUs without AES instructions, typically the MIPS and
+ *  ARM cores of OpenWrt routers, where ChaCha20 in plain integer code is
+ *  several times faster than AES or twofish. Keys come from the keyfile as
+ *  "<sa>_<hexkey>" with a 32 octet key.
+ *
+ *  Two implementations exist and the transop picks one when it is created:
+ *
+ *  - "openssl": the EVP cipher. OpenSSL chooses its SSSE3/AVX2/AVX-512 or
+ *    NEON kernels at runtime from the CPU features.
+ *  - "portable": plain C below, used when edge is built without OpenSSL or
+ *    the library does not provide the cipher. Poly1305 works on 26-bit
+ *    limbs so it needs no 64x64 bit multiplies on 32-bit cores.
+ *
+ *  Both produce the same packets so edges using either interoperate.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#ifndef _MSC_VER
+/* Not included in Visual Studio 2008 */
+#include <strings.h> /* index() */
+#endif
+
+#if defined(N2N_HAVE_AES)
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define N2N_CC20_HAVE_EVP 1
+#include <openssl/evp.h>
+#endif
+#endif
+
+#define N2N_CC20_NUM_SA                 32 /* space for SAs */
+
+#define N2N_CC20_TRANSFORM_VERSION      1  /* version of the transform encoding */
+
+#define TRANSOP_CC20_VER_SIZE           1
+#define TRANSOP_CC20_SA_SIZE            4
+#define TRANSOP_CC20_SALT_SIZE          4
+#define TRANSOP_CC20_NONCE_SIZE         12 /* random salt then 64-bit counter */
+#define TRANSOP_CC20_TAG_SIZE           16
+#define TRANSOP_CC20_KEY_SIZE           32
+#define TRANSOP_CC20_HDR_SIZE           (TRANSOP_CC20_VER_SIZE + TRANSOP_CC20_SA_SIZE + TRANSOP_CC20_NONCE_SIZE)
+
+struct sa_cc20
+{
+    n2n_cipherspec_t    spec;           /* cipher spec parameters */
+    n2n_sa_t            sa_id;          /* security association index */
+    uint8_t             key[TRANSOP_CC20_KEY_SIZE]; /* portable only */
+#if defined(N2N_CC20_HAVE_EVP)
+    EVP_CIPHER_CTX *    enc_ctx;        /* tx, key set, IV set per packet */
+    EVP_CIPHER_CTX *    dec_ctx;        /* rx */
+#endif
+};
+
+typedef struct sa_cc20 sa_cc20_t;
+
+/** One implementation of the AEAD. seal and open return 0 on success; open
+ *  fails if the tag does not match. */
+struct cc20_impl
+{
+    const char *        name;
+    int                 (*setkey)( sa_cc20_t * sa, const uint8_t * key );
+    void                (*clear)( sa_cc20_t * sa );
+    int                 (*seal)( sa_cc20_t * sa, const uint8_t * nonce,
+                                 const uint8_t * aad, size_t aad_len,
+                                 uint8_t * out, const uint8_t * in, size_t len,
+                                 uint8_t * tag );
+    int                 (*open)( sa_cc20_t * sa, const uint8_t * nonce,
+                                 const uint8_t * aad, size_t aad_len,
+                                 uint8_t * out, const uint8_t * in, size_t len,
+                                 const uint8_t * tag );
+};
+
+typedef struct cc20_impl cc20_impl_t;
+
+/** ChaCha20-Poly1305 transform state data. Nonces are built as for AES-GCM:
+ *  the salt followed by a packet counter, both starting at a random value
+ *  drawn per transop so that senders sharing a key use disjoint nonces. */
+struct transop_cc20
+{
+    const cc20_impl_t * impl;
+    ssize_t             tx_sa;
+    size_t              num_sa;
+    uint8_t             salt[TRANSOP_CC20_SALT_SIZE];
+    uint64_t            tx_counter;
+    sa_cc20_t           sa[N2N_CC20_NUM_SA];
+};
+
+typedef struct transop_cc20 transop_cc20_t;
+
+
+/* ------------------------------------------------------------------------ */
+/* Portable implementation */
+
+#define CC20_LOAD32(p)  ( (uint32_t)((p)[0])        | ((uint32_t)((p)[1]) << 8) | \
+                         ((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24) )
+
+#define CC20_ROTL(v,n)  ( ((v) << (n)) | ((v) >> (32 - (n))) )
+
+#define CC20_QR(a,b,c,d) \
+    a += b; d ^= a; d = CC20_ROTL(d,16); \
+    c += d; b ^= c; b = CC20_ROTL(b,12); \
+    a += b; d ^= a; d = CC20_ROTL(d, 8); \
+    c += d; b ^= c; b = CC20_ROTL(b, 7);
+
+static void cc20_store32( uint8_t * p, uint32_t v )
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void cc20_store64( uint8_t * p, uint64_t v )
+{
+    cc20_store32( p, (uint32_t)v );
+    cc20_store32( p+4, (uint32_t)(v >> 32) );
+}
+
+/** Set up the 16 word ChaCha20 input for key, block counter 0 and nonce. */
+static void cc20_setup( uint32_t * st, const uint8_t * key, const uint8_t * nonce )
+{
+    size_t i;
+
+    st[0] = 0x61707865;
+    st[1] = 0x3320646e;
+    st[2] = 0x79622d32;
+    st[3] = 0x6b206574;
+    for ( i=0; i < 8; ++i )
+    {
+        st[4+i] = CC20_LOAD32( key + 4*i );
+    }
+    st[12] = 0;
+    st[13] = CC20_LOAD32( nonce );
+    st[14] = CC20_LOAD32( nonce + 4 );
+    st[15] = CC20_LOAD32( nonce + 8 );
+}
+
+static void cc20_block( const uint32_t * st, uint8_t * out )
+{
+    uint32_t x[16];
+    size_t i;
+
+    memcpy( x, st, sizeof(x) );
+    for ( i=0; i < 10; ++i )
+    {
+        CC20_QR( x[0], x[4], x[ 8], x[12] );
+        CC20_QR( x[1], x[5], x[ 9], x[13] );
+        CC20_QR( x[2], x[6], x[10], x[14] );
+        CC20_QR( x[3], x[7], x[11], x[15] );
+        CC20_QR( x[0], x[5], x[10], x[15] );
+        CC20_QR( x[1], x[6], x[11], x[12] );
+        CC20_QR( x[2], x[7], x[ 8], x[13] );
+        CC20_QR( x[3], x[4], x[ 9], x[14] );
+    }
+
+    for ( i=0; i < 16; ++i )
+    {
+        cc20_store32( out + 4*i, x[i] + st[i] );
+    }
+}
+
+/** XOR len bytes of keystream starting at the current block counter. */
+static void cc20_xor( uint32_t * st, uint8_t * out, const uint8_t * in, size_t len )
+{
+    uint8_t ks[64];
+    size_t n;
+    size_t i;
+
+    while ( len > 0 )
+    {
+        cc20_block( st, ks );
+        ++st[12];
+
+        n = (len < sizeof(ks)) ? len : sizeof(ks);
+        for ( i=0; i < n; ++i )
+        {
+            out[i] = in[i] ^ ks[i];
+        }
+
+        out += n;
+        in += n;
+        len -= n;
+    }
+}
+
+struct poly1305
+{
+    uint32_t            r[5];
+    uint32_t            h[5];
+    uint32_t            pad[4];
+};
+
+typedef struct poly1305 poly1305_t;
+
+static void poly1305_init( poly1305_t * st, const uint8_t * key )
+{
+    st->r[0] = (CC20_LOAD32( key +  0 )     ) & 0x3ffffff;
+    st->r[1] = (CC20_LOAD32( key +  3 ) >> 2) & 0x3ffff03;
+    st->r[2] = (CC20_LOAD32( key +  6 ) >> 4) & 0x3ffc0ff;
+    st->r[3] = (CC20_LOAD32( key +  9 ) >> 6) & 0x3f03fff;
+    st->r[4] = (CC20_LOAD32( key + 12 ) >> 8) & 0x00fffff;
+
+    memset( st->h, 0, sizeof(st->h) );
+
+    st->pad[0] = CC20_LOAD32( key + 16 );
+    st->pad[1] = CC20_LOAD32( key + 20 );
+    st->pad[2] = CC20_LOAD32( key + 24 );
+    st->pad[3] = CC20_LOAD32( key + 28 );
+}
+
+/** Absorb whole 16 byte blocks. The AEAD zero-pads every part of the MAC
+ *  input to 16 bytes so partial blocks never occur. */
+static void poly1305_blocks( poly1305_t * st, const uint8_t * m, size_t len )
+{
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    while ( len >= 16 )
+    {
+        h0 += (CC20_LOAD32( m +  0 )     ) & 0x3ffffff;
+        h1 += (CC20_LOAD32( m +  3 ) >> 2) & 0x3ffffff;
+        h2 += (CC20_LOAD32( m +  6 ) >> 4) & 0x3ffffff;
+        h3 += (CC20_LOAD32( m +  9 ) >> 6) & 0x3ffffff;
+        h4 += (CC20_LOAD32( m + 12 ) >> 8) | (1 << 24);
+
+        d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+        d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+        d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+        d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+        d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+/** Absorb len bytes followed by zeros up to the next 16 byte boundary. */
+static void poly1305_padded( poly1305_t * st, const uint8_t * m, size_t len )
+{
+    uint8_t last[16];
+    size_t whole = len & ~(size_t)15;
+
+    poly1305_blocks( st, m, whole );
+    if ( whole < len )
+    {
+        memset( last, 0, sizeof(last) );
+        memcpy( last, m + whole, len - whole );
+        poly1305_blocks( st, last, sizeof(last) );
+    }
+}
+
+static void poly1305_finish( poly1305_t * st, uint8_t * tag )
+{
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t c, mask;
+    uint64_t f;
+
+    /* fully carry h */
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* g = h + 5 - 2^130, taken if it does not go negative */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    /* h = (h + pad) % 2^128 */
+    h0 = (h0      ) | (h1 << 26);
+    h1 = (h1 >>  6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 <<  8);
+
+    f = (uint64_t)h0 + st->pad[0];             cc20_store32( tag,      (uint32_t)f );
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); cc20_store32( tag +  4, (uint32_t)f );
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); cc20_store32( tag +  8, (uint32_t)f );
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); cc20_store32( tag + 12, (uint32_t)f );
+}
+
+/** Compute the AEAD tag over aad and ciphertext. st is the cipher state at
+ *  block counter 0, whose keystream gives the one-time Poly1305 key; on
+ *  return it is at block 1, ready for the payload. */
+static void cc20_poly_tag( uint32_t * st, const uint8_t * aad, size_t aad_len,
+                           const uint8_t * ct, size_t len, uint8_t * tag )
+{
+    uint8_t otk[64];
+    uint8_t lens[16];
+    poly1305_t mac;
+
+    cc20_block( st, otk );
+    ++st[12];
+
+    poly1305_init( &mac, otk );
+    poly1305_padded( &mac, aad, aad_len );
+    poly1305_padded( &mac, ct, len );
+    cc20_store64( lens, aad_len );
+    cc20_store64( lens + 8, len );
+    poly1305_blocks( &mac, lens, sizeof(lens) );
+    poly1305_finish( &mac, tag );
+
+    memset( otk, 0, sizeof(otk) );
+}
+
+static int cc20_portable_setkey( sa_cc20_t * sa, const uint8_t * key )
+{
+    memcpy( sa->key, key, TRANSOP_CC20_KEY_SIZE );
+    return 0;
+}
+
+static void cc20_portable_clear( sa_cc20_t * sa )
+{
+    memset( sa->key, 0, TRANSOP_CC20_KEY_SIZE );
+}
+
+static int cc20_portable_seal( sa_cc20_t * sa, const uint8_t * nonce,
+                               const uint8_t * aad, size_t aad_len,
+                               uint8_t * out, const uint8_t * in, size_t len,
+                               uint8_t * tag )
+{
+    uint32_t st[16];
+    uint32_t tag_st[16];
+
+    cc20_setup( st, sa->key, nonce );
+    memcpy( tag_st, st, sizeof(st) );
+
+    st[12] = 1;
+    cc20_xor( st, out, in, len );
+    cc20_poly_tag( tag_st, aad, aad_len, out, len, tag );
+
+    return 0;
+}
+
+static int cc20_portable_open( sa_cc20_t * sa, const uint8_t * nonce,
+                               const uint8_t * aad, size_t aad_len,
+                               uint8_t * out, const uint8_t * in, size_t len,
+                               const uint8_t * tag )
+{
+    uint32_t st[16];
+    uint8_t calc[TRANSOP_CC20_TAG_SIZE];
+    uint8_t diff = 0;
+    size_t i;
+
+    /* Check before decrypting; nothing is written for a forged packet. */
+    cc20_setup( st, sa->key, nonce );
+    cc20_poly_tag( st, aad, aad_len, in, len, calc );
+
+    for ( i=0; i < TRANSOP_CC20_TAG_SIZE; ++i )
+    {
+        diff |= calc[i] ^ tag[i];
+    }
+
+    if ( diff )
+    {
+        return -1;
+    }
+
+    cc20_xor( st, out, in, len );
+
+    return 0;
+}
+
+static const cc20_impl_t cc20_portable =
+{
+    "portable",
+    cc20_portable_setkey,
+    cc20_portable_clear,
+    cc20_portable_seal,
+    cc20_portable_open
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* OpenSSL implementation */
+
+#if defined(N2N_CC20_HAVE_EVP)
+
+static void cc20_evp_clear( sa_cc20_t * sa )
+{
+    EVP_CIPHER_CTX_free( sa->enc_ctx );
+    EVP_CIPHER_CTX_free( sa->dec_ctx );
+    sa->enc_ctx = sa->dec_ctx = NULL;
+}
+
+static int cc20_evp_setkey( sa_cc20_t * sa, const uint8_t * key )
+{
+    sa->enc_ctx = EVP_CIPHER_CTX_new();
+    sa->dec_ctx = EVP_CIPHER_CTX_new();
+
+    /* The key schedule is set up once here; packets only set the nonce. */
+    if ( (NULL == sa->enc_ctx) || (NULL == sa->dec_ctx)
+         || (1 != EVP_EncryptInit_ex( sa->enc_ctx, EVP_chacha20_poly1305(), NULL, key, NULL ))
+         || (1 != EVP_DecryptInit_ex( sa->dec_ctx, EVP_chacha20_poly1305(), NULL, key, NULL )) )
+    {
+        cc20_evp_clear( sa );
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cc20_evp_seal( sa_cc20_t * sa, const uint8_t * nonce,
+                          const uint8_t * aad, size_t aad_len,
+                          uint8_t * out, const uint8_t * in, size_t len,
+                          uint8_t * tag )
+{
+    int outl;
+    int fin;
+
+    if ( (1 != EVP_EncryptInit_ex( sa->enc_ctx, NULL, NULL, NULL, nonce ))
+         || (1 != EVP_EncryptUpdate( sa->enc_ctx, NULL, &outl, aad, aad_len ))
+         || (1 != EVP_EncryptUpdate( sa->enc_ctx, out, &outl, in, len ))
+         || (1 != EVP_EncryptFinal_ex( sa->enc_ctx, out + outl, &fin ))
+         || (1 != EVP_CIPHER_CTX_ctrl( sa->enc_ctx, EVP_CTRL_AEAD_GET_TAG, TRANSOP_CC20_TAG_SIZE, tag )) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cc20_evp_open( sa_cc20_t * sa, const uint8_t * nonce,
+                          const uint8_t * aad, size_t aad_len,
+                          uint8_t * out, const uint8_t * in, size_t len,
+                          const uint8_t * tag )
+{
+    int outl;
+    int fin;
+
+    if ( (1 != EVP_DecryptInit_ex( sa->dec_ctx, NULL, NULL, NULL, nonce ))
+         || (1 != EVP_DecryptUpdate( sa->dec_ctx, NULL, &outl, aad, aad_len ))
+         || (1 != EVP_DecryptUpdate( sa->dec_ctx, out, &outl, in, len ))
+         || (1 != EVP_CIPHER_CTX_ctrl( sa->dec_ctx, EVP_CTRL_AEAD_SET_TAG, TRANSOP_CC20_TAG_SIZE, (void *)tag ))
+         || (1 != EVP_DecryptFinal_ex( sa->dec_ctx, out + outl, &fin )) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static const cc20_impl_t cc20_evp =
+{
+    "openssl",
+    cc20_evp_setkey,
+    cc20_evp_clear,
+    cc20_evp_seal,
+    cc20_evp_open
+};
+
+#endif /* #if defined(N2N_CC20_HAVE_EVP) */
+
+
+/** Pick the implementation. OpenSSL is used if it actually provides the
+ *  cipher at runtime (it may be absent from a cut down or FIPS library). */
+static const cc20_impl_t * cc20_select_impl( void )
+{
+#if defined(N2N_CC20_HAVE_EVP)
+    EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
+    uint8_t key[TRANSOP_CC20_KEY_SIZE];
+    int ok;
+
+    memset( key, 0, sizeof(key) );
+    ok = (NULL != ctx) && (1 == EVP_EncryptInit_ex( ctx, EVP_chacha20_poly1305(), NULL, key, key ));
+    EVP_CIPHER_CTX_free( ctx );
+
+    if ( ok )
+    {
+        return &cc20_evp;
+    }
+#endif
+
+    return &cc20_portable;
+}
+
+/** Check the implementations against the AEAD test vector of RFC 8439
+ *  section 2.8.2: the portable one always, OpenSSL if edge has it.
+ *
+ *  @return 0 if each gives the ciphertext and tag of the RFC and opens them
+ *  again, -1 otherwise. */
+int transop_cc20_selftest( void )
+{
+    static const uint8_t nonce[TRANSOP_CC20_NONCE_SIZE] =
+    {
+        0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47
+    };
+    static const uint8_t aad[] =
+    {
+        0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7
+    };
+    static const char plain[] =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only one "
+        "tip for the future, sunscreen would be it.";
+    static const uint8_t cipher[sizeof(plain) - 1] =
+    {
+        0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+        0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+        0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+        0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+        0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+        0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+        0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+        0x61, 0x16
+    };
+    static const uint8_t tag[TRANSOP_CC20_TAG_SIZE] =
+    {
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91
+    };
+    const cc20_impl_t * impls[] =
+    {
+        &cc20_portable,
+#if defined(N2N_CC20_HAVE_EVP)
+        &cc20_evp,
+#endif
+        NULL
+    };
+    uint8_t key[TRANSOP_CC20_KEY_SIZE];
+    uint8_t out[sizeof(cipher)];
+    uint8_t out_tag[TRANSOP_CC20_TAG_SIZE];
+    sa_cc20_t sa;
+    size_t i;
+    int rc = 0;
+
+    for ( i=0; i < sizeof(key); ++i )
+    {
+        key[i] = (uint8_t)(0x80 + i);
+    }
+
+    for ( i=0; impls[i]; ++i )
+    {
+        memset( &sa, 0, sizeof(sa) );
+        if ( 0 != impls[i]->setkey( &sa, key ) )
+        {
+            continue; /* OpenSSL without the cipher at runtime: not used */
+        }
+
+        if ( (0 != impls[i]->seal( &sa, nonce, aad, sizeof(aad), out, (const uint8_t *)plain, sizeof(cipher), out_tag ))
+             || (0 != memcmp( out, cipher, sizeof(cipher) ))
+             || (0 != memcmp( out_tag, tag, sizeof(tag) ))
+             || (0 != impls[i]->open( &sa, nonce, aad, sizeof(aad), out, cipher, sizeof(cipher), tag ))
+             || (0 != memcmp( out, plain, sizeof(cipher) )) )
+        {
+            traceEvent( TRACE_ERROR, "cc20 %s fails the RFC 8439 test vector", impls[i]->name );
+            rc = -1;
+        }
+
+        impls[i]->clear( &sa );
+    }
+
+    return rc;
+}
+
+/** Draw the random start of the nonce space of a transop: the salt and the
+ *  64-bit counter. Falls back to a weak source only when neither OpenSSL nor
+ *  /dev/urandom is available. */
+static void cc20_random_nonce_start( transop_cc20_t * priv )
+{
+    uint8_t start[TRANSOP_CC20_NONCE_SIZE];
+    size_t i;
+    FILE * fd;
+
+#if defined(N2N_HAVE_AES)
+    if ( 1 == RAND_bytes( start, sizeof(start) ) )
+    {
+        goto done;
+    }
+#endif
+
+    fd = fopen( "/dev/urandom", "rb" );
+    if ( fd )
+    {
+        size_t n = fread( start, 1, sizeof(start), fd );
+
+        fclose( fd );
+        if ( sizeof(start) == n )
+        {
+            goto done;
+        }
+    }
+
+    traceEvent( TRACE_WARNING, "No strong randomness for the cc20 nonce start" );
+    for ( i = 0; i < sizeof(start); ++i )
+    {
+        start[i] = (uint8_t)(rand() ^ (time(NULL) >> (i % 4) * 8) ^ (getpid() >> (i % 2) * 8));
+    }
+
+done:
+    memcpy( priv->salt, start, TRANSOP_CC20_SALT_SIZE );
+    memcpy( &(priv->tx_counter), start + TRANSOP_CC20_SALT_SIZE, sizeof(priv->tx_counter) );
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Transop */
+
+static int transop_deinit_cc20( n2n_trans_op_t * arg )
+{
+    transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+    size_t i;
+
+    if ( priv )
+    {
+        for ( i=0; i < priv->num_sa; ++i )
+        {
+            (priv->impl->clear)( &(priv->sa[i]) );
+        }
+
+        free(priv);
+    }
+
+    arg->priv=NULL; /* return to fully uninitialised state */
+
+    return 0;
+}
+
+/** The ChaCha20-Poly1305 packet format is the same as the AES-GCM one:
+ *
+ *  - a 8-bit encoding version in clear text
+ *  - a 32-bit SA number in clear text
+ *  - a 96-bit nonce in clear text
+ *  - the encrypted payload
+ *  - a 128-bit Poly1305 tag authenticating the header and payload
+ *
+ *  [V|SSSS|NNNNNNNNNNNN|DDDDDDDDDDDDDDDD|TTTTTTTTTTTTTTTT]
+ *                      |<-encrypted-->|
+ */
+static int transop_encode_cc20( n2n_trans_op_t * arg,
+                                 uint8_t * outbuf,
+                                 size_t out_len,
+                                 const uint8_t * inbuf,
+                                 size_t in_len )
+{
+    transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+    sa_cc20_t * sa;
+    uint8_t * nonce;
+    size_t idx=0;
+
+    if ( (in_len + TRANSOP_CC20_HDR_SIZE + TRANSOP_CC20_TAG_SIZE) > out_len )
+    {
+        traceEvent( TRACE_ERROR, "encode_cc20 outbuf too small." );
+        return -1;
+    }
+
+    if ( 0 == priv->num_sa )
+    {
+        traceEvent( TRACE_ERROR, "encode_cc20 no SA." );
+        return -1;
+    }
+
+    sa = &(priv->sa[priv->tx_sa]); /* set in tick */
+
+    traceEvent( TRACE_DEBUG, "encode_cc20 %lu with SA %lu.", in_len, sa->sa_id );
+
+    encode_uint8( outbuf, &idx, N2N_CC20_TRANSFORM_VERSION );
+    encode_uint32( outbuf, &idx, sa->sa_id );
+
+    nonce = outbuf + idx;
+    memcpy( nonce, priv->salt, TRANSOP_CC20_SALT_SIZE );
+    idx += TRANSOP_CC20_SALT_SIZE;
+    encode_uint32( outbuf, &idx, (uint32_t)(priv->tx_counter >> 32) );
+    encode_uint32( outbuf, &idx, (uint32_t)(priv->tx_counter) );
+    ++(priv->tx_counter);
+
+    if ( 0 != (priv->impl->seal)( sa, nonce, outbuf, TRANSOP_CC20_HDR_SIZE,
+                                  outbuf + idx, inbuf, in_len, outbuf + idx + in_len ) )
+    {
+        traceEvent( TRACE_ERROR, "encode_cc20 encryption failed." );
+        return -1;
+    }
+
+    return idx + in_len + TRANSOP_CC20_TAG_SIZE;
+}
+
+
+/* Search through the array of SAs to find the one with the required ID.
+ *
+ * @return array index where found or -1 if not found
+ */
+static ssize_t cc20_find_sa( const transop_cc20_t * priv, const n2n_sa_t req_id )
+{
+    size_t i;
+
+    for (i=0; i < priv->num_sa; ++i)
+    {
+        if (req_id == priv->sa[i].sa_id)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/** Authenticate and decrypt a packet. See transop_encode_cc20().
+ *
+ *  @return payload length, or -1 if the packet is malformed, uses an unknown
+ *  SA or fails authentication.
+ */
+static int transop_decode_cc20( n2n_trans_op_t * arg,
+                                uint8_t * outbuf,
+                                size_t out_len,
+                                const uint8_t * inbuf,
+                                size_t in_len )
+{
+    transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+    n2n_sa_t sa_rx;
+    ssize_t sa_idx;
+    uint8_t ver=0;
+    size_t rem=in_len;
+    size_t idx=0;
+    size_t clen;
+
+    if ( in_len < (TRANSOP_CC20_HDR_SIZE + TRANSOP_CC20_TAG_SIZE) )
+    {
+        traceEvent( TRACE_ERROR, "decode_cc20 inbuf too short (%lu).", in_len );
+        return -1;
+    }
+
+    clen = in_len - TRANSOP_CC20_HDR_SIZE - TRANSOP_CC20_TAG_SIZE;
+    if ( clen > out_len )
+    {
+        traceEvent( TRACE_ERROR, "decode_cc20 outbuf too small." );
+        return -1;
+    }
+
+    decode_uint8( &ver, inbuf, &rem, &idx );
+    if ( N2N_CC20_TRANSFORM_VERSION != ver )
+    {
+        traceEvent( TRACE_ERROR, "decode_cc20 unsupported version %u.", ver );
+        return -1;
+    }
+
+    decode_uint32( &sa_rx, inbuf, &rem, &idx );
+    sa_idx = cc20_find_sa( priv, sa_rx );
+    if ( sa_idx < 0 )
+    {
+        traceEvent( TRACE_ERROR, "decode_cc20 SA number %lu not found.", sa_rx );
+        return -1;
+    }
+
+    if ( 0 != (priv->impl->open)( &(priv->sa[sa_idx]), inbuf + idx, inbuf, TRANSOP_CC20_HDR_SIZE,
+                                  outbuf, inbuf + TRANSOP_CC20_HDR_SIZE, clen,
+                                  inbuf + TRANSOP_CC20_HDR_SIZE + clen ) )
+    {
+        traceEvent( TRACE_WARNING, "decode_cc20 authentication failed (SA %lu).", sa_rx );
+        return -1;
+    }
+
+    traceEvent( TRACE_DEBUG, "decode_cc20 %lu with SA %lu.", in_len, sa_rx );
+
+    return clen;
+}
+
+/** Encode the payload in pb where it is. The header goes into the headroom
+ *  and the tag into the tailroom. */
+static int transop_encode_cc20_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    uint8_t * payload = pb->data;
+    size_t in_len = pb->len;
+    int len;
+
+    if ( (NULL == n2n_pktbuf_put( pb, TRANSOP_CC20_TAG_SIZE ))
+         || (NULL == n2n_pktbuf_push( pb, TRANSOP_CC20_HDR_SIZE )) )
+    {
+        traceEvent( TRACE_ERROR, "encode_cc20 no room for header and tag." );
+        return -1;
+    }
+
+    /* The cipher writes the ciphertext over the plaintext. */
+    len = transop_encode_cc20( arg, pb->data, pb->len, payload, in_len );
+
+    return (len < 0) ? -1 : 0;
+}
+
+/** Decode the packet in pb where it is; pb is left on the payload. */
+static int transop_decode_cc20_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    int len;
+
+    if ( pb->len < TRANSOP_CC20_HDR_SIZE )
+    {
+        return -1;
+    }
+
+    len = transop_decode_cc20( arg, pb->data + TRANSOP_CC20_HDR_SIZE,
+                               pb->len - TRANSOP_CC20_HDR_SIZE, pb->data, pb->len );
+    if ( len < 0 )
+    {
+        return -1;
+    }
+
+    n2n_pktbuf_pull( pb, TRANSOP_CC20_HDR_SIZE );
+    return n2n_pktbuf_trim( pb, len );
+}
+
+static int transop_addspec_cc20( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
+{
+    transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+    const char * op = (const char *)cspec->opaque;
+    const char * sep = index( op, '_' );
+    uint8_t keybuf[N2N_MAX_KEYSIZE];
+    ssize_t pstat;
+    sa_cc20_t * sa;
+    char tmp[256];
+    size_t s;
+
+    if ( priv->num_sa >= N2N_CC20_NUM_SA )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_cc20 : full.\n");
+        return 1;
+    }
+
+    if ( NULL == sep )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_cc20 : bad key data - missing '_'.\n");
+        return 1;
+    }
+
+    s = sep - op;
+    if ( s >= sizeof(tmp) )
+    {
+        return 1;
+    }
+    memcpy( tmp, cspec->opaque, s );
+    tmp[s]=0;
+
+    memset( keybuf, 0, N2N_MAX_KEYSIZE );
+    pstat = n2n_parse_hex( keybuf, N2N_MAX_KEYSIZE, sep+1, strlen(sep+1) );
+    if ( TRANSOP_CC20_KEY_SIZE != pstat )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_cc20 : key must be %u octets.\n",
+                    (unsigned int)TRANSOP_CC20_KEY_SIZE );
+        return 1;
+    }
+
+    sa = &(priv->sa[priv->num_sa]);
+    sa->spec = *cspec;
+    sa->sa_id = strtoul(tmp, NULL, 10);
+
+    if ( 0 != (priv->impl->setkey)( sa, keybuf ) )
+    {
+        traceEvent( TRACE_ERROR, "transop_addspec_cc20 : cipher setup failed.\n");
+        return 1;
+    }
+
+    memset( keybuf, 0, N2N_MAX_KEYSIZE );
+
+    traceEvent( TRACE_DEBUG, "transop_addspec_cc20 sa_id=%u (%s).\n", sa->sa_id, priv->impl->name );
+
+    ++(priv->num_sa);
+    return 0;
+}
+
+
+static n2n_tostat_t transop_tick_cc20( n2n_trans_op_t * arg, time_t now )
+{
+    transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+    size_t i;
+    n2n_tostat_t r;
+
+    memset( &r, 0, sizeof(r) );
+
+    for ( i=0; i < priv->num_sa; ++i )
+    {
+        if ( 0 == validCipherSpec( &(priv->sa[i].spec), now ) )
+        {
+            traceEvent( TRACE_INFO, "transop_cc20 choosing tx_sa=%u (valid for %lu sec)",
+                        priv->sa[i].sa_id, priv->sa[i].spec.valid_until - now );
+            priv->tx_sa = i;
+            r.can_tx = 1;
+            r.tx_spec = priv->sa[i].spec;
+            break;
+        }
+    }
+
+    if ( !r.can_tx )
+    {
+        traceEvent( TRACE_INFO, "transop_cc20 no keys are currently valid. Keeping tx_sa=%u", priv->tx_sa );
+    }
+
+    return r;
+}
+
+
+int transop_cc20_init( n2n_trans_op_t * ttt )
+{
+    transop_cc20_t * priv = NULL;
+
+    memset( ttt, 0, sizeof( n2n_trans_op_t ) );
+
+    priv = (transop_cc20_t *) calloc( 1, sizeof(transop_cc20_t) );
+    if ( NULL == priv )
+    {
+        traceEvent( TRACE_ERROR, "Failed to allocate priv for cc20" );
+        return 1;
+    }
+
+    priv->impl = cc20_select_impl();
+    cc20_random_nonce_start( priv );
+
+    ttt->priv = priv;
+    ttt->transform_id = N2N_TRANSFORM_ID_CHACHA20;
+    ttt->addspec = transop_addspec_cc20;
+    ttt->tick = transop_tick_cc20; /* chooses a new tx_sa */
+    ttt->deinit = transop_deinit_cc20;
+    ttt->fwd = transop_encode_cc20;
+    ttt->overhead = TRANSOP_CC20_HDR_SIZE + TRANSOP_CC20_TAG_SIZE;
+    ttt->rev = transop_decode_cc20;
+    ttt->fwd_pb = transop_encode_cc20_pb;
+    ttt->rev_pb = transop_decode_cc20_pb;
+
+    return 0;
+}
+
+/** Name of the ChaCha20-Poly1305 implementation ttt uses. */
+const char * transop_cc20_impl( const n2n_trans_op_t * ttt )
+{
+    const transop_cc20_t * priv = (const transop_cc20_t *)ttt->priv;
+
+    return priv ? priv->impl->name : "none";
+}
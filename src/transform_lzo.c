@@ -0,0 +1,254 @@
+/* (c) 2026 n2n contributors */
+
+/** Compress-then-encrypt transforms.
+ *
+ *  An LZO transop wraps another transop (NULL, twofish or AES-CBC) which holds
+ *  the keys. On encode the payload is compressed with LZO1X-1 and the result
+ *  is passed to the inner transop; decode reverses this. The inner payload
+ *  starts with one byte saying whether the rest is compressed or stored.
+ *
+ *  Frames that are probably incompressible (TLS, media, already compressed
+ *  files) are recognised by sampling their byte distribution and are stored
+ *  without running the compressor.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+#include "minilzo.h"
+
+#define N2N_LZO_STORED                  0
+#define N2N_LZO_LZO1X                   1
+
+#define N2N_LZO_MIN_SIZE                128 /* smaller frames are always stored */
+#define N2N_LZO_SAMPLE_SIZE             256 /* bytes looked at by the estimator */
+#define N2N_LZO_MAX_DISTINCT            128 /* more distinct byte values in the sample means random data */
+
+/* LZO1X-1 worst case expansion. */
+#define N2N_LZO_OUT_SIZE(n)             ((n) + (n) / 16 + 64 + 3)
+
+struct transop_lzo
+{
+    n2n_trans_op_t *    inner;          /* cipher applied after compression; not owned */
+    n2n_lzo_stats_t     stats;
+    lzo_align_t *       wrkmem;         /* compressor dictionary, encode only */
+};
+
+typedef struct transop_lzo transop_lzo_t;
+
+
+static uint64_t lzo_now_ns( void )
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/** Guess whether a payload is worth compressing.
+ *
+ *  Counts distinct byte values in the last N2N_LZO_SAMPLE_SIZE bytes; the
+ *  start of the payload is mostly IP and TCP headers. 256 random bytes hit
+ *  about 162 different values while text and protocol data stay well under
+ *  100.
+ */
+static int lzo_compressible( const uint8_t * buf, size_t len )
+{
+    uint8_t seen[256];
+    size_t sample = (len < N2N_LZO_SAMPLE_SIZE) ? len : N2N_LZO_SAMPLE_SIZE;
+    size_t distinct = 0;
+    size_t i;
+
+    memset( seen, 0, sizeof(seen) );
+    buf += len - sample;
+    for ( i=0; i < sample; ++i )
+    {
+        distinct += !seen[buf[i]];
+        seen[buf[i]] = 1;
+    }
+
+    return (distinct <= N2N_LZO_MAX_DISTINCT);
+}
+
+static int transop_deinit_lzo( n2n_trans_op_t * arg )
+{
+    transop_lzo_t * priv = (transop_lzo_t *)arg->priv;
+
+    if ( priv )
+    {
+        free( priv->wrkmem );
+        free( priv );
+    }
+
+    arg->priv = NULL;
+    return 0;
+}
+
+static int transop_encode_lzo( n2n_trans_op_t * arg,
+                               uint8_t * outbuf,
+                               size_t out_len,
+                               const uint8_t * inbuf,
+                               size_t in_len )
+{
+    transop_lzo_t * priv = (transop_lzo_t *)arg->priv;
+    uint8_t assembly[1 + N2N_LZO_OUT_SIZE(N2N_PKT_BUF_SIZE)];
+    size_t len = 1 + in_len;
+
+    if ( in_len > N2N_PKT_BUF_SIZE )
+    {
+        traceEvent( TRACE_ERROR, "encode_lzo %lu too big for packet buffer", in_len );
+        return -1;
+    }
+
+    ++(priv->stats.frames);
+    priv->stats.bytes_in += in_len;
+
+    assembly[0] = N2N_LZO_STORED;
+    if ( (in_len >= N2N_LZO_MIN_SIZE) && lzo_compressible( inbuf, in_len ) )
+    {
+        lzo_uint clen = 0;
+        uint64_t start = lzo_now_ns();
+
+        if ( (LZO_E_OK == lzo1x_1_compress( inbuf, in_len, assembly+1, &clen, priv->wrkmem ))
+             && (clen < in_len) )
+        {
+            assembly[0] = N2N_LZO_LZO1X;
+            len = 1 + clen;
+            ++(priv->stats.compressed);
+        }
+        else
+        {
+            ++(priv->stats.stored);
+        }
+
+        priv->stats.compress_ns += lzo_now_ns() - start;
+        priv->stats.compress_bytes += in_len;
+    }
+    else if ( in_len >= N2N_LZO_MIN_SIZE )
+    {
+        ++(priv->stats.skipped);
+        priv->stats.skipped_bytes += in_len;
+    }
+
+    if ( N2N_LZO_STORED == assembly[0] )
+    {
+        memcpy( assembly+1, inbuf, in_len );
+    }
+
+    priv->stats.bytes_out += len;
+    traceEvent( TRACE_DEBUG, "encode_lzo %lu -> %lu", in_len, len );
+
+    return (priv->inner->fwd)( priv->inner, outbuf, out_len, assembly, len );
+}
+
+static int transop_decode_lzo( n2n_trans_op_t * arg,
+                               uint8_t * outbuf,
+                               size_t out_len,
+                               const uint8_t * inbuf,
+                               size_t in_len )
+{
+    transop_lzo_t * priv = (transop_lzo_t *)arg->priv;
+    uint8_t assembly[N2N_PKT_BUF_SIZE];
+    int len;
+
+    len = (priv->inner->rev)( priv->inner, assembly, sizeof(assembly), inbuf, in_len );
+    if ( len < 1 )
+    {
+        return -1;
+    }
+
+    if ( N2N_LZO_LZO1X == assembly[0] )
+    {
+        lzo_uint dlen = out_len;
+
+        if ( LZO_E_OK != lzo1x_decompress_safe( assembly+1, len-1, outbuf, &dlen, NULL ) )
+        {
+            traceEvent( TRACE_WARNING, "decode_lzo bad compressed data (%d bytes)", len );
+            return -1;
+        }
+
+        traceEvent( TRACE_DEBUG, "decode_lzo %d -> %lu", len, (unsigned long)dlen );
+        return dlen;
+    }
+
+    if ( (N2N_LZO_STORED != assembly[0]) || ((size_t)(len-1) > out_len) )
+    {
+        traceEvent( TRACE_WARNING, "decode_lzo bad payload type %u", (unsigned int)assembly[0] );
+        return -1;
+    }
+
+    memcpy( outbuf, assembly+1, len-1 );
+    return len-1;
+}
+
+static int transop_addspec_lzo( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
+{
+    return 0; /* keys live in the inner transop */
+}
+
+static n2n_tostat_t transop_tick_lzo( n2n_trans_op_t * arg, time_t now )
+{
+    transop_lzo_t * priv = (transop_lzo_t *)arg->priv;
+
+    return (priv->inner->tick)( priv->inner, now );
+}
+
+/** Initialise a compressing transop for transform id which encrypts with
+ *  inner. inner must outlive ttt.
+ *
+ *  @return 0 on success.
+ */
+int transop_lzo_init( n2n_trans_op_t * ttt, n2n_transform_t id, n2n_trans_op_t * inner )
+{
+    transop_lzo_t * priv;
+
+    memset( ttt, 0, sizeof(n2n_trans_op_t) );
+
+    priv = (transop_lzo_t *)calloc( 1, sizeof(transop_lzo_t) );
+    if ( priv )
+    {
+        priv->wrkmem = (lzo_align_t *)malloc( LZO1X_1_MEM_COMPRESS );
+    }
+
+    if ( (NULL == priv) || (NULL == priv->wrkmem) )
+    {
+        free( priv );
+        traceEvent( TRACE_ERROR, "Failed to allocate priv for lzo" );
+        return 1;
+    }
+
+    priv->inner = inner;
+
+    ttt->priv = priv;
+    ttt->transform_id = id;
+    ttt->deinit  = transop_deinit_lzo;
+    ttt->addspec = transop_addspec_lzo;
+    ttt->tick    = transop_tick_lzo;
+    ttt->fwd     = transop_encode_lzo;
+    ttt->overhead = 1 + inner->overhead; /* payload type byte */
+    ttt->rev     = transop_decode_lzo;
+
+    return 0;
+}
+
+/** Add the compression counters of an LZO transop to stats. */
+void transop_lzo_stats( const n2n_trans_op_t * ttt, n2n_lzo_stats_t * stats )
+{
+    const transop_lzo_t * priv = (const transop_lzo_t *)ttt->priv;
+
+    if ( priv )
+    {
+        stats->frames         += priv->stats.frames;
+        stats->compressed     += priv->stats.compressed;
+        stats->stored         += priv->stats.stored;
+        stats->skipped        += priv->stats.skipped;
+        stats->bytes_in       += priv->stats.bytes_in;
+        stats->bytes_out      += priv->stats.bytes_out;
+        stats->compress_ns    += priv->stats.compress_ns;
+        stats->compress_bytes += priv->stats.compress_bytes;
+        stats->skipped_bytes  += priv->stats.skipped_bytes;
+    }
+}
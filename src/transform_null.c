@@ -53,6 +53,11 @@ static int transop_decode_null( n2n_trans_op_t * arg,
     return retval;
 }
 
+static int transop_pb_null( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    return 0; /* already in place */
+}
+
 static int transop_addspec_null( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
 {
     return 0;
@@ -81,4 +86,6 @@ void transop_null_init( n2n_trans_op_t * ttt )
     ttt->tick    = transop_tick_null;
     ttt->fwd     = transop_encode_null;
     ttt->rev     = transop_decode_null;
+    ttt->fwd_pb  = transop_pb_null;
+    ttt->rev_pb  = transop_pb_null;
 }
@@ -88,72 +88,86 @@ static size_t tf_choose_tx_sa( transop_tf_t * priv )
  *
  *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
  *         |<------ encrypted ------>|
+ *
+ *  The payload in pb is encrypted where it is; nonce and header go into the
+ *  headroom.
  */
+static int transop_encode_twofish_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    transop_tf_t * priv = (transop_tf_t *)arg->priv;
+    sa_twofish_t * sa;
+    uint32_t nonce;
+    size_t in_len = pb->len;
+    size_t idx=0;
+    uint32_t len;
+
+    if ( NULL == n2n_pktbuf_push( pb, TRANSOP_TF_NONCE_SIZE ) )
+    {
+        traceEvent( TRACE_ERROR, "encode_twofish no headroom." );
+        return -1;
+    }
+
+    /* Less than one block is encrypted as a whole zero padded block. */
+    if ( (pb->len < TwoFish_BLOCK_SIZE)
+         && (NULL == n2n_pktbuf_put( pb, TwoFish_BLOCK_SIZE - pb->len )) )
+    {
+        traceEvent( TRACE_ERROR, "encode_twofish no tailroom." );
+        return -1;
+    }
+
+    /* The transmit sa is periodically updated */
+    sa = &(priv->sa[tf_choose_tx_sa( priv )]); /* Proper Tx SA index */
+
+    traceEvent( TRACE_DEBUG, "encode_twofish %lu with SA %lu.", in_len, sa->sa_id );
+
+    nonce = rand();
+    memcpy( pb->data, &nonce, TRANSOP_TF_NONCE_SIZE );
+
+    /* Encrypting in place is safe: output trails input by a block. */
+    len = TwoFishEncryptRaw( pb->data, pb->data, TRANSOP_TF_NONCE_SIZE + in_len, sa->enc_tf );
+    if ( 0 == len )
+    {
+        traceEvent( TRACE_ERROR, "encode_twofish encryption failed." );
+        return -1;
+    }
+
+    n2n_pktbuf_trim( pb, len );
+    if ( NULL == n2n_pktbuf_push( pb, TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE ) )
+    {
+        traceEvent( TRACE_ERROR, "encode_twofish no headroom." );
+        return -1;
+    }
+
+    encode_uint8( pb->data, &idx, N2N_TWOFISH_TRANSFORM_VERSION );
+    encode_uint32( pb->data, &idx, sa->sa_id );
+
+    return 0;
+}
+
+/** Encode into a separate buffer. See transop_encode_twofish_pb(). */
 static int transop_encode_twofish( n2n_trans_op_t * arg,
                                    uint8_t * outbuf,
                                    size_t out_len,
                                    const uint8_t * inbuf,
                                    size_t in_len )
 {
-    int len=-1;
-    transop_tf_t * priv = (transop_tf_t *)arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
-    uint32_t * pnonce;
+    const size_t hdr = TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE;
+    n2n_pktbuf_t pb;
 
-    if ( (in_len + TRANSOP_TF_NONCE_SIZE) <= N2N_PKT_BUF_SIZE )
+    if ( (in_len + hdr) > out_len )
     {
-        if ( (in_len + TRANSOP_TF_NONCE_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_VER_SIZE) <= out_len )
-        {
-            size_t idx=0;
-            sa_twofish_t * sa;
-            size_t tx_sa_num = 0;
-
-            /* The transmit sa is periodically updated */
-            tx_sa_num = tf_choose_tx_sa( priv );
-
-            sa = &(priv->sa[tx_sa_num]); /* Proper Tx SA index */
-        
-            traceEvent( TRACE_DEBUG, "encode_twofish %lu with SA %lu.", in_len, sa->sa_id );
-            
-            /* Encode the twofish format version. */
-            encode_uint8( outbuf, &idx, N2N_TWOFISH_TRANSFORM_VERSION );
-
-            /* Encode the security association (SA) number */
-            encode_uint32( outbuf, &idx, sa->sa_id );
-
-            /* The assembly buffer is a source for encrypting data. The nonce is
-             * written in first followed by the packet payload. The whole
-             * contents of assembly are encrypted. */
-            pnonce = (uint32_t *)assembly;
-            *pnonce = rand();
-            memcpy( assembly + TRANSOP_TF_NONCE_SIZE, inbuf, in_len );
-
-            /* Encrypt the assembly contents and write the ciphertext after the SA. */
-            len = TwoFishEncryptRaw( assembly, /* source */
-                                     outbuf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE, 
-                                     in_len + TRANSOP_TF_NONCE_SIZE, /* enc size */
-                                     sa->enc_tf);
-            if ( len > 0 )
-            {
-                len += TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE; /* size of data carried in UDP. */
-            }
-            else
-            {
-                traceEvent( TRACE_ERROR, "encode_twofish encryption failed." );
-            }
-
-        }
-        else
-        {
-            traceEvent( TRACE_ERROR, "encode_twofish outbuf too small." );
-        }
+        traceEvent( TRACE_ERROR, "encode_twofish outbuf too small." );
+        return -1;
     }
-    else
+
+    memcpy( outbuf + hdr, inbuf, in_len );
+    n2n_pktbuf_init( &pb, outbuf, out_len, hdr, in_len );
+    if ( 0 != transop_encode_twofish_pb( arg, &pb ) )
     {
-        traceEvent( TRACE_ERROR, "encode_twofish inbuf too big to encrypt." );
+        return -1;
     }
 
-    return len;
+    return pb.len;
 }
 
 
@@ -268,6 +282,52 @@ static int transop_decode_twofish( n2n_trans_op_t * arg,
     return len;
 }
 
+/** Decode the packet in pb where it is; pb is left on the payload. See
+ *  transop_decode_twofish(). */
+static int transop_decode_twofish_pb( n2n_trans_op_t * arg, n2n_pktbuf_t * pb )
+{
+    transop_tf_t * priv = (transop_tf_t *)arg->priv;
+    const size_t hdr = TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE;
+    n2n_sa_t sa_rx;
+    ssize_t sa_idx;
+    size_t rem=pb->len;
+    size_t idx=0;
+    uint8_t tf_enc_ver=0;
+
+    if ( pb->len < (hdr + TwoFish_BLOCK_SIZE) )
+    {
+        traceEvent( TRACE_ERROR, "decode_twofish inbuf wrong size (%lu) to decrypt.", pb->len );
+        return -1;
+    }
+
+    decode_uint8( &tf_enc_ver, pb->data, &rem, &idx );
+    if ( N2N_TWOFISH_TRANSFORM_VERSION != tf_enc_ver )
+    {
+        traceEvent( TRACE_ERROR, "decode_twofish unsupported twofish version %u.", tf_enc_ver );
+        return -1;
+    }
+
+    decode_uint32( &sa_rx, pb->data, &rem, &idx );
+    sa_idx = twofish_find_sa( priv, sa_rx );
+    if ( sa_idx < 0 )
+    {
+        traceEvent( TRACE_ERROR, "decode_twofish SA number %lu not found.", sa_rx );
+        return -1;
+    }
+
+    traceEvent( TRACE_DEBUG, "decode_twofish %lu with SA %lu.", pb->len, sa_rx );
+
+    n2n_pktbuf_pull( pb, hdr );
+    if ( 0 == TwoFishDecryptRaw( pb->data, pb->data, pb->len, priv->sa[sa_idx].dec_tf ) )
+    {
+        traceEvent( TRACE_ERROR, "decode_twofish decryption failed." );
+        return -1;
+    }
+
+    n2n_pktbuf_pull( pb, TRANSOP_TF_NONCE_SIZE );
+    return 0;
+}
+
 static int transop_addspec_twofish( n2n_trans_op_t * arg, const n2n_cipherspec_t * cspec )
 {
     int retval = 1;
@@ -417,7 +477,10 @@ int transop_twofish_setup( n2n_trans_op_t * ttt,
             ttt->addspec = transop_addspec_twofish;
             ttt->tick = transop_tick_twofish; /* chooses a new tx_sa */
             ttt->fwd = transop_encode_twofish;
+            ttt->overhead = TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE;
             ttt->rev = transop_decode_twofish;
+            ttt->fwd_pb = transop_encode_twofish_pb;
+            ttt->rev_pb = transop_decode_twofish_pb;
                 
             retval = 0;
         }
@@ -464,7 +527,10 @@ int transop_twofish_init( n2n_trans_op_t * ttt )
         ttt->tick = transop_tick_twofish; /* chooses a new tx_sa */
         ttt->deinit = transop_deinit_twofish;
         ttt->fwd = transop_encode_twofish;
+        ttt->overhead = TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE;
         ttt->rev = transop_decode_twofish;
+        ttt->fwd_pb = transop_encode_twofish_pb;
+        ttt->rev_pb = transop_decode_twofish_pb;
 
         for(i=0; i<N2N_TWOFISH_NUM_SA; ++i)
         {
@@ -16,6 +16,7 @@
 */
 
 #include "n2n.h"
+#include <sys/uio.h>
 
 #ifdef __linux__
 
@@ -55,6 +56,14 @@ static void read_mac(char *ifname, n2n_mac_t mac_addr) {
  *  @param device_mask - netmask for device_ip
  *  @param mtu         - MTU for device_ip
  *
+ *  If device->num_queues is greater than one the device is created with
+ *  IFF_MULTI_QUEUE and that many queues are opened into device->queue_fd. The
+ *  kernel then spreads flows sent to the interface over the queues.
+ *
+ *  If device->vnet_hdr is set the device is created with IFF_VNET_HDR and
+ *  checksum and TSO offloads are enabled. Every frame read then starts with
+ *  an n2n_vnet_hdr_t and may be a GSO super-frame.
+ *
  *  @return - negative value on error
  *          - non-negative file-descriptor on success
  */
@@ -70,24 +79,63 @@ int tuntap_open(tuntap_dev *device,
   char buf[N2N_LINUX_SYSTEMCMD_SIZE];
   struct ifreq ifr;
   int rc;
+  int q;
 
-  device->fd = open(tuntap_device, O_RDWR);
-  if(device->fd < 0) {
-    printf("ERROR: ioctl() [%s][%d]\n", strerror(errno), errno);
-    return -1;
-  }
+  if((device->num_queues < 1) || (device->num_queues > N2N_TUNTAP_MAX_QUEUES))
+    device->num_queues = 1;
 
   memset(&ifr, 0, sizeof(ifr));
   ifr.ifr_flags = IFF_TAP|IFF_NO_PI; /* Want a TAP device for layer 2 frames. */
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+  if(device->num_queues > 1)
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#else
+  device->num_queues = 1;
+#endif
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+  if(device->vnet_hdr)
+    ifr.ifr_flags |= IFF_VNET_HDR;
+#else
+  device->vnet_hdr = 0;
+#endif
   strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-  rc = ioctl(device->fd, TUNSETIFF, (void *)&ifr);
 
-  if(rc < 0) {
-    traceEvent(TRACE_ERROR, "ioctl() [%s][%d]\n", strerror(errno), rc);
-    close(device->fd);
-    return -1;
+  for(q=0; q<device->num_queues; q++) {
+    /* Every queue is attached by opening the clone device again and setting
+     * the same interface name, which the first TUNSETIFF filled in. */
+    device->queue_fd[q] = open(tuntap_device, O_RDWR);
+    if(device->queue_fd[q] < 0) {
+      printf("ERROR: ioctl() [%s][%d]\n", strerror(errno), errno);
+      rc = -1;
+    } else {
+      rc = ioctl(device->queue_fd[q], TUNSETIFF, (void *)&ifr);
+      if(rc < 0) {
+        traceEvent(TRACE_ERROR, "ioctl() [%s][%d]\n", strerror(errno), rc);
+        close(device->queue_fd[q]);
+      }
+    }
+
+    if(rc < 0) {
+      while(q-- > 0) close(device->queue_fd[q]);
+      return -1;
+    }
   }
 
+  device->fd = device->queue_fd[0];
+
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+  if(device->vnet_hdr) {
+    /* Offloads are per device, setting them through one queue is enough. */
+    if(ioctl(device->fd, TUNSETOFFLOAD, TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6) < 0) {
+      traceEvent(TRACE_WARNING, "TUNSETOFFLOAD failed [%s], offloads disabled", strerror(errno));
+      ioctl(device->fd, TUNSETOFFLOAD, 0);
+    } else
+      traceEvent(TRACE_NORMAL, "Enabled checksum and TSO offloads on %s", ifr.ifr_name);
+  }
+#endif
+  if(device->num_queues > 1)
+    traceEvent(TRACE_NORMAL, "Opened %d queues on %s", device->num_queues, ifr.ifr_name);
+
   /* Store the device name for later reuse */
   strncpy(device->dev_name, ifr.ifr_name, MIN(IFNAMSIZ, N2N_IFNAMSIZ) );
 
@@ -124,11 +172,49 @@ int tuntap_read(struct tuntap_dev *tuntap, unsigned char *buf, int len) {
   return(read(tuntap->fd, buf, len));
 }
 
+#if defined(N2N_HAVE_TAP_MULTI_QUEUE)
+int tuntap_read_queue(struct tuntap_dev *tuntap, int queue, unsigned char *buf, int len) {
+  return(read(tuntap->queue_fd[queue], buf, len));
+}
+#endif
+
 int tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len) {
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+  if(tuntap->vnet_hdr) {
+    n2n_vnet_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    return(tuntap_write_vnet(tuntap, &hdr, buf, len));
+  }
+#endif
   return(write(tuntap->fd, buf, len));
 }
 
+#if defined(N2N_HAVE_TAP_VNET_HDR)
+/** Write a frame preceded by its virtio-net header. Only valid if the device
+ *  was opened with vnet_hdr set.
+ *
+ *  @return number of frame bytes written, excluding the header, or -1.
+ */
+int tuntap_write_vnet(struct tuntap_dev *tuntap, const n2n_vnet_hdr_t *hdr, unsigned char *buf, int len) {
+  struct iovec iov[2];
+  ssize_t rc;
+
+  iov[0].iov_base = (void *)hdr;
+  iov[0].iov_len = N2N_VNET_HDR_SIZE;
+  iov[1].iov_base = buf;
+  iov[1].iov_len = len;
+
+  rc = writev(tuntap->fd, iov, 2);
+  return((rc < N2N_VNET_HDR_SIZE) ? -1 : (int)(rc - N2N_VNET_HDR_SIZE));
+}
+#endif
+
 void tuntap_close(struct tuntap_dev *tuntap) {
+  int q;
+
+  for(q=1; q<tuntap->num_queues; q++)
+    close(tuntap->queue_fd[q]);
   close(tuntap->fd);
 }
 
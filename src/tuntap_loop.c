@@ -0,0 +1,97 @@
+/* (c) 2026 n2n contributors */
+
+/** Loopback TAP device.
+ *
+ *  Instead of a kernel TAP interface edge exchanges Ethernet frames with
+ *  another local process over a SOCK_SEQPACKET unix socket. Every message is
+ *  one frame, so reads and writes on device->fd behave as on a TAP fd and
+ *  tuntap_read(), tuntap_write() and tuntap_close() work unchanged. The other
+ *  process, e.g. the benchmark_edge traffic generator, listens on the socket
+ *  path before edge starts. Nothing is configured on the host so supernode
+ *  and edges can run unprivileged.
+ */
+
+#include "n2n.h"
+
+#ifndef WIN32
+#include <sys/un.h>
+
+/** Connect device to the frame source listening on path.
+ *
+ *  The device has a single queue and no virtio-net header, whatever was
+ *  requested. Its MAC address is device_mac or a random locally administered
+ *  one.
+ *
+ *  @return the socket fd or -1 on error.
+ */
+int tuntap_loop_open( tuntap_dev * device,
+                      const char * path,
+                      const char * address_mode,
+                      char * device_ip,
+                      char * device_mask,
+                      const char * device_mac,
+                      int mtu )
+{
+    struct sockaddr_un addr;
+    macstr_t mac_buf;
+    size_t i;
+    int fd;
+
+    if ( 0 == strcmp( "dhcp", address_mode ) )
+    {
+        traceEvent( TRACE_ERROR, "loop device needs a static address" );
+        return -1;
+    }
+
+    if ( strlen( path ) >= sizeof(addr.sun_path) )
+    {
+        traceEvent( TRACE_ERROR, "loop device path too long: %s", path );
+        return -1;
+    }
+
+    fd = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+    if ( fd < 0 )
+    {
+        traceEvent( TRACE_ERROR, "loop device socket() [%s]", strerror(errno) );
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path, sizeof(addr.sun_path) - 1 );
+
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 )
+    {
+        traceEvent( TRACE_ERROR, "loop device connect(%s) [%s]", path, strerror(errno) );
+        close( fd );
+        return -1;
+    }
+
+    device->fd = fd;
+    device->queue_fd[0] = fd;
+    device->num_queues = 1;
+    device->vnet_hdr = 0;
+    device->mtu = mtu;
+    strncpy( device->dev_name, "loop", N2N_IFNAMSIZ );
+    device->ip_addr = inet_addr( device_ip );
+    device->device_mask = inet_addr( device_mask );
+
+    if ( device_mac && device_mac[0] != '\0' )
+    {
+        str2mac( device->mac_addr, device_mac );
+    }
+    else
+    {
+        for ( i=0; i < sizeof(n2n_mac_t); ++i )
+        {
+            device->mac_addr[i] = (uint8_t)rand();
+        }
+        device->mac_addr[0] = (device->mac_addr[0] & 0xfe) | 0x02; /* unicast, locally administered */
+    }
+
+    traceEvent( TRACE_NORMAL, "Loop device on %s has MAC %s", path, macaddr_str( mac_buf, device->mac_addr ) );
+
+    return fd;
+}
+
+#endif /* #ifndef WIN32 */
@@ -113,10 +113,29 @@ static uint32_t TwoFish_MDS[4][256]; /* TwoFish_MDS matrix */
 
 /*#define	TwoFish__b(x,N)	(((uint8_t *)&x)[((N)&3)^TwoFish_ADDR_XOR])*/ /* pick bytes out of a dword */
 
-#define	TwoFish_b0(x)			TwoFish__b(x,0)		/* extract LSB of uint32_t  */
-#define	TwoFish_b1(x)			TwoFish__b(x,1)
-#define	TwoFish_b2(x)			TwoFish__b(x,2)
-#define	TwoFish_b3(x)			TwoFish__b(x,3)		/* extract MSB of uint32_t  */
+#define	TwoFish_b0(x)			((uint8_t)(x))		/* extract LSB of uint32_t  */
+#define	TwoFish_b1(x)			((uint8_t)((x)>>8))
+#define	TwoFish_b2(x)			((uint8_t)((x)>>16))
+#define	TwoFish_b3(x)			((uint8_t)((x)>>24))	/* extract MSB of uint32_t  */
+
+/* g() on the key dependent tables built by _TwoFish_MakeSubKeys(). sBox holds
+ * four 256 entry tables, each S-box already folded into its MDS column, so a
+ * round is eight lookups on 32-bit words. G1 is g() of the word rotated left
+ * by 8. */
+#define	TwoFish_G0(s,x)	((s)[TwoFish_b0(x)] ^ (s)[0x100+TwoFish_b1(x)] ^ (s)[0x200+TwoFish_b2(x)] ^ (s)[0x300+TwoFish_b3(x)])
+#define	TwoFish_G1(s,x)	((s)[TwoFish_b3(x)] ^ (s)[0x100+TwoFish_b0(x)] ^ (s)[0x200+TwoFish_b1(x)] ^ (s)[0x300+TwoFish_b2(x)])
+
+/* One encryption round updating c and d from a and b with subkeys K[k] and K[k+1]. */
+#define	TwoFish_ENC_ROUND(s,K,a,b,c,d,k,t0,t1) \
+  { t0=TwoFish_G0(s,a); t1=TwoFish_G1(s,b); \
+    c^=t0+t1+(K)[k]; c=(c>>1)|(c<<31); \
+    d=(d<<1)|(d>>31); d^=t0+(t1<<1)+(K)[(k)+1]; }
+
+/* The inverse of TwoFish_ENC_ROUND. */
+#define	TwoFish_DEC_ROUND(s,K,a,b,c,d,k,t0,t1) \
+  { t0=TwoFish_G0(s,a); t1=TwoFish_G1(s,b); \
+    d^=t0+(t1<<1)+(K)[(k)+1]; d=(d>>1)|(d<<31); \
+    c=(c<<1)|(c>>31); c^=t0+t1+(K)[k]; }
 
 uint8_t TwoFish__b(uint32_t x,int n)
 {	n&=3;
@@ -247,9 +266,12 @@ uint32_t TwoFishEncryptRaw(uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
 			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,FALSE,tfdata);	/* and go for it. */
+{	if(in==NULL || out==NULL || len==0 || tfdata==NULL)
+    return 0;
+  if(len>TwoFish_BLOCK_SIZE)
+    return _TwoFish_EncryptCBC(in,out,len,tfdata);
+  _TwoFish_ResetCBC(tfdata);							/* zero pads the single block */
+  return _TwoFish_CryptRaw16(in,out,len,FALSE,tfdata);
 }
 
 /*	TwoFish Raw Decryption
@@ -268,9 +290,12 @@ uint32_t TwoFishDecryptRaw(uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
 			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,TRUE,tfdata);	/* and go for it. */
+{	if(in==NULL || out==NULL || len==0 || tfdata==NULL)
+    return 0;
+  if(len>TwoFish_BLOCK_SIZE)
+    return _TwoFish_DecryptCBC(in,out,len,tfdata);
+  _TwoFish_ResetCBC(tfdata);							/* zero pads the single block */
+  return _TwoFish_CryptRaw16(in,out,len,TRUE,tfdata);
 }
 
 /*	TwoFish Free
@@ -607,10 +632,10 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
     {   b0 = b1 = b2 = b3 = i;
       switch (k64Cnt & 3)
         {	case 1: /* 64-bit keys */
-	    tfdata->sBox[      2*i  ] = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
-	    tfdata->sBox[      2*i+1] = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
-	    tfdata->sBox[0x200+2*i  ] = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
-	    tfdata->sBox[0x200+2*i+1] = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
+	    tfdata->sBox[      i] = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
+	    tfdata->sBox[0x100+i] = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
+	    tfdata->sBox[0x200+i] = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
+	    tfdata->sBox[0x300+i] = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
 	    break;
 	case 0: /* 256-bit keys (same as 4) */
 	  b0 = (TwoFish_P[TwoFish_P_04][b0]) ^ TwoFish_b0(k3);
@@ -623,19 +648,19 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
 	  b2 = (TwoFish_P[TwoFish_P_23][b2]) ^ TwoFish_b2(k2);
 	  b3 = (TwoFish_P[TwoFish_P_33][b3]) ^ TwoFish_b3(k2);
 	case 2: /* 128-bit keys */
-	  tfdata->sBox[      2*i  ]=
+	  tfdata->sBox[      i]=
 	    TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][(TwoFish_P[TwoFish_P_02][b0]) ^
 						    TwoFish_b0(k1)]) ^ TwoFish_b0(k0)];
 
-	  tfdata->sBox[      2*i+1]=
+	  tfdata->sBox[0x100+i]=
 	    TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][(TwoFish_P[TwoFish_P_12][b1]) ^
 						    TwoFish_b1(k1)]) ^ TwoFish_b1(k0)];
 
-	  tfdata->sBox[0x200+2*i  ]=
+	  tfdata->sBox[0x200+i]=
 	    TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][(TwoFish_P[TwoFish_P_22][b2]) ^
 						    TwoFish_b2(k1)]) ^ TwoFish_b2(k0)];
 
-	  tfdata->sBox[0x200+2*i+1]=
+	  tfdata->sBox[0x300+i]=
 	    TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][(TwoFish_P[TwoFish_P_32][b3]) ^
 						    TwoFish_b3(k1)]) ^ TwoFish_b3(k0)];
 	}
@@ -781,104 +806,226 @@ void _TwoFish_FlushOutput(uint8_t *b,uint32_t len,TWOFISH *tfdata)
   tfdata->dontflush=FALSE;
 }
 
+static uint32_t _TwoFish_Load32(const uint8_t *p)
+{   return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static void _TwoFish_Store32(uint8_t *p,uint32_t x)
+{   p[0]=(uint8_t)(x);
+  p[1]=(uint8_t)(x>>8);
+  p[2]=(uint8_t)(x>>16);
+  p[3]=(uint8_t)(x>>24);
+}
+
+static void _TwoFish_LoadBlock(const uint8_t *p,uint32_t *x)
+{   x[0]=_TwoFish_Load32(p);
+  x[1]=_TwoFish_Load32(p+4);
+  x[2]=_TwoFish_Load32(p+8);
+  x[3]=_TwoFish_Load32(p+12);
+}
+
+static void _TwoFish_StoreBlock(uint8_t *p,const uint32_t *x)
+{   _TwoFish_Store32(p,x[0]);
+  _TwoFish_Store32(p+4,x[1]);
+  _TwoFish_Store32(p+8,x[2]);
+  _TwoFish_Store32(p+12,x[3]);
+}
+
+/* Encrypt the block in x, four little endian words, in place. */
+static void _TwoFish_EncryptWords(const TWOFISH *tfdata,uint32_t *x)
+{	const uint32_t *s=tfdata->sBox;
+  const uint32_t *K=tfdata->subKeys;
+  uint32_t x0,x1,x2,x3,t0,t1;
+  int k;
+
+  x0=x[0]^K[0];
+  x1=x[1]^K[1];
+  x2=x[2]^K[2];
+  x3=x[3]^K[3];
+
+  for(k=8;k<8+2*TwoFish_ROUNDS;k+=4)
+    {	TwoFish_ENC_ROUND(s,K,x0,x1,x2,x3,k,t0,t1);
+      TwoFish_ENC_ROUND(s,K,x2,x3,x0,x1,k+2,t0,t1);
+    }
+
+  x[0]=x2^K[4];
+  x[1]=x3^K[5];
+  x[2]=x0^K[6];
+  x[3]=x1^K[7];
+}
+
+/* Decrypt the block in x in place. */
+static void _TwoFish_DecryptWords(const TWOFISH *tfdata,uint32_t *x)
+{	const uint32_t *s=tfdata->sBox;
+  const uint32_t *K=tfdata->subKeys;
+  uint32_t x0,x1,x2,x3,t0,t1;
+  int k;
+
+  x0=x[0]^K[4];
+  x1=x[1]^K[5];
+  x2=x[2]^K[6];
+  x3=x[3]^K[7];
+
+  for(k=4+2*TwoFish_ROUNDS;k>=8;k-=4)
+    {	TwoFish_DEC_ROUND(s,K,x0,x1,x2,x3,k+2,t0,t1);
+      TwoFish_DEC_ROUND(s,K,x2,x3,x0,x1,k,t0,t1);
+    }
+
+  x[0]=x2^K[0];
+  x[1]=x3^K[1];
+  x[2]=x0^K[2];
+  x[3]=x1^K[3];
+}
+
+/* Decrypt the two independent blocks in x and y at once. The rounds of both
+ * are interleaved so the table lookups of one overlap the other. */
+static void _TwoFish_DecryptWords2(const TWOFISH *tfdata,uint32_t *x,uint32_t *y)
+{	const uint32_t *s=tfdata->sBox;
+  const uint32_t *K=tfdata->subKeys;
+  uint32_t x0,x1,x2,x3,t0,t1;
+  uint32_t y0,y1,y2,y3,u0,u1;
+  int k;
+
+  x0=x[0]^K[4]; y0=y[0]^K[4];
+  x1=x[1]^K[5]; y1=y[1]^K[5];
+  x2=x[2]^K[6]; y2=y[2]^K[6];
+  x3=x[3]^K[7]; y3=y[3]^K[7];
+
+  for(k=4+2*TwoFish_ROUNDS;k>=8;k-=4)
+    {	TwoFish_DEC_ROUND(s,K,x0,x1,x2,x3,k+2,t0,t1);
+      TwoFish_DEC_ROUND(s,K,y0,y1,y2,y3,k+2,u0,u1);
+      TwoFish_DEC_ROUND(s,K,x2,x3,x0,x1,k,t0,t1);
+      TwoFish_DEC_ROUND(s,K,y2,y3,y0,y1,k,u0,u1);
+    }
+
+  x[0]=x2^K[0]; y[0]=y2^K[0];
+  x[1]=x3^K[1]; y[1]=y3^K[1];
+  x[2]=x0^K[2]; y[2]=y0^K[2];
+  x[3]=x1^K[3]; y[3]=y1^K[3];
+}
+
 void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata)
-{	uint32_t x0,x1,x2,x3;
-  uint32_t k,t0,t1,R;
-
-
-  x0=*in++;
-  x0|=(*in++ << 8 );
-  x0|=(*in++ << 16);
-  x0|=(*in++ << 24);
-  x1=*in++;
-  x1|=(*in++ << 8 );
-  x1|=(*in++ << 16);
-  x1|=(*in++ << 24);
-  x2=*in++;
-  x2|=(*in++ << 8 );
-  x2|=(*in++ << 16);
-  x2|=(*in++ << 24);
-  x3=*in++;
-  x3|=(*in++ << 8 );
-  x3|=(*in++ << 16);
-  x3|=(*in++ << 24);
+{	uint32_t x[4];
 
+  _TwoFish_LoadBlock(in,x);
   if(decrypt)
-    {	x0 ^= tfdata->subKeys[4];	/* swap input and output whitening keys when decrypting */
-      x1 ^= tfdata->subKeys[5];
-      x2 ^= tfdata->subKeys[6];
-      x3 ^= tfdata->subKeys[7];
-
-      k = 7+(TwoFish_ROUNDS*2);
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-	{   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x3  = x3 >> 1 | x3 << 31;
-	  x2  = x2 << 1 | x2 >> 31;
-	  x2 ^= t0 + t1 + tfdata->subKeys[k--];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x1  = x1 >> 1 | x1 << 31;
-	  x0  = x0 << 1 | x0 >> 31;
-	  x0 ^= t0 + t1 + tfdata->subKeys[k--];
-        }
+    _TwoFish_DecryptWords(tfdata,x);
+  else
+    _TwoFish_EncryptWords(tfdata,x);
+  _TwoFish_StoreBlock(out,x);
+}
+
+/* Encrypt len bytes in CBC mode with a zero IV. If len is not a multiple of
+ * the block size the last two blocks use the same ciphertext stealing as
+ * _TwoFish_BlockCrypt(): the final partial block is padded with zeros and
+ * encrypted into the place of the previous block, whose ciphertext is cut
+ * short and moved to the end. len must be larger than one block. in and out
+ * may be the same buffer. */
+uint32_t _TwoFish_EncryptCBC(const uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata)
+{	uint32_t c[4]={0,0,0,0};
+  uint32_t x[4];
+  uint8_t last[TwoFish_BLOCK_SIZE];
+  uint32_t nblocks=(len-1)/TwoFish_BLOCK_SIZE;	/* blocks before the last 1..16 bytes */
+  uint32_t tail=len-nblocks*TwoFish_BLOCK_SIZE;
+  uint32_t i;
+
+  if(tail==TwoFish_BLOCK_SIZE)
+    {	nblocks++;
+      tail=0;
+    }
+
+  for(i=0;i<nblocks;i++,in+=TwoFish_BLOCK_SIZE,out+=TwoFish_BLOCK_SIZE)
+    {	_TwoFish_LoadBlock(in,x);
+      c[0]^=x[0];
+      c[1]^=x[1];
+      c[2]^=x[2];
+      c[3]^=x[3];
+      _TwoFish_EncryptWords(tfdata,c);
+      _TwoFish_StoreBlock(out,c);
+    }
+
+  if(tail>0)
+    {	memset(last,0,TwoFish_BLOCK_SIZE);
+      memcpy(last,in,tail);
+      memcpy(out,out-TwoFish_BLOCK_SIZE,tail);	/* Cn-1 cut short becomes Cn */
+      _TwoFish_LoadBlock(last,x);
+      c[0]^=x[0];
+      c[1]^=x[1];
+      c[2]^=x[2];
+      c[3]^=x[3];
+      _TwoFish_EncryptWords(tfdata,c);
+      _TwoFish_StoreBlock(out-TwoFish_BLOCK_SIZE,c);
+    }
+  return len;
+}
 
-      x2 ^= tfdata->subKeys[0];
-      x3 ^= tfdata->subKeys[1];
-      x0 ^= tfdata->subKeys[2];
-      x1 ^= tfdata->subKeys[3];
+/* The inverse of _TwoFish_EncryptCBC(). Blocks are decrypted two at a time
+ * since CBC decryption does not depend on the previous plaintext. in and out
+ * may be the same buffer. */
+uint32_t _TwoFish_DecryptCBC(const uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata)
+{	uint32_t prev[4]={0,0,0,0};
+  uint32_t c0[4],c1[4],x[4],y[4];
+  uint8_t last[TwoFish_BLOCK_SIZE];
+  uint32_t nblocks=(len-1)/TwoFish_BLOCK_SIZE;
+  uint32_t tail=len-nblocks*TwoFish_BLOCK_SIZE;
+  uint32_t i;
+
+  if(tail==TwoFish_BLOCK_SIZE)
+    {	nblocks++;
+      tail=0;
     }
   else
-    {	x0 ^= tfdata->subKeys[0];
-      x1 ^= tfdata->subKeys[1];
-      x2 ^= tfdata->subKeys[2];
-      x3 ^= tfdata->subKeys[3];
-
-      k = 8;
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-        {   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x2 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x2  = x2 >> 1 | x2 << 31;
-	  x3  = x3 << 1 | x3 >> 31;
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x0 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x0  = x0 >> 1 | x0 << 31;
-	  x1  = x1 << 1 | x1 >> 31;
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-        }
+    nblocks--;		/* Cn-1 is handled with the partial block */
+
+  for(i=0;i+1<nblocks;i+=2,in+=2*TwoFish_BLOCK_SIZE,out+=2*TwoFish_BLOCK_SIZE)
+    {	_TwoFish_LoadBlock(in,c0);
+      _TwoFish_LoadBlock(in+TwoFish_BLOCK_SIZE,c1);
+      memcpy(x,c0,sizeof(x));
+      memcpy(y,c1,sizeof(y));
+      _TwoFish_DecryptWords2(tfdata,x,y);
+      x[0]^=prev[0]; y[0]^=c0[0];
+      x[1]^=prev[1]; y[1]^=c0[1];
+      x[2]^=prev[2]; y[2]^=c0[2];
+      x[3]^=prev[3]; y[3]^=c0[3];
+      _TwoFish_StoreBlock(out,x);
+      _TwoFish_StoreBlock(out+TwoFish_BLOCK_SIZE,y);
+      memcpy(prev,c1,sizeof(prev));
+    }
 
-      x2 ^= tfdata->subKeys[4];
-      x3 ^= tfdata->subKeys[5];
-      x0 ^= tfdata->subKeys[6];
-      x1 ^= tfdata->subKeys[7];
+  if(i<nblocks)
+    {	_TwoFish_LoadBlock(in,c0);
+      memcpy(x,c0,sizeof(x));
+      _TwoFish_DecryptWords(tfdata,x);
+      x[0]^=prev[0];
+      x[1]^=prev[1];
+      x[2]^=prev[2];
+      x[3]^=prev[3];
+      _TwoFish_StoreBlock(out,x);
+      memcpy(prev,c0,sizeof(prev));
+      in+=TwoFish_BLOCK_SIZE;
+      out+=TwoFish_BLOCK_SIZE;
     }
 
-  *out++ = (uint8_t)(x2      );
-  *out++ = (uint8_t)(x2 >>  8);
-  *out++ = (uint8_t)(x2 >> 16);
-  *out++ = (uint8_t)(x2 >> 24);
-
-  *out++ = (uint8_t)(x3      );
-  *out++ = (uint8_t)(x3 >>  8);
-  *out++ = (uint8_t)(x3 >> 16);
-  *out++ = (uint8_t)(x3 >> 24);
-
-  *out++ = (uint8_t)(x0      );
-  *out++ = (uint8_t)(x0 >>  8);
-  *out++ = (uint8_t)(x0 >> 16);
-  *out++ = (uint8_t)(x0 >> 24);
-
-  *out++ = (uint8_t)(x1      );
-  *out++ = (uint8_t)(x1 >>  8);
-  *out++ = (uint8_t)(x1 >> 16);
-  *out++ = (uint8_t)(x1 >> 24);
+  if(tail>0)
+    {	/* in holds the stolen block followed by tail bytes of Cn-1 */
+      _TwoFish_LoadBlock(in,x);
+      _TwoFish_DecryptWords(tfdata,x);
+      _TwoFish_StoreBlock(last,x);
+      for(i=0;i<tail;i++)
+	{   uint8_t cn=in[TwoFish_BLOCK_SIZE+i];
+
+	  out[TwoFish_BLOCK_SIZE+i]=cn^last[i];	/* Pn */
+	  last[i]=cn;				/* rebuild Cn-1 */
+	}
+      _TwoFish_LoadBlock(last,x);
+      _TwoFish_DecryptWords(tfdata,x);
+      x[0]^=prev[0];
+      x[1]^=prev[1];
+      x[2]^=prev[2];
+      x[3]^=prev[3];
+      _TwoFish_StoreBlock(out,x);
+    }
+  return len;
 }
 
 /**
@@ -945,24 +1092,18 @@ uint32_t _TwoFish_F32(uint32_t k64Cnt,uint32_t x,uint32_t *k32)
 }
 
 uint32_t _TwoFish_Fe320(uint32_t *lsBox,uint32_t x)
-{   return lsBox[        TwoFish_b0(x)<<1    ]^
-    lsBox[      ((TwoFish_b1(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b2(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b3(x)<<1)|1)];
+{   return TwoFish_G0(lsBox,x);
 }
 
 uint32_t _TwoFish_Fe323(uint32_t *lsBox,uint32_t x)
-{   return lsBox[       (TwoFish_b3(x)<<1)   ]^
-    lsBox[      ((TwoFish_b0(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b1(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b2(x)<<1)|1)];
+{   return TwoFish_G1(lsBox,x);
 }
 
 uint32_t _TwoFish_Fe32(uint32_t *lsBox,uint32_t x,uint32_t R)
-{   return lsBox[      2*TwoFish__b(x,R  )  ]^
-    lsBox[      2*TwoFish__b(x,R+1)+1]^
-    lsBox[0x200+2*TwoFish__b(x,R+2)  ]^
-    lsBox[0x200+2*TwoFish__b(x,R+3)+1];
+{   return lsBox[      TwoFish__b(x,R  )]^
+    lsBox[0x100+TwoFish__b(x,R+1)]^
+    lsBox[0x200+TwoFish__b(x,R+2)]^
+    lsBox[0x300+TwoFish__b(x,R+3)];
 }
 
 
@@ -110,7 +110,7 @@ enum
 
 typedef struct    
 {
-    uint32_t sBox[4 * 256];                    /* Key dependent S-box */
+    uint32_t sBox[4 * 256];                    /* Key dependent S-boxes combined with the MDS matrix */
     uint32_t subKeys[TwoFish_TOTAL_SUBKEYS];   /* Subkeys  */
     uint8_t key[TwoFish_KEY_LENGTH];           /* Encryption Key */
     uint8_t *output;                           /* Pointer to output buffer */
@@ -282,6 +282,8 @@ void _TwoFish_ResetCBC(TWOFISH *tfdata);
 void _TwoFish_FlushOutput(uint8_t *b,uint32_t len,TWOFISH *tfdata);
 void _TwoFish_BlockCrypt(uint8_t *in,uint8_t *out,uint32_t size,int decrypt,TWOFISH *tfdata);
 void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata);
+uint32_t _TwoFish_EncryptCBC(const uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata);
+uint32_t _TwoFish_DecryptCBC(const uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata);
 uint32_t _TwoFish_RS_MDS_Encode(uint32_t k0,uint32_t k1);
 uint32_t _TwoFish_F32(uint32_t k64Cnt,uint32_t x,uint32_t *k32);
 uint32_t _TwoFish_Fe320(uint32_t *lsBox,uint32_t x);
@@ -317,6 +317,10 @@ int encode_PEER_INFO( uint8_t * base,
     retval += encode_sock( base, idx, pi->sockets );
     if(pi->aflags & N2N_AFLAGS_LOCAL_SOCKET)
         retval += encode_sock( base, idx, pi->sockets+1 );
+    if(pi->aflags & N2N_AFLAGS_PORT_PREDICT) {
+        retval += encode_uint16( base, idx, pi->pred_port );
+        retval += encode_uint8( base, idx, pi->pred_count );
+    }
 
     return retval;
 }
@@ -335,6 +339,10 @@ int decode_PEER_INFO( n2n_PEER_INFO_t * pi,
     retval += decode_sock( pi->sockets, base, rem, idx );
     if(pi->aflags & N2N_AFLAGS_LOCAL_SOCKET)
         retval += decode_sock( pi->sockets+1, base, rem, idx );
+    if(pi->aflags & N2N_AFLAGS_PORT_PREDICT) {
+        retval += decode_uint16( &(pi->pred_port), base, rem, idx );
+        retval += decode_uint8( &(pi->pred_count), base, rem, idx );
+    }
 
     return retval;
 }
@@ -366,6 +374,68 @@ int decode_QUERY_PEER( n2n_QUERY_PEER_t * qp,
     return retval;
 }
 
+int encode_FEC( uint8_t * base, 
+                size_t * idx,
+                const n2n_common_t * common, 
+                const n2n_FEC_t * fec )
+{
+    int retval=0;
+    uint8_t i;
+
+    retval += encode_common( base, idx, common );
+    retval += encode_mac( base, idx, fec->srcMac );
+    retval += encode_mac( base, idx, fec->dstMac );
+    retval += encode_uint8( base, idx, fec->count );
+    if ( 0 == fec->count )
+    {
+        retval += encode_uint16( base, idx, fec->loss );
+    }
+    else
+    {
+        retval += encode_uint16( base, idx, fec->len_xor );
+        for ( i=0; i < fec->count; ++i )
+        {
+            retval += encode_uint32( base, idx, fec->hash[i] );
+        }
+    }
+
+    return retval;
+}
+
+int decode_FEC( n2n_FEC_t * fec,
+                const n2n_common_t * cmn, /* info on how to interpret it */
+                const uint8_t * base,
+                size_t * rem,
+                size_t * idx )
+{
+    size_t retval=0;
+    uint8_t i;
+
+    memset( fec, 0, sizeof(n2n_FEC_t) );
+    retval += decode_mac( fec->srcMac, base, rem, idx );
+    retval += decode_mac( fec->dstMac, base, rem, idx );
+    retval += decode_uint8( &(fec->count), base, rem, idx );
+    if ( fec->count > N2N_FEC_MAX_GROUP )
+    {
+        return -1;
+    }
+
+    if ( 0 == fec->count )
+    {
+        retval += decode_uint16( &(fec->loss), base, rem, idx );
+    }
+    else
+    {
+        retval += decode_uint16( &(fec->len_xor), base, rem, idx );
+        for ( i=0; i < fec->count; ++i )
+        {
+            retval += decode_uint32( &(fec->hash[i]), base, rem, idx );
+        }
+    }
+
+    return retval;
+}
+
 int encode_REGISTER_ACK( uint8_t * base, 
                          size_t * idx,
                          const n2n_common_t * common, 
@@ -412,6 +482,10 @@ int encode_REGISTER_SUPER_ACK( uint8_t * base,
         /* We only support 0 or 1 at this stage */
         retval += encode_sock( base, idx, &(reg->sn_bak) );
     }
+    if ( reg->probe_port )
+    {
+        retval += encode_uint16( base, idx, reg->probe_port );
+    }
 
     return retval;
 }
@@ -440,6 +514,9 @@ int decode_REGISTER_SUPER_ACK( n2n_REGISTER_SUPER_ACK_t * reg,
         retval += decode_sock( &(reg->sn_bak), base, rem, idx );
     }
 
+    /* Not sent by older supernodes: stays 0. */
+    retval += decode_uint16( &(reg->probe_port), base, rem, idx );
+
     return retval;
 }
 
@@ -107,6 +107,8 @@ typedef struct tuntap_dev {
 	uint8_t      mac_addr[6];
 	uint32_t     ip_addr, device_mask;
 	unsigned int mtu;
+	int          num_queues;   /* always 1 */
+	int          vnet_hdr;     /* always 0, no offloads */
 } tuntap_dev;
 
 #define index(a, b) strchr(a, b)